@@ -78,6 +78,33 @@ struct kevent {
 	void		*udata;		/* opaque user data identifier */
 };
 
+/* Used with kevent64(), which keeps all 64 bits of udata on every host */
+struct kevent64_s {
+	uint64_t	ident;		/* identifier for this event */
+	int16_t		filter;		/* filter for event */
+	uint16_t	flags;
+	uint32_t	fflags;
+	int64_t		data;
+	uint64_t	udata;		/* opaque user data identifier */
+	uint64_t	ext[2];		/* returned as they were set */
+};
+
+#define EV_SET64(kevp_, a, b, c, d, e, f, g, h) do {	\
+	struct kevent64_s *kevp = (kevp_);		\
+	(kevp)->ident = (a);			\
+	(kevp)->filter = (b);			\
+	(kevp)->flags = (c);			\
+	(kevp)->fflags = (d);			\
+	(kevp)->data = (e);			\
+	(kevp)->udata = (f);			\
+	(kevp)->ext[0] = (g);			\
+	(kevp)->ext[1] = (h);			\
+} while(0)
+
+/* flags for kevent64() */
+#define KEVENT_FLAG_NONE	0x0000
+#define KEVENT_FLAG_IMMEDIATE	0x0001		/* do not wait for events */
+
 /* actions */
 #define EV_ADD		0x0001		/* add event to kq (implies enable) */
 #define EV_DELETE	0x0002		/* delete event from kq */
@@ -120,7 +147,15 @@ struct kevent {
  * data/hint flags for EVFILT_{READ|WRITE}
  */
 #define NOTE_LOWAT	0x0001			/* low water mark */
-#undef  NOTE_LOWAT                  /* Not supported on Linux */
+#define NOTE_EXCLUSIVE	0x0100			/* wake one waiter per connection,
+						   listening sockets only */
+#define NOTE_NODATA	0x0200			/* data is not computed */
+#define NOTE_PRIORITY	0x0400			/* reported ahead of other
+						   events, Linux only */
+#define NOTE_COALESCE	0x0800			/* reported at most once per
+						   data usec, Linux only */
+#define NOTE_NESTED	0x1000			/* ident is a kqueue, whose
+						   events are reported instead */
 
 /*
  * data/hint flags for EVFILT_VNODE
@@ -148,6 +183,18 @@ struct kevent {
 #define	NOTE_TRACKERR	0x00000002		/* could not track child */
 #define	NOTE_CHILD	0x00000004		/* am a child process */
 
+/*
+ * data/hint flags for EVFILT_TIMER, as on FreeBSD. Without a unit flag,
+ * data is in milliseconds.
+ */
+#define NOTE_SECONDS	0x0001			/* data is seconds */
+#define NOTE_MSECONDS	0x0002			/* data is milliseconds */
+#define NOTE_USECONDS	0x0004			/* data is microseconds */
+#define NOTE_NSECONDS	0x0008			/* data is nanoseconds */
+#define NOTE_ABSTIME	0x0010			/* data is a time since
+						   the Epoch */
+#define NOTE_ABSOLUTE	NOTE_ABSTIME		/* Darwin name */
+
 /*
  * data/hint flags for EVFILT_NETDEV
  */
@@ -174,6 +221,38 @@ struct kevent {
 extern "C" {
 #endif
 
+#define KQUEUE_STATS_BUCKETS    40
+
+/* Counters returned by kqueue_stats() */
+struct kqueue_stats {
+    uint64_t ks_knotes[EVFILT_SYSCOUNT];    /* knotes, indexed by ~filter */
+    uint64_t ks_changes;                    /* changelist entries processed */
+    uint64_t ks_wakeups;                    /* waits that returned events */
+    uint64_t ks_events;                     /* events returned by kevent() */
+    uint64_t ks_spurious;                   /* events discarded on copyout */
+
+    /* Time spent waiting; bucket i counts waits of [2^(i-1), 2^i) ns */
+    uint64_t ks_wait_ns[KQUEUE_STATS_BUCKETS];
+
+    /* Events per kevent() call, bucketed the same way */
+    uint64_t ks_batch[KQUEUE_STATS_BUCKETS];
+};
+
+/* An entry of the flight recorder, returned by kqueue_record_dump() */
+struct kqueue_record {
+    uint64_t rc_time;       /* monotonic clock, in ns */
+    uint64_t rc_ident;      /* ident of the change or event */
+    uint32_t rc_data;       /* depends on rc_type */
+    int16_t  rc_filter;     /* filter of the change or event */
+    uint8_t  rc_type;       /* one of KQUEUE_RECORD_* */
+    uint8_t  rc_thread;     /* shard of the thread that recorded it */
+};
+
+#define KQUEUE_RECORD_CHANGE     1  /* a change was applied, rc_data = flags */
+#define KQUEUE_RECORD_WAIT_ENTER 2  /* kevent() waits, rc_data = nevents */
+#define KQUEUE_RECORD_WAIT_EXIT  3  /* the wait returned, rc_data = nready */
+#define KQUEUE_RECORD_EVENT      4  /* an event was returned, rc_data = flags */
+
 #ifdef _WIN32
 
 struct timespec {
@@ -181,14 +260,57 @@ struct timespec {
     long    tv_nsec;
 };
 
+/*
+ * The request of an EVFILT_AIO knote, in place of the POSIX one. The
+ * file is a HANDLE opened with FILE_FLAG_OVERLAPPED.
+ */
+#define LIO_READ    0
+#define LIO_WRITE   1
+#define LIO_NOP     2
+
+struct aiocb {
+    intptr_t        aio_fildes;
+    int64_t         aio_offset;
+    volatile void  *aio_buf;
+    size_t          aio_nbytes;
+    int             aio_lio_opcode;
+};
+
 __declspec(dllexport) int
 kqueue(void);
 
+__declspec(dllexport) int
+kqueue_close(int kq);
+
 __declspec(dllexport) int
 kevent(int kq, const struct kevent *changelist, int nchanges,
 	    struct kevent *eventlist, int nevents,
 	    const struct timespec *timeout);
 
+__declspec(dllexport) int
+kevent64(int kq, const struct kevent64_s *changelist, int nchanges,
+	    struct kevent64_s *eventlist, int nevents, unsigned int flags,
+	    const struct timespec *timeout);
+
+__declspec(dllexport) int
+kevent_post(int kq, const struct kevent *changelist, int nchanges);
+
+__declspec(dllexport) int
+kevent_submit(int kq, const struct kevent *changelist, int nchanges,
+	    int *status);
+
+__declspec(dllexport) int
+kqueue_stats(int kq, struct kqueue_stats *stats);
+
+__declspec(dllexport) int
+kqueue_lockstat(int fd);
+
+__declspec(dllexport) int
+kqueue_record_start(int kq, unsigned int nrecords);
+
+__declspec(dllexport) int
+kqueue_record_dump(int kq, struct kqueue_record *records, int nrecords);
+
 #ifdef MAKE_STATIC
 __declspec(dllexport) int
 libkqueue_init();
@@ -196,9 +318,59 @@ libkqueue_init();
 
 #else
 int     kqueue(void);
+/* Close a kqueue and release what it holds now, not on descriptor reuse */
+int     kqueue_close(int kq);
 int     kevent(int kq, const struct kevent *changelist, int nchanges,
 	    struct kevent *eventlist, int nevents,
 	    const struct timespec *timeout);
+int     kevent64(int kq, const struct kevent64_s *changelist, int nchanges,
+	    struct kevent64_s *eventlist, int nevents, unsigned int flags,
+	    const struct timespec *timeout);
+
+/* A ring that one thread fills with events and other threads drain */
+struct kqueue_ring;
+struct kqueue_ring *kqueue_ring_open(int kq, unsigned int nslots);
+int     kqueue_ring_wait(struct kqueue_ring *ring, const struct timespec *timeout);
+int     kqueue_ring_pop(struct kqueue_ring *ring, struct kevent *kev);
+int     kqueue_ring_close(struct kqueue_ring *ring);
+
+/* A kqueue whose knotes are split between per-thread shards */
+int     kqueue_group(unsigned int nshards);
+int     kqueue_group_shard(int kq, unsigned int shard);
+int     kqueue_group_assign(int kq, uintptr_t ident, unsigned int shard);
+
+/* Worker threads that run a callback for each event of a kqueue */
+struct kqueue_dispatch;
+struct kqueue_dispatch *kqueue_dispatch_start(int kq, unsigned int nworkers,
+            void (*func)(void *udata, const struct kevent *kev));
+int     kqueue_dispatch_change(struct kqueue_dispatch *dispatch,
+            const struct kevent *changelist, int nchanges);
+int     kqueue_dispatch_stop(struct kqueue_dispatch *dispatch);
+
+/* Poll for up to usec microseconds before kevent() blocks */
+int     kqueue_busy_poll(int kq, unsigned int usec);
+
+/* Create a kqueue with the same knotes, such as in the child of fork() */
+int     kqueue_clone(int kq);
+
+/* Trigger an EVFILT_USER event without going through kevent() */
+int     kqueue_user_trigger(int kq, uintptr_t ident, unsigned int fflags);
+
+/* Queue changes for the next kevent() and wake a thread that waits in it */
+int     kevent_post(int kq, const struct kevent *changelist, int nchanges);
+
+/* Apply every change, with the errno of each one in status */
+int     kevent_submit(int kq, const struct kevent *changelist, int nchanges,
+	    int *status);
+
+int     kqueue_stats(int kq, struct kqueue_stats *stats);
+
+/* Write the lock statistics of a build with LOCKSTAT defined to fd */
+int     kqueue_lockstat(int fd);
+
+/* Keep the last nrecords changes, waits and events of each thread */
+int     kqueue_record_start(int kq, unsigned int nrecords);
+int     kqueue_record_dump(int kq, struct kqueue_record *records, int nrecords);
 #ifdef MAKE_STATIC
 int     libkqueue_init();
 #endif
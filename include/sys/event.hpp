@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * C++20 coroutines on top of kevent().
+ *
+ * A coroutine that returns libkqueue::task can wait for a kqueue event:
+ *
+ *     libkqueue::task echo(libkqueue::loop &kq, int fd)
+ *     {
+ *         for (;;) {
+ *             struct kevent kev = co_await kq.readable(fd);
+ *             ...
+ *         }
+ *     }
+ *
+ * Each awaiter registers a knote whose udata is the handle of the
+ * suspended coroutine, and loop::run_once() resumes the handles straight
+ * from the eventlist. The awaiters live in the coroutine frame, so an
+ * await does not allocate memory. A coroutine that is still suspended
+ * when its loop is destroyed is never resumed or freed.
+ */
+
+#ifndef _SYS_EVENT_HPP_
+#define _SYS_EVENT_HPP_
+
+#include <chrono>
+#include <coroutine>
+#include <cerrno>
+#include <cstdint>
+#include <exception>
+#include <system_error>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/event.h>
+
+namespace libkqueue {
+
+/* A coroutine that starts at once and frees itself when it returns */
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+class loop {
+public:
+    /* Events taken by one call to kevent() */
+    static constexpr int batch = 64;
+
+    /*
+     * Waits for a change to its knote to fire. The result of co_await
+     * is the kevent that resumed the coroutine.
+     */
+    class awaiter {
+    public:
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            for (int i = 0; i < nchanges_; i++) {
+                if (changes_[i].filter == EVFILT_TIMER)
+                    changes_[i].ident = reinterpret_cast<uintptr_t>(this);
+                changes_[i].udata = handle.address();
+            }
+            loop_.submit(changes_, nchanges_);
+            loop_.pending_++;
+        }
+
+        struct kevent await_resume() const noexcept { return *loop_.current_; }
+
+    private:
+        friend class loop;
+
+        awaiter(loop &lp, const struct kevent &kev) noexcept
+            : loop_(lp), nchanges_(1)
+        {
+            changes_[0] = kev;
+        }
+
+        awaiter(loop &lp, const struct kevent &kev,
+                const struct kevent &kev2) noexcept
+            : loop_(lp), nchanges_(2)
+        {
+            changes_[0] = kev;
+            changes_[1] = kev2;
+        }
+
+        loop           &loop_;
+        int             nchanges_;
+        struct kevent   changes_[2];
+    };
+
+    loop()
+        : kq_(::kqueue())
+    {
+        if (kq_ < 0)
+            throw std::system_error(errno, std::generic_category(), "kqueue");
+    }
+
+    /* Take over an existing kqueue descriptor */
+    explicit loop(int kq) noexcept
+        : kq_(kq)
+    {
+    }
+
+    ~loop()
+    {
+        if (kq_ >= 0)
+            (void) ::close(kq_);
+    }
+
+    loop(const loop &) = delete;
+    loop &operator=(const loop &) = delete;
+
+    int fd() const noexcept { return kq_; }
+
+    /* Number of coroutines waiting for an event */
+    unsigned int pending() const noexcept { return pending_; }
+
+    /* Resume once the descriptor is readable */
+    awaiter readable(int fd) noexcept
+    {
+        return awaiter(*this, change(fd, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0));
+    }
+
+    /* Resume once the descriptor is writable */
+    awaiter writable(int fd) noexcept
+    {
+        return awaiter(*this, change(fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0));
+    }
+
+    /*
+     * Resume after a delay, rounded up to whole milliseconds. The timer
+     * is named after the awaiter, which stays put while it is pending.
+     */
+    template <class Rep, class Period>
+    awaiter sleep(std::chrono::duration<Rep, Period> delay) noexcept
+    {
+        auto ms = std::chrono::ceil<std::chrono::milliseconds>(delay).count();
+
+        return awaiter(*this, change(0, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0,
+                    (ms > 0) ? ms : 0));
+    }
+
+    /*
+     * Resume when the EVFILT_USER event is triggered with trigger(). The
+     * knote is kept between awaits; EV_DISPATCH disables it when it fires
+     * and the next await updates its udata and enables it again.
+     */
+    awaiter user(uintptr_t ident) noexcept
+    {
+        return awaiter(*this,
+                change(ident, EVFILT_USER, EV_ADD | EV_CLEAR | EV_DISPATCH, 0, 0),
+                change(ident, EVFILT_USER, EV_ENABLE, 0, 0));
+    }
+
+    /* Trigger an EVFILT_USER event without losing the udata of its knote */
+    void trigger(uintptr_t ident, unsigned int fflags = 0)
+    {
+        if (::kqueue_user_trigger(kq_, ident, fflags) < 0)
+            throw std::system_error(errno, std::generic_category(), "kqueue_user_trigger");
+    }
+
+    /*
+     * Wait for one batch of events and resume the coroutine of each one.
+     * Returns the number of coroutines resumed.
+     */
+    int run_once(const struct timespec *timeout = nullptr)
+    {
+        struct kevent events[batch];
+        int i, n;
+
+        n = ::kevent(kq_, nullptr, 0, events, batch, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                return (0);
+            throw std::system_error(errno, std::generic_category(), "kevent");
+        }
+        for (i = 0; i < n; i++) {
+            pending_--;
+            current_ = &events[i];
+            std::coroutine_handle<>::from_address(events[i].udata).resume();
+        }
+        current_ = nullptr;
+
+        return (n);
+    }
+
+    /* Run until no coroutine is waiting for an event */
+    void run()
+    {
+        while (pending_ > 0)
+            (void) run_once();
+    }
+
+private:
+    static struct kevent change(uintptr_t ident, short filter,
+            unsigned short flags, unsigned int fflags, intptr_t data) noexcept
+    {
+        struct kevent kev;
+
+        EV_SET(&kev, ident, filter, flags, fflags, data, nullptr);
+        return (kev);
+    }
+
+    void submit(const struct kevent *changes, int nchanges)
+    {
+        if (::kevent(kq_, changes, nchanges, nullptr, 0, nullptr) < 0)
+            throw std::system_error(errno, std::generic_category(), "kevent");
+    }
+
+    int                  kq_;
+    unsigned int         pending_ = 0;
+    const struct kevent *current_ = nullptr;
+};
+
+} /* namespace libkqueue */
+
+#endif /* !_SYS_EVENT_HPP_ */
@@ -15,70 +15,177 @@
  */
 
 
+#ifndef  _KQUEUE_ALLOC_H
+#define  _KQUEUE_ALLOC_H
+
 /*
- * A simple fixed-size memory allocator.
+ * A slab allocator for fixed-size objects.
  *
- * Each translation unit in a program can include this header and
- * have access to it's own private memory allocator. This can be useful
- * for improving the performance of programs which frequently allocate 
- * and deallocate objects with a fixed size.
+ * Objects are carved out of slabs that hold mp_slab_objs objects each,
+ * and are never returned to the system until the pool is destroyed.
  *
- * The allocator must be initialized by calling mem_init(). This
- * function takes two arguments: the object size, and the maximum
- * number of objects in the cache.
+ * Calls to mem_pool_alloc() must be serialized by the caller, but
+ * mem_pool_free() may be called from any thread. Freed objects are
+ * pushed onto a lock-free list, which is reclaimed in a single step
+ * by the allocating thread once its private free list runs dry.
  *
- * The functions mem_alloc() and mem_free() have similar semantics
- * to the traditional malloc() and free() calls. The main difference
- * is that mem_alloc() does not allow you to specify a specific size.
+ * The mp_live counter reports the number of objects currently handed
+ * out, and mem_pool_cached() the number waiting to be reused.
  *
+ * Objects of a cache line or more are padded to a whole number of cache
+ * lines and start on a cache line boundary, so that two objects never
+ * share a line.
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef _WIN32
 # include <unistd.h>
 #endif
 
-static __thread struct {
-    void  **ac_cache;       /* An array of reusable memory objects */
-    size_t  ac_count;       /* The number of objects in the cache */
-    size_t  ac_max;         /* The maximum number of cached objects */
-    size_t  ac_size;        /* The size, in bytes, of each object */
-} _ma;
+/* Every object is aligned to this boundary */
+#define MEM_ALIGN       (2 * sizeof(void *))
+#define MEM_ROUND(x)    (((x) + MEM_ALIGN - 1) & ~(MEM_ALIGN - 1))
+
+/* The cache line size assumed for padding and alignment */
+#define CACHE_LINE      64
+#define CACHE_ROUND(x)  (((x) + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1))
+
+struct mem_pool {
+    size_t              mp_size;        /* The size, in bytes, of each object */
+    size_t              mp_slab_objs;   /* The number of objects per slab */
+    void               *mp_free;        /* Reusable objects (allocator only) */
+    void * volatile     mp_deferred;    /* Objects freed by any thread */
+    void               *mp_slabs;       /* All slabs owned by the pool */
+    size_t              mp_total;       /* Objects in all slabs */
+    volatile uint32_t   mp_live;        /* Objects currently allocated */
+};
+
+#define mem_pool_cached(mp)     ((mp)->mp_total - (mp)->mp_live)
+
+static inline void
+mem_pool_init(struct mem_pool *mp, size_t objsize, size_t slab_objs)
+{
+    memset(mp, 0, sizeof(*mp));
+    if (objsize >= CACHE_LINE)
+        mp->mp_size = CACHE_ROUND(objsize);
+    else
+        mp->mp_size = MEM_ROUND(objsize < sizeof(void *) ? sizeof(void *) : objsize);
+    mp->mp_slab_objs = (slab_objs > 0) ? slab_objs : 1;
+}
 
+/* Allocate a new slab and thread its objects onto the private free list */
 static inline int
-mem_init(size_t objsize, size_t cachesize)
+mem_pool_grow(struct mem_pool *mp)
 {
-    _ma.ac_size = objsize;
-    _ma.ac_cache = malloc(cachesize * sizeof(void *));
-    return (_ma.ac_cache == NULL ? -1 : 0);
+    char *slab, *obj;
+    size_t i;
+
+    slab = malloc(CACHE_LINE + mp->mp_slab_objs * mp->mp_size);
+    if (slab == NULL)
+        return (-1);
+    *((void **) slab) = mp->mp_slabs;
+    mp->mp_slabs = slab;
+
+    /* The first object follows the link to the next slab */
+    obj = slab + MEM_ROUND(sizeof(void *));
+    if (mp->mp_size >= CACHE_LINE)
+        obj = (char *) CACHE_ROUND((uintptr_t) obj);
+    for (i = 0; i < mp->mp_slab_objs; i++, obj += mp->mp_size) {
+        *((void **) obj) = mp->mp_free;
+        mp->mp_free = obj;
+    }
+    mp->mp_total += mp->mp_slab_objs;
+
+    return (0);
 }
 
 static inline void *
-mem_alloc(void)
+mem_pool_alloc(struct mem_pool *mp)
 {
-    if (_ma.ac_count > 0) 
-        return (_ma.ac_cache[_ma.ac_count--]);
-    else 
-        return (malloc(_ma.ac_size));
+    void *p;
+
+    if (mp->mp_free == NULL) {
+        /* Take ownership of everything freed since the last time */
+        do {
+            p = mp->mp_deferred;
+        } while (p != NULL && atomic_ptr_cas(&mp->mp_deferred, p, NULL) != p);
+        mp->mp_free = p;
+
+        if (mp->mp_free == NULL && mem_pool_grow(mp) < 0)
+            return (NULL);
+    }
+
+    p = mp->mp_free;
+    mp->mp_free = *((void **) p);
+    atomic_inc(&mp->mp_live);
+
+    return (p);
 }
 
 static inline void *
-mem_calloc(void)
+mem_pool_calloc(struct mem_pool *mp)
 {
     void *p;
 
-    p = mem_alloc();
+    p = mem_pool_alloc(mp);
     if (p != NULL)
-        memset(p, 0, _ma.ac_size);
+        memset(p, 0, mp->mp_size);
     return (p);
 }
 
 static inline void
-mem_free(void *ptr)
+mem_pool_free(struct mem_pool *mp, void *ptr)
 {
-    if (_ma.ac_count < _ma.ac_max)
-        _ma.ac_cache[_ma.ac_count++] = ptr;
-    else 
-        free(ptr);
+    void *head;
+
+    do {
+        head = mp->mp_deferred;
+        *((void **) ptr) = head;
+    } while (atomic_ptr_cas(&mp->mp_deferred, head, ptr) != head);
+    atomic_dec(&mp->mp_live);
 }
+
+/*
+ * Put every object of every slab back on the private free list, so the
+ * pool can be used again from scratch. Nothing may still refer to the
+ * objects, including the references left on the deferred list.
+ */
+static inline void
+mem_pool_reset(struct mem_pool *mp)
+{
+    char *slab, *obj;
+    size_t i;
+
+    mp->mp_free = NULL;
+    mp->mp_deferred = NULL;
+    for (slab = mp->mp_slabs; slab != NULL; slab = *((void **) slab)) {
+        obj = slab + MEM_ROUND(sizeof(void *));
+        if (mp->mp_size >= CACHE_LINE)
+            obj = (char *) CACHE_ROUND((uintptr_t) obj);
+        for (i = 0; i < mp->mp_slab_objs; i++, obj += mp->mp_size) {
+            *((void **) obj) = mp->mp_free;
+            mp->mp_free = obj;
+        }
+    }
+    mp->mp_live = 0;
+}
+
+/* Release every slab. All objects must have been freed beforehand. */
+static inline void
+mem_pool_destroy(struct mem_pool *mp)
+{
+    void *slab;
+
+    while ((slab = mp->mp_slabs) != NULL) {
+        mp->mp_slabs = *((void **) slab);
+        free(slab);
+    }
+    mp->mp_free = NULL;
+    mp->mp_deferred = NULL;
+    mp->mp_total = 0;
+    mp->mp_live = 0;
+}
+
+#endif  /* ! _KQUEUE_ALLOC_H */
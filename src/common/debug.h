@@ -18,6 +18,7 @@
 #define  _DEBUG_H
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #ifdef _WIN32
 # include <windows.h>
@@ -30,7 +31,10 @@ extern char *KQUEUE_DEBUG_IDENT;
 
 #if defined(__linux__)
 # include <sys/syscall.h>
-# define THREAD_ID ((pid_t)  syscall(__NR_gettid))
+/* The thread ID is cached, since tracing mutexes record it on every lock */
+extern __thread pid_t kq_thread_id;
+# define THREAD_ID (slowpath(kq_thread_id == 0) \
+        ? (kq_thread_id = (pid_t) syscall(__NR_gettid)) : kq_thread_id)
 #elif defined(__sun)
 # define THREAD_ID ((int) pthread_self())
 #elif defined(_WIN32)
@@ -41,19 +45,19 @@ extern char *KQUEUE_DEBUG_IDENT;
 
 #ifndef NDEBUG
 #define dbg_puts(str)           do {                                \
-    if (DEBUG_KQUEUE)                                                      \
+    if (slowpath(DEBUG_KQUEUE))                                            \
       fprintf(stderr, "%s [%d]: %s(): %s\n",                        \
               KQUEUE_DEBUG_IDENT, THREAD_ID, __func__, str);               \
 } while (0)
 
 #define dbg_printf(fmt,...)     do {                                \
-    if (DEBUG_KQUEUE)                                                      \
+    if (slowpath(DEBUG_KQUEUE))                                            \
       fprintf(stderr, "%s [%d]: %s(): "fmt"\n",                     \
               KQUEUE_DEBUG_IDENT, THREAD_ID, __func__, __VA_ARGS__);       \
 } while (0)
 
 #define dbg_perror(str)         do {                                \
-    if (DEBUG_KQUEUE)                                                      \
+    if (slowpath(DEBUG_KQUEUE))                                            \
       fprintf(stderr, "%s [%d]: %s(): %s: %s (errno=%d)\n",         \
               KQUEUE_DEBUG_IDENT, THREAD_ID, __func__, str,                \
               strerror(errno), errno);                              \
@@ -63,13 +67,13 @@ extern char *KQUEUE_DEBUG_IDENT;
 
 # if defined(_WIN32)
 #  define dbg_lasterror(str)     do {                                \
-    if (DEBUG_KQUEUE)                                                      \
+    if (slowpath(DEBUG_KQUEUE))                                            \
       fprintf(stderr, "%s: [%d] %s(): %s: (LastError=%d)\n",        \
               KQUEUE_DEBUG_IDENT, THREAD_ID, __func__, str, (int)GetLastError());            \
 } while (0)
 
 #  define dbg_wsalasterror(str)  do {                                \
-    if (DEBUG_KQUEUE)                                                      \
+    if (slowpath(DEBUG_KQUEUE))                                            \
       fprintf(stderr, "%s: [%d] %s(): %s: (WSALastError=%d)\n",        \
               KQUEUE_DEBUG_IDENT, THREAD_ID, __func__, str, (int)WSAGetLastError());            \
 } while (0)
@@ -79,26 +83,81 @@ extern char *KQUEUE_DEBUG_IDENT;
 #  define dbg_wsalasterror(str)  ;
 # endif
 
+#else /* NDEBUG */
+# define dbg_puts(str)           do {} while (0)
+# define dbg_printf(fmt,...)     do {} while (0)
+# define dbg_perror(str)         do {} while (0)
+# define dbg_lasterror(str)      do {} while (0)
+# define dbg_wsalasterror(str)   do {} while (0)
+# define reset_errno()           do {} while (0)
+#endif 
+
+#if !defined(NDEBUG) || defined(LOCKSTAT)
 /*
  * Tracing mutexes are a thin wrapper around the pthread_mutex_t 
  * datatype that tracks and reports when a mutex is locked or unlocked.
  * It also allows you to assert that a mutex has (or has not) been locked
  * by calling tracing_mutex_assert().
+ *
+ * When built with LOCKSTAT, each place that locks one also records how
+ * often it did, how often it had to wait, and histograms of how long it
+ * waited and held the lock; see lockstat.c.
  */
 
 # define MTX_UNLOCKED    0
 # define MTX_LOCKED      1
 
+# ifdef LOCKSTAT
+#  define LOCKSTAT_BUCKETS  40
+
+/* Bucket i of the histograms counts times of [2^(i-1), 2^i) ns */
+struct lockstat_site {
+    const char             *ls_name;
+    const char             *ls_file;
+    int                     ls_line;
+    volatile uint32_t       ls_registered;
+    struct lockstat_site   *ls_next;
+    volatile uint32_t       ls_acquired;
+    volatile uint32_t       ls_contended;
+    volatile uint32_t       ls_wait[LOCKSTAT_BUCKETS];
+    volatile uint32_t       ls_hold[LOCKSTAT_BUCKETS];
+};
+# endif
+
 typedef struct {
     pthread_mutex_t mtx_lock; 
     int mtx_status; 
     int mtx_owner;
+# ifdef LOCKSTAT
+    struct lockstat_site *mtx_site;     /* Where the holder locked it */
+    uint64_t mtx_acquired;              /* When, from stats_clock() */
+# endif
 } tracing_mutex_t; 
 
+# ifdef LOCKSTAT
+void lockstat_acquire(tracing_mutex_t *, struct lockstat_site *);
+void lockstat_release(tracing_mutex_t *);
+
+#  define tracing_mutex_acquire(x) do { \
+    static struct lockstat_site _ls = { #x, __FILE__, __LINE__, 0, NULL, 0, 0, {0}, {0} }; \
+    lockstat_acquire((x), &_ls); \
+} while (0)
+#  define tracing_mutex_release(x) do { \
+    lockstat_release((x)); \
+    pthread_mutex_unlock(&((x)->mtx_lock)); \
+} while (0)
+#  define tracing_mutex_init_site(x) ((x)->mtx_site = NULL)
+# else
+#  define tracing_mutex_acquire(x) pthread_mutex_lock(&((x)->mtx_lock))
+#  define tracing_mutex_release(x) pthread_mutex_unlock(&((x)->mtx_lock))
+#  define tracing_mutex_init_site(x) do {} while (0)
+# endif
+
 # define tracing_mutex_init(mtx, attr) do { \
     pthread_mutex_init(&(mtx)->mtx_lock, (attr)); \
     (mtx)->mtx_status = MTX_UNLOCKED; \
     (mtx)->mtx_owner = -1; \
+    tracing_mutex_init_site(mtx); \
 } while (0)
 
 # define tracing_mutex_destroy(mtx) pthread_mutex_destroy(&(mtx)->mtx_lock)
@@ -114,7 +173,7 @@ typedef struct {
 
 # define tracing_mutex_lock(x)  do { \
     dbg_printf("waiting for %s", #x); \
-    pthread_mutex_lock(&((x)->mtx_lock)); \
+    tracing_mutex_acquire(x); \
     dbg_printf("locked %s", #x); \
     (x)->mtx_owner = THREAD_ID; \
     (x)->mtx_status = MTX_LOCKED; \
@@ -123,17 +182,11 @@ typedef struct {
 # define tracing_mutex_unlock(x)  do { \
     (x)->mtx_status = MTX_UNLOCKED; \
     (x)->mtx_owner = -1; \
-    pthread_mutex_unlock(&((x)->mtx_lock)); \
+    tracing_mutex_release(x); \
     dbg_printf("unlocked %s", # x); \
 } while (0)
 
-#else /* NDEBUG */
-# define dbg_puts(str)           do {} while (0)
-# define dbg_printf(fmt,...)     do {} while (0)
-# define dbg_perror(str)         do {} while (0)
-# define dbg_lasterror(str)      do {} while (0)
-# define dbg_wsalasterror(str)   do {} while (0)
-# define reset_errno()           do {} while (0)
+#else
 # define MTX_UNLOCKED                
 # define MTX_LOCKED                 
 # define tracing_mutex_t            pthread_mutex_t
@@ -142,6 +195,6 @@ typedef struct {
 # define tracing_mutex_assert(x,y)  do {} while (0)
 # define tracing_mutex_lock         pthread_mutex_lock
 # define tracing_mutex_unlock       pthread_mutex_unlock
-#endif 
+#endif
 
 #endif  /* ! _DEBUG_H */
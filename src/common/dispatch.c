@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A pool of worker threads that runs a callback for each event of a
+ * kqueue.
+ *
+ * Each worker has a deque of events. A worker with an empty deque first
+ * steals half of the events left in another worker's deque, and if there
+ * are none, it becomes the one thread that waits in kevent(). The batch
+ * it gets back goes to its own deque, so the events it runs itself are
+ * the ones whose knotes it just copied out, and the idle workers are
+ * woken to steal the rest.
+ *
+ * Knotes registered with kqueue_dispatch_change() get EV_DISPATCH, and a
+ * worker enables the knote again after the callback returns. An event is
+ * therefore never run by two workers at once, even for a level-triggered
+ * knote that is still ready.
+ *
+ * An EVFILT_USER knote whose ident is the address of the dispatcher
+ * wakes the waiting worker when the dispatcher is stopped.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "private.h"
+
+/* Events taken by one call to kevent(), and the size of each deque */
+#define DISPATCH_BATCH      64
+
+/* Largest number of workers accepted by kqueue_dispatch_start() */
+#define DISPATCH_MAX        1024
+
+struct dispatch_worker {
+    pthread_mutex_t dw_mtx;                 /* Protects the deque */
+    unsigned int    dw_head;                /* Oldest event; thieves take it */
+    unsigned int    dw_tail;                /* One past the newest event */
+    struct kevent   dw_events[DISPATCH_BATCH];
+    struct kqueue_dispatch *dw_disp;
+    pthread_t       dw_tid;
+    unsigned int    dw_id;
+};
+
+struct kqueue_dispatch {
+    int             kd_kq;
+    void          (*kd_func)(void *, const struct kevent *);
+    volatile int    kd_stop;
+    pthread_mutex_t kd_poll_mtx;            /* Held by the waiting worker */
+    pthread_mutex_t kd_mtx;                 /* Protects kd_gen */
+    pthread_cond_t  kd_cond;                /* Signalled when kd_gen changes */
+    unsigned int    kd_gen;                 /* Number of waits that ended */
+    unsigned int    kd_nworkers;
+    struct dispatch_worker kd_worker[];
+};
+
+/* Take the newest event of the worker's own deque */
+static int
+dispatch_pop(struct dispatch_worker *dw, struct kevent *kev)
+{
+    int rv = 0;
+
+    pthread_mutex_lock(&dw->dw_mtx);
+    if (dw->dw_head != dw->dw_tail) {
+        memcpy(kev, &dw->dw_events[--dw->dw_tail], sizeof(*kev));
+        rv = 1;
+    }
+    pthread_mutex_unlock(&dw->dw_mtx);
+
+    return (rv);
+}
+
+/* Move half of the oldest events of another worker into the empty deque */
+static int
+dispatch_steal(struct dispatch_worker *dw)
+{
+    struct kqueue_dispatch *kd = dw->dw_disp;
+    struct dispatch_worker *victim;
+    struct kevent stolen[DISPATCH_BATCH];
+    unsigned int i, n;
+
+    for (i = 1; i < kd->kd_nworkers; i++) {
+        victim = &kd->kd_worker[(dw->dw_id + i) % kd->kd_nworkers];
+        if (victim->dw_head == victim->dw_tail)
+            continue;
+
+        pthread_mutex_lock(&victim->dw_mtx);
+        n = (victim->dw_tail - victim->dw_head + 1) / 2;
+        memcpy(stolen, &victim->dw_events[victim->dw_head], n * sizeof(struct kevent));
+        victim->dw_head += n;
+        pthread_mutex_unlock(&victim->dw_mtx);
+        if (n == 0)
+            continue;
+
+        pthread_mutex_lock(&dw->dw_mtx);
+        memcpy(dw->dw_events, stolen, n * sizeof(struct kevent));
+        dw->dw_head = 0;
+        dw->dw_tail = n;
+        pthread_mutex_unlock(&dw->dw_mtx);
+        return (1);
+    }
+
+    return (0);
+}
+
+/* Wait for a batch of events and put it in the empty deque */
+static void
+dispatch_wait(struct dispatch_worker *dw)
+{
+    struct kqueue_dispatch *kd = dw->dw_disp;
+    struct kevent kev[DISPATCH_BATCH];
+    int i, n, nqueued;
+
+    n = kevent(kd->kd_kq, NULL, 0, kev, DISPATCH_BATCH, NULL);
+    pthread_mutex_unlock(&kd->kd_poll_mtx);
+    if (n < 0)
+        dbg_perror("kevent(2)");
+
+    pthread_mutex_lock(&dw->dw_mtx);
+    dw->dw_head = 0;
+    for (i = 0, nqueued = 0; i < n; i++) {
+        if (kev[i].filter == EVFILT_USER && kev[i].ident == (uintptr_t) kd)
+            continue;
+        memcpy(&dw->dw_events[nqueued++], &kev[i], sizeof(struct kevent));
+    }
+    dw->dw_tail = nqueued;
+    pthread_mutex_unlock(&dw->dw_mtx);
+
+    /*
+     * Wake one worker to take over the wait, or all of them if there are
+     * events to steal.
+     */
+    pthread_mutex_lock(&kd->kd_mtx);
+    kd->kd_gen++;
+    if (nqueued > 1)
+        pthread_cond_broadcast(&kd->kd_cond);
+    else
+        pthread_cond_signal(&kd->kd_cond);
+    pthread_mutex_unlock(&kd->kd_mtx);
+}
+
+static void
+dispatch_run(struct kqueue_dispatch *kd, struct kevent *kev)
+{
+    struct kevent enable;
+
+    kd->kd_func(kev->udata, kev);
+
+    /* The callback may have deleted the knote, so ENOENT is expected */
+    if (kev->flags & EV_DISPATCH) {
+        EV_SET(&enable, kev->ident, kev->filter, EV_ENABLE, 0, 0, kev->udata);
+        (void) kevent(kd->kd_kq, &enable, 1, NULL, 0, NULL);
+    }
+}
+
+static void *
+dispatch_worker_main(void *arg)
+{
+    struct dispatch_worker *dw = arg;
+    struct kqueue_dispatch *kd = dw->dw_disp;
+    struct kevent kev;
+    unsigned int gen;
+
+    for (;;) {
+        /* The events already taken are run even after a stop */
+        if (dispatch_pop(dw, &kev)) {
+            dispatch_run(kd, &kev);
+            continue;
+        }
+        if (dispatch_steal(dw))
+            continue;
+        if (kd->kd_stop)
+            break;
+
+        pthread_mutex_lock(&kd->kd_mtx);
+        gen = kd->kd_gen;
+        pthread_mutex_unlock(&kd->kd_mtx);
+        if (pthread_mutex_trylock(&kd->kd_poll_mtx) == 0) {
+            dispatch_wait(dw);
+            continue;
+        }
+
+        /* Another worker is waiting; sleep until its wait ends */
+        pthread_mutex_lock(&kd->kd_mtx);
+        while (kd->kd_gen == gen && !kd->kd_stop)
+            pthread_cond_wait(&kd->kd_cond, &kd->kd_mtx);
+        pthread_mutex_unlock(&kd->kd_mtx);
+    }
+
+    return (NULL);
+}
+
+VISIBLE struct kqueue_dispatch *
+kqueue_dispatch_start(int kq, unsigned int nworkers,
+        void (*func)(void *, const struct kevent *))
+{
+    struct kqueue_dispatch *kd;
+    struct kevent kev;
+    unsigned int i;
+    long ncpu;
+
+    if (kqueue_lookup(kq) == NULL) {
+        errno = EBADF;
+        return (NULL);
+    }
+    if (nworkers == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ncpu < 1)
+            ncpu = 1;
+        nworkers = (ncpu > DISPATCH_MAX) ? DISPATCH_MAX : ncpu;
+    }
+    if (nworkers > DISPATCH_MAX || func == NULL) {
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    kd = calloc(1, sizeof(*kd) + nworkers * sizeof(struct dispatch_worker));
+    if (kd == NULL)
+        return (NULL);
+    kd->kd_kq = kq;
+    kd->kd_func = func;
+    kd->kd_nworkers = nworkers;
+    pthread_mutex_init(&kd->kd_poll_mtx, NULL);
+    pthread_mutex_init(&kd->kd_mtx, NULL);
+    pthread_cond_init(&kd->kd_cond, NULL);
+
+    /* Once triggered, it stays ready so that every later wait returns */
+    EV_SET(&kev, (uintptr_t) kd, EVFILT_USER, EV_ADD, 0, 0, NULL);
+    if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+        goto errout;
+
+    for (i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&kd->kd_worker[i].dw_mtx, NULL);
+        kd->kd_worker[i].dw_disp = kd;
+        kd->kd_worker[i].dw_id = i;
+    }
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&kd->kd_worker[i].dw_tid, NULL,
+                    dispatch_worker_main, &kd->kd_worker[i]) != 0) {
+            dbg_puts("pthread_create(3) failed");
+            kd->kd_nworkers = i;
+            (void) kqueue_dispatch_stop(kd);
+            errno = EAGAIN;
+            return (NULL);
+        }
+    }
+
+    dbg_printf("dispatch=%p kq=%d workers=%u", kd, kq, nworkers);
+    return (kd);
+
+errout:
+    pthread_cond_destroy(&kd->kd_cond);
+    pthread_mutex_destroy(&kd->kd_mtx);
+    pthread_mutex_destroy(&kd->kd_poll_mtx);
+    free(kd);
+    return (NULL);
+}
+
+/*
+ * Apply a changelist, adding EV_DISPATCH to the knotes that are created
+ * or modified so that the workers can rely on it.
+ */
+int VISIBLE
+kqueue_dispatch_change(struct kqueue_dispatch *kd,
+        const struct kevent *changelist, int nchanges)
+{
+    struct kevent kev[DISPATCH_BATCH];
+    int i, n;
+
+    for (; nchanges > 0; changelist += n, nchanges -= n) {
+        n = (nchanges > DISPATCH_BATCH) ? DISPATCH_BATCH : nchanges;
+        memcpy(kev, changelist, n * sizeof(struct kevent));
+        for (i = 0; i < n; i++) {
+            if (kev[i].flags & EV_ADD && !(kev[i].flags & EV_ONESHOT))
+                kev[i].flags |= EV_DISPATCH;
+        }
+        if (kevent(kd->kd_kq, kev, n, NULL, 0, NULL) < 0)
+            return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * Stop the workers and wait for them to exit. The events that a worker
+ * had already taken from the kqueue are run first.
+ */
+int VISIBLE
+kqueue_dispatch_stop(struct kqueue_dispatch *kd)
+{
+    struct kevent kev;
+    unsigned int i;
+
+    kd->kd_stop = 1;
+    EV_SET(&kev, (uintptr_t) kd, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    (void) kevent(kd->kd_kq, &kev, 1, NULL, 0, NULL);
+    pthread_mutex_lock(&kd->kd_mtx);
+    pthread_cond_broadcast(&kd->kd_cond);
+    pthread_mutex_unlock(&kd->kd_mtx);
+
+    for (i = 0; i < kd->kd_nworkers; i++) {
+        if (pthread_join(kd->kd_worker[i].dw_tid, NULL) != 0)
+            dbg_puts("pthread_join(3) failed");
+        pthread_mutex_destroy(&kd->kd_worker[i].dw_mtx);
+    }
+
+    EV_SET(&kev, (uintptr_t) kd, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    (void) kevent(kd->kd_kq, &kev, 1, NULL, 0, NULL);
+    pthread_cond_destroy(&kd->kd_cond);
+    pthread_mutex_destroy(&kd->kd_mtx);
+    pthread_mutex_destroy(&kd->kd_poll_mtx);
+    free(kd);
+
+    return (0);
+}
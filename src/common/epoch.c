@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Deferred reclamation for the objects of a kqueue.
+ *
+ * Every call of kevent() and kqueue_user_trigger() is a read section of
+ * the epoch of its kqueue. Within it, knotes may be reached without a
+ * lock or a reference: knote_lookup() takes no lock, and the backend may
+ * return an event for a knote that another thread has just deleted. So
+ * a deleted knote, or a knote index that was replaced, is retired rather
+ * than freed, and it is freed once every read section that was running
+ * at the time has ended. A read section only delays the objects retired
+ * while it runs. A thread that waits for events holds its read section
+ * through the wait, because the backend may return a knote that is
+ * deleted meanwhile. So when the limbo grows, the waiters are woken, and
+ * each one passes through a quiescent state before it waits again.
+ *
+ * This works like sleepable RCU. A read section counts itself in one of
+ * two counters, chosen by the parity of the epoch when it started. The
+ * epoch advances when the counter of the previous epoch is zero, and an
+ * object retired in epoch N is unreachable once the epoch is N + 2.
+ */
+
+#include <stdlib.h>
+
+#include "private.h"
+
+/* Wake the waiters each time this many entries are held back */
+#define EPOCH_LIMBO_WAKE    256
+
+void
+epoch_init(struct epoch *ep)
+{
+    memset(ep, 0, sizeof(*ep));
+    pthread_mutex_init(&ep->ep_mtx, NULL);
+}
+
+/* Free everything; no read section may be running */
+void
+epoch_free(struct epoch *ep)
+{
+    struct epoch_entry *ee;
+
+    while ((ee = ep->ep_limbo) != NULL) {
+        ep->ep_limbo = ee->ee_next;
+        ee->ee_free(ee);
+    }
+    ep->ep_nlimbo = 0;
+}
+
+/** @return the counter to pass to epoch_exit() */
+unsigned int
+epoch_enter(struct epoch *ep)
+{
+    unsigned int idx;
+
+    idx = ep->ep_epoch & 1;
+    atomic_inc(&ep->ep_readers[idx]);
+
+    return (idx);
+}
+
+void
+epoch_exit(struct epoch *ep, unsigned int idx)
+{
+    atomic_dec(&ep->ep_readers[idx]);
+    if (ep->ep_nlimbo != 0)
+        epoch_reclaim(ep);
+}
+
+/*
+ * Free <ee> with <fn> once no read section can reach it. The caller must
+ * have made it unreachable for new read sections already.
+ *
+ * @return 1 if the caller should wake the threads that wait on the
+ *         kqueue, so that the epoch can advance
+ */
+int
+epoch_retire(struct epoch *ep, struct epoch_entry *ee,
+        void (*fn)(struct epoch_entry *))
+{
+    uint32_t n;
+
+    ee->ee_free = fn;
+    pthread_mutex_lock(&ep->ep_mtx);
+    ee->ee_epoch = ep->ep_epoch;
+    ee->ee_next = ep->ep_limbo;
+    ep->ep_limbo = ee;
+    n = ++ep->ep_nlimbo;
+    pthread_mutex_unlock(&ep->ep_mtx);
+
+    return (n % EPOCH_LIMBO_WAKE == 0);
+}
+
+/* Advance the epoch as far as the read sections allow, and free what it can */
+void
+epoch_reclaim(struct epoch *ep)
+{
+    struct epoch_entry *ee, **prev, *expired;
+    unsigned int epoch, i;
+
+    pthread_mutex_lock(&ep->ep_mtx);
+    for (i = 0; i < 2; i++) {
+        epoch = ep->ep_epoch;
+        atomic_barrier();
+        if (ep->ep_readers[(epoch - 1) & 1] != 0)
+            break;
+        ep->ep_epoch = epoch + 1;
+        atomic_barrier();
+    }
+
+    /* Nothing has expired since the last scan unless the epoch advanced */
+    epoch = ep->ep_epoch;
+    if (epoch == ep->ep_scanned) {
+        pthread_mutex_unlock(&ep->ep_mtx);
+        return;
+    }
+    ep->ep_scanned = epoch;
+
+    /* The list is in retirement order, newest first */
+    for (prev = &ep->ep_limbo; *prev != NULL; prev = &(*prev)->ee_next) {
+        if (epoch - (*prev)->ee_epoch >= 2)
+            break;
+    }
+    expired = *prev;
+    *prev = NULL;
+    for (ee = expired; ee != NULL; ee = ee->ee_next)
+        ep->ep_nlimbo--;
+    pthread_mutex_unlock(&ep->ep_mtx);
+
+    while ((ee = expired) != NULL) {
+        expired = ee->ee_next;
+        ee->ee_free(ee);
+    }
+}
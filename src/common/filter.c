@@ -23,13 +23,58 @@
 
 #include "private.h"
 
+#if KQUEUE_FILTER_READ
 extern const struct filter evfilt_read;
+#endif
+#if KQUEUE_FILTER_WRITE
 extern const struct filter evfilt_write;
+#endif
+#if KQUEUE_FILTER_AIO
+extern const struct filter evfilt_aio;
+#endif
+#if KQUEUE_FILTER_SIGNAL
 extern const struct filter evfilt_signal;
+#endif
+#if KQUEUE_FILTER_VNODE
 extern const struct filter evfilt_vnode;
+#endif
+#if KQUEUE_FILTER_PROC
 extern const struct filter evfilt_proc;
+#endif
+#if KQUEUE_FILTER_TIMER
 extern const struct filter evfilt_timer;
+#endif
+#if KQUEUE_FILTER_USER
 extern const struct filter evfilt_user;
+#endif
+
+/* The filters that filter_lookup() sets up, indexed by ~id */
+static const struct filter *filter_table[EVFILT_SYSCOUNT] = {
+#if KQUEUE_FILTER_READ
+    [~EVFILT_READ]   = &evfilt_read,
+#endif
+#if KQUEUE_FILTER_WRITE
+    [~EVFILT_WRITE]  = &evfilt_write,
+#endif
+#if KQUEUE_FILTER_AIO
+    [~EVFILT_AIO]    = &evfilt_aio,
+#endif
+#if KQUEUE_FILTER_SIGNAL
+    [~EVFILT_SIGNAL] = &evfilt_signal,
+#endif
+#if KQUEUE_FILTER_VNODE
+    [~EVFILT_VNODE]  = &evfilt_vnode,
+#endif
+#if KQUEUE_FILTER_PROC
+    [~EVFILT_PROC]   = &evfilt_proc,
+#endif
+#if KQUEUE_FILTER_TIMER
+    [~EVFILT_TIMER]  = &evfilt_timer,
+#endif
+#if KQUEUE_FILTER_USER
+    [~EVFILT_USER]   = &evfilt_user,
+#endif
+};
 
 static int
 filter_register(struct kqueue *kq, short filter, const struct filter *src)
@@ -42,97 +87,82 @@ filter_register(struct kqueue *kq, short filter, const struct filter *src)
     if (filt >= EVFILT_SYSCOUNT) 
         return (-1);
 
-    dst = &kq->kq_filt[filt];
-    memcpy(dst, src, sizeof(*src));
-    dst->kf_kqueue = kq;
-    RB_INIT(&dst->kf_knote);
-    pthread_rwlock_init(&dst->kf_knote_mtx, NULL);
-    if (src->kf_id == 0) {
-        dbg_puts("filter is not implemented");
-        return (0);
-    }
-
-    assert(src->kf_copyout);
+    assert(src->kf_copyout || src->kf_copyout_filter);
     assert(src->kn_create);
     assert(src->kn_modify);
     assert(src->kn_delete);
     assert(src->kn_enable);
     assert(src->kn_disable);
 
+    dst = malloc(sizeof(*dst));
+    if (dst == NULL)
+        return (-1);
+    memcpy(dst, src, sizeof(*src));
+    dst->kf_kqueue = kq;
+    RB_INIT(&dst->kf_knote);
+    tracing_mutex_init(&dst->kf_knote_mtx, NULL);
+    pthread_mutex_init(&dst->kf_mtx, NULL);
+
+    /* Descriptor-based filters can look up knotes directly by ident */
+    if (filter == EVFILT_READ || filter == EVFILT_WRITE)
+        dst->kf_knote_indexed = 1;
+
     /* Perform (optional) per-filter initialization */
     if (src->kf_init != NULL) {
         rv = src->kf_init(dst);
         if (rv < 0) {
             dbg_puts("filter failed to initialize");
-            dst->kf_id = 0;
+            free(dst);
             return (-1);
         }
     }
 
-#if DEADWOOD
-    /* Add the filter's event descriptor to the main fdset */
-    if (dst->kf_pfd > 0) {
-        FD_SET(dst->kf_pfd, &kq->kq_fds);
-        if (dst->kf_pfd > kq->kq_nfds)  
-            kq->kq_nfds = dst->kf_pfd;
-        dbg_printf("fds: added %d (nfds=%d)", dst->kf_pfd, kq->kq_nfds);
-    }
-    dbg_printf("filter %d (%s) registered", filter, filter_name(filter));
-#endif
-
 	/* FIXME: should totally remove const from src */
 	if (kqops.filter_init != NULL
-            && kqops.filter_init(kq, dst) < 0)
+            && kqops.filter_init(kq, dst) < 0) {
+        if (dst->kf_destroy != NULL)
+            dst->kf_destroy(dst);
+        free(dst);
 		return (-1);
+    }
 
-    return (0);
-}
+    /* Lookups without the kqueue lock may use the filter from here on */
+    atomic_barrier();
+    kq->kq_filt[filt] = dst;
 
-int
-filter_register_all(struct kqueue *kq)
-{
-    int rv;
-
-    FD_ZERO(&kq->kq_fds);
-    rv = 0;
-    rv += filter_register(kq, EVFILT_READ, &evfilt_read);
-    rv += filter_register(kq, EVFILT_WRITE, &evfilt_write);
-    rv += filter_register(kq, EVFILT_SIGNAL, &evfilt_signal);
-    rv += filter_register(kq, EVFILT_VNODE, &evfilt_vnode);
-    rv += filter_register(kq, EVFILT_PROC, &evfilt_proc);
-    rv += filter_register(kq, EVFILT_TIMER, &evfilt_timer);
-    rv += filter_register(kq, EVFILT_USER, &evfilt_user);
-    kq->kq_nfds++;
-    if (rv != 0) {
-        filter_unregister_all(kq);
-        return (-1);
-    } else {
-        dbg_puts("complete");
-        return (0);
-    }
+    return (0);
 }
 
 void
 filter_unregister_all(struct kqueue *kq)
 {
+    struct filter *filt;
     int i;
 
     for (i = 0; i < EVFILT_SYSCOUNT; i++) {
-        if (kq->kq_filt[i].kf_id == 0)
+        filt = kq->kq_filt[i];
+        if (filt == NULL)
             continue;
 
-        if (kq->kq_filt[i].kf_destroy != NULL) 
-            kq->kq_filt[i].kf_destroy(&kq->kq_filt[i]);
-
-        //XXX-FIXME
-        //knote_free_all(&kq->kq_filt[i]);
+        /* The knotes of an inherited kqueue go with the pool */
+        if (!kq->kq_inherited)
+            knote_free_all(filt);
+        if (filt->kf_destroy != NULL) 
+            filt->kf_destroy(filt);
+        knote_index_free(filt);
 
         if (kqops.filter_free != NULL)
-            kqops.filter_free(kq, &kq->kq_filt[i]);
+            kqops.filter_free(kq, filt);
+        free(filt);
+        kq->kq_filt[i] = NULL;
 	}
-    memset(&kq->kq_filt[0], 0, sizeof(kq->kq_filt));
 }
 
+/*
+ * Find a filter, setting it up the first time it is used, so that a
+ * kqueue only pays for the filters that it needs. Call with the kqueue
+ * locked.
+ */
 int
 filter_lookup(struct filter **filt, struct kqueue *kq, short id)
 {
@@ -142,12 +172,16 @@ filter_lookup(struct filter **filt, struct kqueue *kq, short id)
         *filt = NULL;
         return (-1);
     }
-    *filt = &kq->kq_filt[~id];
-    if ((*filt)->kf_copyout == NULL) {
-        dbg_printf("filter %s is not implemented", filter_name(id));
-        errno = ENOSYS;
-        *filt = NULL;
-        return (-1);
+    *filt = kq->kq_filt[~id];
+    if (slowpath(*filt == NULL)) {
+        if (filter_table[~id] == NULL || filter_table[~id]->kf_id == 0) {
+            dbg_printf("filter %s is not implemented", filter_name(id));
+            errno = ENOSYS;
+            return (-1);
+        }
+        if (filter_register(kq, id, filter_table[~id]) < 0)
+            return (-1);
+        *filt = kq->kq_filt[~id];
     }
 
     return (0);
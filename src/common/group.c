@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A group of kqueues that splits its knotes between shards.
+ *
+ * kqueue_group() creates one ordinary kqueue for each shard, and one more
+ * that is returned as the group descriptor. Each change made through the
+ * group descriptor is applied to the shard that owns its ident: the shard
+ * given to kqueue_group_assign(), or else one chosen by hashing the ident.
+ * A worker thread can wait on its own shard, so it only shares the shard
+ * lock and backend instance with the threads that use the same shard.
+ *
+ * The group kqueue has an EVFILT_READ knote for the descriptor of each
+ * shard, so it becomes readable whenever a shard has events and can be
+ * nested into another event loop. kevent() on the group descriptor takes
+ * the events from the shards in turn.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "private.h"
+
+/* Largest number of shards accepted by kqueue_group() */
+#define GROUP_MAX       1024
+
+/* Events of the group kqueue taken per wait; they are only wakeups */
+#define GROUP_WAKEUPS   16
+
+struct group_affinity {
+    uintptr_t       ga_ident;
+    unsigned int    ga_shard;
+    RB_ENTRY(group_affinity) ga_entry;
+};
+
+struct kqueue_group {
+    pthread_mutex_t kg_mtx;                 /* Protects kg_affinity */
+    RB_HEAD(group_affinity_tree, group_affinity) kg_affinity;
+    volatile uint32_t kg_nassigned;         /* Entries in kg_affinity */
+    volatile uint32_t kg_next;              /* Shard the next wait starts at */
+    unsigned int    kg_nshards;
+    int             kg_shard[];             /* Descriptors of the shards */
+};
+
+static int
+group_affinity_cmp(struct group_affinity *a, struct group_affinity *b)
+{
+    if (a->ga_ident == b->ga_ident)
+        return (0);
+    return (a->ga_ident < b->ga_ident ? -1 : 1);
+}
+
+RB_GENERATE(group_affinity_tree, group_affinity, ga_entry, group_affinity_cmp)
+
+static struct kqueue_group *
+group_lookup(int gfd)
+{
+    struct kqueue *kq;
+
+    kq = kqueue_lookup(gfd);
+    if (kq == NULL || kq->kq_group == NULL) {
+        errno = EBADF;
+        return (NULL);
+    }
+    return (kq->kq_group);
+}
+
+/* The shard that owns an ident */
+static unsigned int
+group_shard(struct kqueue_group *kg, uintptr_t ident)
+{
+    struct group_affinity key, *ga;
+    unsigned int shard;
+
+    if (kg->kg_nassigned > 0) {
+        key.ga_ident = ident;
+        pthread_mutex_lock(&kg->kg_mtx);
+        ga = RB_FIND(group_affinity_tree, &kg->kg_affinity, &key);
+        shard = (ga != NULL) ? ga->ga_shard : kg->kg_nshards;
+        pthread_mutex_unlock(&kg->kg_mtx);
+        if (shard < kg->kg_nshards)
+            return (shard);
+    }
+
+    /* Descriptors are small and dense, so mix the bits before reducing */
+    return ((unsigned int) (((uint64_t) ident * 0x9E3779B97F4A7C15ULL) >> 32)
+            % kg->kg_nshards);
+}
+
+/*
+ * Take the pending events of the shards without waiting, starting at a
+ * different shard each time so that a busy one cannot starve the rest.
+ */
+static int
+group_collect(struct kqueue_group *kg, struct kevent *eventlist, int nevents)
+{
+    static const struct timespec zero = { 0, 0 };
+    unsigned int i, first;
+    int n, rv;
+
+    first = atomic_inc(&kg->kg_next);
+    for (i = 0, n = 0; i < kg->kg_nshards && n < nevents; i++) {
+        rv = kevent(kg->kg_shard[(first + i) % kg->kg_nshards], NULL, 0,
+                eventlist + n, nevents - n, &zero);
+        if (rv < 0)
+            return ((n > 0) ? n : -1);
+        n += rv;
+    }
+
+    return (n);
+}
+
+/*
+ * kevent() for a group descriptor. Changelist errors and receipts are
+ * reported the same way as for a single kqueue.
+ */
+int
+kqueue_group_kevent(struct kqueue *kq, const struct kevent *changelist,
+        int nchanges, struct kevent *eventlist, int nevents,
+        const struct timespec *timeout)
+{
+    struct kqueue_group *kg = kq->kq_group;
+    struct kevent wakeup[GROUP_WAKEUPS];
+    struct timespec remain;
+    uint64_t deadline = 0, now;
+    int i, nret, rv, status;
+
+    for (i = 0, nret = 0; i < nchanges; i++) {
+        rv = kevent(kg->kg_shard[group_shard(kg, changelist[i].ident)],
+                &changelist[i], 1, NULL, 0, NULL);
+        if (rv < 0)
+            status = errno;
+        else if (changelist[i].flags & EV_RECEIPT)
+            status = 0;
+        else
+            continue;
+        if (nret >= nevents) {
+            errno = status;
+            return (-1);
+        }
+        memcpy(&eventlist[nret], &changelist[i], sizeof(struct kevent));
+        eventlist[nret].data = status;
+        nret++;
+    }
+    if (nchanges > 0)
+        stats_changes(kq, nchanges);
+    if (nret > 0 || nevents <= 0)
+        return (nret);
+
+    if (timeout != NULL)
+        deadline = stats_clock() + timeout->tv_sec * 1000000000ULL
+            + timeout->tv_nsec;
+    for (;;) {
+        rv = group_collect(kg, eventlist, nevents);
+        if (rv != 0)
+            return (rv);
+
+        /* Sleep until a shard is readable, and leave its events to it */
+        if (timeout != NULL) {
+            now = stats_clock();
+            if (now >= deadline)
+                return (0);
+            remain.tv_sec = (deadline - now) / 1000000000;
+            remain.tv_nsec = (deadline - now) % 1000000000;
+        }
+        rv = kevent_wait_copyout(kq, wakeup, GROUP_WAKEUPS,
+                (timeout != NULL) ? &remain : NULL, NULL);
+        if (rv < 0)
+            return (-1);
+    }
+}
+
+int VISIBLE
+kqueue_group(unsigned int nshards)
+{
+    struct kqueue_group *kg;
+    struct kevent kev;
+    unsigned int i;
+    long ncpu;
+    int gfd;
+
+    if (nshards == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ncpu < 1)
+            ncpu = 1;
+        nshards = (ncpu > GROUP_MAX) ? GROUP_MAX : ncpu;
+    }
+    if (nshards > GROUP_MAX) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    kg = calloc(1, sizeof(*kg) + nshards * sizeof(int));
+    if (kg == NULL)
+        return (-1);
+    pthread_mutex_init(&kg->kg_mtx, NULL);
+    RB_INIT(&kg->kg_affinity);
+    kg->kg_nshards = nshards;
+    for (i = 0; i < nshards; i++)
+        kg->kg_shard[i] = -1;
+
+    gfd = kqueue();
+    if (gfd < 0)
+        goto errout;
+    for (i = 0; i < nshards; i++) {
+        kg->kg_shard[i] = kqueue();
+        if (kg->kg_shard[i] < 0)
+            goto errout;
+        EV_SET(&kev, kg->kg_shard[i], EVFILT_READ, EV_ADD, NOTE_NODATA, 0, NULL);
+        if (kevent(gfd, &kev, 1, NULL, 0, NULL) < 0)
+            goto errout;
+    }
+
+    /* From here on, kevent() hands the changes to the shards */
+    atomic_barrier();
+    kqueue_lookup(gfd)->kq_group = kg;
+
+    dbg_printf("group kq=%d shards=%u", gfd, nshards);
+    return (gfd);
+
+errout:
+    for (i = 0; i < nshards && kg->kg_shard[i] >= 0; i++)
+        (void) close(kg->kg_shard[i]);
+    if (gfd >= 0)
+        (void) close(gfd);
+    pthread_mutex_destroy(&kg->kg_mtx);
+    free(kg);
+    return (-1);
+}
+
+/* Called when the group descriptor is torn down; see kqueue_free() */
+void
+kqueue_group_free(struct kqueue_group *kg)
+{
+    struct group_affinity *ga;
+    unsigned int i;
+
+    for (i = 0; i < kg->kg_nshards; i++)
+        (void) kqueue_close(kg->kg_shard[i]);
+    while ((ga = RB_MIN(group_affinity_tree, &kg->kg_affinity)) != NULL) {
+        RB_REMOVE(group_affinity_tree, &kg->kg_affinity, ga);
+        free(ga);
+    }
+    pthread_mutex_destroy(&kg->kg_mtx);
+    free(kg);
+}
+
+int VISIBLE
+kqueue_group_shard(int gfd, unsigned int shard)
+{
+    struct kqueue_group *kg;
+
+    kg = group_lookup(gfd);
+    if (kg == NULL)
+        return (-1);
+    if (shard >= kg->kg_nshards) {
+        errno = EINVAL;
+        return (-1);
+    }
+    return (kg->kg_shard[shard]);
+}
+
+int VISIBLE
+kqueue_group_assign(int gfd, uintptr_t ident, unsigned int shard)
+{
+    struct kqueue_group *kg;
+    struct group_affinity *ga, *old;
+
+    kg = group_lookup(gfd);
+    if (kg == NULL)
+        return (-1);
+    if (shard >= kg->kg_nshards) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    ga = malloc(sizeof(*ga));
+    if (ga == NULL)
+        return (-1);
+    ga->ga_ident = ident;
+    ga->ga_shard = shard;
+
+    pthread_mutex_lock(&kg->kg_mtx);
+    old = RB_INSERT(group_affinity_tree, &kg->kg_affinity, ga);
+    if (old != NULL) {
+        old->ga_shard = shard;
+        free(ga);
+    } else {
+        atomic_inc(&kg->kg_nassigned);
+    }
+    pthread_mutex_unlock(&kg->kg_mtx);
+
+    return (0);
+}
@@ -28,6 +28,17 @@
 
 #include "private.h"
 
+/* The changelist entry being applied by this thread, if any */
+__thread const struct kevent *kevent_change;
+
+/* The changelist of the kevent64() call in progress in this thread */
+static __thread const struct kevent64_s *kevent64_changes;
+static __thread int kevent64_nchanges;
+
+/* The number of nested kqueues being harvested by this thread */
+static __thread int kevent_nest_depth;
+#define KEVENT_NEST_MAX     4
+
 static const char *
 kevent_filter_dump(const struct kevent *kev)
 {
@@ -115,38 +126,131 @@ kevent_dump(const struct kevent *kev)
     return ((const char *) &buf[0]);
 }
 
-static int
-kevent_copyin_one(struct kqueue *kq, const struct kevent *src)
+/*
+ * Return the kevent64() change that a change was converted from, if any.
+ * kevent64() passes a pointer to it as the udata of the change.
+ */
+static const struct kevent64_s *
+kevent64_source(const struct kevent *kev)
 {
-    struct knote  *kn = NULL;
-    struct filter *filt;
-    int rv = 0;
+    uintptr_t p = (uintptr_t) kev->udata;
 
-    if (src->flags & EV_DISPATCH && src->flags & EV_ONESHOT) {
-        dbg_puts("Error: EV_DISPATCH and EV_ONESHOT are mutually exclusive");
+    if (kevent64_changes == NULL
+            || p < (uintptr_t) kevent64_changes
+            || p >= (uintptr_t) (kevent64_changes + kevent64_nchanges))
+        return (NULL);
+    return ((const struct kevent64_s *) p);
+}
+
+/* Must hold the knote lock when calling this */
+static void
+knote_set_udata(struct knote *kn, const struct kevent *src)
+{
+    const struct kevent64_s *src64 = kevent64_source(src);
+
+    if (src64 == NULL) {
+        kn->kev.flags &= ~EV_KEVENT64;
+        kn->kev.udata = src->udata;
+        return;
+    }
+    kn->kn_udata64 = src64->udata;
+    kn->kn_ext[0] = src64->ext[0];
+    kn->kn_ext[1] = src64->ext[1];
+    kn->kev.flags |= EV_KEVENT64;
+    kn->kev.udata = kn;
+}
+
+/*
+ * Put the udata of a knote added by kevent64() back into its event, and
+ * convert the event for kevent64() if kev64 is not NULL. The knote is
+ * not freed before the caller leaves its epoch, even if it was deleted.
+ */
+static void
+kevent_export(struct kevent *kev, struct kevent64_s *kev64)
+{
+    const struct kevent64_s *src64;
+    struct knote *kn;
+
+    if (slowpath(kev->flags & EV_KEVENT64)) {
+        kn = (struct knote *) kev->udata;
+        kev->flags &= ~EV_KEVENT64;
+        kev->udata = (void *) (uintptr_t) kn->kn_udata64;
+        if (kev64 == NULL)
+            return;
+        kev64->udata = kn->kn_udata64;
+        kev64->ext[0] = kn->kn_ext[0];
+        kev64->ext[1] = kn->kn_ext[1];
+    } else if (kev64 == NULL) {
+        return;
+    } else if ((src64 = kevent64_source(kev)) != NULL) {
+        /* A changelist entry that failed, or one with EV_RECEIPT */
+        kev64->udata = src64->udata;
+        kev64->ext[0] = src64->ext[0];
+        kev64->ext[1] = src64->ext[1];
+    } else {
+        kev64->udata = (uintptr_t) kev->udata;
+        kev64->ext[0] = 0;
+        kev64->ext[1] = 0;
+    }
+    kev64->ident = kev->ident;
+    kev64->filter = kev->filter;
+    kev64->flags = kev->flags;
+    kev64->fflags = kev->fflags;
+    kev64->data = kev->data;
+}
+
+/*
+ * The ident of an EVFILT_READ knote with NOTE_NESTED must be another
+ * kqueue. Its events are then returned in place of its own.
+ */
+static int
+kevent_nest_check(struct kqueue *kq, const struct kevent *src)
+{
+    if (src->ident == (uintptr_t) kq->kq_id
+            || kqueue_lookup((int) src->ident) == NULL) {
+        dbg_printf("Error: %d is not a child kqueue", (int) src->ident);
         errno = EINVAL;
         return (-1);
     }
+    kq->kq_nested = 1;
+    return (0);
+}
 
-    if (filter_lookup(&filt, kq, src->filter) < 0) 
-        return (-1);
+/* Must hold the filter lock when calling this */
+static int
+kevent_copyin_knote(struct kqueue *kq, struct filter *filt,
+        const struct kevent *src)
+{
+    struct knote  *kn = NULL;
+    int rv = 0;
 
-    dbg_printf("src=%s", kevent_dump(src));
+    if (slowpath(src->filter == EVFILT_READ && src->fflags & NOTE_NESTED)
+            && src->flags & EV_ADD && kevent_nest_check(kq, src) < 0)
+        return (-1);
 
     kn = knote_lookup(filt, src->ident);
     dbg_printf("knote_lookup: ident %d == %p", (int)src->ident, kn);
+
+    /* The knote may have been deleted by a thread copying out events */
+    if (kn != NULL && !knote_tryretain(kn))
+        kn = NULL;
+
     if (kn == NULL) {
         if (src->flags & EV_ADD) {
-            if ((kn = knote_new()) == NULL) {
+            if ((kn = knote_new(kq)) == NULL) {
                 errno = ENOENT;
                 return (-1);
             }
             memcpy(&kn->kev, src, sizeof(kn->kev));
+            knote_set_udata(kn, src);
             kn->kev.flags &= ~EV_ENABLE;
             kn->kev.flags |= EV_ADD;//FIXME why?
-			kn->kn_kq = kq;
             assert(filt->kn_create);
+
+            /* Events may be copied out as soon as the knote is created */
+            knote_lock(kn);
             if (filt->kn_create(filt, kn) < 0) {
+                knote_unlock(kn);
                 knote_release(kn);
                 errno = EFAULT;
                 return (-1);
@@ -157,11 +261,12 @@ kevent_copyin_one(struct kqueue *kq, const struct kevent *src)
 /* XXX- FIXME Needs to be handled in kn_create() to prevent races */
             if (src->flags & EV_DISABLE) {
                 kn->kev.flags |= EV_DISABLE;
-                return (filt->kn_disable(filt, kn));
+                rv = filt->kn_disable(filt, kn);
             }
             //........................................
+            knote_unlock(kn);
 
-            return (0);
+            return (rv);
         } else {
             dbg_printf("no entry found for ident=%u", (unsigned int)src->ident); 
             errno = ENOENT;
@@ -169,7 +274,12 @@ kevent_copyin_one(struct kqueue *kq, const struct kevent *src)
         }
     }
 
-    if (src->flags & EV_DELETE) {
+    knote_lock(kn);
+    if (kn->kn_flags & KNFL_KNOTE_DELETED) {
+        dbg_printf("ident=%u was deleted concurrently", (unsigned int)src->ident); 
+        errno = ENOENT;
+        rv = -1;
+    } else if (src->flags & EV_DELETE) {
         rv = knote_delete(filt, kn);
         dbg_printf("knote_delete returned %d", rv);
     } else if (src->flags & EV_DISABLE) {
@@ -181,27 +291,94 @@ kevent_copyin_one(struct kqueue *kq, const struct kevent *src)
         rv = filt->kn_enable(filt, kn);
         dbg_printf("kn_enable returned %d", rv);
     } else if (src->flags & EV_ADD || src->flags == 0 || src->flags & EV_RECEIPT) {
-        kn->kev.udata = src->udata;
         rv = filt->kn_modify(filt, kn, src);
+        knote_set_udata(kn, src);
         dbg_printf("kn_modify returned %d", rv);
     }
+    knote_unlock(kn);
+    knote_release(kn);
+
+    return (rv);
+}
+
+static int
+kevent_copyin_one(struct kqueue *kq, const struct kevent *src)
+{
+    struct filter *filt;
+    int rv;
+
+    if (src->flags & EV_DISPATCH && src->flags & EV_ONESHOT) {
+        dbg_puts("Error: EV_DISPATCH and EV_ONESHOT are mutually exclusive");
+        errno = EINVAL;
+        return (-1);
+    }
+
+    if (filter_lookup(&filt, kq, src->filter) < 0) 
+        return (-1);
+
+    dbg_printf("src=%s", kevent_dump(src));
+    trace_kevent_register(kq, src);
+    record_add(kq, 0, KQUEUE_RECORD_CHANGE, src->ident, src->filter, src->flags);
+
+    filter_lock(filt);
+    rv = kevent_copyin_knote(kq, filt, src);
+    filter_unlock(filt);
 
     return (rv);
 }
 
+/*
+ * Submit the backend updates that were deferred while applying the
+ * changelist, and report the entries that failed.
+ *
+ * @param last set to the last entry reported, if any
+ * @return number of events added to the eventlist, or -1 if it is full
+ */
+static int
+kevent_copyin_flush(struct kqueue *kq, struct kevent **eventlist,
+        int *nevents, const struct kevent **last, int nwait,
+        const struct timespec *timeout)
+{
+    struct kevent_error *ke;
+    int i, n;
+
+    if (kqops.kevent_flush == NULL)
+        return (0);
+
+    n = kqops.kevent_flush(kq, &ke, nwait, timeout);
+    for (i = 0; i < n; i++) {
+        if (*nevents == 0) {
+            errno = ke[i].ke_errno;
+            return (-1);
+        }
+        memcpy(*eventlist, ke[i].ke_change, sizeof(struct kevent));
+        (*eventlist)->flags &= ~EV_KEVENT64;
+        (*eventlist)->data = ke[i].ke_errno;
+        (*nevents)--;
+        (*eventlist)++;
+        *last = ke[i].ke_change;
+    }
+
+    return (n);
+}
+
 /** @return number of events added to the eventlist */
 static int
 kevent_copyin(struct kqueue *kq, const struct kevent *src, int nchanges,
-        struct kevent *eventlist, int nevents)
+        struct kevent *eventlist, int nevents, const struct timespec *timeout)
 {
-    int status, nret;
+    const struct kevent *last = NULL;
+    int status, nret, nwait, rv;
 
     dbg_printf("nchanges=%d nevents=%d", nchanges, nevents);
 
     /* TODO: refactor, this has become convoluted to support EV_RECEIPT */
     for (nret = 0; nchanges > 0; src++, nchanges--) {
 
-        if (kevent_copyin_one(kq, src) < 0) {
+        kevent_change = src;
+        rv = kevent_copyin_one(kq, src);
+        kevent_change = NULL;
+        if (rv < 0) {
             dbg_printf("errno=%s",strerror(errno));
             status = errno;
             goto err_path;
@@ -215,27 +392,218 @@ kevent_copyin(struct kqueue *kq, const struct kevent *src, int nchanges,
         continue;
 
 err_path:
+        /* Keep the eventlist in changelist order */
+        rv = kevent_copyin_flush(kq, &eventlist, &nevents, &last, 0, NULL);
+        if (rv < 0)
+            return (-1);
+        nret += rv;
+        if (last == src)
+            continue;
         if (nevents > 0) {
             memcpy(eventlist, src, sizeof(*src));
+            eventlist->flags &= ~EV_KEVENT64;
             eventlist->data = status;
             nevents--;
             eventlist++;
             nret++;
         } else {
+            errno = status;
             return (-1);
         }
     }
 
+    /* If kevent() will wait next, the backend may combine the two. */
+    if (nret > 0)
+        nwait = 0;
+    else
+#if KQUEUE_UNLIMITED_NEVENTS
+        nwait = nevents;
+#else
+        nwait = (nevents > MAX_KEVENT) ? MAX_KEVENT : nevents;
+#endif
+    rv = kevent_copyin_flush(kq, &eventlist, &nevents, &last, nwait,
+            timeout);
+    if (rv < 0)
+        return (-1);
+
+    return (nret + rv);
+}
+
+/*
+ * Apply the changes queued by kevent_post(), in the order they were
+ * queued. An error cannot be reported to the thread that queued the
+ * change, so it only skips that change.
+ */
+static void
+kevent_post_apply(struct kqueue *kq)
+{
+    const struct kevent64_s *changes64 = kevent64_changes;
+    struct kevent_post *kp, *next, *list;
+    int i;
+
+    do {
+        list = kq->kq_posted;
+    } while (atomic_ptr_cas(&kq->kq_posted, list, NULL) != list);
+
+    /* The list is last-in first-out, so reverse it */
+    for (kp = list, list = NULL; kp != NULL; kp = next) {
+        next = kp->kp_next;
+        kp->kp_next = list;
+        list = kp;
+    }
+
+    /* The changes were not converted by a kevent64() of this thread */
+    kevent64_changes = NULL;
+    kqueue_lock(kq);
+    for (kp = list; kp != NULL; kp = next) {
+        next = kp->kp_next;
+        for (i = 0; i < kp->kp_nchanges; i++) {
+            if (kevent_copyin(kq, &kp->kp_changes[i], 1, NULL, 0, NULL) < 0)
+                dbg_printf("posted change failed: %s", strerror(errno));
+        }
+        stats_changes(kq, kp->kp_nchanges);
+        free(kp);
+    }
+    kqueue_unlock(kq);
+    kevent64_changes = changes64;
+}
+
+/*
+ * Replace the event of each nested kqueue by the events it has ready,
+ * fetched without waiting. The harvested events are appended after
+ * the others, within the room left in the eventlist. A kqueue that does
+ * not fit, or is nested more than KEVENT_NEST_MAX deep, stays readable
+ * and is harvested by a later call.
+ *
+ * @return the number of events in the eventlist
+ */
+static int
+kevent_nest_harvest(struct kevent *eventlist, int nevents, int nret)
+{
+    static const struct timespec zero = { 0, 0 };
+    struct kevent *ev;
+    int i, end, child, n;
+
+    if (kevent_nest_depth >= KEVENT_NEST_MAX)
+        return (nret);
+
+    kevent_nest_depth++;
+    for (i = 0, end = nret; i < end; ) {
+        ev = &eventlist[i];
+        if (ev->filter != EVFILT_READ || !(ev->fflags & NOTE_NESTED)) {
+            i++;
+            continue;
+        }
+        child = (int) ev->ident;
+        memmove(ev, ev + 1, (nret - i - 1) * sizeof(*ev));
+        end--;
+        nret--;
+
+        n = kevent(child, NULL, 0, &eventlist[nret], nevents - nret, &zero);
+        if (n > 0)
+            nret += n;
+    }
+    kevent_nest_depth--;
+
     return (nret);
 }
 
-int VISIBLE
-kevent(int kqfd, const struct kevent *changelist, int nchanges,
-        struct kevent *eventlist, int nevents,
-        const struct timespec *timeout)
+/*
+ * Point *timeout at what is left of <orig> after the time since <begin>.
+ *
+ * @return 0 if none of it is left
+ */
+static int
+kevent_timeout_remain(const struct timespec *orig, uint64_t begin,
+        struct timespec *remain, const struct timespec **timeout)
 {
-    struct kqueue *kq;
-    int rv = 0;
+    uint64_t total, elapsed;
+
+    total = orig->tv_sec * 1000000000ULL + orig->tv_nsec;
+    elapsed = stats_clock() - begin;
+    if (elapsed >= total)
+        return (0);
+    remain->tv_sec = (total - elapsed) / 1000000000;
+    remain->tv_nsec = (total - elapsed) % 1000000000;
+    *timeout = remain;
+    return (1);
+}
+
+/**
+ * Wait for events on a kqueue and copy them to the eventlist.
+ *
+ * @param idx the read section of the caller, which is left and entered
+ *        again between waits, or NULL
+ * @return the number of events copied out, or -1 if the wait failed
+ */
+int
+kevent_wait_copyout(struct kqueue *kq, struct kevent *eventlist, int nevents,
+        const struct timespec *timeout, unsigned int *idx)
+{
+    const struct timespec *orig = timeout;
+    struct timespec remain;
+    uint64_t begin, start;
+    int rv;
+
+    begin = stats_clock();
+again:
+    trace_kevent_wait_enter(kq, nevents);
+    start = stats_clock();
+    record_add(kq, start, KQUEUE_RECORD_WAIT_ENTER, 0, 0, nevents);
+    rv = kqops.kevent_wait(kq, nevents, timeout);
+    stats_wait(kq, start, rv);
+    trace_kevent_wait_exit(kq, rv);
+    record_add(kq, 0, KQUEUE_RECORD_WAIT_EXIT, 0, 0, rv > 0 ? rv : 0);
+    dbg_printf("kqops.kevent_wait returned %d", rv);
+    if (fastpath(rv > 0)) {
+#if KQUEUE_FINE_GRAINED_LOCKING
+        /* The platform locks each knote and filter it copies out */
+        rv = kqops.kevent_copyout(kq, rv, eventlist, nevents);
+#else
+        kqueue_lock(kq);
+        rv = kqops.kevent_copyout(kq, rv, eventlist, nevents);
+        kqueue_unlock(kq);
+#endif
+        trace_kevent_copyout(kq, rv);
+
+        if (slowpath(kq->kq_nested) && rv > 0)
+            rv = kevent_nest_harvest(eventlist, nevents, rv);
+
+        /* Woken by kevent_post(); apply the changes, and wait again */
+        if (rv == 0 && kq->kq_posted != NULL)
+            kevent_post_apply(kq);
+
+        /* Every event was discarded; keep waiting for the rest of the timeout */
+        if (rv == 0 && (orig == NULL
+                    || kevent_timeout_remain(orig, begin, &remain, &timeout))) {
+            /* Nothing is held here, so the epoch may advance */
+            if (idx != NULL) {
+                epoch_exit(&kq->kq_epoch, *idx);
+                *idx = epoch_enter(&kq->kq_epoch);
+            }
+            goto again;
+        }
+    } else if (rv < 0) {
+        return (-1);
+    }
+    stats_events(kq, rv);
+    if (slowpath(kq->kq_record != NULL))
+        record_events(kq, eventlist, rv);
+
+    return (rv);
+}
+
+/*
+ * The part of kevent() and kevent64() that runs within the epoch of the
+ * kqueue. If eventlist64 is not NULL, the events are converted into it.
+ */
+static int
+kevent_common(struct kqueue *kq, const struct kevent *changelist,
+        int nchanges, struct kevent *eventlist, int nevents,
+        const struct timespec *timeout, struct kevent64_s *eventlist64)
+{
+    unsigned int idx;
+    int i, rv = 0;
 #ifndef NDEBUG
     static unsigned int _kevent_counter = 0;
     unsigned int myid = 0;
@@ -243,12 +611,12 @@ kevent(int kqfd, const struct kevent *changelist, int nchanges,
     (void) myid;
 #endif
 
-    /* Convert the descriptor into an object pointer */
-    kq = kqueue_lookup(kqfd);
-    if (kq == NULL) {
-        errno = ENOENT;
-        return (-1);
-    }
+    /* Deleted knotes are not freed until every thread has left here */
+    idx = epoch_enter(&kq->kq_epoch);
+
+    /* Changes posted by other threads come before those of this call */
+    if (slowpath(kq->kq_posted != NULL))
+        kevent_post_apply(kq);
 
 #ifndef NDEBUG
     if (DEBUG_KQUEUE) {
@@ -262,15 +630,13 @@ kevent(int kqfd, const struct kevent *changelist, int nchanges,
      */
     if (nchanges > 0) {
         kqueue_lock(kq);
-        rv = kevent_copyin(kq, changelist, nchanges, eventlist, nevents);
+        rv = kevent_copyin(kq, changelist, nchanges, eventlist, nevents,
+                timeout);
         kqueue_unlock(kq);
+        stats_changes(kq, nchanges);
         dbg_printf("(%u) changelist: rv=%d", myid, rv);
-        if (rv < 0)
+        if (rv != 0)
             goto out;
-        if (rv > 0) {
-            eventlist += rv;
-            nevents -= rv;
-        }
     }
 
     rv = 0;
@@ -278,18 +644,13 @@ kevent(int kqfd, const struct kevent *changelist, int nchanges,
     /*
      * Wait for events and copy them to the eventlist
      */
+#if !KQUEUE_UNLIMITED_NEVENTS
     if (nevents > MAX_KEVENT)
         nevents = MAX_KEVENT;
+#endif
     if (nevents > 0) {
-        rv = kqops.kevent_wait(kq, nevents, timeout);
-        dbg_printf("kqops.kevent_wait returned %d", rv);
-        if (fastpath(rv > 0)) {
-            kqueue_lock(kq);
-            rv = kqops.kevent_copyout(kq, rv, eventlist, nevents);
-            kqueue_unlock(kq);
-        } else if (rv == 0) {
-            /* Timeout reached */
-        } else {
+        rv = kevent_wait_copyout(kq, eventlist, nevents, timeout, &idx);
+        if (rv < 0) {
             dbg_printf("(%u) kevent_wait failed", myid);
             goto out;
         }
@@ -307,6 +668,320 @@ kevent(int kqfd, const struct kevent *changelist, int nchanges,
 #endif
 
 out:
+    for (i = 0; i < rv; i++)
+        kevent_export(&eventlist[i], (eventlist64 != NULL) ? &eventlist64[i] : NULL);
+    epoch_exit(&kq->kq_epoch, idx);
     dbg_printf("--- END kevent %u ret %d ---", myid, rv);
     return (rv);
 }
+
+int VISIBLE
+kevent(int kqfd, const struct kevent *changelist, int nchanges,
+        struct kevent *eventlist, int nevents,
+        const struct timespec *timeout)
+{
+    struct kqueue *kq;
+
+    /* Convert the descriptor into an object pointer */
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+
+#ifndef _WIN32
+    /* A group applies the changes to its shards and collects their events */
+    if (kq->kq_group != NULL)
+        return (kqueue_group_kevent(kq, changelist, nchanges,
+                    eventlist, nevents, timeout));
+#endif
+
+    return (kevent_common(kq, changelist, nchanges, eventlist, nevents,
+                timeout, NULL));
+}
+
+/* Changes and events up to this many are converted on the stack */
+#define KEVENT64_STACK  32
+
+/*
+ * The same as kevent(), with 64-bit ident, data and udata, and the ext[]
+ * of a change returned with each of its events. The changes are
+ * converted to struct kevent, with a pointer to the original as udata.
+ */
+int VISIBLE
+kevent64(int kqfd, const struct kevent64_s *changelist, int nchanges,
+        struct kevent64_s *eventlist, int nevents, unsigned int flags,
+        const struct timespec *timeout)
+{
+    static const struct timespec zero = { 0, 0 };
+    struct kevent chbuf[KEVENT64_STACK], evbuf[KEVENT64_STACK];
+    struct kevent *ch = chbuf, *ev = evbuf;
+    struct kqueue *kq;
+    int i, rv;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+    if (flags & ~KEVENT_FLAG_IMMEDIATE) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    /* A group keeps only the struct kevent of each change */
+    if (kq->kq_group != NULL) {
+        errno = ENOTSUP;
+        return (-1);
+    }
+
+    if (flags & KEVENT_FLAG_IMMEDIATE)
+        timeout = &zero;
+    if (nchanges < 0)
+        nchanges = 0;
+    if (nevents < 0)
+        nevents = 0;
+
+    if (nchanges > KEVENT64_STACK
+            && (ch = malloc(nchanges * sizeof(*ch))) == NULL)
+        return (-1);
+    if (nevents > KEVENT64_STACK
+            && (ev = malloc(nevents * sizeof(*ev))) == NULL) {
+        rv = -1;
+        goto out;
+    }
+
+    for (i = 0; i < nchanges; i++) {
+        /* Neither is truncated to fit a struct kevent */
+        if ((uint64_t) (uintptr_t) changelist[i].ident != changelist[i].ident
+                || (int64_t) (intptr_t) changelist[i].data != changelist[i].data) {
+            errno = EINVAL;
+            rv = -1;
+            goto out;
+        }
+        EV_SET(&ch[i], (uintptr_t) changelist[i].ident, changelist[i].filter,
+                changelist[i].flags & ~EV_KEVENT64, changelist[i].fflags,
+                (intptr_t) changelist[i].data, (void *) &changelist[i]);
+    }
+
+    kevent64_changes = changelist;
+    kevent64_nchanges = nchanges;
+    rv = kevent_common(kq, ch, nchanges, ev, nevents, timeout, eventlist);
+    kevent64_changes = NULL;
+    kevent64_nchanges = 0;
+
+out:
+    if (ch != chbuf)
+        free(ch);
+    if (ev != evbuf)
+        free(ev);
+    return (rv);
+}
+
+/*
+ * Queue changes for the kqueue without waiting for its lock, and wake a
+ * thread that waits for its events. The changes are applied, in order,
+ * by the next kevent() call on the kqueue, and errors are not reported.
+ */
+int VISIBLE
+kevent_post(int kqfd, const struct kevent *changelist, int nchanges)
+{
+    struct kqueue *kq;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+    return (kevent_post_changes(kq, changelist, nchanges));
+}
+
+/* kevent_post() for a filter that already has the kqueue */
+int
+kevent_post_changes(struct kqueue *kq, const struct kevent *changelist,
+        int nchanges)
+{
+    struct kevent_post *kp, *head;
+
+    /* A group applies changes without kevent_common() */
+    if (kq->kq_group != NULL) {
+        errno = ENOTSUP;
+        return (-1);
+    }
+    if (nchanges <= 0)
+        return (0);
+
+    kp = malloc(sizeof(*kp) + nchanges * sizeof(kp->kp_changes[0]));
+    if (kp == NULL)
+        return (-1);
+    kp->kp_nchanges = nchanges;
+    memcpy(kp->kp_changes, changelist, nchanges * sizeof(kp->kp_changes[0]));
+
+    do {
+        head = kq->kq_posted;
+        kp->kp_next = head;
+    } while (atomic_ptr_cas(&kq->kq_posted, head, kp) != head);
+
+    /* Only the first change in the list needs to wake the waiter */
+    if (head == NULL && kqops.kqueue_wake != NULL)
+        return (kqops.kqueue_wake(kq));
+    return (0);
+}
+
+/* A filter lock is held for at most this many changes of kevent_submit() */
+#define KEVENT_SUBMIT_RUN   128
+
+/* Order changes by filter and then by ident, keeping changelist order */
+static int
+kevent_submit_cmp(const void *a, const void *b)
+{
+    const struct kevent *x = *((const struct kevent * const *) a);
+    const struct kevent *y = *((const struct kevent * const *) b);
+
+    if (x->filter != y->filter)
+        return ((x->filter < y->filter) ? -1 : 1);
+    if (x->ident != y->ident)
+        return ((x->ident < y->ident) ? -1 : 1);
+    return ((x < y) ? -1 : (x > y));
+}
+
+/*
+ * Apply every change of a changelist. The changes are applied in order
+ * of filter and ident, so changes to the same knote keep their order
+ * but others may not. The errno of each change, or 0, is written to the
+ * same entry of status if it is not NULL.
+ *
+ * @return the number of changes that failed, or -1 if none were applied
+ */
+int VISIBLE
+kevent_submit(int kqfd, const struct kevent *changelist, int nchanges,
+        int *status)
+{
+    const struct kevent **sorted, *src;
+    struct kevent_error *ke;
+    struct filter *filt;
+    struct kqueue *kq;
+    unsigned int idx;
+    int i, j, n, err, nfailed = 0;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+    /* A group applies changes without kevent_common() */
+    if (kq->kq_group != NULL) {
+        errno = ENOTSUP;
+        return (-1);
+    }
+    if (nchanges <= 0)
+        return (0);
+
+    sorted = malloc(nchanges * sizeof(*sorted));
+    if (sorted == NULL)
+        return (-1);
+    for (i = 0; i < nchanges; i++)
+        sorted[i] = &changelist[i];
+    qsort(sorted, nchanges, sizeof(*sorted), kevent_submit_cmp);
+    if (status != NULL)
+        memset(status, 0, nchanges * sizeof(*status));
+
+    idx = epoch_enter(&kq->kq_epoch);
+    if (slowpath(kq->kq_posted != NULL))
+        kevent_post_apply(kq);
+
+    kqueue_lock(kq);
+    for (i = 0; i < nchanges; i = j) {
+        /* Each run of changes to one filter takes its lock once */
+        src = sorted[i];
+        if (filter_lookup(&filt, kq, src->filter) < 0)
+            filt = NULL;
+        err = errno;
+        if (filt != NULL)
+            filter_lock(filt);
+        for (j = i; j < nchanges && j - i < KEVENT_SUBMIT_RUN
+                && sorted[j]->filter == src->filter; j++) {
+            n = -1;
+            if (filt == NULL) {
+                errno = err;
+            } else if (sorted[j]->flags & EV_DISPATCH && sorted[j]->flags & EV_ONESHOT) {
+                errno = EINVAL;
+            } else {
+                trace_kevent_register(kq, sorted[j]);
+                record_add(kq, 0, KQUEUE_RECORD_CHANGE, sorted[j]->ident,
+                        sorted[j]->filter, sorted[j]->flags);
+                kevent_change = sorted[j];
+                n = kevent_copyin_knote(kq, filt, sorted[j]);
+                kevent_change = NULL;
+            }
+            if (n == 0)
+                continue;
+            dbg_printf("change %s failed: %s", kevent_dump(sorted[j]), strerror(errno));
+            if (status != NULL)
+                status[sorted[j] - changelist] = errno;
+            nfailed++;
+        }
+        if (filt != NULL)
+            filter_unlock(filt);
+    }
+
+    /* Failures of the backend updates that were deferred */
+    if (kqops.kevent_flush != NULL) {
+        n = kqops.kevent_flush(kq, &ke, 0, NULL);
+        for (i = 0; i < n; i++) {
+            j = ke[i].ke_change - changelist;
+            if (status == NULL || status[j] == 0)
+                nfailed++;
+            if (status != NULL && status[j] == 0)
+                status[j] = ke[i].ke_errno;
+        }
+    }
+    kqueue_unlock(kq);
+    stats_changes(kq, nchanges);
+    epoch_exit(&kq->kq_epoch, idx);
+
+    free(sorted);
+    return (nfailed);
+}
+
+int VISIBLE
+kqueue_user_trigger(int kqfd, uintptr_t ident, unsigned int fflags)
+{
+    struct kqueue *kq;
+    struct filter *filt;
+    struct knote *kn;
+    struct kevent kev;
+    unsigned int idx;
+    int rv;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+    /* Without an EVFILT_USER knote, the filter may not be set up yet */
+    filt = kq->kq_filt[~EVFILT_USER];
+    if (filt == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+
+    /* Without a fast path, this is the same as a NOTE_TRIGGER change */
+    if (filt->kn_trigger == NULL) {
+        EV_SET(&kev, ident, EVFILT_USER, 0, fflags | NOTE_TRIGGER, 0, NULL);
+        return (kevent(kqfd, &kev, 1, NULL, 0, NULL));
+    }
+
+    idx = epoch_enter(&kq->kq_epoch);
+    kn = knote_lookup(filt, ident);
+    if (kn == NULL || !knote_tryretain(kn)) {
+        epoch_exit(&kq->kq_epoch, idx);
+        errno = ENOENT;
+        return (-1);
+    }
+    rv = filt->kn_trigger(filt, kn, fflags);
+    knote_release(kn);
+    epoch_exit(&kq->kq_epoch, idx);
+
+    return (rv);
+}
@@ -15,19 +15,69 @@
  */
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
 #include "private.h"
 
-#include "alloc.h"
+/*
+ * Filters whose idents are file descriptors keep their knotes in a dense
+ * array indexed by ident, which is grown on demand up to KNOTE_INDEX_MAX
+ * slots. Idents beyond that limit, and all idents of the other filters,
+ * are stored in the red-black tree.
+ *
+ * knote_lookup() takes no lock. It runs within the epoch of the kqueue,
+ * so a knote or an index it reaches is not freed while it uses it, even
+ * if another thread removes it; growing the index retires the old one.
+ * A lookup in the tree is retried if the tree changed meanwhile, since a
+ * rotation may hide a node from it for a moment.
+ */
+#define KNOTE_INDEX_MIN     64
+#define KNOTE_INDEX_MAX     (1 << 20)
+
+/* Deeper than any red-black tree; a concurrent rotation can form a cycle */
+#define KNOTE_TREE_DEPTH    128
+
+struct knote_index {
+    struct epoch_entry      ki_retire;
+    size_t                  ki_len;
+    struct knote * volatile ki_slot[];
+};
+
+/*
+ * Default number of knotes per slab in each kqueue's knote pool.
+ * This can be overridden with the KQUEUE_KNOTE_SLAB environment variable.
+ */
+#define KNOTE_SLAB_SIZE     128
+
+static size_t knote_slab_size = KNOTE_SLAB_SIZE;
 
 int
 knote_init(void)
 {
-    return 0;
-//    return (mem_init(sizeof(struct knote), 1024));
+    char *s;
+    long n;
+
+    s = getenv("KQUEUE_KNOTE_SLAB");
+    if (s != NULL && strlen(s) > 0) {
+        n = strtol(s, NULL, 10);
+        if (n <= 0) {
+            dbg_printf("invalid KQUEUE_KNOTE_SLAB value: %s", s);
+            return (-1);
+        }
+        knote_slab_size = (size_t) n;
+    }
+    dbg_printf("knote slab size is %zu", knote_slab_size);
+
+    return (0);
+}
+
+void
+knote_pool_init(struct kqueue *kq)
+{
+    mem_pool_init(&kq->kq_knote_pool, sizeof(struct knote), knote_slab_size);
 }
 
 static int
@@ -39,19 +89,32 @@ knote_cmp(struct knote *a, struct knote *b)
 RB_GENERATE(knt, knote, kn_entries, knote_cmp)
 
 struct knote *
-knote_new(void)
+knote_new(struct kqueue *kq)
 {
 	struct knote *res;
 
-    res = calloc(1, sizeof(struct knote));
+    res = mem_pool_calloc(&kq->kq_knote_pool);
 	if (res == NULL)
         return (NULL);
 
+    res->kn_kq = kq;
     res->kn_ref = 1;
+    pthread_mutex_init(&res->kn_mtx, NULL);
 
     return (res);
 }
 
+static void
+knote_free(struct epoch_entry *ee)
+{
+    struct knote *kn;
+
+    kn = (struct knote *) ((char *) ee - offsetof(struct knote, kn_retire));
+    dbg_printf("freeing knote at %p", kn);
+    pthread_mutex_destroy(&kn->kn_mtx);
+    mem_pool_free(&kn->kn_kq->kq_knote_pool, kn);
+}
+
 void
 knote_release(struct knote *kn)
 {
@@ -59,8 +122,10 @@ knote_release(struct knote *kn)
 
 	if (atomic_dec(&kn->kn_ref) == 0) {
         if (kn->kn_flags & KNFL_KNOTE_DELETED) {
-            dbg_printf("freeing knote at %p", kn);
-            free(kn);
+            /* Lookups and stale backend events may still reach it */
+            if (epoch_retire(&kn->kn_kq->kq_epoch, &kn->kn_retire, knote_free)
+                    && kqops.kqueue_wake != NULL)
+                (void) kqops.kqueue_wake(kn->kn_kq);
         } else {
             dbg_puts("this should never happen");
         }
@@ -69,17 +134,114 @@ knote_release(struct knote *kn)
     }
 }
 
+/*
+ * Take a reference unless the last one has already been dropped, which
+ * happens when the knote was deleted by another thread after the caller
+ * obtained the pointer. Returns 0 if the knote must not be used.
+ */
+int
+knote_tryretain(struct knote *kn)
+{
+    uint32_t ref;
+
+    do {
+        ref = kn->kn_ref;
+        if (ref == 0)
+            return (0);
+    } while (atomic_cas(&kn->kn_ref, ref, ref + 1) != ref);
+
+    return (1);
+}
+
+static void
+knote_index_retired(struct epoch_entry *ee)
+{
+    free(ee);
+}
+
+/* Must hold the kf_knote_mtx when calling this */
+static int
+knote_index_grow(struct filter *filt, uintptr_t ident)
+{
+    struct knote_index *old, *ki;
+    size_t len, i;
+
+    old = filt->kf_knote_index;
+    len = (old != NULL) ? old->ki_len : KNOTE_INDEX_MIN;
+    while (len <= ident)
+        len *= 2;
+
+    ki = malloc(sizeof(*ki) + len * sizeof(ki->ki_slot[0]));
+    if (ki == NULL) {
+        dbg_perror("malloc(3)");
+        return (-1);
+    }
+    ki->ki_len = len;
+    for (i = 0; i < len; i++)
+        ki->ki_slot[i] = (old != NULL && i < old->ki_len) ? old->ki_slot[i] : NULL;
+
+    /* Lookups in the old index may still be running */
+    atomic_barrier();
+    filt->kf_knote_index = ki;
+    if (old != NULL && epoch_retire(&filt->kf_kqueue->kq_epoch,
+                &old->ki_retire, knote_index_retired)
+            && kqops.kqueue_wake != NULL)
+        (void) kqops.kqueue_wake(filt->kf_kqueue);
+    dbg_printf("knote index resized to %zu slots", len);
+
+    return (0);
+}
+
+/* Lookups see the tree between these as changing, and retry */
+static void
+knote_tree_begin(struct filter *filt)
+{
+    filt->kf_knote_seq++;
+    atomic_barrier();
+}
+
+static void
+knote_tree_end(struct filter *filt)
+{
+    atomic_barrier();
+    filt->kf_knote_seq++;
+}
+
 void
 knote_insert(struct filter *filt, struct knote *kn)
 {
-    pthread_rwlock_wrlock(&filt->kf_knote_mtx);
-    RB_INSERT(knt, &filt->kf_knote, kn);
-    pthread_rwlock_unlock(&filt->kf_knote_mtx);
+    uintptr_t ident = kn->kev.ident;
+
+    tracing_mutex_lock(&filt->kf_knote_mtx);
+
+    /* Lookups may use the knote as soon as it is linked */
+    atomic_barrier();
+    if (filt->kf_knote_indexed && ident < KNOTE_INDEX_MAX
+            && ((filt->kf_knote_index != NULL
+                    && ident < filt->kf_knote_index->ki_len)
+                || knote_index_grow(filt, ident) == 0)) {
+        filt->kf_knote_index->ki_slot[ident] = kn;
+    } else {
+        knote_tree_begin(filt);
+        RB_INSERT(knt, &filt->kf_knote, kn);
+        knote_tree_end(filt);
+    }
+    filt->kf_knote_count++;
+    tracing_mutex_unlock(&filt->kf_knote_mtx);
+}
+
+/* Called once no lookup can run, so the index is freed immediately */
+void
+knote_index_free(struct filter *filt)
+{
+    free(filt->kf_knote_index);
+    filt->kf_knote_index = NULL;
 }
 
 int
 knote_delete(struct filter *filt, struct knote *kn)
 {
+    struct knote_index *ki;
     struct knote query;
     struct knote *tmp;
 
@@ -93,12 +255,22 @@ knote_delete(struct filter *filt, struct knote *kn)
      * thread before we acquired the knotelist lock.
      */
     query.kev.ident = kn->kev.ident;
-    pthread_rwlock_wrlock(&filt->kf_knote_mtx);
-    tmp = RB_FIND(knt, &filt->kf_knote, &query);
-    if (tmp == kn) {
-        RB_REMOVE(knt, &filt->kf_knote, kn);
+    tracing_mutex_lock(&filt->kf_knote_mtx);
+    ki = filt->kf_knote_index;
+    if (ki != NULL && query.kev.ident < ki->ki_len
+            && ki->ki_slot[query.kev.ident] == kn) {
+        ki->ki_slot[query.kev.ident] = NULL;
+        filt->kf_knote_count--;
+    } else {
+        tmp = RB_FIND(knt, &filt->kf_knote, &query);
+        if (tmp == kn) {
+            knote_tree_begin(filt);
+            RB_REMOVE(knt, &filt->kf_knote, kn);
+            knote_tree_end(filt);
+            filt->kf_knote_count--;
+        }
     }
-    pthread_rwlock_unlock(&filt->kf_knote_mtx);
+    tracing_mutex_unlock(&filt->kf_knote_mtx);
 
     filt->kn_delete(filt, kn); //XXX-FIXME check return value
 
@@ -109,30 +281,121 @@ knote_delete(struct filter *filt, struct knote *kn)
     return (0);
 }
 
+/*
+ * Walk the tree without the lock. Returns -1 if the walk went deeper
+ * than the tree can be, which only happens while it is being changed.
+ */
+static int
+knote_tree_find(struct filter *filt, uintptr_t ident, struct knote **res)
+{
+    struct knote *kn;
+    int depth, cmp;
+
+    kn = *(struct knote * volatile *) &RB_ROOT(&filt->kf_knote);
+    for (depth = 0; kn != NULL; depth++) {
+        if (depth == KNOTE_TREE_DEPTH)
+            return (-1);
+        /* The same order as knote_cmp() */
+        cmp = memcmp(&ident, &kn->kev.ident, sizeof(ident));
+        if (cmp == 0)
+            break;
+        if (cmp < 0)
+            kn = *(struct knote * volatile *) &RB_LEFT(kn, kn_entries);
+        else
+            kn = *(struct knote * volatile *) &RB_RIGHT(kn, kn_entries);
+    }
+    *res = kn;
+
+    return (0);
+}
+
+/* Must be called within the epoch of the kqueue */
 struct knote *
 knote_lookup(struct filter *filt, uintptr_t ident)
 {
-    struct knote query;
+    struct knote_index *ki;
     struct knote *ent = NULL;
+    unsigned int seq;
+    int rv;
 
-    query.kev.ident = ident;
+    ki = filt->kf_knote_index;
+    if (ki != NULL && ident < ki->ki_len)
+        ent = ki->ki_slot[ident];
 
-    pthread_rwlock_rdlock(&filt->kf_knote_mtx);
-    ent = RB_FIND(knt, &filt->kf_knote, &query);
-    pthread_rwlock_unlock(&filt->kf_knote_mtx);
+    while (ent == NULL) {
+        seq = filt->kf_knote_seq;
+        atomic_barrier();
+        rv = (seq & 1) ? -1 : knote_tree_find(filt, ident, &ent);
+        atomic_barrier();
+        if (rv == 0 && filt->kf_knote_seq == seq)
+            break;
+        ent = NULL;
+    }
 
     dbg_printf("id=%" PRIuPTR " ent=%p", ident, ent);
 
     return (ent);
 }
     
+/*
+ * Store up to n of the knotes of a filter that are not deleted. Call it
+ * within the epoch of the kqueue, so that they are not freed meanwhile.
+ *
+ * @return the number of knotes stored
+ */
+int
+knote_list(struct filter *filt, struct knote **kn, int n)
+{
+    struct knote_index *ki;
+    struct knote *ent;
+    size_t i;
+    int count = 0;
+
+    tracing_mutex_lock(&filt->kf_knote_mtx);
+    ki = filt->kf_knote_index;
+    for (i = 0; ki != NULL && i < ki->ki_len && count < n; i++) {
+        ent = ki->ki_slot[i];
+        if (ent != NULL && !(ent->kn_flags & KNFL_KNOTE_DELETED))
+            kn[count++] = ent;
+    }
+    RB_FOREACH(ent, knt, &filt->kf_knote) {
+        if (count == n)
+            break;
+        if (!(ent->kn_flags & KNFL_KNOTE_DELETED))
+            kn[count++] = ent;
+    }
+    tracing_mutex_unlock(&filt->kf_knote_mtx);
+
+    return (count);
+}
+
+/*
+ * Delete every knote of a filter, which releases the descriptors and
+ * other backend resources they hold. Used when the kqueue is torn down,
+ * so no other thread may be using it.
+ */
+void
+knote_free_all(struct filter *filt)
+{
+    struct knote *kn[64];
+    int i, n;
+
+    while ((n = knote_list(filt, kn, 64)) > 0) {
+        for (i = 0; i < n; i++) {
+            knote_lock(kn[i]);
+            (void) knote_delete(filt, kn[i]);
+            knote_unlock(kn[i]);
+        }
+    }
+}
+
 #if DEADWOOD
 struct knote *
 knote_get_by_data(struct filter *filt, intptr_t data)
 {
     struct knote *kn;
 
-    pthread_rwlock_rdlock(&filt->kf_knote_mtx);
+    tracing_mutex_lock(&filt->kf_knote_mtx);
     RB_FOREACH(kn, knt, &filt->kf_knote) {
         if (data == kn->kev.data) 
             break;
@@ -140,7 +403,7 @@ knote_get_by_data(struct filter *filt, intptr_t data)
     if (kn != NULL) {
         knote_retain(kn);
     }
-    pthread_rwlock_unlock(&filt->kf_knote_mtx);
+    tracing_mutex_unlock(&filt->kf_knote_mtx);
 
     return (kn);
 }
@@ -26,6 +26,9 @@
 
 int DEBUG_KQUEUE = 0;
 char *KQUEUE_DEBUG_IDENT = "KQ";
+#if defined(__linux__)
+__thread pid_t kq_thread_id;
+#endif
 
 #ifdef _WIN32
 static LONG kq_init_begin = 0;
@@ -51,14 +54,46 @@ get_fd_limit(void)
     if (getrlimit(RLIMIT_NOFILE, &rlim) < 0) {
         dbg_perror("getrlimit(2)");
         return (65536);
-    } else {
-        return (rlim.rlim_max);
     }
+
+    /* Descriptors are ints, and the limit may be RLIM_INFINITY */
+    if (rlim.rlim_max == RLIM_INFINITY || rlim.rlim_max > INT_MAX)
+        return (INT_MAX);
+    return (rlim.rlim_max);
 #endif
 }
 
 static struct map *kqmap;
 
+/* The number of times this process is a child of fork(2) */
+static volatile unsigned int kqueue_forks;
+
+#ifndef _WIN32
+static void
+kqueue_atfork_prepare(void)
+{
+    (void) pthread_mutex_lock(&kq_mtx);
+}
+
+static void
+kqueue_atfork_parent(void)
+{
+    (void) pthread_mutex_unlock(&kq_mtx);
+}
+
+/*
+ * The child only has the thread that called fork(). The locks of the
+ * kqueues it inherited may have been held by other threads, so
+ * kqueue_clone() sets them up again before it reads the knotes.
+ */
+static void
+kqueue_atfork_child(void)
+{
+    kqueue_forks++;
+    (void) pthread_mutex_unlock(&kq_mtx);
+}
+#endif
+
 void
 libkqueue_init(void)
 {
@@ -92,30 +127,125 @@ libkqueue_init(void)
        abort(); 
    if (knote_init() < 0)
        abort();
+   lockstat_init();
+#ifndef _WIN32
+   (void) pthread_atfork(kqueue_atfork_prepare, kqueue_atfork_parent,
+           kqueue_atfork_child);
+#endif
    dbg_puts("library initialization complete");
 #ifdef _WIN32
    kq_init_complete = 1;
 #endif
 }
 
-#if DEADWOOD
+/*
+ * Kqueues that were closed, kept for the next kqueue() call along with
+ * their knote pools. A slot is taken or filled with a compare-and-swap,
+ * which gives the caller sole use of the kqueue in it.
+ */
+#define KQUEUE_CACHE_MAX    16
+
+/* A closed kqueue with more knotes in its pool than this is not kept */
+#define KQUEUE_CACHE_KNOTES 4096
+
+static struct kqueue * volatile kqueue_cache[KQUEUE_CACHE_MAX];
+
+static struct kqueue *
+kqueue_cache_get(void)
+{
+    struct kqueue *kq;
+    int i;
+
+    for (i = 0; i < KQUEUE_CACHE_MAX; i++) {
+        kq = kqueue_cache[i];
+        if (kq != NULL && atomic_ptr_cas(&kqueue_cache[i], kq, NULL) == kq)
+            return (kq);
+    }
+    return (NULL);
+}
+
 static int
-kqueue_cmp(struct kqueue *a, struct kqueue *b)
+kqueue_cache_put(struct kqueue *kq)
 {
-    return memcmp(&a->kq_id, &b->kq_id, sizeof(int)); 
+    int i;
+
+    for (i = 0; i < KQUEUE_CACHE_MAX; i++) {
+        if (kqueue_cache[i] == NULL
+                && atomic_ptr_cas(&kqueue_cache[i], NULL, kq) == NULL)
+            return (0);
+    }
+    return (-1);
 }
 
-/* Must hold the kqtree_mtx when calling this */
+/*
+ * Release everything a kqueue holds: the knotes and the descriptors
+ * behind them, the filters, and the backend. The backend descriptor
+ * itself is closed only if closefd is set; when kqueue() finds that a
+ * descriptor number was reused, it has been closed already.
+ *
+ * The backend registrations of a kqueue inherited across fork() are
+ * those of the parent as well, so they are left alone: only the memory
+ * and the descriptors of this process are released.
+ *
+ * No other thread may be using the kqueue.
+ */
 void
-kqueue_free(struct kqueue *kq)
+kqueue_free(struct kqueue *kq, int closefd)
 {
-    RB_REMOVE(kqt, &kqtree, kq);
+    struct kevent_post *kp;
+
+    dbg_printf("freeing kqueue, fd=%d", kq->kq_id);
+    if (!closefd)
+        kq->kq_id = -1;
+    if (kq->kq_forks != kqueue_forks)
+        kq->kq_inherited = 1;
+
+    if (kq->kq_group != NULL) {
+        kqueue_group_free(kq->kq_group);
+        kq->kq_group = NULL;
+    }
     filter_unregister_all(kq);
+    while ((kp = kq->kq_posted) != NULL) {
+        kq->kq_posted = kp->kp_next;
+        free(kp);
+    }
+    epoch_free(&kq->kq_epoch);
     kqops.kqueue_free(kq);
+    stats_free(kq);
+    record_free(kq);
+
+    /*
+     * The knotes still counted as live are held by queues of the
+     * filters that are gone now, so the whole pool can be reused.
+     */
+    if (kq->kq_knote_pool.mp_total <= KQUEUE_CACHE_KNOTES) {
+        mem_pool_reset(&kq->kq_knote_pool);
+        if (kqueue_cache_put(kq) == 0)
+            return;
+    }
+    mem_pool_destroy(&kq->kq_knote_pool);
     free(kq);
 }
 
-#endif
+/* A kqueue from the cache, or a new one, with everything else cleared */
+static struct kqueue *
+kqueue_alloc(void)
+{
+    struct kqueue *kq;
+    struct mem_pool pool;
+
+    kq = kqueue_cache_get();
+    if (kq == NULL) {
+        kq = calloc(1, sizeof(*kq));
+        if (kq != NULL)
+            knote_pool_init(kq);
+        return (kq);
+    }
+    pool = kq->kq_knote_pool;
+    memset(kq, 0, sizeof(*kq));
+    kq->kq_knote_pool = pool;
+    return (kq);
+}
 
 struct kqueue *
 kqueue_lookup(int kq)
@@ -143,29 +273,212 @@ kqueue(void)
     (void) pthread_mutex_unlock(&kq_mtx);
 #endif
 
-    kq = calloc(1, sizeof(*kq));
+    kq = kqueue_alloc();
     if (kq == NULL)
         return (-1);
 
 	tracing_mutex_init(&kq->kq_mtx, NULL);
+    kq->kq_forks = kqueue_forks;
+    epoch_init(&kq->kq_epoch);
+    if (stats_init(kq) < 0) {
+        mem_pool_destroy(&kq->kq_knote_pool);
+        free(kq);
+        return (-1);
+    }
 
     if (kqops.kqueue_init(kq) < 0) {
+        stats_free(kq);
+        mem_pool_destroy(&kq->kq_knote_pool);
         free(kq);
         return (-1);
     }
 
     dbg_printf("created kqueue, fd=%d", kq->kq_id);
 
+    /* A kqueue that was closed with close(2), whose number was reused */
     tmp = map_delete(kqmap, kq->kq_id);
-    if (tmp != NULL) {
-        dbg_puts("FIXME -- memory leak here");
-        // TODO: kqops.kqueue_free(tmp), or (better yet) decrease it's refcount
+    if (tmp != NULL && tmp != (void *) -1) {
+        dbg_printf("kqueue fd=%d was closed, tearing it down", kq->kq_id);
+        kqueue_free(tmp, 0);
     }
     if (map_insert(kqmap, kq->kq_id, kq) < 0) {
         dbg_puts("map insertion failed");
-        kqops.kqueue_free(kq);
+        kqueue_free(kq, 1);
         return (-1);
     }
 
     return (kq->kq_id);
 }
+
+/*
+ * Close a kqueue, and release everything it holds right away instead of
+ * when its descriptor number is reused. It must not be used by another
+ * thread at the same time.
+ */
+int VISIBLE
+kqueue_close(int kqfd)
+{
+    struct kqueue *kq;
+
+    kq = map_delete(kqmap, kqfd);
+    if (kq == NULL || kq == (void *) -1) {
+        errno = EBADF;
+        return (-1);
+    }
+    kqueue_free(kq, 1);
+    return (0);
+}
+
+int VISIBLE
+kqueue_busy_poll(int kqfd, unsigned int usec)
+{
+    struct kqueue *kq;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
+    if (kqops.kqueue_busy_poll == NULL) {
+        errno = ENOTSUP;
+        return (-1);
+    }
+    return (kqops.kqueue_busy_poll(kq, usec));
+}
+
+#ifndef _WIN32
+/*
+ * Set up the locks of a kqueue inherited across fork() again, since the
+ * threads that held them are gone.
+ */
+static void
+kqueue_relock(struct kqueue *kq)
+{
+    struct filter *filt;
+    int i;
+
+    dbg_printf("kqueue %d was inherited across fork()", kq->kq_id);
+    tracing_mutex_init(&kq->kq_mtx, NULL);
+    for (i = 0; i < EVFILT_SYSCOUNT; i++) {
+        if ((filt = kq->kq_filt[i]) == NULL)
+            continue;
+        tracing_mutex_init(&filt->kf_knote_mtx, NULL);
+        pthread_mutex_init(&filt->kf_mtx, NULL);
+    }
+}
+
+/*
+ * Create a kqueue with the same knotes as another one. In the child of
+ * a prefork server, this replaces a kqueue inherited from the parent,
+ * whose backend descriptors are shared with it, in one pass: the knotes
+ * are read from the trees of the parent's kqueue and applied with
+ * kevent_submit(), so the backend registrations are batched.
+ *
+ * The triggered and disabled states are kept. Timers start a new period,
+ * and EVFILT_AIO knotes are left out, since their requests belong to the
+ * parent.
+ */
+int VISIBLE
+kqueue_clone(int kqfd)
+{
+    struct kqueue *kq, *dst;
+    struct filter *filt;
+    struct knote **kn, *dkn;
+    struct kevent *ch;
+    int *status;
+    unsigned int idx;
+    int i, j, n, max, err, forked, rv = -1, fd = -1;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+    if (kq->kq_group != NULL) {
+        errno = ENOTSUP;
+        return (-1);
+    }
+
+    idx = epoch_enter(&kq->kq_epoch);
+    forked = (kq->kq_forks != kqueue_forks);
+    if (slowpath(forked)) {
+        kqueue_relock(kq);
+        kq->kq_inherited = 1;
+    }
+
+    for (i = 0, max = 0; i < EVFILT_SYSCOUNT; i++) {
+        if (kq->kq_filt[i] != NULL)
+            max += kq->kq_filt[i]->kf_knote_count;
+    }
+    kn = malloc((max + 1) * sizeof(*kn));
+    ch = malloc((max + 1) * sizeof(*ch));
+    status = malloc((max + 1) * sizeof(*status));
+    if (kn == NULL || ch == NULL || status == NULL)
+        goto out;
+
+    kqueue_lock(kq);
+    for (i = 0, n = 0; i < EVFILT_SYSCOUNT; i++) {
+        filt = kq->kq_filt[i];
+        if (filt == NULL || filt->kf_id == EVFILT_AIO)
+            continue;
+        n += knote_list(filt, kn + n, max - n);
+    }
+    kqueue_unlock(kq);
+
+    for (i = 0; i < n; i++) {
+        if (slowpath(forked))
+            pthread_mutex_init(&kn[i]->kn_mtx, NULL);
+        knote_lock(kn[i]);
+        ch[i] = kn[i]->kev;
+        knote_unlock(kn[i]);
+        ch[i].flags = EV_ADD | (ch[i].flags
+                & (EV_ONESHOT | EV_CLEAR | EV_DISPATCH | EV_DISABLE));
+        if (kn[i]->kev.flags & EV_KEVENT64)
+            ch[i].udata = NULL;
+    }
+
+    if ((fd = kqueue()) < 0)
+        goto out;
+    if (kevent_submit(fd, ch, n, status) != 0) {
+        for (i = 0, err = EINVAL; i < n; i++) {
+            if (status[i] != 0) {
+                dbg_printf("knote %s was not cloned: %s",
+                        kevent_dump(&ch[i]), strerror(status[i]));
+                err = status[i];
+                break;
+            }
+        }
+        (void) close(fd);
+        fd = -1;
+        errno = err;
+        goto out;
+    }
+
+    /* The udata and ext[] of the knotes added by kevent64() */
+    dst = kqueue_lookup(fd);
+    for (i = 0; i < n; i++) {
+        if (!(kn[i]->kev.flags & EV_KEVENT64))
+            continue;
+        j = ~kn[i]->kev.filter;
+        if ((dkn = knote_lookup(dst->kq_filt[j], kn[i]->kev.ident)) == NULL)
+            continue;
+        knote_lock(dkn);
+        dkn->kn_udata64 = kn[i]->kn_udata64;
+        dkn->kn_ext[0] = kn[i]->kn_ext[0];
+        dkn->kn_ext[1] = kn[i]->kn_ext[1];
+        dkn->kev.flags |= EV_KEVENT64;
+        dkn->kev.udata = dkn;
+        knote_unlock(dkn);
+    }
+    /* The locks are set up again, but the backend is still the parent's */
+    kq->kq_forks = kqueue_forks;
+    rv = fd;
+
+out:
+    epoch_exit(&kq->kq_epoch, idx);
+    free(kn);
+    free(ch);
+    free(status);
+    return (rv);
+}
+#endif /* ! _WIN32 */
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Lock contention statistics for tracing mutexes.
+ *
+ * In a build with LOCKSTAT defined, every tracing_mutex_lock() call site
+ * has a lockstat_site, which is added to a list the first time it is
+ * used. The time a mutex is held is counted for the site that locked
+ * it. kqueue_lockstat() writes a report of every site that was used, and
+ * if KQUEUE_LOCKSTAT is set in the environment, it is also written to
+ * stderr when the program exits.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+# include <io.h>
+# define write _write
+#else
+# include <unistd.h>
+#endif
+
+#include "private.h"
+
+#ifdef LOCKSTAT
+
+static struct lockstat_site * volatile lockstat_sites;
+
+static void
+lockstat_register(struct lockstat_site *ls)
+{
+    struct lockstat_site *head;
+
+    if (atomic_cas(&ls->ls_registered, 0, 1) != 0)
+        return;
+    do {
+        head = lockstat_sites;
+        ls->ls_next = head;
+    } while (atomic_ptr_cas(&lockstat_sites, head, ls) != head);
+}
+
+void
+lockstat_acquire(tracing_mutex_t *mtx, struct lockstat_site *ls)
+{
+    uint64_t start;
+
+    if (slowpath(!ls->ls_registered))
+        lockstat_register(ls);
+
+    if (pthread_mutex_trylock(&mtx->mtx_lock) == 0) {
+        atomic_inc(&ls->ls_wait[0]);
+    } else {
+        start = stats_clock();
+        pthread_mutex_lock(&mtx->mtx_lock);
+        atomic_inc(&ls->ls_contended);
+        atomic_inc(&ls->ls_wait[stats_bucket(stats_clock() - start)]);
+    }
+    atomic_inc(&ls->ls_acquired);
+
+    mtx->mtx_site = ls;
+    mtx->mtx_acquired = stats_clock();
+}
+
+/* Called with the mutex still held */
+void
+lockstat_release(tracing_mutex_t *mtx)
+{
+    struct lockstat_site *ls = mtx->mtx_site;
+
+    if (ls == NULL)
+        return;
+    atomic_inc(&ls->ls_hold[stats_bucket(stats_clock() - mtx->mtx_acquired)]);
+    mtx->mtx_site = NULL;
+}
+
+static int
+lockstat_puts(int fd, const char *buf)
+{
+    size_t len = strlen(buf);
+
+    return (write(fd, buf, len) == (int) len ? 0 : -1);
+}
+
+/* Print the nonzero buckets as "<upper bound in ns>:<count>" */
+static int
+lockstat_histogram(int fd, const char *label, volatile uint32_t *hist)
+{
+    char buf[64];
+    int i;
+
+    if (lockstat_puts(fd, label) < 0)
+        return (-1);
+    for (i = 0; i < LOCKSTAT_BUCKETS; i++) {
+        if (hist[i] == 0)
+            continue;
+        snprintf(buf, sizeof(buf), " %llu:%u",
+                (unsigned long long) 1 << i, (unsigned int) hist[i]);
+        if (lockstat_puts(fd, buf) < 0)
+            return (-1);
+    }
+    return (lockstat_puts(fd, "\n"));
+}
+
+static int
+lockstat_dump(int fd)
+{
+    struct lockstat_site *ls;
+    char buf[512];
+
+    for (ls = lockstat_sites; ls != NULL; ls = ls->ls_next) {
+        snprintf(buf, sizeof(buf), "%s:%d %s acquired %u contended %u\n",
+                ls->ls_file, ls->ls_line, ls->ls_name,
+                (unsigned int) ls->ls_acquired,
+                (unsigned int) ls->ls_contended);
+        if (lockstat_puts(fd, buf) < 0
+                || lockstat_histogram(fd, "    wait", ls->ls_wait) < 0
+                || lockstat_histogram(fd, "    hold", ls->ls_hold) < 0)
+            return (-1);
+    }
+    return (0);
+}
+
+static void
+lockstat_atexit(void)
+{
+    (void) lockstat_dump(2);
+}
+
+void
+lockstat_init(void)
+{
+    if (getenv("KQUEUE_LOCKSTAT") != NULL)
+        atexit(lockstat_atexit);
+}
+
+int VISIBLE
+kqueue_lockstat(int fd)
+{
+    return (lockstat_dump(fd));
+}
+
+#else
+
+void
+lockstat_init(void)
+{
+}
+
+int VISIBLE
+kqueue_lockstat(int fd)
+{
+    (void) fd;
+    errno = ENOTSUP;
+    return (-1);
+}
+
+#endif /* LOCKSTAT */
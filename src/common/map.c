@@ -16,9 +16,22 @@
 
 #include "private.h"
 
+/*
+ * A two-level table of pointers, indexed by descriptor number.
+ *
+ * The directory has a slot for every leaf that the table could need,
+ * and a leaf of MAP_LEAF_SIZE pointers is only allocated when the first
+ * value is stored in it. Leaves are never freed before the map itself,
+ * so map_lookup() needs no locking.
+ */
+#define MAP_LEAF_SHIFT  12
+#define MAP_LEAF_SIZE   (1 << MAP_LEAF_SHIFT)
+#define MAP_LEAF_MASK   (MAP_LEAF_SIZE - 1)
+
 struct map {
     size_t len;
-    void **data;
+    size_t nleaves;
+    void ** volatile *dir;
 };
 
 struct map *
@@ -29,41 +42,82 @@ map_new(size_t len)
     dst = calloc(1, sizeof(struct map));
     if (dst == NULL)
         return (NULL);
-#ifdef _WIN32
-	dst->data = calloc(len, sizeof(void*));
-	if(dst->data == NULL) {
-		dbg_perror("calloc()");
-		free(dst);
-		return NULL;
-	}
-	dst->len = len;
-#else
-    dst->data = mmap(NULL, len * sizeof(void *), PROT_READ | PROT_WRITE, 
-            MAP_PRIVATE | MAP_NORESERVE | MAP_ANON, -1, 0);
-    if (dst->data == MAP_FAILED) {
-        dbg_perror("mmap(2)");
+    dst->nleaves = (len + MAP_LEAF_MASK) >> MAP_LEAF_SHIFT;
+    dst->dir = calloc(dst->nleaves, sizeof(*dst->dir));
+    if (dst->dir == NULL) {
+        dbg_perror("calloc()");
         free(dst);
         return (NULL);
     }
     dst->len = len;
-#endif
 
     return (dst);
 }
 
+void
+map_free(struct map *m)
+{
+    size_t i;
+
+    for (i = 0; i < m->nleaves; i++)
+        free(m->dir[i]);
+    free((void *) m->dir);
+    free(m);
+}
+
+/* Return the slot for idx, or NULL if its leaf has not been allocated */
+static inline void **
+map_slot(struct map *m, int idx)
+{
+    void **leaf;
+
+    leaf = m->dir[idx >> MAP_LEAF_SHIFT];
+    if (leaf == NULL)
+        return (NULL);
+    return (&leaf[idx & MAP_LEAF_MASK]);
+}
+
+/* Return the slot for idx, allocating its leaf if needed */
+static void **
+map_slot_alloc(struct map *m, int idx)
+{
+    void **leaf, **cur;
+
+    leaf = m->dir[idx >> MAP_LEAF_SHIFT];
+    if (leaf == NULL) {
+        leaf = calloc(MAP_LEAF_SIZE, sizeof(void *));
+        if (leaf == NULL) {
+            dbg_perror("calloc()");
+            return (NULL);
+        }
+
+        /* Another thread may have installed a leaf first */
+        cur = atomic_ptr_cas(&m->dir[idx >> MAP_LEAF_SHIFT], NULL, leaf);
+        if (cur != NULL) {
+            free(leaf);
+            leaf = cur;
+        }
+    }
+    return (&leaf[idx & MAP_LEAF_MASK]);
+}
+
 int
 map_insert(struct map *m, int idx, void *ptr)
 {
-    if (slowpath(idx < 0 || idx > (int)m->len))
+    void **slot;
+
+    if (slowpath(idx < 0 || idx >= (int)m->len))
+           return (-1);
+    if ((slot = map_slot_alloc(m, idx)) == NULL)
            return (-1);
 
-    if (atomic_ptr_cas(&(m->data[idx]), 0, ptr) == NULL) {
+    if (atomic_ptr_cas(slot, 0, ptr) == NULL) {
         dbg_printf("inserted %p in location %d", ptr, idx);
         return (0);
     } else {
         dbg_printf("tried to insert a value into a non-empty location %d (value=%p)",
                 idx,
-                m->data[idx]);
+                *slot);
         return (-1);
     }
 }
@@ -71,14 +125,18 @@ map_insert(struct map *m, int idx, void *ptr)
 int
 map_remove(struct map *m, int idx, void *ptr)
 {
-    if (slowpath(idx < 0 || idx > (int)m->len))
+    void **slot;
+
+    if (slowpath(idx < 0 || idx >= (int)m->len))
+           return (-1);
+    if ((slot = map_slot(m, idx)) == NULL)
            return (-1);
 
-    if (atomic_ptr_cas(&(m->data[idx]), ptr, 0) == NULL) {
+    if (atomic_ptr_cas(slot, ptr, 0) == ptr) {
         dbg_printf("removed %p from location %d", ptr, idx);
         return (0);
     } else {
-        dbg_printf("removal failed: location %d does not contain value %p", idx, m->data[idx]);
+        dbg_printf("removal failed: location %d does not contain value %p", idx, *slot);
         return (-1);
     }
 }
@@ -86,12 +144,15 @@ map_remove(struct map *m, int idx, void *ptr)
 int
 map_replace(struct map *m, int idx, void *oldp, void *newp)
 {
+    void **slot;
     void *tmp;
 
-    if (slowpath(idx < 0 || idx > (int)m->len))
+    if (slowpath(idx < 0 || idx >= (int)m->len))
+           return (-1);
+    if ((slot = map_slot_alloc(m, idx)) == NULL)
            return (-1);
 
-    tmp = atomic_ptr_cas(&(m->data[idx]), oldp, newp);
+    tmp = atomic_ptr_cas(slot, oldp, newp);
     if (tmp == oldp) {
         dbg_printf("replaced value %p in location %d with value %p",
                 oldp, idx, newp);
@@ -106,28 +167,33 @@ map_replace(struct map *m, int idx, void *oldp, void *newp)
 void *
 map_lookup(struct map *m, int idx)
 {
-    if (slowpath(idx < 0 || idx > (int)m->len))
+    void **slot;
+
+    if (slowpath(idx < 0 || idx >= (int)m->len))
+        return (NULL);
+    if ((slot = map_slot(m, idx)) == NULL)
         return (NULL);
 
-    return m->data[idx];
+    return (*slot);
 }
 
 void *
 map_delete(struct map *m, int idx)
 {
+    void **slot;
     void *oval;
     void *nval;
 
-    if (slowpath(idx < 0 || idx > (int)m->len))
+    if (slowpath(idx < 0 || idx >= (int)m->len))
            return ((void *)-1);
+    if ((slot = map_slot(m, idx)) == NULL)
+           return (NULL);
 
     /* Hopefully we aren't racing with another thread, but you never know.. */
     do {
-        oval = m->data[idx];
-        nval = atomic_ptr_cas(&(m->data[idx]), oval, NULL);
+        oval = *slot;
+        nval = atomic_ptr_cas(slot, oval, NULL);
     } while (nval != oval);
 
-    m->data[idx] = NULL;
-
     return ((void *) oval);
 }
@@ -23,15 +23,35 @@
 #include "config.h"
 #include "tree.h"
 
-/* Maximum events returnable in a single kevent() call */
+/*
+ * Maximum events returnable in a single kevent() call, unless the
+ * platform defines KQUEUE_UNLIMITED_NEVENTS
+ */
 #define MAX_KEVENT  512
 
+/*
+ * The filters that are built. A build that only needs some of them
+ * defines KQUEUE_FILTER_SET and KQUEUE_FILTER_<name> for each one, see
+ * --with-filters in configure.ac; the others then fail with ENOSYS.
+ */
+#ifndef KQUEUE_FILTER_SET
+# define KQUEUE_FILTER_READ     1
+# define KQUEUE_FILTER_WRITE    1
+# define KQUEUE_FILTER_AIO      1
+# define KQUEUE_FILTER_SIGNAL   1
+# define KQUEUE_FILTER_VNODE    1
+# define KQUEUE_FILTER_PROC     1
+# define KQUEUE_FILTER_TIMER    1
+# define KQUEUE_FILTER_USER     1
+#endif
+
 struct kqueue;
 struct kevent;
 struct knote;
 struct map;
 struct eventfd;
 struct evfilt_data;
+struct record_log;
 
 #if defined(_WIN32)
 # include "../windows/platform.h"
@@ -50,6 +70,8 @@ struct evfilt_data;
 #endif
 
 #include "debug.h"
+#include "trace.h"
+#include "alloc.h"
 
 /* Workaround for Android */
 #ifndef EPOLLONESHOT
@@ -68,29 +90,83 @@ struct eventfd {
  */
 #define KNFL_PASSIVE_SOCKET  (0x01)  /* Socket is in listen(2) mode */
 #define KNFL_REGULAR_FILE    (0x02)  /* File descriptor is a regular file */
+#define KNFL_DISARMED        (0x04)  /* The backend stopped reporting events */
+#define KNFL_PRIORITY        (0x08)  /* Reported ahead of other knotes */
+#define KNFL_COALESCE        (0x20)  /* Rearmed by the backend after a delay */
 #define KNFL_KNOTE_DELETED   (0x10)  /* The knote object is no longer valid */
+#define KNFL_LOWAT           (0x40)  /* NOTE_LOWAT is applied by copyout */
+
+/*
+ * Set in kev.flags of a knote that was added or modified by kevent64().
+ * Its kev.udata then points to the knote, which holds the 64-bit udata
+ * and ext[]; kevent_export() puts them back into each event.
+ */
+#define EV_KEVENT64          (0x1000)   /* One of EV_SYSFLAGS */
+
+/*
+ * Deferred reclamation, see epoch.c. An object that lock-free readers
+ * may still reach embeds an epoch_entry, and is retired with it.
+ */
+struct epoch_entry {
+    struct epoch_entry *ee_next;
+    unsigned int        ee_epoch;   /* ep_epoch when it was retired */
+    void              (*ee_free)(struct epoch_entry *);
+};
+
+struct epoch {
+    volatile unsigned int ep_epoch;
+    volatile uint32_t   ep_readers[2];  /* Read sections, by epoch parity */
+    volatile uint32_t   ep_nlimbo;      /* Entries on ep_limbo */
+    struct epoch_entry *ep_limbo;       /* Retired, newest first */
+    unsigned int        ep_scanned;     /* ep_epoch at the last scan of it */
+    pthread_mutex_t     ep_mtx;
+};
+
+/* The position of a knote in a timer heap */
+struct timer_entry {
+    uint64_t  when;   /* Expiration time, in nanoseconds */
+    size_t    index;  /* Position in the timer heap */
+};
  
+/*
+ * The fields that every change and copyout touch come first, so that
+ * they share the knote's first cache line; the knote pool aligns each
+ * knote to a line, so kn_ref never shares one with another knote.
+ */
 struct knote {
     struct kevent     kev;
     int               kn_flags;       
+    volatile uint32_t kn_ref;
+	struct kqueue*	   kn_kq;
     union {
         /* OLD */
         int           pfd;       /* Used by timerfd */
         int           events;    /* Used by socket */
+        int           inflight;  /* Used by linux/aio.c */
         struct {
             nlink_t   nlink;  /* Used by vnode */
             off_t     size;   /* Used by vnode */
+            int       wd;     /* inotify watch descriptor */
+            uint32_t  pending; /* inotify events not yet copied out */
+            struct knote *next; /* Next knote with the same wd */
+            struct vnode_fid *fid; /* fanotify file handle */
         } vnode;
-        timer_t       timerid;  
+        struct timer_entry timer; /* Used by timerheap.c */
+        struct {
+            struct knote *next;     /* Next knote on the pending list */
+            volatile int  queued;   /* Nonzero while on the pending list */
+        } user;                     /* Used by linux/user.c and windows/user.c */
         struct sleepreq *sleepreq; /* Used by posix/timer.c */
 		void          *handle;      /* Used by win32 filters */
     } data;
-	struct kqueue*	   kn_kq;
-    volatile uint32_t  kn_ref;
+    pthread_mutex_t    kn_mtx;        /* Held while changing or copying out */
 #if defined(KNOTE_PLATFORM_SPECIFIC)
     KNOTE_PLATFORM_SPECIFIC;
 #endif
     RB_ENTRY(knote)   kn_entries;
+    struct epoch_entry kn_retire;     /* Used by knote_release() */
+    uint64_t          kn_udata64;     /* Set with EV_KEVENT64 */
+    uint64_t          kn_ext[2];      /* Set with EV_KEVENT64 */
 };
 
 #define KNOTE_ENABLE(ent)           do {                            \
@@ -119,6 +195,19 @@ struct filter {
     int     (*kn_enable)(struct filter *, struct knote *);
     int     (*kn_disable)(struct filter *, struct knote *);
 
+    /* 
+     * Optional: copyout for an event on a descriptor that is shared by
+     * all the knotes of the filter. Returns the number of kevents
+     * written, which may be zero and must not exceed the int argument.
+     */
+    int     (*kf_copyout_filter)(struct filter *, struct kevent *, int);
+
+    /*
+     * Optional: trigger a knote on behalf of kqueue_user_trigger(). It is
+     * called with a reference on the knote, but without any locks held.
+     */
+    int     (*kn_trigger)(struct filter *, struct knote *, unsigned int);
+
     struct eventfd kf_efd;             /* Used by user.c */
 
     //MOVE TO POSIX?
@@ -128,7 +217,12 @@ struct filter {
 
     struct evfilt_data *kf_data;	    /* filter-specific data */
     RB_HEAD(knt, knote) kf_knote;
-    pthread_rwlock_t    kf_knote_mtx;
+    struct knote_index * volatile kf_knote_index; /* knotes indexed by ident */
+    int                 kf_knote_indexed;   /* use kf_knote_index if set */
+    size_t              kf_knote_count;     /* knotes in kf_knote and the index */
+    volatile unsigned int kf_knote_seq;     /* Odd while kf_knote changes */
+    tracing_mutex_t     kf_knote_mtx;       /* Held to change the knotes */
+    pthread_mutex_t     kf_mtx;         /* Used with kf_copyout_filter */
     struct kqueue      *kf_kqueue;
 #if defined(FILTER_PLATFORM_SPECIFIC)
     FILTER_PLATFORM_SPECIFIC;
@@ -140,17 +234,37 @@ struct filter {
 
 struct kqueue {
     int             kq_id;
-    struct filter   kq_filt[EVFILT_SYSCOUNT];
-    fd_set          kq_fds, kq_rfds; 
-    int             kq_nfds;
+    struct filter  *kq_filt[EVFILT_SYSCOUNT]; /* Set up by filter_lookup() */
     tracing_mutex_t kq_mtx;
     volatile uint32_t kq_ref;
+    struct mem_pool kq_knote_pool;      /* Used by knote_new() */
+    void * volatile *kq_stats;          /* Counter shards, see stats.c */
+    struct kqueue_group *kq_group;      /* Set by kqueue_group() */
+    struct epoch    kq_epoch;           /* Reclaims knotes, see epoch.c */
+    struct kevent_post * volatile kq_posted; /* Queued by kevent_post() */
+    volatile int    kq_nested;          /* Has a NOTE_NESTED knote */
+    unsigned int    kq_forks;           /* kqueue_forks when last locked */
+    int             kq_inherited;       /* Its backend is shared with a parent */
+    struct record_log * volatile kq_record; /* Set by kqueue_record_start() */
 #if defined(KQUEUE_PLATFORM_SPECIFIC)
     KQUEUE_PLATFORM_SPECIFIC;
 #endif
     RB_ENTRY(kqueue) entries;
 };
 
+/* Changes queued by one kevent_post() call */
+struct kevent_post {
+    struct kevent_post *kp_next;
+    int                 kp_nchanges;
+    struct kevent       kp_changes[];
+};
+
+/* A changelist entry whose deferred backend update failed */
+struct kevent_error {
+    const struct kevent *ke_change;
+    int                  ke_errno;
+};
+
 struct kqueue_vtable {
     int  (*kqueue_init)(struct kqueue *);
     void (*kqueue_free)(struct kqueue *);
@@ -171,6 +285,23 @@ struct kqueue_vtable {
     int  (*eventfd_raise)(struct eventfd *);
     int  (*eventfd_lower)(struct eventfd *);
     int  (*eventfd_descriptor)(struct eventfd *);
+    // Optional. Submit the backend updates deferred while applying
+    // the changelist.
+    // @param kevent_error set to the changelist entries that failed
+    // @param int the number of events kevent_wait() will be called
+    //        with next, or 0. The backend may start the wait with the
+    //        updates, before the kqueue is unlocked.
+    // @param timespec the timeout kevent_wait() will be called with
+    // @return the number of failed entries
+    int  (*kevent_flush)(struct kqueue *, struct kevent_error **, int,
+            const struct timespec *);
+    // Optional. Poll for up to this many microseconds before blocking
+    // in kevent_wait(), or never if it is 0.
+    int  (*kqueue_busy_poll)(struct kqueue *, unsigned int);
+    // Optional. Make a thread waiting in kevent_wait() return, so that
+    // it applies the changes queued by kevent_post(). Called from any
+    // thread, without any locks held.
+    int  (*kqueue_wake)(struct kqueue *);
 };
 extern const struct kqueue_vtable kqops;
 
@@ -180,30 +311,121 @@ extern const struct kqueue_vtable kqops;
 #define kqueue_lock(kq)     tracing_mutex_lock(&(kq)->kq_mtx)
 #define kqueue_unlock(kq)   tracing_mutex_unlock(&(kq)->kq_mtx)
 
+/* The changelist entry being applied by this thread, if any */
+extern __thread const struct kevent *kevent_change;
+
+/*
+ * Locking
+ *
+ * kqueue_lock() serializes changes to a kqueue. If the platform defines
+ * KQUEUE_FINE_GRAINED_LOCKING, events are copied out without it: each
+ * knote is locked while it is changed or copied out, and a filter with a
+ * shared descriptor is locked by both, because its copyout handles all
+ * of its knotes. The lock order is kqueue, filter, knote.
+ */
+#define filter_lock(filt)   do {                                    \
+    if ((filt)->kf_copyout_filter != NULL)                          \
+        pthread_mutex_lock(&(filt)->kf_mtx);                        \
+} while (0/*CONSTCOND*/)
+#define filter_unlock(filt) do {                                    \
+    if ((filt)->kf_copyout_filter != NULL)                          \
+        pthread_mutex_unlock(&(filt)->kf_mtx);                      \
+} while (0/*CONSTCOND*/)
+#define knote_lock(kn)      pthread_mutex_lock(&(kn)->kn_mtx)
+#define knote_unlock(kn)    pthread_mutex_unlock(&(kn)->kn_mtx)
+
 /*
  * knote internal API
  */
 struct knote * knote_lookup(struct filter *, uintptr_t);
+int         knote_list(struct filter *, struct knote **, int);
+void        knote_free_all(struct filter *);
 //DEADWOOD: struct knote * knote_get_by_data(struct filter *filt, intptr_t);
-struct knote * knote_new(void);
+struct knote * knote_new(struct kqueue *);
+void knote_pool_init(struct kqueue *);
 #define knote_retain(kn) atomic_inc(&kn->kn_ref)
+int  knote_tryretain(struct knote *);
 void knote_release(struct knote *);
 void knote_insert(struct filter *, struct knote *);
+void knote_index_free(struct filter *);
 int  knote_delete(struct filter *, struct knote *);
 int  knote_init(void);
 int  knote_disable(struct filter *, struct knote *);
-#define knote_get_filter(knt) &((knt)->kn_kq->kq_filt[(knt)->kev.filter])
+#define knote_get_filter(knt) ((knt)->kn_kq->kq_filt[~(knt)->kev.filter])
+
+/*
+ * Epoch internal API
+ */
+void         epoch_init(struct epoch *);
+void         epoch_free(struct epoch *);
+unsigned int epoch_enter(struct epoch *);
+void         epoch_exit(struct epoch *, unsigned int);
+int          epoch_retire(struct epoch *, struct epoch_entry *,
+                void (*)(struct epoch_entry *));
+void         epoch_reclaim(struct epoch *);
+
+/*
+ * Timer heap internal API
+ */
+#define TIMER_HEAP_NONE     ((size_t) -1)
+
+struct timer_heap {
+    struct knote **th_heap;
+    size_t         th_len;
+    size_t         th_max;
+    size_t         th_entry;    /* Offset of the timer_entry in a knote */
+};
+
+void          timer_heap_init(struct timer_heap *);
+void          timer_heap_init_at(struct timer_heap *, size_t);
+void          timer_heap_free(struct timer_heap *);
+int           timer_heap_insert(struct timer_heap *, struct knote *);
+void          timer_heap_remove(struct timer_heap *, struct knote *);
+struct knote *timer_heap_peek(struct timer_heap *);
+uint64_t      timer_heap_deadline(struct timer_heap *);
+uint64_t      timer_interval(const struct knote *);
+uint64_t      timer_first(const struct knote *, uint64_t);
+uint64_t      timer_now(void);
+uint64_t      timer_realtime(void);
+
+int         stats_init(struct kqueue *);
+void        stats_free(struct kqueue *);
+uint64_t    stats_clock(void);
+int         stats_bucket(uint64_t);
+void        stats_changes(struct kqueue *, int);
+void        stats_wait(struct kqueue *, uint64_t, int);
+void        stats_events(struct kqueue *, int);
+void        stats_spurious(struct kqueue *);
+
+void        lockstat_init(void);
+
+void        record_push(struct kqueue *, uint64_t, int, uintptr_t, short,
+                unsigned int);
+void        record_events(struct kqueue *, const struct kevent *, int);
+void        record_free(struct kqueue *);
+
+/* Write an entry to the flight recorder, if it was started */
+#define record_add(kq, now, type, ident, filter, data) do { \
+    if (slowpath((kq)->kq_record != NULL)) \
+        record_push((kq), (now), (type), (ident), (filter), (data)); \
+} while (0)
 
 int         filter_lookup(struct filter **, struct kqueue *, short);
-int      	filter_register_all(struct kqueue *);
 void     	filter_unregister_all(struct kqueue *);
 const char *filter_name(short);
 
 int         kevent_wait(struct kqueue *, const struct timespec *);
 int         kevent_copyout(struct kqueue *, int, struct kevent *, int);
+int         kevent_wait_copyout(struct kqueue *, struct kevent *, int,
+                const struct timespec *, unsigned int *);
+int         kevent_post_changes(struct kqueue *, const struct kevent *, int);
+int         kqueue_group_kevent(struct kqueue *, const struct kevent *, int,
+                struct kevent *, int, const struct timespec *);
+void        kqueue_group_free(struct kqueue_group *);
 void 		kevent_free(struct kqueue *);
 const char *kevent_dump(const struct kevent *);
 struct kqueue * kqueue_lookup(int);
+void        kqueue_free(struct kqueue *, int);
 int         kqueue_validate(struct kqueue *);
 
 struct map *map_new(size_t);
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A flight recorder of the recent activity of a kqueue.
+ *
+ * Once kqueue_record_start() is called, every change, wait and returned
+ * event is written to a ring of fixed size. As with the statistics, the
+ * rings are split into shards that are allocated on first use, and each
+ * thread writes to the shard it was assigned, so recording only costs a
+ * counter increment and a few stores to a cache line the thread owns.
+ * Older entries are overwritten.
+ *
+ * Each entry has a sequence number, which is cleared while the entry is
+ * written. kqueue_record_dump() skips the entries whose sequence number
+ * changes while they are copied, so it may run while other threads are
+ * recording.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "private.h"
+
+#define RECORD_SHARDS   16
+
+/* Largest ring accepted by kqueue_record_start() */
+#define RECORD_MAX      (1U << 20)
+
+struct record_entry {
+    uint32_t             re_seq;    /* Zero while being written */
+    struct kqueue_record re_rec;
+};
+
+struct record_shard {
+    volatile uint32_t   rs_head;    /* Sequence number of the last entry */
+    struct record_entry rs_entry[];
+};
+
+struct record_log {
+    unsigned int  rl_mask;          /* Entries per shard, minus one */
+    void * volatile rl_shard[RECORD_SHARDS];
+};
+
+/* rl_shard holds the allocations, which are aligned to a cache line here */
+#define shard_ptr(p)    ((struct record_shard *) CACHE_ROUND((uintptr_t) (p)))
+
+static volatile uint32_t record_next_shard;
+static __thread int record_shard_id = -1;
+
+static struct record_shard *
+record_shard(struct record_log *rl)
+{
+    void *p, *cur;
+
+    if (slowpath(record_shard_id < 0))
+        record_shard_id = atomic_inc(&record_next_shard) % RECORD_SHARDS;
+
+    p = rl->rl_shard[record_shard_id];
+    if (slowpath(p == NULL)) {
+        p = calloc(1, sizeof(struct record_shard) + CACHE_LINE
+                + (rl->rl_mask + 1) * sizeof(struct record_entry));
+        if (p == NULL)
+            return (NULL);
+
+        /* Another thread with the same shard may have allocated it first */
+        cur = atomic_ptr_cas(&rl->rl_shard[record_shard_id], NULL, p);
+        if (cur != NULL) {
+            free(p);
+            p = cur;
+        }
+    }
+    return (shard_ptr(p));
+}
+
+/* Called through record_add(), once kq_record is set */
+void
+record_push(struct kqueue *kq, uint64_t now, int type, uintptr_t ident,
+        short filter, unsigned int data)
+{
+    struct record_log *rl = kq->kq_record;
+    struct record_shard *rs;
+    struct record_entry *re;
+    uint32_t seq;
+
+    if ((rs = record_shard(rl)) == NULL)
+        return;
+
+    /* Zero is left for the entries being written */
+    if (slowpath((seq = atomic_inc(&rs->rs_head)) == 0))
+        seq = atomic_inc(&rs->rs_head);
+    re = &rs->rs_entry[seq & rl->rl_mask];
+
+    /* The fences keep the stores to the entry between the two of re_seq */
+    __atomic_store_n(&re->re_seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    re->re_rec.rc_time = now != 0 ? now : stats_clock();
+    re->re_rec.rc_ident = ident;
+    re->re_rec.rc_data = data;
+    re->re_rec.rc_filter = filter;
+    re->re_rec.rc_type = type;
+    re->re_rec.rc_thread = record_shard_id;
+    __atomic_store_n(&re->re_seq, seq, __ATOMIC_RELEASE);
+}
+
+/* Record the events returned by kevent(), with one reading of the clock */
+void
+record_events(struct kqueue *kq, const struct kevent *eventlist, int nevents)
+{
+    uint64_t now = stats_clock();
+    int i;
+
+    for (i = 0; i < nevents; i++)
+        record_push(kq, now, KQUEUE_RECORD_EVENT, eventlist[i].ident,
+                eventlist[i].filter, eventlist[i].flags);
+}
+
+void
+record_free(struct kqueue *kq)
+{
+    struct record_log *rl = kq->kq_record;
+    int i;
+
+    if (rl == NULL)
+        return;
+    for (i = 0; i < RECORD_SHARDS; i++)
+        free(rl->rl_shard[i]);
+    free(rl);
+    kq->kq_record = NULL;
+}
+
+int VISIBLE
+kqueue_record_start(int kqfd, unsigned int nrecords)
+{
+    struct kqueue *kq;
+    struct record_log *rl;
+    unsigned int n;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
+    if (nrecords == 0 || nrecords > RECORD_MAX) {
+        errno = EINVAL;
+        return (-1);
+    }
+    for (n = 1; n < nrecords; n <<= 1)
+        ;
+
+    rl = calloc(1, sizeof(*rl));
+    if (rl == NULL)
+        return (-1);
+    rl->rl_mask = n - 1;
+
+    /* The recorder cannot be resized, since other threads may be using it */
+    if (atomic_ptr_cas(&kq->kq_record, NULL, rl) != NULL) {
+        free(rl);
+        errno = EBUSY;
+        return (-1);
+    }
+    return (0);
+}
+
+static int
+record_cmp(const void *a, const void *b)
+{
+    const struct kqueue_record *x = a, *y = b;
+
+    if (x->rc_time != y->rc_time)
+        return (x->rc_time < y->rc_time ? -1 : 1);
+    return (0);
+}
+
+int VISIBLE
+kqueue_record_dump(int kqfd, struct kqueue_record *records, int nrecords)
+{
+    struct kqueue *kq;
+    struct record_log *rl;
+    struct record_shard *rs;
+    struct kqueue_record *buf;
+    struct record_entry *re;
+    uint32_t seq;
+    unsigned int i, j;
+    int n = 0;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
+    if ((rl = kq->kq_record) == NULL) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if (nrecords <= 0)
+        return (0);
+
+    buf = malloc(RECORD_SHARDS * (rl->rl_mask + 1) * sizeof(*buf));
+    if (buf == NULL)
+        return (-1);
+
+    for (i = 0; i < RECORD_SHARDS; i++) {
+        if (rl->rl_shard[i] == NULL)
+            continue;
+        rs = shard_ptr(rl->rl_shard[i]);
+        for (j = 0; j <= rl->rl_mask; j++) {
+            re = &rs->rs_entry[j];
+            if ((seq = __atomic_load_n(&re->re_seq, __ATOMIC_ACQUIRE)) == 0)
+                continue;
+            buf[n].rc_time = re->re_rec.rc_time;
+            buf[n].rc_ident = re->re_rec.rc_ident;
+            buf[n].rc_data = re->re_rec.rc_data;
+            buf[n].rc_filter = re->re_rec.rc_filter;
+            buf[n].rc_type = re->re_rec.rc_type;
+            buf[n].rc_thread = re->re_rec.rc_thread;
+
+            /* Overwritten while it was copied */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&re->re_seq, __ATOMIC_RELAXED) != seq)
+                continue;
+            n++;
+        }
+    }
+
+    /* Return the most recent entries, oldest first */
+    qsort(buf, n, sizeof(*buf), record_cmp);
+    if (n > nrecords) {
+        memcpy(records, buf + n - nrecords, nrecords * sizeof(*buf));
+        n = nrecords;
+    } else {
+        memcpy(records, buf, n * sizeof(*buf));
+    }
+    free(buf);
+
+    return (n);
+}
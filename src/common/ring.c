@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A ring of kevent records with one producer and many consumers.
+ *
+ * The producer calls kqueue_ring_wait(), which has kevent() copy the
+ * events straight into the free slots of the ring. Consumers take one
+ * event at a time with kqueue_ring_pop(), which only needs atomic loads
+ * and a compare-and-swap, so they never enter kevent() or take the
+ * kqueue lock.
+ */
+
+#include "private.h"
+
+/* Largest ring accepted by kqueue_ring_open() */
+#define RING_MAX    (1U << 20)
+
+struct kqueue_ring {
+    volatile unsigned int kr_head;  /* Next slot the producer fills */
+    volatile unsigned int kr_tail;  /* Next slot a consumer takes */
+    unsigned int  kr_mask;          /* Number of slots, minus one */
+    int           kr_kq;            /* The kqueue being drained */
+    size_t        kr_len;           /* Size of the mapping */
+    struct kevent kr_events[];
+};
+
+VISIBLE struct kqueue_ring *
+kqueue_ring_open(int kq, unsigned int nslots)
+{
+    struct kqueue_ring *ring;
+    unsigned int size;
+    size_t len;
+
+    if (kqueue_lookup(kq) == NULL) {
+        errno = EBADF;
+        return (NULL);
+    }
+    if (nslots == 0 || nslots > RING_MAX) {
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    /* Round up to a power of two so the index can be masked */
+    for (size = 1; size < nslots; size <<= 1)
+        ;
+
+    len = sizeof(*ring) + size * sizeof(struct kevent);
+    ring = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANON, -1, 0);
+    if (ring == MAP_FAILED) {
+        dbg_perror("mmap(2)");
+        return (NULL);
+    }
+    ring->kr_head = 0;
+    ring->kr_tail = 0;
+    ring->kr_mask = size - 1;
+    ring->kr_kq = kq;
+    ring->kr_len = len;
+
+    dbg_printf("ring=%p kq=%d slots=%u", ring, kq, size);
+    return (ring);
+}
+
+int VISIBLE
+kqueue_ring_close(struct kqueue_ring *ring)
+{
+    if (munmap(ring, ring->kr_len) < 0) {
+        dbg_perror("munmap(2)");
+        return (-1);
+    }
+    return (0);
+}
+
+/*
+ * Wait for events and append them to the ring. Only one thread may call
+ * this at a time. Returns the number of events added, which is zero if
+ * the ring is full or the timeout expired.
+ */
+int VISIBLE
+kqueue_ring_wait(struct kqueue_ring *ring, const struct timespec *timeout)
+{
+    unsigned int head, tail, slot, nfree;
+    int rv;
+
+    head = ring->kr_head;
+    tail = ring->kr_tail;
+    nfree = ring->kr_mask + 1 - (head - tail);
+    if (nfree == 0)
+        return (0);
+
+    /* kevent() can only fill the slots up to the end of the array */
+    slot = head & ring->kr_mask;
+    if (nfree > ring->kr_mask + 1 - slot)
+        nfree = ring->kr_mask + 1 - slot;
+
+    rv = kevent(ring->kr_kq, NULL, 0, &ring->kr_events[slot], nfree, timeout);
+    if (rv <= 0)
+        return (rv);
+
+    /* Publish the events after they have been written */
+    atomic_barrier();
+    ring->kr_head = head + rv;
+
+    return (rv);
+}
+
+/*
+ * Take the oldest event from the ring. Returns 1 if an event was copied
+ * to kev, or 0 if the ring is empty.
+ */
+int VISIBLE
+kqueue_ring_pop(struct kqueue_ring *ring, struct kevent *kev)
+{
+    unsigned int head, tail;
+
+    for (;;) {
+        tail = ring->kr_tail;
+        head = ring->kr_head;
+        if (tail == head)
+            return (0);
+        atomic_barrier();
+
+        /*
+         * The slot cannot be reused before kr_tail moves past it, so
+         * the copy is only valid if the tail is still where it was.
+         */
+        memcpy(kev, &ring->kr_events[tail & ring->kr_mask], sizeof(*kev));
+        if (atomic_cas(&ring->kr_tail, tail, tail + 1) == tail)
+            return (1);
+    }
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Per-kqueue statistics.
+ *
+ * The counters are split into shards, one cache line apart, and each
+ * thread updates the shard it was assigned when it first counted
+ * something. Unless there are more threads than shards, no two threads
+ * write to the same cache line. Threads beyond that share a shard, so the
+ * counters are updated with relaxed atomic adds, which cost no more than
+ * a plain add on a line that is not contended. kqueue_stats() adds the
+ * shards up.
+ *
+ * A shard is only allocated when a thread first uses it, so a kqueue
+ * used by a single thread carries a single shard.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "private.h"
+
+#define STATS_SHARDS    16
+
+struct stats_shard {
+    uint64_t st_changes;
+    uint64_t st_wakeups;
+    uint64_t st_events;
+    uint64_t st_spurious;
+    uint64_t st_wait_ns[KQUEUE_STATS_BUCKETS];
+    uint64_t st_batch[KQUEUE_STATS_BUCKETS];
+};
+
+/* kq_stats holds the allocations, which are aligned to a cache line here */
+#define shard_ptr(p)    ((struct stats_shard *) CACHE_ROUND((uintptr_t) (p)))
+
+static volatile uint32_t stats_next_shard;
+static __thread int stats_shard_id = -1;
+
+#define stats_count(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define stats_read(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+
+/* Counts go here if a shard cannot be allocated */
+static struct stats_shard stats_dummy;
+
+static struct stats_shard *
+stats_shard(struct kqueue *kq)
+{
+    void *p, *cur;
+
+    if (slowpath(stats_shard_id < 0))
+        stats_shard_id = atomic_inc(&stats_next_shard) % STATS_SHARDS;
+
+    p = kq->kq_stats[stats_shard_id];
+    if (slowpath(p == NULL)) {
+        p = calloc(1, sizeof(struct stats_shard) + CACHE_LINE);
+        if (p == NULL)
+            return (&stats_dummy);
+
+        /* Another thread with the same shard may have allocated it first */
+        cur = atomic_ptr_cas(&kq->kq_stats[stats_shard_id], NULL, p);
+        if (cur != NULL) {
+            free(p);
+            p = cur;
+        }
+    }
+    return (shard_ptr(p));
+}
+
+/* Return the bucket for n: 0 for 0, and k for values in [2^(k-1), 2^k) */
+int
+stats_bucket(uint64_t n)
+{
+    int k;
+
+    for (k = 0; n > 0 && k < KQUEUE_STATS_BUCKETS - 1; k++)
+        n >>= 1;
+    return (k);
+}
+
+int
+stats_init(struct kqueue *kq)
+{
+    kq->kq_stats = calloc(STATS_SHARDS, sizeof(void *));
+    if (kq->kq_stats == NULL)
+        return (-1);
+    return (0);
+}
+
+void
+stats_free(struct kqueue *kq)
+{
+    int i;
+
+    if (kq->kq_stats == NULL)
+        return;
+    for (i = 0; i < STATS_SHARDS; i++)
+        free(kq->kq_stats[i]);
+    free((void *) kq->kq_stats);
+    kq->kq_stats = NULL;
+}
+
+uint64_t
+stats_clock(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return ((uint64_t) (count.QuadPart * (1000000000.0 / freq.QuadPart)));
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec);
+#endif
+}
+
+void
+stats_changes(struct kqueue *kq, int nchanges)
+{
+    stats_count(&stats_shard(kq)->st_changes, nchanges);
+}
+
+/* Record a call to kevent_wait() that started at the given time */
+void
+stats_wait(struct kqueue *kq, uint64_t start, int nready)
+{
+    struct stats_shard *st = stats_shard(kq);
+
+    stats_count(&st->st_wait_ns[stats_bucket(stats_clock() - start)], 1);
+    if (nready > 0)
+        stats_count(&st->st_wakeups, 1);
+}
+
+/* Record the number of events returned by kevent() */
+void
+stats_events(struct kqueue *kq, int nevents)
+{
+    struct stats_shard *st = stats_shard(kq);
+
+    stats_count(&st->st_events, nevents);
+    stats_count(&st->st_batch[stats_bucket(nevents)], 1);
+}
+
+/* Record an event that was discarded during copyout */
+void
+stats_spurious(struct kqueue *kq)
+{
+    stats_count(&stats_shard(kq)->st_spurious, 1);
+}
+
+int VISIBLE
+kqueue_stats(int kqfd, struct kqueue_stats *ks)
+{
+    struct kqueue *kq;
+    struct filter *filt;
+    struct stats_shard *st;
+    int i, j;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
+
+    memset(ks, 0, sizeof(*ks));
+    for (i = 0; i < EVFILT_SYSCOUNT; i++) {
+        filt = kq->kq_filt[i];
+        if (filt == NULL)
+            continue;
+        ks->ks_knotes[i] = filt->kf_knote_count;
+    }
+
+    /* Other threads may be updating the shards, so this is a snapshot */
+    for (i = 0; i < STATS_SHARDS; i++) {
+        if (kq->kq_stats[i] == NULL)
+            continue;
+        st = shard_ptr(kq->kq_stats[i]);
+        ks->ks_changes += stats_read(&st->st_changes);
+        ks->ks_wakeups += stats_read(&st->st_wakeups);
+        ks->ks_events += stats_read(&st->st_events);
+        ks->ks_spurious += stats_read(&st->st_spurious);
+        for (j = 0; j < KQUEUE_STATS_BUCKETS; j++) {
+            ks->ks_wait_ns[j] += stats_read(&st->st_wait_ns[j]);
+            ks->ks_batch[j] += stats_read(&st->st_batch[j]);
+        }
+    }
+
+    return (0);
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2011 Mark Heily <mark@heily.com>
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A binary min-heap of timer knotes, ordered by expiration time.
+ *
+ * This lets a timer filter drive any number of timers from a single
+ * kernel timer that is armed for the earliest expiration.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "private.h"
+
+/* Initial number of slots in the heap */
+#define TIMER_HEAP_MIN  64
+
+/* Longest interval, which keeps deadlines from overflowing */
+#define TIMER_MAX       (UINT64_MAX / 4)
+
+/* The timer_entry of a knote; data.timer, unless timer_heap_init_at() chose another */
+#define heap_entry(th, kn)  ((struct timer_entry *) ((char *) (kn) + (th)->th_entry))
+#define heap_when(th, i)    (heap_entry((th), (th)->th_heap[(i)])->when)
+
+/* Nanoseconds that a timer may be delayed so it can expire with others */
+static uint64_t timer_slack;
+
+void
+timer_heap_init(struct timer_heap *th)
+{
+    timer_heap_init_at(th, offsetof(struct knote, data.timer));
+}
+
+/* Use the timer_entry at <offset> in each knote */
+void
+timer_heap_init_at(struct timer_heap *th, size_t offset)
+{
+    static int slack_parsed;
+    char *s;
+
+    if (!slack_parsed) {
+        s = getenv("KQUEUE_TIMER_SLACK");
+        if (s != NULL)
+            timer_slack = strtoull(s, NULL, 10);
+        slack_parsed = 1;
+    }
+
+    th->th_heap = NULL;
+    th->th_len = 0;
+    th->th_max = 0;
+    th->th_entry = offset;
+}
+
+void
+timer_heap_free(struct timer_heap *th)
+{
+    free(th->th_heap);
+    th->th_heap = NULL;
+    th->th_len = 0;
+    th->th_max = 0;
+}
+
+static void
+heap_set(struct timer_heap *th, size_t i, struct knote *kn)
+{
+    th->th_heap[i] = kn;
+    heap_entry(th, kn)->index = i;
+}
+
+static void
+heap_sift_up(struct timer_heap *th, size_t i)
+{
+    struct knote *kn = th->th_heap[i];
+    size_t parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (heap_when(th, parent) <= heap_entry(th, kn)->when)
+            break;
+        heap_set(th, i, th->th_heap[parent]);
+        i = parent;
+    }
+    heap_set(th, i, kn);
+}
+
+static void
+heap_sift_down(struct timer_heap *th, size_t i)
+{
+    struct knote *kn = th->th_heap[i];
+    size_t child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= th->th_len)
+            break;
+        if (child + 1 < th->th_len
+                && heap_when(th, child + 1) < heap_when(th, child))
+            child++;
+        if (heap_entry(th, kn)->when <= heap_when(th, child))
+            break;
+        heap_set(th, i, th->th_heap[child]);
+        i = child;
+    }
+    heap_set(th, i, kn);
+}
+
+/* Add a timer that expires at the when of its timer_entry */
+int
+timer_heap_insert(struct timer_heap *th, struct knote *kn)
+{
+    struct knote **tmp;
+    size_t max;
+
+    if (th->th_len == th->th_max) {
+        max = th->th_max ? th->th_max * 2 : TIMER_HEAP_MIN;
+        tmp = realloc(th->th_heap, max * sizeof(*tmp));
+        if (tmp == NULL) {
+            dbg_perror("realloc(3)");
+            return (-1);
+        }
+        th->th_heap = tmp;
+        th->th_max = max;
+    }
+
+    th->th_heap[th->th_len] = kn;
+    heap_sift_up(th, th->th_len++);
+
+    return (0);
+}
+
+/* Remove a timer. Does nothing if the timer is not in the heap. */
+void
+timer_heap_remove(struct timer_heap *th, struct knote *kn)
+{
+    size_t i = heap_entry(th, kn)->index;
+
+    if (i >= th->th_len || th->th_heap[i] != kn)
+        return;
+
+    heap_entry(th, kn)->index = TIMER_HEAP_NONE;
+    if (--th->th_len == i)
+        return;
+
+    heap_set(th, i, th->th_heap[th->th_len]);
+    if (i > 0 && heap_when(th, (i - 1) / 2) > heap_when(th, i))
+        heap_sift_up(th, i);
+    else
+        heap_sift_down(th, i);
+}
+
+/* Return the timer that expires first, or NULL if the heap is empty */
+struct knote *
+timer_heap_peek(struct timer_heap *th)
+{
+    return ((th->th_len > 0) ? th->th_heap[0] : NULL);
+}
+
+/*
+ * Return the time the kernel timer should be armed for, or 0 if there
+ * are no timers. The earliest timer may be delayed by up to the slack,
+ * so that the timers that expire soon after it are delivered with it.
+ */
+uint64_t
+timer_heap_deadline(struct timer_heap *th)
+{
+    if (th->th_len == 0)
+        return (0);
+    return (heap_when(th, 0) + timer_slack);
+}
+
+/*
+ * Return the interval of a timer knote in nanoseconds. The unit of data
+ * is chosen by NOTE_SECONDS, NOTE_USECONDS or NOTE_NSECONDS, and is
+ * milliseconds by default.
+ */
+uint64_t
+timer_interval(const struct knote *kn)
+{
+    uint64_t data, unit;
+
+    switch (kn->kev.fflags & (NOTE_SECONDS | NOTE_MSECONDS | NOTE_USECONDS | NOTE_NSECONDS)) {
+    case NOTE_SECONDS:
+        unit = 1000000000;
+        break;
+    case NOTE_USECONDS:
+        unit = 1000;
+        break;
+    case NOTE_NSECONDS:
+        unit = 1;
+        break;
+    default:
+        unit = 1000000;
+        break;
+    }
+
+    data = (kn->kev.data > 0) ? (uint64_t) kn->kev.data : 0;
+    if (data > TIMER_MAX / unit)
+        return (TIMER_MAX);
+    return ((data > 0) ? data * unit : 1);
+}
+
+/* The time since the Epoch, in nanoseconds */
+uint64_t
+timer_realtime(void)
+{
+#ifdef _WIN32
+    FILETIME ft;
+    ULARGE_INTEGER t;
+
+    /* FILETIME counts 100 ns ticks since 1601 */
+    GetSystemTimeAsFileTime(&ft);
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    return ((t.QuadPart - 116444736000000000ULL) * 100);
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return ((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec);
+#endif
+}
+
+/* The time on the monotonic clock that deadlines are kept in, in nanoseconds */
+uint64_t
+timer_now(void)
+{
+#ifdef _WIN32
+    return (stats_clock());
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec);
+#endif
+}
+
+/*
+ * Return when a timer knote first expires, on the clock that now was
+ * read from. A NOTE_ABSTIME timer expires at a time since the Epoch,
+ * which is converted with the offset between the two clocks at the time
+ * it is armed; a later step of the system clock does not move it. The
+ * Linux backend keeps them on CLOCK_REALTIME instead, and does not call
+ * this for them.
+ */
+uint64_t
+timer_first(const struct knote *kn, uint64_t now)
+{
+    uint64_t deadline, realtime;
+
+    if (!(kn->kev.fflags & NOTE_ABSTIME))
+        return (now + timer_interval(kn));
+
+    deadline = timer_interval(kn);
+    realtime = timer_realtime();
+    if (deadline <= realtime)
+        return (now);
+    return (now + (deadline - realtime));
+}
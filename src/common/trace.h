@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef  _TRACE_H
+#define  _TRACE_H
+
+/*
+ * Static tracepoints.
+ *
+ * If <sys/sdt.h> is available, these are USDT probes of the "libkqueue"
+ * provider, which can be listed with `perf list sdt_libkqueue:*` or used
+ * from bpftrace and SystemTap. An unused probe is a single nop, and it
+ * passes raw values only, so nothing is formatted unless a tracer is
+ * attached and asks for it. Otherwise the tracepoints compile to nothing.
+ *
+ *   kevent_register(kq, ident, filter, flags)  a change is applied
+ *   kevent_wait_enter(kq, nevents)            kevent() starts waiting
+ *   kevent_wait_exit(kq, nready)              the wait returned
+ *   kevent_copyout(kq, nevents)               events were copied out
+ */
+
+#if HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+
+# define trace_kevent_register(kq, kev) \
+    DTRACE_PROBE4(libkqueue, kevent_register, (kq)->kq_id, \
+            (kev)->ident, (kev)->filter, (kev)->flags)
+# define trace_kevent_wait_enter(kq, nevents) \
+    DTRACE_PROBE2(libkqueue, kevent_wait_enter, (kq)->kq_id, (nevents))
+# define trace_kevent_wait_exit(kq, nready) \
+    DTRACE_PROBE2(libkqueue, kevent_wait_exit, (kq)->kq_id, (nready))
+# define trace_kevent_copyout(kq, nevents) \
+    DTRACE_PROBE2(libkqueue, kevent_copyout, (kq)->kq_id, (nevents))
+#else
+# define trace_kevent_register(kq, kev)         do {} while (0)
+# define trace_kevent_wait_enter(kq, nevents)   do {} while (0)
+# define trace_kevent_wait_exit(kq, nready)     do {} while (0)
+# define trace_kevent_copyout(kq, nevents)      do {} while (0)
+#endif
+
+#endif  /* ! _TRACE_H */
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * EVFILT_AIO: asynchronous file I/O that completes as a kevent.
+ *
+ * The ident of the knote is a struct aiocb, whose aio_lio_opcode is
+ * LIO_READ or LIO_WRITE. Adding the knote queues the request on an
+ * io_uring instance that belongs to the filter, and the ring descriptor
+ * is in the epoll set, so it is readable while there are completions.
+ * Each completion becomes one kevent and deletes its knote; data is the
+ * number of bytes transferred, or EV_EOF is set and fflags is the error.
+ *
+ * A request holds a reference on its knote until it completes. Deleting
+ * the knote earlier cancels the request, and its completion is dropped.
+ */
+
+#include <aio.h>
+#include <stdlib.h>
+
+#include "private.h"
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+
+/* Number of submission queue entries; the completion queue is twice that */
+#define AIO_RING_ENTRIES    256
+
+/* The user_data of a cancel request, whose completion is ignored */
+#define AIO_CANCEL          ((uint64_t) 0)
+
+struct evfilt_data {
+    struct uring    ring;
+    unsigned int    inflight;       /* Requests that have not completed */
+    unsigned int    max_inflight;   /* Size of the completion queue */
+};
+
+int
+evfilt_aio_init(struct filter *filt)
+{
+    struct evfilt_data *ed;
+    struct epoll_event ev;
+
+    ed = calloc(1, sizeof(*ed));
+    if (ed == NULL)
+        return (-1);
+    if (uring_setup(&ed->ring, AIO_RING_ENTRIES) < 0) {
+        free(ed);
+        return (-1);
+    }
+    ed->max_inflight = *ed->ring.ur_cq_mask + 1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = epoll_filter_ptr(filt);
+    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, ed->ring.ur_fd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        uring_free(&ed->ring);
+        free(ed);
+        return (-1);
+    }
+
+    filt->kf_data = ed;
+    return (0);
+}
+
+/*
+ * Requests that are still queued are cancelled when the ring is closed;
+ * the references they hold go away with the knote pool.
+ */
+void
+evfilt_aio_destroy(struct filter *filt)
+{
+    struct evfilt_data *ed = filt->kf_data;
+
+    uring_free(&ed->ring);
+    free(ed);
+    filt->kf_data = NULL;
+}
+
+int
+evfilt_aio_copyout(struct filter *filt, struct kevent *dst, int nevents)
+{
+    struct evfilt_data *ed = filt->kf_data;
+    struct io_uring_cqe *cqe;
+    struct knote *kn;
+    unsigned head, tail;
+    int nret;
+
+    head = *ed->ring.ur_cq_head;
+    tail = __atomic_load_n(ed->ring.ur_cq_tail, __ATOMIC_ACQUIRE);
+    for (nret = 0; head != tail && nret < nevents; head++) {
+        cqe = &ed->ring.ur_cqes[head & *ed->ring.ur_cq_mask];
+        if (cqe->user_data == AIO_CANCEL)
+            continue;
+        kn = (struct knote *) (uintptr_t) cqe->user_data;
+        kn->data.inflight = 0;
+        ed->inflight--;
+
+        /* The knote was deleted and the request cancelled */
+        if (kn->kn_flags & KNFL_KNOTE_DELETED) {
+            knote_release(kn);
+            continue;
+        }
+
+        memcpy(dst, &kn->kev, sizeof(*dst));
+        if (cqe->res < 0) {
+            dst->flags |= EV_EOF;
+            dst->fflags = -cqe->res;
+            dst->data = 0;
+        } else {
+            dst->data = cqe->res;
+        }
+        knote_delete(filt, kn);
+        knote_release(kn);
+        dst++;
+        nret++;
+    }
+    __atomic_store_n(ed->ring.ur_cq_head, head, __ATOMIC_RELEASE);
+
+    return (nret);
+}
+
+int
+evfilt_aio_knote_create(struct filter *filt, struct knote *kn)
+{
+    struct evfilt_data *ed = filt->kf_data;
+    struct aiocb *iocb = (struct aiocb *) kn->kev.ident;
+    struct io_uring_sqe *sqe;
+    uint8_t opcode;
+
+    switch (iocb->aio_lio_opcode) {
+    case LIO_READ:
+        opcode = IORING_OP_READ;
+        break;
+    case LIO_WRITE:
+        opcode = IORING_OP_WRITE;
+        break;
+    default:
+        errno = EINVAL;
+        return (-1);
+    }
+    if ((uint64_t) iocb->aio_nbytes > UINT32_MAX || iocb->aio_offset < 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if (ed->inflight >= ed->max_inflight) {
+        errno = EAGAIN;
+        return (-1);
+    }
+
+    /* The completion deletes the knote */
+    kn->kev.flags |= EV_ONESHOT;
+    kn->kev.flags &= ~EV_CLEAR;
+
+    sqe = uring_get_sqe(&ed->ring);
+    sqe->opcode = opcode;
+    sqe->fd = iocb->aio_fildes;
+    sqe->addr = (uintptr_t) iocb->aio_buf;
+    sqe->len = iocb->aio_nbytes;
+    sqe->off = iocb->aio_offset;
+    sqe->user_data = (uintptr_t) kn;
+
+    knote_retain(kn);
+    if (uring_submit(&ed->ring, 1, 0) != 1) {
+        knote_release(kn);
+        return (-1);
+    }
+    kn->data.inflight = 1;
+    ed->inflight++;
+
+    dbg_printf("aiocb=%p fd=%d opcode=%d nbytes=%zu", (void *) iocb,
+            iocb->aio_fildes, iocb->aio_lio_opcode, iocb->aio_nbytes);
+    return (0);
+}
+
+int
+evfilt_aio_knote_modify(struct filter *filt, struct knote *kn,
+        const struct kevent *kev)
+{
+    (void) filt;
+    (void) kn;
+    (void) kev;
+
+    /* An aiocb can only be queued once at a time */
+    errno = EBUSY;
+    return (-1);
+}
+
+int
+evfilt_aio_knote_delete(struct filter *filt, struct knote *kn)
+{
+    struct evfilt_data *ed = filt->kf_data;
+    struct io_uring_sqe *sqe;
+
+    if (!kn->data.inflight)
+        return (0);
+
+    /* The request keeps its reference until its completion is reaped */
+    sqe = uring_get_sqe(&ed->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) kn;
+    sqe->user_data = AIO_CANCEL;
+    if (uring_submit(&ed->ring, 1, 0) != 1)
+        return (-1);
+
+    return (0);
+}
+
+/* A queued request cannot be paused, so these have no effect */
+int
+evfilt_aio_knote_enable(struct filter *filt, struct knote *kn)
+{
+    (void) filt;
+    (void) kn;
+    return (0);
+}
+
+int
+evfilt_aio_knote_disable(struct filter *filt, struct knote *kn)
+{
+    (void) filt;
+    (void) kn;
+    return (0);
+}
+
+const struct filter evfilt_aio = {
+    EVFILT_AIO,
+    evfilt_aio_init,
+    evfilt_aio_destroy,
+    NULL,
+    evfilt_aio_knote_create,
+    evfilt_aio_knote_modify,
+    evfilt_aio_knote_delete,
+    evfilt_aio_knote_enable,
+    evfilt_aio_knote_disable,
+    evfilt_aio_copyout,
+};
+
+#else
+
+const struct filter evfilt_aio = EVFILT_NOTIMPL;
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -16,16 +16,46 @@
 
 # define _GNU_SOURCE
 # include <poll.h>
+# include <sys/ioctl.h>
 #include "../common/private.h"
 
-//XXX-FIXME TEMP
-const struct filter evfilt_proc = EVFILT_NOTIMPL;
+/* Busy-poll parameters of an epoll instance, added in Linux 6.9 */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t  prefer_busy_poll;
+    uint8_t  __pad;
+};
+# define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+/* Packets each NAPI poll may process, the kernel's own default */
+#define BUSY_POLL_BUDGET    8
 
 /*
  * Per-thread epoll event buffer used to ferry data between
- * kevent_wait() and kevent_copyout().
+ * kevent_wait() and kevent_copyout(). Waits for up to MAX_KEVENT events
+ * use a static buffer; larger ones use a heap buffer that is kept for
+ * later calls, and freed when the thread exits.
  */
-static __thread struct epoll_event epevt[MAX_KEVENT];
+static __thread struct epoll_event epevt_static[MAX_KEVENT];
+static __thread struct epoll_event *epevt_heap;
+static __thread size_t epevt_heap_max;
+static __thread struct epoll_event *epevt;
+static pthread_key_t epevt_key;
+static pthread_once_t epevt_key_once = PTHREAD_ONCE_INIT;
+
+/* Nonzero if the last wait found regular files to report; see read.c */
+static __thread int epevt_files;
+
+#if defined(SYS_epoll_pwait2)
+/*
+ * Nonzero if the kernel implements epoll_pwait2(2), which takes a
+ * timespec. Checked once, by the first call to linux_kqueue_init().
+ */
+static int have_epoll_pwait2 = -1;
+#endif
 
 const struct kqueue_vtable kqops = {
     linux_kqueue_init,
@@ -38,7 +68,10 @@ const struct kqueue_vtable kqops = {
     linux_eventfd_close,
     linux_eventfd_raise,
     linux_eventfd_lower,
-    linux_eventfd_descriptor
+    linux_eventfd_descriptor,
+    linux_kevent_flush,
+    linux_kqueue_busy_poll,
+    linux_kqueue_wake
 };
 
 int
@@ -50,10 +83,22 @@ linux_kqueue_init(struct kqueue *kq)
         return (-1);
     }
 
-    if (filter_register_all(kq) < 0) {
-        close(kq->kq_id);
-        return (-1);
+    pthread_mutex_init(&kq->kq_sock_mtx, NULL);
+    pthread_mutex_init(&kq->kq_file_mtx, NULL);
+    TAILQ_INIT(&kq->kq_files);
+    kq->kq_prio_epfd = -1;
+
+#if defined(SYS_epoll_pwait2)
+    if (have_epoll_pwait2 < 0) {
+        struct __kernel_timespec kts = { 0, 0 };
+        struct epoll_event ev;
+
+        have_epoll_pwait2 = (syscall(SYS_epoll_pwait2, kq->kq_id, &ev, 1,
+                    &kts, NULL, 0) >= 0);
+        dbg_printf("epoll_pwait2(2) is %savailable",
+                have_epoll_pwait2 ? "" : "not ");
     }
+#endif
 
 
  #if DEADWOOD
@@ -61,14 +106,14 @@ linux_kqueue_init(struct kqueue *kq)
 
     /* Add each filter's pollable descriptor to the epollset */
     for (i = 0; i < EVFILT_SYSCOUNT; i++) {
-        filt = &kq->kq_filt[i];
+        filt = kq->kq_filt[i];
 
         if (filt->kf_id == 0)
             continue;
 
         memset(&ev, 0, sizeof(ev));
         ev.events = EPOLLIN;
-        ev.data.ptr = filt;
+        ev.data.ptr = epoll_filter_ptr(filt);
 
         if (epoll_ctl(kq->kq_id, EPOLL_CTL_ADD, filt->kf_pfd, &ev) < 0) {
             dbg_perror("epoll_ctl(2)");
@@ -82,9 +127,16 @@ linux_kqueue_init(struct kqueue *kq)
 }
 
 void
-linux_kqueue_free(struct kqueue *kq UNUSED)
+linux_kqueue_free(struct kqueue *kq)
 {
-    abort();//FIXME
+    if (kq->kq_wake_state == 2)
+        kqops.eventfd_close(&kq->kq_wake_efd);
+    if (kq->kq_prio_epfd >= 0)
+        (void) close(kq->kq_prio_epfd);
+    if (kq->kq_id >= 0)
+        (void) close(kq->kq_id);
+    pthread_mutex_destroy(&kq->kq_sock_mtx);
+    pthread_mutex_destroy(&kq->kq_file_mtx);
 }
 
 static int
@@ -126,14 +178,180 @@ linux_kevent_wait_hires(
     return (n);
 }
 
+#if defined(SYS_epoll_pwait2)
+/* Wait with the full precision of the timeout, in a single syscall */
+static int
+linux_kevent_wait_pwait2(
+        struct kqueue *kq,
+        int nevents,
+        const struct timespec *ts)
+{
+    struct __kernel_timespec kts;
+    int nret;
+
+    if (ts != NULL) {
+        kts.tv_sec = ts->tv_sec;
+        kts.tv_nsec = ts->tv_nsec;
+    }
+
+    dbg_puts("waiting for events");
+    nret = syscall(SYS_epoll_pwait2, kqueue_epfd(kq), &epevt[0], nevents,
+            (ts != NULL) ? &kts : NULL, NULL, 0);
+    if (nret < 0) {
+        dbg_perror("epoll_pwait2");
+        return (-1);
+    }
+
+    return (nret);
+}
+#endif
+
+static void
+epevt_key_create(void)
+{
+    if (pthread_key_create(&epevt_key, free) != 0)
+        dbg_puts("pthread_key_create(3) failed");
+}
+
+/*
+ * Point epevt at a buffer with room for *nevents events. If a large
+ * enough buffer cannot be allocated, *nevents is reduced to MAX_KEVENT.
+ */
+static void
+epevt_reserve(int *nevents)
+{
+    struct epoll_event *buf;
+    size_t max;
+
+    if (fastpath(*nevents <= MAX_KEVENT)) {
+        epevt = &epevt_static[0];
+        return;
+    }
+    if ((size_t) *nevents <= epevt_heap_max) {
+        epevt = epevt_heap;
+        return;
+    }
+
+    for (max = 2 * MAX_KEVENT; max < (size_t) *nevents; max *= 2)
+        ;
+    buf = malloc(max * sizeof(*buf));
+    if (buf == NULL) {
+        dbg_perror("malloc(3)");
+        *nevents = MAX_KEVENT;
+        epevt = &epevt_static[0];
+        return;
+    }
+    free(epevt_heap);
+    epevt_heap = buf;
+    epevt_heap_max = max;
+
+    (void) pthread_once(&epevt_key_once, epevt_key_create);
+    (void) pthread_setspecific(epevt_key, epevt_heap);
+
+    dbg_printf("epoll event buffer grown to %zu events", max);
+    epevt = epevt_heap;
+}
+
 int
-linux_kevent_wait(
-        struct kqueue *kq, 
+linux_kqueue_busy_poll(struct kqueue *kq, unsigned int usec)
+{
+    struct epoll_params params;
+
+    kq->kq_busy_max = usec;
+    kq->kq_busy_usec = usec;
+
+    /*
+     * Have the kernel poll the NAPI queues of the sockets in the epoll
+     * set while it waits, if it knows how. Older kernels reject the ioctl,
+     * which leaves the spinning in linux_kevent_spin() alone.
+     */
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = usec;
+    params.busy_poll_budget = (usec > 0) ? BUSY_POLL_BUDGET : 0;
+    if (ioctl(kqueue_epfd(kq), EPIOCSPARAMS, &params) < 0)
+        dbg_perror("ioctl(2) EPIOCSPARAMS");
+
+    return (0);
+}
+
+/*
+ * Spin with non-blocking epoll_wait() calls for up to kq_busy_usec before
+ * the caller blocks, and take the time spent off the timeout. Each spin
+ * that finds nothing halves the next one, and linux_kevent_wait() doubles
+ * it when a blocking wait ends soon enough that a spin would have caught
+ * the event.
+ *
+ * @return the number of events, or 0 if the caller should block
+ */
+static int
+linux_kevent_spin(struct kqueue *kq, int nevents, const struct timespec **ts,
+        struct timespec *remain)
+{
+    uint64_t start, spin, elapsed, timeout = 0;
+    int nret;
+
+    spin = kq->kq_busy_usec * 1000ULL;
+    if (*ts != NULL) {
+        timeout = (*ts)->tv_sec * 1000000000ULL + (*ts)->tv_nsec;
+        if (timeout == 0)
+            return (0);
+        if (spin > timeout)
+            spin = timeout;
+    }
+
+    start = stats_clock();
+    do {
+        nret = epoll_wait(kqueue_epfd(kq), &epevt[0], nevents, 0);
+        if (nret != 0)
+            return (nret);
+        elapsed = stats_clock() - start;
+    } while (elapsed < spin);
+    kq->kq_busy_usec /= 2;
+
+    if (*ts != NULL) {
+        timeout = (elapsed < timeout) ? timeout - elapsed : 0;
+        remain->tv_sec = timeout / 1000000000;
+        remain->tv_nsec = timeout % 1000000000;
+        *ts = remain;
+    }
+    return (0);
+}
+
+/*
+ * Convert a timeout to the milliseconds taken by epoll_wait(2). The
+ * value is rounded up, so a short timeout does not become a poll, and
+ * clamped to INT_MAX, so a long one does not become an infinite wait.
+ */
+int
+linux_timeout_ms(const struct timespec *ts)
+{
+    long long ms;
+
+    if (ts == NULL)
+        return (-1);
+    if (ts->tv_sec < 0)
+        return (0);
+    if (ts->tv_sec >= INT_MAX / 1000)
+        return (INT_MAX);
+    ms = 1000LL * ts->tv_sec + (ts->tv_nsec + 999999) / 1000000;
+
+    return ((ms > INT_MAX) ? INT_MAX : (int) ms);
+}
+
+/* Block until there are events or the timeout expires */
+static int
+linux_kevent_wait_block(
+        struct kqueue *kq,
         int nevents,
         const struct timespec *ts)
 {
     int timeout, nret;
 
+#if defined(SYS_epoll_pwait2)
+    if (have_epoll_pwait2 > 0)
+        return (linux_kevent_wait_pwait2(kq, nevents, ts));
+#endif
+
     /* Use a high-resolution syscall if the timeout value is less than one millisecond.  */
     if (ts != NULL && ts->tv_sec == 0 && ts->tv_nsec > 0 && ts->tv_nsec < 1000000) {
         nret = linux_kevent_wait_hires(kq, ts);
@@ -143,11 +361,7 @@ linux_kevent_wait(
         /* epoll_wait() should have ready events */
         timeout = 0;
     } else {
-        /* Convert timeout to the format used by epoll_wait() */
-        if (ts == NULL) 
-            timeout = -1;
-        else
-            timeout = (1000 * ts->tv_sec) + (ts->tv_nsec / 1000000);
+        timeout = linux_timeout_ms(ts);
     }
 
     dbg_puts("waiting for events");
@@ -160,21 +374,272 @@ linux_kevent_wait(
     return (nret);
 }
 
+static int
+linux_kevent_wait_epoll(
+        struct kqueue *kq, 
+        int nevents,
+        const struct timespec *ts)
+{
+    struct timespec remain;
+    uint64_t start;
+    int nret;
+
+    if (kq->kq_busy_max > 0) {
+        if (kq->kq_busy_usec > 0) {
+            nret = linux_kevent_spin(kq, nevents, &ts, &remain);
+            if (nret != 0)
+                return (nret);
+        }
+        start = stats_clock();
+        nret = linux_kevent_wait_block(kq, nevents, ts);
+
+        /* A spin of the longest length would have seen this event */
+        if (nret > 0 && stats_clock() - start <= kq->kq_busy_max * 1000ULL) {
+            if (kq->kq_busy_usec == 0)
+                kq->kq_busy_usec = 1;
+            else if (kq->kq_busy_usec * 2 <= kq->kq_busy_max)
+                kq->kq_busy_usec *= 2;
+            else
+                kq->kq_busy_usec = kq->kq_busy_max;
+        }
+        return (nret);
+    }
+
+    return (linux_kevent_wait_block(kq, nevents, ts));
+}
+
+/*
+ * Create the nested epoll set that NOTE_PRIORITY knotes are registered
+ * in. It is itself registered in the epoll set of the kqueue, so that a
+ * wait on that wakes up for it. Call with the kqueue lock held.
+ */
+int
+linux_kqueue_prio_init(struct kqueue *kq)
+{
+    struct epoll_event ev;
+    int epfd;
+
+    if (kq->kq_prio_epfd >= 0)
+        return (0);
+
+    epfd = epoll_create(1);
+    if (epfd < 0) {
+        dbg_perror("epoll_create(2)");
+        return (-1);
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = EPOLL_PRIO_PTR;
+    if (epoll_ctl(kqueue_epfd(kq), EPOLL_CTL_ADD, epfd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        close(epfd);
+        return (-1);
+    }
+    atomic_barrier();
+    kq->kq_prio_epfd = epfd;
+    dbg_printf("epfd %d holds the priority knotes", epfd);
+
+    return (0);
+}
+
+/*
+ * Take the event of the nested epoll set out of the <nret> events after
+ * the first <nprio>. If the priority knotes were not collected before
+ * the wait, collect them now, into the slots before the other events.
+ *
+ * @return the number of events after the first <nprio>
+ */
+static int
+linux_kevent_prio(struct kqueue *kq, int nprio, int nret, int nevents)
+{
+    struct epoll_event *ev = &epevt[nprio];
+    int i, room, n;
+
+    for (i = 0; i < nret; i++) {
+        if (ev[i].data.ptr == EPOLL_PRIO_PTR)
+            break;
+    }
+    if (i == nret)
+        return (nret);
+    ev[i] = ev[--nret];
+
+    /* The ones that became ready since are reported by the next wait */
+    if (nprio > 0)
+        return (nret);
+
+    room = nevents - nret;
+    memmove(&epevt[room], &epevt[0], nret * sizeof(epevt[0]));
+    n = epoll_wait(kq->kq_prio_epfd, &epevt[0], room, 0);
+    if (n < 0) {
+        dbg_perror("epoll_wait");
+        n = 0;
+    }
+    if (n < room)
+        memmove(&epevt[n], &epevt[room], nret * sizeof(epevt[0]));
+
+    return (n + nret);
+}
+
+/*
+ * The buffer for a wait of up to <*nevents> events that is submitted
+ * before linux_kevent_wait() is called, or NULL if the wait has to be
+ * done there, because regular files or NOTE_PRIORITY knotes are
+ * collected first. Called with the kqueue locked.
+ */
+struct epoll_event *
+linux_kevent_wait_buffer(struct kqueue *kq, int *nevents)
+{
+    if (kq->kq_prio_epfd >= 0 || linux_file_pending(kq))
+        return (NULL);
+    epevt_reserve(nevents);
+    return (epevt);
+}
+
+/*
+ * Readable regular files are not in the epoll set, so the wait does not
+ * block while there are any, and they count as one more event. One slot
+ * of the eventlist is kept for them, so that a busy epoll set cannot
+ * starve them.
+ *
+ * The events of NOTE_PRIORITY knotes are collected from their own epoll
+ * set first, and the rest of the eventlist is filled from the epoll set
+ * of the kqueue. A burst of other events then never holds them back for
+ * a whole eventlist.
+ */
+int
+linux_kevent_wait(
+        struct kqueue *kq, 
+        int nevents,
+        const struct timespec *ts)
+{
+    static const struct timespec zero = { 0, 0 };
+    struct epoll_event *buf;
+    int nprio = 0, nret;
+
+    /* The wait went in with the changes; see linux_kevent_flush() */
+    if (epoll_batch_deferred()) {
+        epevt_files = 0;
+        return (epoll_batch_wait(kq, &epevt[0], nevents, ts));
+    }
+
+    epevt_reserve(&nevents);
+
+    epevt_files = linux_file_pending(kq);
+    if (epevt_files) {
+        ts = &zero;
+        if (nevents > 1)
+            nevents--;
+    }
+
+    if (slowpath(kq->kq_prio_epfd >= 0)) {
+        nprio = epoll_wait(kq->kq_prio_epfd, &epevt[0], nevents, 0);
+        if (nprio < 0) {
+            dbg_perror("epoll_wait");
+            nprio = 0;
+        }
+        if (nprio == nevents)
+            return (nprio + epevt_files);
+        if (nprio > 0)
+            ts = &zero;
+    }
+
+    buf = epevt;
+    epevt += nprio;
+    nret = linux_kevent_wait_epoll(kq, nevents - nprio, ts);
+    epevt = buf;
+    if (nret < 0) {
+        if (nprio == 0)
+            return (nret);
+        nret = 0;
+    }
+    if (slowpath(kq->kq_prio_epfd >= 0))
+        nret = linux_kevent_prio(kq, nprio, nret, nevents);
+
+    return (nprio + nret + epevt_files);
+}
+
 int
 linux_kevent_copyout(struct kqueue *kq, int nready,
-        struct kevent *eventlist, int nevents UNUSED)
+        struct kevent *eventlist, int nevents)
 {
+    struct kevent *start = eventlist;
     struct epoll_event *ev;
-    struct filter *filt;
+    struct filter *filt = NULL;
     struct knote *kn;
     int i, nret, rv;
 
+    nready -= epevt_files;
+
     nret = nready;
     for (i = 0; i < nready; i++) {
         ev = &epevt[i];
+
+        /*
+         * A wakeup for kevent_post(); the caller applies the changes. The
+         * nested epoll set is only seen here if the wait raced with its
+         * creation, and its events are collected by the next wait.
+         */
+        if (slowpath(ev->data.ptr == EPOLL_WAKE_PTR
+                    || ev->data.ptr == EPOLL_PRIO_PTR)) {
+            if (ev->data.ptr == EPOLL_WAKE_PTR)
+                (void) kqops.eventfd_lower(&kq->kq_wake_efd);
+            nret--;
+            continue;
+        }
+
+        /* 
+         * An event on a descriptor shared by the knotes of a filter
+         * becomes any number of kevents, leaving room for the rest.
+         */
+        if (epoll_event_is_filter(ev)) {
+            filt = epoll_event_filter(ev);
+            filter_lock(filt);
+            rv = filt->kf_copyout_filter(filt, eventlist,
+                    nevents - (eventlist - start) - (nready - i - 1));
+            filter_unlock(filt);
+            if (slowpath(rv < 0)) {
+                dbg_puts("kf_copyout_filter failed");
+                abort();
+            }
+            eventlist += rv;
+            nret += rv - 1;
+            continue;
+        }
+
+        /* The read and write knotes of a descriptor share a registration */
+        if (epoll_event_is_shared(ev)) {
+            rv = linux_socket_copyout(kq, eventlist,
+                    nevents - (eventlist - start) - (nready - i - 1), ev);
+            eventlist += rv;
+            nret += rv - 1;
+            continue;
+        }
+
+        /*
+         * Another thread may have deleted or disabled the knote after
+         * epoll reported it; the event is then discarded. The knote is
+         * not freed before this thread leaves kevent(), see epoch.c.
+         */
         kn = (struct knote *) ev->data.ptr;
-        filt = &kq->kq_filt[~(kn->kev.filter)];
-        rv = filt->kf_copyout(eventlist, kn, ev);
+        if (slowpath(!knote_tryretain(kn))) {
+            stats_spurious(kq);
+            nret--;
+            continue;
+        }
+        knote_lock(kn);
+        if (slowpath(kn->kn_flags & KNFL_KNOTE_DELETED 
+                    || kn->kev.flags & EV_DISABLE)) {
+            knote_unlock(kn);
+            knote_release(kn);
+            stats_spurious(kq);
+            nret--;
+            continue;
+        }
+
+        /* Consecutive events are usually for the same filter */
+        if (filt == NULL || filt->kf_id != kn->kev.filter)
+            filt = kq->kq_filt[~(kn->kev.filter)];
+        rv = linux_filter_copyout(filt, eventlist, kn, ev);
         if (slowpath(rv < 0)) {
             dbg_puts("knote_copyout failed");
             /* XXX-FIXME: hard to handle this without losing events */
@@ -185,11 +650,17 @@ linux_kevent_copyout(struct kqueue *kq, int nready,
          * Certain flags cause the associated knote to be deleted
          * or disabled.
          */
-        if (eventlist->flags & EV_DISPATCH) 
-            knote_disable(filt, kn); //FIXME: Error checking
-        if (eventlist->flags & EV_ONESHOT) {
-            knote_delete(filt, kn); //FIXME: Error checking
+        if (slowpath(eventlist->flags & (EV_DISPATCH | EV_ONESHOT))) {
+            if (eventlist->flags & EV_DISPATCH) 
+                knote_disable(filt, kn); //FIXME: Error checking
+            if (eventlist->flags & EV_ONESHOT)
+                knote_delete(filt, kn); //FIXME: Error checking
+        } else if (slowpath(kn->kn_flags & KNFL_COALESCE)) {
+            /* Disarmed like EV_DISPATCH, but armed again after a delay */
+            linux_socket_coalesce(filt, kn);
         }
+        knote_unlock(kn);
+        knote_release(kn);
 
         /* If an empty kevent structure is returned, the event is discarded. */
         /* TODO: add these semantics to windows + solaris platform.c */
@@ -197,13 +668,53 @@ linux_kevent_copyout(struct kqueue *kq, int nready,
             eventlist++;
         } else {
             dbg_puts("spurious wakeup, discarding event");
+            stats_spurious(kq);
             nret--;
         }
     }
 
+    if (epevt_files) {
+        epevt_files = 0;
+        nret += linux_file_copyout(kq, eventlist, nevents - (eventlist - start));
+    }
+
     return (nret);
 }
 
+/*
+ * Wake a thread waiting on the kqueue, so that it applies the changes
+ * queued by kevent_post(). The eventfd is set up the first time; a thread
+ * that finds another one doing that can rely on it raising the eventfd.
+ */
+int
+linux_kqueue_wake(struct kqueue *kq)
+{
+    struct epoll_event ev;
+
+    if (slowpath(kq->kq_wake_state != 2)) {
+        if (atomic_cas(&kq->kq_wake_state, 0, 1) != 0)
+            return (0);
+        if (kqops.eventfd_init(&kq->kq_wake_efd) < 0) {
+            kq->kq_wake_state = 0;
+            return (-1);
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = EPOLL_WAKE_PTR;
+        if (epoll_ctl(kqueue_epfd(kq), EPOLL_CTL_ADD,
+                    kqops.eventfd_descriptor(&kq->kq_wake_efd), &ev) < 0) {
+            dbg_perror("epoll_ctl(2)");
+            kqops.eventfd_close(&kq->kq_wake_efd);
+            kq->kq_wake_state = 0;
+            return (-1);
+        }
+        atomic_barrier();
+        kq->kq_wake_state = 2;
+    }
+
+    return (kqops.eventfd_raise(&kq->kq_wake_efd));
+}
+
 int
 linux_eventfd_init(struct eventfd *e)
 {
@@ -360,6 +871,7 @@ epoll_event_dump(struct epoll_event *evt)
 #endif
     EPEVT_DUMP(EPOLLONESHOT);
     EPEVT_DUMP(EPOLLET);
+    EPEVT_DUMP(EPOLLEXCLUSIVE);
     strcat(&buf[0], "}\n");
 
     return (&buf[0]);
@@ -371,7 +883,9 @@ epoll_update(int op, struct filter *filt, struct knote *kn, struct epoll_event *
 {
     dbg_printf("op=%d fd=%d events=%s", op, (int)kn->kev.ident, 
             epoll_event_dump(ev));
-    if (epoll_ctl(filter_epfd(filt), op, kn->kev.ident, ev) < 0) {
+    if (epoll_batch_add(op, filt, kn, ev))
+        return (0);
+    if (epoll_ctl(knote_epfd(filt, kn), op, kn->kev.ident, ev) < 0) {
         dbg_printf("epoll_ctl(2): %s", strerror(errno));
         return (-1);
     }
@@ -18,11 +18,20 @@
 #define  _KQUEUE_LINUX_PLATFORM_H
 
 struct filter;
+struct kevent_error;
+struct proc_watch;
 
 #include <sys/syscall.h>
 #include <sys/epoll.h>
+#ifndef EPOLLRDHUP
+# define EPOLLRDHUP 0x2000
+#endif
+#ifndef EPOLLEXCLUSIVE
+# define EPOLLEXCLUSIVE (1U << 28)
+#endif
 #include <sys/queue.h>
 #include <sys/inotify.h>
+#include <linux/time_types.h>
 #if HAVE_SYS_EVENTFD_H
 # include <sys/eventfd.h>
 #else
@@ -53,6 +62,39 @@ extern long int syscall (long int __sysno, ...);
 #define kqueue_epfd(kq)     ((kq)->kq_id)
 #define filter_epfd(filt)   ((filt)->kf_kqueue->kq_id)
 
+/* The epoll set that holds the registration of a knote */
+#define knote_epfd(filt, kn) \
+    (((kn)->kn_flags & KNFL_PRIORITY) ? (filt)->kf_kqueue->kq_prio_epfd : filter_epfd(filt))
+
+/* 
+ * Set in the data.ptr of a descriptor that is registered by a filter
+ * rather than by a knote. The rest of the pointer is the filter.
+ */
+#define EPOLL_FILTER_TAG    2
+#define epoll_filter_ptr(filt) ((void *) ((uintptr_t) (filt) | EPOLL_FILTER_TAG))
+#define epoll_event_is_filter(ev) ((uintptr_t) (ev)->data.ptr & EPOLL_FILTER_TAG)
+#define epoll_event_filter(ev) \
+    ((struct filter *) ((uintptr_t) (ev)->data.ptr & ~(uintptr_t) EPOLL_FILTER_TAG))
+
+/* The data.ptr of the eventfd that linux_kqueue_wake() raises */
+#define EPOLL_WAKE_PTR      epoll_filter_ptr(NULL)
+
+/* The data.ptr of the nested epoll set of NOTE_PRIORITY knotes */
+#define EPOLL_PRIO_PTR      epoll_filter_ptr(4)
+
+/*
+ * Set in the data.ptr of a registration that is shared by the read and
+ * write knotes of a descriptor. The rest of the pointer is the read knote.
+ */
+#define EPOLL_PEER_TAG      1
+#define epoll_event_is_shared(ev) ((uintptr_t) (ev)->data.ptr & EPOLL_PEER_TAG)
+
+/* linux_kevent_copyout() does its own locking */
+#define KQUEUE_FINE_GRAINED_LOCKING 1
+
+/* linux_kevent_wait() is not limited to MAX_KEVENT events */
+#define KQUEUE_UNLIMITED_NEVENTS 1
+
 /*
  * Additional members of struct filter
  */
@@ -63,28 +105,101 @@ extern long int syscall (long int __sysno, ...);
  */
 #define KNOTE_PLATFORM_SPECIFIC \
     int kn_epollfd; /* A copy of filter->epfd */      \
+    struct knote *kn_peer; /* Shares the epoll registration */ \
     union { \
         int kn_timerfd; \
         int kn_signalfd; \
         int kn_inotifyfd; \
         int kn_eventfd; \
+        int kn_pidfd; \
+        struct proc_watch *kn_proc; /* With the proc connector; see proc.c */ \
+        TAILQ_ENTRY(knote) kn_ready; /* On kq_files; see read.c */ \
+        struct timer_entry kn_rearm; /* NOTE_COALESCE; see socket.c */ \
     } kdata
 
 /*
  * Additional members of struct kqueue
  */
 #define KQUEUE_PLATFORM_SPECIFIC \
-    struct epoll_event kq_plist[MAX_KEVENT]; \
-    size_t kq_nplist
+    pthread_mutex_t kq_sock_mtx; /* Used by socket.c */ \
+    pthread_mutex_t kq_file_mtx; /* Protects kq_files */ \
+    TAILQ_HEAD(, knote) kq_files; /* Readable regular files */ \
+    unsigned int kq_nfiles; /* Length of kq_files */ \
+    unsigned int kq_busy_max; /* Longest spin before a wait, in usec */ \
+    volatile unsigned int kq_busy_usec; /* Current spin, adapted to hits */ \
+    struct eventfd kq_wake_efd; /* Raised by linux_kqueue_wake() */ \
+    volatile uint32_t kq_wake_state; /* 0, 1 while kq_wake_efd is set up, or 2 */ \
+    int kq_prio_epfd /* Nested epoll set of NOTE_PRIORITY knotes, or -1 */
+
+#if HAVE_LINUX_IO_URING_H
+/* An io_uring instance; see uring.c */
+struct uring {
+    int                  ur_fd;
+    unsigned             ur_tail;        /* Local copy of *ur_sq_tail */
+    unsigned            *ur_sq_head;
+    unsigned            *ur_sq_tail;
+    unsigned            *ur_sq_mask;
+    unsigned            *ur_sq_array;
+    struct io_uring_sqe *ur_sqes;
+    unsigned            *ur_cq_head;
+    unsigned            *ur_cq_tail;
+    unsigned            *ur_cq_mask;
+    struct io_uring_cqe *ur_cqes;
+    void                *ur_sq_ring;
+    size_t               ur_sq_ring_sz;
+    void                *ur_cq_ring;
+    size_t               ur_cq_ring_sz;
+    size_t               ur_sqes_sz;
+};
+
+int     uring_setup(struct uring *, unsigned);
+void    uring_free(struct uring *);
+struct io_uring_sqe *uring_get_sqe(struct uring *);
+unsigned uring_submit(struct uring *, unsigned, unsigned);
+#endif
 
 int     linux_kqueue_init(struct kqueue *);
 void    linux_kqueue_free(struct kqueue *);
 
 int     linux_kevent_wait(struct kqueue *, int, const struct timespec *);
+int     linux_timeout_ms(const struct timespec *);
 int     linux_kevent_copyout(struct kqueue *, int, struct kevent *, int);
+int     linux_kevent_flush(struct kqueue *, struct kevent_error **, int,
+                const struct timespec *);
+struct epoll_event *linux_kevent_wait_buffer(struct kqueue *, int *);
+int     linux_kqueue_busy_poll(struct kqueue *, unsigned int);
 
 int     linux_knote_copyout(struct kevent *, struct knote *);
 
+int     linux_socket_register(struct filter *, struct knote *);
+int     linux_socket_unregister(struct filter *, struct knote *);
+int     linux_socket_enable(struct filter *, struct knote *);
+int     linux_socket_disable(struct filter *, struct knote *);
+int     linux_socket_copyout(struct kqueue *, struct kevent *, int, struct epoll_event *);
+void    linux_socket_coalesce(struct filter *, struct knote *);
+void    linux_socket_lowat(struct kevent *, struct knote *,
+            const struct epoll_event *);
+int     linux_socket_rearm(struct filter *, struct kevent *, int);
+void    linux_socket_destroy(struct filter *);
+
+int     linux_file_pending(struct kqueue *);
+int     linux_file_copyout(struct kqueue *, struct kevent *, int);
+
+int     evfilt_read_copyout(struct kevent *, struct knote *, void *);
+int     evfilt_socket_copyout(struct kevent *, struct knote *, void *);
+
+/*
+ * Copy out the event of a knote. The read and write filters are always
+ * built here, so their events are copied out by a direct call instead of
+ * going through the struct filter.
+ */
+#define linux_filter_copyout(filt, dst, kn, ev) \
+    ((kn)->kev.filter == EVFILT_READ ? evfilt_read_copyout((dst), (kn), (ev)) \
+     : (kn)->kev.filter == EVFILT_WRITE ? evfilt_socket_copyout((dst), (kn), (ev)) \
+     : (filt)->kf_copyout((dst), (kn), (ev)))
+
+int     linux_kqueue_wake(struct kqueue *);
+int     linux_kqueue_prio_init(struct kqueue *);
 int     linux_eventfd_init(struct eventfd *);
 void    linux_eventfd_close(struct eventfd *);
 int     linux_eventfd_raise(struct eventfd *);
@@ -100,5 +215,8 @@ int     linux_fd_to_path(char *, size_t, int);
 
 int     epoll_update(int, struct filter *, struct knote *, struct epoll_event *);
 char *  epoll_event_dump(struct epoll_event *);
+int     epoll_batch_add(int, struct filter *, struct knote *, struct epoll_event *);
+int     epoll_batch_deferred(void);
+int     epoll_batch_wait(struct kqueue *, struct epoll_event *, int, const struct timespec *);
 
 #endif  /* ! _KQUEUE_LINUX_PLATFORM_H */
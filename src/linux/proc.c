@@ -15,223 +15,951 @@
  */
 
 #include <errno.h>
-#include <err.h>
 #include <fcntl.h>
-#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
-#include <stdio.h>
-#include <sys/queue.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <string.h>
 #include <unistd.h>
 
-#include <limits.h>
-#include <sys/inotify.h>
-#include <sys/epoll.h>
-
 #include "sys/event.h"
 #include "private.h"
 
+#if HAVE_LINUX_CN_PROC_H
+# include <linux/cn_proc.h>
+# include <linux/connector.h>
+# include <linux/netlink.h>
+# include <poll.h>
+# include <pthread.h>
+# include <sys/socket.h>
+#endif
+
+/*
+ * Each watched process is represented by a pidfd, which becomes readable
+ * when the process exits. There are no helper threads; the exit status is
+ * read with waitid(2) and WNOWAIT, so the process is left for the
+ * application to reap.
+ *
+ * When KQUEUE_PROC_CONNECTOR is set in the environment, or the first
+ * knote of a filter has NOTE_TRACK, the events come from the netlink proc
+ * connector instead, which also reports forks and execs. The process has
+ * one netlink socket, which is read by a thread of its own: the watched
+ * processes are found in a table shared by every kqueue, and their events
+ * are queued on the pending list of the filter that watches them, whose
+ * eventfd is then raised. A kqueue is thus only woken for its own events.
+ * Both are protected by proc_cn.mtx, which ranks below the filter and
+ * knote locks.
+ *
+ * With NOTE_TRACK, a fork adds a watch for the child right away, so that
+ * its own events are not missed, and its knote is added through
+ * kevent_post_changes() with NOTE_CHILD in fflags; the knote adopts the
+ * watch and reports NOTE_CHILD, with the parent in data. Subscribing
+ * needs CAP_NET_ADMIN in the initial network namespace; if that fails,
+ * pidfds are used, and NOTE_TRACK is rejected.
+ */
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+static int
+pidfd_open(pid_t pid)
+{
+#if defined(SYS_pidfd_open)
+    return ((int) syscall(SYS_pidfd_open, pid, 0));
+#else
+    (void) pid;
+    errno = ENOSYS;
+    return (-1);
+#endif
+}
+
+/* The status of an exited process, in the format used by wait(2) */
+static int
+proc_status(const siginfo_t *si)
+{
+    switch (si->si_code) {
+    case CLD_EXITED:
+        return ((si->si_status & 0xff) << 8);
+    case CLD_KILLED:
+        return (si->si_status & 0x7f);
+    case CLD_DUMPED:
+        return ((si->si_status & 0x7f) | 0x80);
+    default:
+        return (0);
+    }
+}
+
+int
+evfilt_proc_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
+{
+    siginfo_t si;
+
+    memcpy(dst, &src->kev, sizeof(*dst));
+
+    /* The exit is the only event that is reported */
+    dst->fflags &= NOTE_EXIT;
+    dst->flags |= EV_EOF | EV_ONESHOT;
+
+    /* On return, data contains the status in the format used by wait(2) */
+    memset(&si, 0, sizeof(si));
+    if (waitid(P_PIDFD, src->kdata.kn_pidfd, &si, 
+                WEXITED | WNOWAIT | WNOHANG) < 0) {
+        /* Not a child of this process, or it has been reaped already */
+        dbg_perror("waitid(2)");
+        dst->data = 0;
+        return (0);
+    }
+    dst->data = proc_status(&si);
+
+    return (0);
+}
 
-/* XXX-FIXME Should only have one wait_thread per process.
-   Now, there is one thread per kqueue
+/*
+ * The knotes of an inherited kqueue are not deleted, because their
+ * registrations are shared with the parent; close the pidfds they hold.
  */
+static void
+proc_close_pidfds(struct filter *filt)
+{
+    struct knote **kn;
+    int i, n;
+
+    if (!filt->kf_kqueue->kq_inherited || filt->kf_knote_count == 0)
+        return;
+    kn = malloc(filt->kf_knote_count * sizeof(*kn));
+    if (kn == NULL)
+        return;
+    n = knote_list(filt, kn, filt->kf_knote_count);
+    for (i = 0; i < n; i++) {
+        if (kn[i]->kdata.kn_pidfd >= 0)
+            (void) close(kn[i]->kdata.kn_pidfd);
+    }
+    free(kn);
+}
+
+#if HAVE_LINUX_CN_PROC_H
+
+/* Buckets of the table of watched processes; a power of two */
+#define PROC_HASH_SIZE  1024
+#define proc_hash(pid)  (&proc_cn.table[(unsigned int) (pid) & (PROC_HASH_SIZE - 1)])
+
+/* Most messages read from the socket before the lock is dropped */
+#define PROC_DRAIN_MAX  256
+
+/* How long to wait for the kernel to acknowledge the subscription */
+#define PROC_ACK_MSEC   1000
+
+/* A process watched through the proc connector */
+struct proc_watch {
+    pid_t              pw_pid;
+    struct proc_watch *pw_next;     /* Next watch in the same bucket */
+    TAILQ_ENTRY(proc_watch) pw_pend; /* On the pending list of pw_filt */
+    struct filter     *pw_filt;
+    struct knote      *pw_kn;       /* NULL until a child's knote adopts it */
+    struct kevent      pw_kev;      /* Copied into the knotes of children */
+    uint32_t           pw_pending;  /* NOTE_ flags not yet copied out */
+    int                pw_queued;   /* Nonzero while on the pending list */
+    int                pw_status;   /* Of the exit, as for wait(2) */
+    pid_t              pw_ppid;     /* The parent, for NOTE_CHILD */
+};
+
 struct evfilt_data {
-    pthread_t       wthr_id;
-    pthread_cond_t   wait_cond;
-    pthread_mutex_t  wait_mtx;
+    int                evfd;
+    int                raised;      /* The eventfd is readable */
+    TAILQ_HEAD(, proc_watch) pend;
 };
 
-//FIXME: WANT: static void *
-void *
-wait_thread(void *arg)
+static struct {
+    pthread_mutex_t    mtx;
+    int                fd;          /* The netlink socket, or -1 */
+    pid_t              pid;         /* The process that opened it */
+    pid_t              failed;      /* The process that could not */
+    int                atfork;      /* The fork handlers are installed */
+    struct proc_watch *table[PROC_HASH_SIZE];
+} proc_cn = { PTHREAD_MUTEX_INITIALIZER, -1, 0, 0, 0, { NULL } };
+
+static void
+proc_cn_lock(void)
 {
-    struct filter *filt = (struct filter *) arg;
-    uint64_t counter = 1;
-    const int options = WEXITED | WNOWAIT; 
-    struct knote *kn;
-    siginfo_t si;
-    sigset_t sigmask;
+    pthread_mutex_lock(&proc_cn.mtx);
+}
 
-    /* Block all signals */
-    sigfillset (&sigmask);
-    pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+static void
+proc_cn_unlock(void)
+{
+    pthread_mutex_unlock(&proc_cn.mtx);
+}
 
-    for (;;) {
+/* Send a PROC_CN_MCAST_ op to the connector */
+static int
+proc_cn_send(int fd, enum proc_cn_mcast_op op)
+{
+    union {
+        struct nlmsghdr nh;
+        char           buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(op))];
+    } msg;
+    struct cn_msg *cn;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+    msg.nh.nlmsg_type = NLMSG_DONE;
+    msg.nh.nlmsg_pid = getpid();
+    cn = (struct cn_msg *) NLMSG_DATA(&msg.nh);
+    cn->id.idx = CN_IDX_PROC;
+    cn->id.val = CN_VAL_PROC;
+    cn->len = sizeof(op);
+    memcpy(cn->data, &op, sizeof(op));
+
+    if (send(fd, &msg, msg.nh.nlmsg_len, 0) < 0) {
+        dbg_perror("send(2) to the proc connector");
+        return (-1);
+    }
+    return (0);
+}
+
+/* The proc_event of a message, which is not aligned in the buffer */
+static void
+proc_cn_copy(struct proc_event *pe, const struct nlmsghdr *nh)
+{
+    const struct cn_msg *cn = (const struct cn_msg *) NLMSG_DATA(nh);
+
+    memset(pe, 0, sizeof(*pe));
+    memcpy(pe, cn->data, cn->len < sizeof(*pe) ? cn->len : sizeof(*pe));
+}
 
-        /* Wait for a child process to exit(2) */
-        if (waitid(P_ALL, 0, &si, options) != 0) {
-            if (errno == ECHILD) {
-                dbg_puts("got ECHILD, waiting for wakeup condition");
-                pthread_mutex_lock(&filt->kf_data->wait_mtx);
-                pthread_cond_wait(&filt->kf_data->wait_cond, &filt->kf_data->wait_mtx);
-                pthread_mutex_unlock(&filt->kf_data->wait_mtx);
-                dbg_puts("awoken from ECHILD-induced sleep");
+/* Wait for the kernel to acknowledge the subscription */
+static int
+proc_cn_ack(int fd)
+{
+    union {
+        struct nlmsghdr nh;
+        char           buf[1024];
+    } msg;
+    struct nlmsghdr *nh;
+    struct proc_event pe;
+    struct pollfd pfd;
+    ssize_t n;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, PROC_ACK_MSEC) == 1) {
+        if ((n = recv(fd, &msg, sizeof(msg), 0)) < 0)
+            break;
+        for (nh = &msg.nh; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+            proc_cn_copy(&pe, nh);
+            if (pe.what != PROC_EVENT_NONE)
                 continue;
+            if (pe.event_data.ack.err != 0) {
+                errno = pe.event_data.ack.err;
+                return (-1);
             }
+            return (0);
+        }
+    }
+    errno = ETIMEDOUT;
+    return (-1);
+}
 
-            dbg_puts("  waitid(2) returned");
-            if (errno == EINTR)
-                continue;
-            dbg_perror("waitid(2)");
-            break; 
+/* Queue a watch that has events; call with proc_cn.mtx held */
+static void
+proc_queue(struct proc_watch *pw)
+{
+    struct evfilt_data *ed = pw->pw_filt->kf_data;
+
+    if (pw->pw_queued || pw->pw_kn == NULL || pw->pw_pending == 0)
+        return;
+    TAILQ_INSERT_TAIL(&ed->pend, pw, pw_pend);
+    pw->pw_queued = 1;
+    if (!ed->raised) {
+        if (eventfd_write(ed->evfd, 1) < 0) {
+            dbg_perror("eventfd_write(3)");
+            return;
+        }
+        ed->raised = 1;
+    }
+}
+
+static void
+proc_note(struct proc_watch *pw, uint32_t fflags)
+{
+    pw->pw_pending |= fflags;
+    proc_queue(pw);
+}
+
+static void
+proc_link(struct proc_watch *pw)
+{
+    struct proc_watch **head = proc_hash(pw->pw_pid);
+
+    pw->pw_next = *head;
+    *head = pw;
+}
+
+static void
+proc_unlink(struct proc_watch *pw)
+{
+    struct proc_watch **pp;
+
+    for (pp = proc_hash(pw->pw_pid); *pp != NULL; pp = &(*pp)->pw_next) {
+        if (*pp == pw) {
+            *pp = pw->pw_next;
+            break;
         }
+    }
+    if (pw->pw_queued) {
+        TAILQ_REMOVE(&((struct evfilt_data *) pw->pw_filt->kf_data)->pend,
+                pw, pw_pend);
+        pw->pw_queued = 0;
+    }
+}
 
-        /* Scan the wait queue to see if anyone is interested */
-        kn = knote_lookup(filt, si.si_pid);
-        if (kn == NULL) 
-            continue;
+/* Watch the child of a NOTE_TRACK process; call with proc_cn.mtx held */
+static void
+proc_track(struct proc_watch *parent, pid_t pid)
+{
+    struct proc_watch *pw;
+    struct kevent kev;
+
+    pw = calloc(1, sizeof(*pw));
+    if (pw == NULL) {
+        proc_note(parent, NOTE_TRACKERR);
+        return;
+    }
+    pw->pw_pid = pid;
+    pw->pw_filt = parent->pw_filt;
+    pw->pw_kev = parent->pw_kev;
+    pw->pw_kev.ident = pid;
+    pw->pw_pending = NOTE_CHILD;
+    pw->pw_ppid = parent->pw_pid;
+
+    /* The kqueue cannot go away while its filter has watches */
+    EV_SET(&kev, pid, EVFILT_PROC,
+            EV_ADD | (parent->pw_kev.flags & (EV_CLEAR | EV_ONESHOT | EV_DISPATCH)),
+            parent->pw_kev.fflags | NOTE_CHILD, parent->pw_pid,
+            parent->pw_kev.udata);
+    if (kevent_post_changes(pw->pw_filt->kf_kqueue, &kev, 1) < 0) {
+        dbg_perror("kevent_post_changes()");
+        free(pw);
+        proc_note(parent, NOTE_TRACKERR);
+        return;
+    }
+    proc_link(pw);
+    dbg_printf("tracking pid %d, the child of %d", (int) pid, (int) parent->pw_pid);
+}
+
+static void
+proc_cn_event(const struct proc_event *pe)
+{
+    struct proc_watch *pw;
+    pid_t pid, child = 0;
+    uint32_t fflags;
+
+    switch (pe->what) {
+    case PROC_EVENT_FORK:
+        /* A new thread is reported as well */
+        if (pe->event_data.fork.child_pid != pe->event_data.fork.child_tgid)
+            return;
+        pid = pe->event_data.fork.parent_tgid;
+        child = pe->event_data.fork.child_tgid;
+        fflags = NOTE_FORK;
+        break;
+    case PROC_EVENT_EXEC:
+        pid = pe->event_data.exec.process_tgid;
+        fflags = NOTE_EXEC;
+        break;
+    case PROC_EVENT_EXIT:
+        /* Take the exit of the main thread for that of the process */
+        if (pe->event_data.exit.process_pid != pe->event_data.exit.process_tgid)
+            return;
+        pid = pe->event_data.exit.process_tgid;
+        fflags = NOTE_EXIT;
+        break;
+    default:
+        return;
+    }
 
-        /* Create a proc_event */
-        if (si.si_code == CLD_EXITED) {
-            kn->kev.data = si.si_status;
-        } else if (si.si_code == CLD_KILLED) {
-            /* FIXME: probably not true on BSD */
-            /* FIXME: arbitrary non-zero number */
-            kn->kev.data = 254; 
+    /* A watch added for a tracked child goes at the head of the bucket */
+    for (pw = *proc_hash(pid); pw != NULL; pw = pw->pw_next) {
+        if (pw->pw_pid != pid)
+            continue;
+        if (fflags == NOTE_EXIT) {
+            pw->pw_status = pe->event_data.exit.exit_code;
+            proc_note(pw, NOTE_EXIT);
         } else {
-            /* Should never happen. */
-            /* FIXME: arbitrary non-zero number */
-            kn->kev.data = 1; 
+            if (child != 0 && pw->pw_kev.fflags & NOTE_TRACK)
+                proc_track(pw, child);
+            if (pw->pw_kev.fflags & fflags)
+                proc_note(pw, fflags);
         }
+    }
+}
 
-        knote_enqueue(filt, kn);
+/* Whether a watched process has exited; sets the status if it is known */
+static int
+proc_exited(pid_t pid, int *status)
+{
+    siginfo_t si;
 
-        /* Indicate read(2) readiness */
-        if (write(filt->kf_pfd, &counter, sizeof(counter)) < 0) {
-            if (errno != EAGAIN) {
-                dbg_printf("write(2): %s", strerror(errno));
-                /* TODO: set filter error flag */
-                break;
-                }
-        }
+    memset(&si, 0, sizeof(si));
+    if (waitid(P_PID, pid, &si, WEXITED | WNOWAIT | WNOHANG) == 0) {
+        if (si.si_pid != pid)
+            return (0);
+        *status = proc_status(&si);
+        return (1);
     }
 
-    /* TODO: error handling */
+    /* Not a child of this process */
+    *status = 0;
+    return (kill(pid, 0) < 0 && errno == ESRCH);
+}
+
+/*
+ * Messages were dropped because the socket buffer was full. Find the
+ * watched processes that have exited since, and tell the tracked ones
+ * that their children may have been missed.
+ */
+static void
+proc_cn_resync(void)
+{
+    struct proc_watch *pw;
+    int i, status;
+
+    for (i = 0; i < PROC_HASH_SIZE; i++) {
+        for (pw = proc_cn.table[i]; pw != NULL; pw = pw->pw_next) {
+            if (pw->pw_kev.fflags & NOTE_TRACK)
+                proc_note(pw, NOTE_TRACKERR);
+            if (!(pw->pw_pending & NOTE_EXIT) && proc_exited(pw->pw_pid, &status)) {
+                pw->pw_status = status;
+                proc_note(pw, NOTE_EXIT);
+            }
+        }
+    }
+}
 
-    return (NULL);
+/* Read the queued messages; call with proc_cn.mtx held */
+static void
+proc_cn_drain(void)
+{
+    union {
+        struct nlmsghdr nh;
+        char           buf[4096];
+    } msg;
+    struct nlmsghdr *nh;
+    struct proc_event pe;
+    struct cn_msg *cn;
+    ssize_t n;
+    int reads;
+
+    for (reads = 0; reads < PROC_DRAIN_MAX; reads++) {
+        n = recv(proc_cn.fd, &msg, sizeof(msg), 0);
+        if (n < 0) {
+            if (errno == ENOBUFS) {
+                dbg_puts("proc connector messages were dropped");
+                proc_cn_resync();
+                continue;
+            }
+            if (errno != EAGAIN && errno != EINTR)
+                dbg_perror("recv(2) from the proc connector");
+            return;
+        }
+        for (nh = &msg.nh; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+            if (nh->nlmsg_type != NLMSG_DONE)
+                continue;
+            cn = (struct cn_msg *) NLMSG_DATA(nh);
+            if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+                continue;
+            proc_cn_copy(&pe, nh);
+            proc_cn_event(&pe);
+        }
+    }
 }
 
-int
-evfilt_proc_init(struct filter *filt)
+/* Read the socket for every kqueue of the process */
+static void *
+proc_cn_thread(void *arg)
 {
-#if FIXME
-    struct evfilt_data *ed;
-    int efd = -1;
+    struct pollfd pfd;
+
+    pfd.fd = (int) (intptr_t) arg;
+    pfd.events = POLLIN;
+    for (;;) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            dbg_perror("poll(2) of the proc connector");
+            return (NULL);
+        }
+        pthread_mutex_lock(&proc_cn.mtx);
+        proc_cn_drain();
+        pthread_mutex_unlock(&proc_cn.mtx);
+    }
+}
 
-    if ((ed = calloc(1, sizeof(*ed))) == NULL)
+/* Open the socket of this process, unless it is; call with proc_cn.mtx held */
+static int
+proc_cn_open(void)
+{
+    struct sockaddr_nl sa;
+    struct proc_watch *pw;
+    pthread_attr_t attr;
+    pthread_t tid;
+    sigset_t mask, omask;
+    int fd, i, rv, size = 1 << 20;
+
+    if (proc_cn.fd >= 0 && proc_cn.pid == getpid())
+        return (0);
+    if (proc_cn.failed == getpid())
         return (-1);
-    filt->kf_data = ed;
 
-    pthread_mutex_init(&ed->wait_mtx, NULL);
-    pthread_cond_init(&ed->wait_cond, NULL);
-    if ((efd = eventfd(0, 0)) < 0) 
+    /* The socket and the watches were inherited, and belong to the parent */
+    if (proc_cn.fd >= 0) {
+        (void) close(proc_cn.fd);
+        proc_cn.fd = -1;
+        for (i = 0; i < PROC_HASH_SIZE; i++) {
+            while ((pw = proc_cn.table[i]) != NULL) {
+                proc_cn.table[i] = pw->pw_next;
+                free(pw);
+            }
+        }
+    }
+
+    fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            NETLINK_CONNECTOR);
+    if (fd < 0) {
+        dbg_perror("socket(2) of NETLINK_CONNECTOR");
+        proc_cn.failed = getpid();
+        return (-1);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = CN_IDX_PROC;
+    if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+        dbg_perror("bind(2) to CN_IDX_PROC");
         goto errout;
-    if (fcntl(filt->kf_pfd, F_SETFL, O_NONBLOCK) < 0) 
+    }
+
+    /* Every process on the system is reported, so make room */
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    if (proc_cn_send(fd, PROC_CN_MCAST_LISTEN) < 0)
         goto errout;
-    filt->kf_pfd = efd;
-    if (pthread_create(&ed->wthr_id, NULL, wait_thread, filt) != 0) 
+    if (proc_cn_ack(fd) < 0) {
+        dbg_perror("subscribing to the proc connector");
         goto errout;
+    }
+
+    /* The thread may hold the lock when the process forks */
+    if (!proc_cn.atfork) {
+        if (pthread_atfork(proc_cn_lock, proc_cn_unlock, proc_cn_unlock) != 0)
+            goto errout;
+        proc_cn.atfork = 1;
+    }
 
+    /* The thread must not take the signals meant for a signalfd */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &omask);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rv = pthread_create(&tid, &attr, proc_cn_thread, (void *) (intptr_t) fd);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &omask, NULL);
+    if (rv != 0) {
+        dbg_puts("pthread_create(3) failed");
+        goto errout;
+    }
 
+    proc_cn.fd = fd;
+    proc_cn.pid = getpid();
+    dbg_printf("proc connector fd=%d", fd);
     return (0);
 
 errout:
-    if (efd >= 0)
-        close(efd);
-    free(ed);
-    close(filt->kf_pfd);
+    (void) close(fd);
+    proc_cn.failed = getpid();
     return (-1);
-#endif
-    return (-1); /*STUB*/
+}
+
+/*
+ * Attach the filter to the proc connector, unless it is not available.
+ * Called with no knotes in the filter yet.
+ *
+ * @return 0, with kf_data set if the connector is used, or -1 on error
+ */
+static int
+proc_cn_attach(struct filter *filt)
+{
+    struct evfilt_data *ed;
+    struct epoll_event ev;
+
+    ed = calloc(1, sizeof(*ed));
+    if (ed == NULL)
+        return (-1);
+    TAILQ_INIT(&ed->pend);
+    ed->evfd = eventfd(0, EFD_CLOEXEC);
+    if (ed->evfd < 0) {
+        dbg_perror("eventfd(2)");
+        free(ed);
+        return (-1);
+    }
+
+    pthread_mutex_lock(&proc_cn.mtx);
+    if (proc_cn_open() < 0) {
+        /* Fall back to pidfds */
+        pthread_mutex_unlock(&proc_cn.mtx);
+        (void) close(ed->evfd);
+        free(ed);
+        return (0);
+    }
+    pthread_mutex_unlock(&proc_cn.mtx);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = epoll_filter_ptr(filt);
+    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, ed->evfd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        (void) close(ed->evfd);
+        free(ed);
+        return (-1);
+    }
+
+    filt->kf_data = ed;
+    return (0);
+}
+
+int
+evfilt_proc_init(struct filter *filt)
+{
+    filt->kf_data = NULL;
+    if (getenv("KQUEUE_PROC_CONNECTOR") == NULL)
+        return (0);
+    return (proc_cn_attach(filt));
 }
 
 void
 evfilt_proc_destroy(struct filter *filt)
 {
-//TODO:    pthread_cancel(filt->kf_data->wthr_id);
-    close(filt->kf_pfd);
+    struct evfilt_data *ed = filt->kf_data;
+    struct proc_watch *pw, **pp;
+    int i;
+
+    if (ed == NULL) {
+        proc_close_pidfds(filt);
+        return;
+    }
+
+    /* Drop the children that no knote adopted, and those of the knotes */
+    pthread_mutex_lock(&proc_cn.mtx);
+    for (i = 0; i < PROC_HASH_SIZE; i++) {
+        for (pp = &proc_cn.table[i]; (pw = *pp) != NULL; ) {
+            if (pw->pw_filt == filt) {
+                *pp = pw->pw_next;
+                free(pw);
+            } else {
+                pp = &pw->pw_next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&proc_cn.mtx);
+
+    (void) close(ed->evfd);
+    free(ed);
+    filt->kf_data = NULL;
 }
 
 int
-evfilt_proc_copyout(struct filter *filt, 
-            struct kevent *dst, 
-            int maxevents)
+evfilt_proc_copyout_filter(struct filter *filt, struct kevent *dst, int nevents)
 {
+    struct evfilt_data *ed = filt->kf_data;
+    struct proc_watch *pw;
     struct knote *kn;
-    int nevents = 0;
-    uint64_t cur;
+    eventfd_t cur;
+    uint32_t pending;
+    int i, nret = 0;
+
+    pthread_mutex_lock(&proc_cn.mtx);
+    if (ed->raised) {
+        if (eventfd_read(ed->evfd, &cur) < 0)
+            dbg_perror("eventfd_read(3)");
+        ed->raised = 0;
+    }
 
-    /* Reset the counter */
-    if (read(filt->kf_pfd, &cur, sizeof(cur)) < sizeof(cur)) {
-        dbg_printf("read(2): %s", strerror(errno));
-        return (-1);
+    while (nret < nevents && (pw = TAILQ_FIRST(&ed->pend)) != NULL) {
+        TAILQ_REMOVE(&ed->pend, pw, pw_pend);
+        pw->pw_queued = 0;
+        kn = pw->pw_kn;
+
+        /* Left pending until the knote is enabled */
+        if (kn->kev.flags & EV_DISABLE)
+            continue;
+
+        pending = pw->pw_pending;
+        memcpy(&dst[nret], &kn->kev, sizeof(*dst));
+        if (pending & NOTE_CHILD) {
+            /* The first event of a child, on its own */
+            dst[nret].fflags = NOTE_CHILD;
+            dst[nret].data = pw->pw_ppid;
+            pw->pw_pending &= ~NOTE_CHILD;
+            proc_queue(pw);
+        } else {
+            dst[nret].fflags = pending & (kn->kev.fflags | NOTE_TRACKERR);
+            dst[nret].data = 0;
+            if (pending & NOTE_EXIT) {
+                dst[nret].flags |= EV_EOF | EV_ONESHOT;
+                dst[nret].data = pw->pw_status;
+            }
+            pw->pw_pending = 0;
+        }
+        nret++;
+    }
+
+    /* Have epoll report the filter again for the watches that are left */
+    if (!TAILQ_EMPTY(&ed->pend) && !ed->raised) {
+        if (eventfd_write(ed->evfd, 1) < 0)
+            dbg_perror("eventfd_write(3)");
+        else
+            ed->raised = 1;
+    }
+    pthread_mutex_unlock(&proc_cn.mtx);
+
+    /* kn_delete takes proc_cn.mtx */
+    for (i = 0; i < nret; i++) {
+        if (!(dst[i].flags & (EV_DISPATCH | EV_ONESHOT)))
+            continue;
+        if ((kn = knote_lookup(filt, dst[i].ident)) == NULL)
+            continue;
+        if (dst[i].flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        if (dst[i].flags & EV_ONESHOT)
+            knote_delete(filt, kn); //FIXME: Error checking
     }
-    dbg_printf("  counter=%llu", (unsigned long long) cur);
 
-    for (kn = knote_dequeue(filt); kn != NULL; kn = knote_dequeue(filt)) {
-        kevent_dump(&kn->kev);
-        memcpy(dst, &kn->kev, sizeof(*dst));
+    return (nret);
+}
 
-        if (kn->kev.flags & EV_DISPATCH) {
-            KNOTE_DISABLE(kn);
+static int
+proc_watch_add(struct filter *filt, struct knote *kn)
+{
+    struct proc_watch *pw;
+    pid_t pid = kn->kev.ident;
+    int child = kn->kev.fflags & NOTE_CHILD;
+    int status;
+
+    /* NOTE_CHILD marks the knote that proc_track() posted */
+    kn->kev.fflags &= ~NOTE_CHILD;
+    kn->kev.data = 0;
+
+    pthread_mutex_lock(&proc_cn.mtx);
+    if (child) {
+        for (pw = *proc_hash(pid); pw != NULL; pw = pw->pw_next) {
+            if (pw->pw_pid == pid && pw->pw_filt == filt && pw->pw_kn == NULL)
+                break;
         }
-        if (kn->kev.flags & EV_ONESHOT) {
-            knote_free(filt, kn);
-        } else {
-            kn->kev.data = 0; //why??
+        if (pw != NULL) {
+            pw->pw_kn = kn;
+            kn->kdata.kn_proc = pw;
+            proc_queue(pw);
+            pthread_mutex_unlock(&proc_cn.mtx);
+            return (0);
         }
+    }
 
+    pw = calloc(1, sizeof(*pw));
+    if (pw == NULL) {
+        pthread_mutex_unlock(&proc_cn.mtx);
+        return (-1);
+    }
+    pw->pw_pid = pid;
+    pw->pw_filt = filt;
+    pw->pw_kn = kn;
+    pw->pw_kev = kn->kev;
+    proc_link(pw);
+    kn->kdata.kn_proc = pw;
+
+    /* It may have exited before the watch was added */
+    if (proc_exited(pid, &status)) {
+        pw->pw_status = status;
+        proc_note(pw, NOTE_EXIT);
+    }
+    pthread_mutex_unlock(&proc_cn.mtx);
+
+    return (0);
+}
 
-        if (++nevents > maxevents)
+/* The child of a NOTE_TRACK process was already watched; drop its watch */
+static void
+proc_watch_orphan(struct filter *filt, pid_t pid)
+{
+    struct proc_watch *pw;
+
+    pthread_mutex_lock(&proc_cn.mtx);
+    for (pw = *proc_hash(pid); pw != NULL; pw = pw->pw_next) {
+        if (pw->pw_pid == pid && pw->pw_filt == filt && pw->pw_kn == NULL) {
+            proc_unlink(pw);
+            free(pw);
             break;
-        dst++;
+        }
     }
+    pthread_mutex_unlock(&proc_cn.mtx);
+}
 
-    if (knote_events_pending(filt)) {
-    /* XXX-FIXME: If there are leftover events on the waitq, 
-       re-arm the eventfd. list */
-        abort();
-    }
+#else
+
+int
+evfilt_proc_init(struct filter *filt)
+{
+    filt->kf_data = NULL;
+    return (0);
+}
+
+void
+evfilt_proc_destroy(struct filter *filt)
+{
+    proc_close_pidfds(filt);
+}
 
-    return (nevents);
+int
+evfilt_proc_copyout_filter(struct filter *filt UNUSED, struct kevent *dst UNUSED,
+        int nevents UNUSED)
+{
+    return (0);
 }
- 
+
+#endif /* HAVE_LINUX_CN_PROC_H */
+
 int
 evfilt_proc_knote_create(struct filter *filt, struct knote *kn)
 {
-    return (0); /* STUB */
+    struct epoll_event ev;
+
+#if HAVE_LINUX_CN_PROC_H
+    /* NOTE_TRACK asks for the connector, unless pidfds are in use already */
+    if (filt->kf_data == NULL && kn->kev.fflags & NOTE_TRACK
+            && filt->kf_knote_count == 0 && proc_cn_attach(filt) < 0)
+        return (-1);
+    if (filt->kf_data != NULL)
+        return (proc_watch_add(filt, kn));
+#endif
+
+    /* NOTE_FORK and NOTE_EXEC are not reported, and children not tracked */
+    if (kn->kev.fflags & NOTE_TRACK) {
+        dbg_puts("NOTE_TRACK needs the proc connector");
+        errno = ENOTSUP;
+        return (-1);
+    }
+    kn->kdata.kn_pidfd = pidfd_open(kn->kev.ident);
+    if (kn->kdata.kn_pidfd < 0) {
+        dbg_perror("pidfd_open(2)");
+        return (-1);
+    }
+    if (fcntl(kn->kdata.kn_pidfd, F_SETFD, FD_CLOEXEC) < 0) {
+        dbg_perror("fcntl(2)");
+        goto errout;
+    }
+
+    kn->kn_epollfd = filter_epfd(filt);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = kn;
+    if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kdata.kn_pidfd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        goto errout;
+    }
+
+    return (0);
+
+errout:
+    (void) close(kn->kdata.kn_pidfd);
+    kn->kdata.kn_pidfd = -1;
+    return (-1);
 }
 
 int
-evfilt_proc_knote_modify(struct filter *filt, struct knote *kn, 
+evfilt_proc_knote_modify(struct filter *filt, struct knote *kn UNUSED,
         const struct kevent *kev)
 {
-    return (0); /* STUB */
+#if HAVE_LINUX_CN_PROC_H
+    /* The change posted for a tracked child that already had a knote */
+    if (filt->kf_data != NULL && kev->fflags & NOTE_CHILD)
+        proc_watch_orphan(filt, kev->ident);
+#else
+    (void) filt;
+    (void) kev;
+#endif
+    return (0);
 }
 
 int
 evfilt_proc_knote_delete(struct filter *filt, struct knote *kn)
 {
-    return (0); /* STUB */
+#if HAVE_LINUX_CN_PROC_H
+    if (filt->kf_data != NULL) {
+        pthread_mutex_lock(&proc_cn.mtx);
+        proc_unlink(kn->kdata.kn_proc);
+        pthread_mutex_unlock(&proc_cn.mtx);
+        free(kn->kdata.kn_proc);
+        kn->kdata.kn_proc = NULL;
+        return (0);
+    }
+#endif
+    if (kn->kdata.kn_pidfd < 0)
+        return (0);
+    if (!(kn->kev.flags & EV_DISABLE) 
+            && epoll_ctl(kn->kn_epollfd, EPOLL_CTL_DEL, kn->kdata.kn_pidfd, NULL) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        return (-1);
+    }
+    (void) close(kn->kdata.kn_pidfd);
+    kn->kdata.kn_pidfd = -1;
+
+    return (0);
 }
 
 int
 evfilt_proc_knote_enable(struct filter *filt, struct knote *kn)
 {
-    return (0); /* STUB */
+    struct epoll_event ev;
+
+#if HAVE_LINUX_CN_PROC_H
+    /* Report what happened while it was disabled */
+    if (filt->kf_data != NULL) {
+        pthread_mutex_lock(&proc_cn.mtx);
+        proc_queue(kn->kdata.kn_proc);
+        pthread_mutex_unlock(&proc_cn.mtx);
+        return (0);
+    }
+#endif
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = kn;
+    if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kdata.kn_pidfd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        return (-1);
+    }
+
+    return (0);
 }
 
 int
 evfilt_proc_knote_disable(struct filter *filt, struct knote *kn)
 {
-    return (0); /* STUB */
+#if HAVE_LINUX_CN_PROC_H
+    /* Copyout leaves its events pending */
+    if (filt->kf_data != NULL)
+        return (0);
+#endif
+    if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_DEL, kn->kdata.kn_pidfd, NULL) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        return (-1);
+    }
+
+    return (0);
 }
 
-const struct filter evfilt_proc_DEADWOOD = {
-    0, //XXX-FIXME broken: EVFILT_PROC,
+const struct filter evfilt_proc = {
+    EVFILT_PROC,
     evfilt_proc_init,
     evfilt_proc_destroy,
     evfilt_proc_copyout,
@@ -240,4 +968,5 @@ const struct filter evfilt_proc_DEADWOOD = {
     evfilt_proc_knote_delete,
     evfilt_proc_knote_enable,
     evfilt_proc_knote_disable,
+    evfilt_proc_copyout_filter,
 };
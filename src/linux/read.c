@@ -38,6 +38,15 @@ get_eof_offset(int fd)
 {
     off_t curpos;
     struct stat sb;
+    int avail;
+
+    /*
+     * For a regular file, FIONREAD returns the size minus the current
+     * position in a single syscall. The result is truncated to an int,
+     * so a value that is not positive is checked with lseek() and fstat().
+     */
+    if (ioctl(fd, FIONREAD, &avail) == 0 && avail > 0)
+        return (avail);
 
     curpos = lseek(fd, 0, SEEK_CUR);
     if (curpos == (off_t) -1) {
@@ -53,56 +62,120 @@ get_eof_offset(int fd)
     return (sb.st_size - curpos); //FIXME: can overflow
 }
 
+/*
+ * A regular file is always readable, so its knote needs no descriptor of
+ * its own: while it is enabled, it is on the kq_files list of the kqueue.
+ * linux_kevent_wait() does not block while the list is not empty, and
+ * linux_kevent_copyout() reports the knotes on it after the epoll events.
+ * A knote is taken off the list when it is reported at the end of the
+ * file, or reported at all if it has EV_CLEAR, EV_ONESHOT or EV_DISPATCH,
+ * as the surrogate eventfd it replaces would have stopped being readable.
+ *
+ * The list lock nests inside the knote lock. A knote that is linked has
+ * kn_ready.tqe_prev set.
+ */
+static void
+file_link(struct kqueue *kq, struct knote *kn)
+{
+    pthread_mutex_lock(&kq->kq_file_mtx);
+    if (kn->kdata.kn_ready.tqe_prev == NULL) {
+        TAILQ_INSERT_TAIL(&kq->kq_files, kn, kdata.kn_ready);
+        __atomic_add_fetch(&kq->kq_nfiles, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&kq->kq_file_mtx);
+}
+
+static void
+file_unlink(struct kqueue *kq, struct knote *kn)
+{
+    pthread_mutex_lock(&kq->kq_file_mtx);
+    if (kn->kdata.kn_ready.tqe_prev != NULL) {
+        TAILQ_REMOVE(&kq->kq_files, kn, kdata.kn_ready);
+        kn->kdata.kn_ready.tqe_prev = NULL;
+        __atomic_sub_fetch(&kq->kq_nfiles, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&kq->kq_file_mtx);
+}
+
+/* Nonzero if there are regular files to report */
 int
-evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
+linux_file_pending(struct kqueue *kq)
 {
-    struct epoll_event * const ev = (struct epoll_event *) ptr;
+    return (__atomic_load_n(&kq->kq_nfiles, __ATOMIC_RELAXED) != 0);
+}
 
-    /* Special case: for regular files, return the offset from current position to end of file */
-    if (src->kn_flags & KNFL_REGULAR_FILE) {
-        memcpy(dst, &src->kev, sizeof(*dst));
-        dst->data = get_eof_offset(src->kev.ident);
-
-        if (dst->data == 0) {
-            dst->filter = 0;    /* Will cause the kevent to be discarded */
-            if (epoll_ctl(src->kn_epollfd, EPOLL_CTL_DEL, src->kdata.kn_eventfd, NULL) < 0) {
-                dbg_perror("epoll_ctl(2)");
-                return (-1);
-            }
-
-#if FIXME
-            /* XXX-FIXME Switch to using kn_inotifyfd to monitor for IN_ATTRIB events
-                         that may signify the file size has changed.
-
-                         This code is not tested.
-             */
-            int inofd;
-            char path[PATH_MAX];
-
-            inofd = inotify_init();
-            if (inofd < 0) {
-                dbg_perror("inotify_init(2)");
-                (void) close(inofd);
-                return (-1);
-            }
-            src->kdata.kn_inotifyfd = inofd;
-            if (linux_fd_to_path(&path[0], sizeof(path), src->kev.ident) < 0)
-                return (-1);
-            if (inotify_add_watch(inofd, path, IN_ATTRIB) < 0) {
-                dbg_perror("inotify_add_watch");
-                return (-1);
-            }
-            if (epoll_ctl(src->kn_epollfd, EPOLL_CTL_ADD, src->kdata.kn_inotifyfd, NULL) < 0) {
-                dbg_perror("epoll_ctl(2)");
-                return (-1);
-            }
-            /* FIXME: race here, should we check the EOF status again ? */
-#endif
+/*
+ * Report the knotes on kq_files. Each one is unlinked before it is locked,
+ * and linked again at the tail if it stays readable, so a call does not
+ * see a knote twice and a long list is reported in turns.
+ *
+ * @return the number of events copied out
+ */
+int
+linux_file_copyout(struct kqueue *kq, struct kevent *dst, int nevents)
+{
+    struct filter *filt = kq->kq_filt[~EVFILT_READ];
+    struct knote *kn;
+    unsigned int n;
+    int nret = 0;
+
+    for (n = __atomic_load_n(&kq->kq_nfiles, __ATOMIC_RELAXED);
+            n > 0 && nret < nevents; n--) {
+        pthread_mutex_lock(&kq->kq_file_mtx);
+        kn = TAILQ_FIRST(&kq->kq_files);
+        if (kn != NULL) {
+            TAILQ_REMOVE(&kq->kq_files, kn, kdata.kn_ready);
+            kn->kdata.kn_ready.tqe_prev = NULL;
+            __atomic_sub_fetch(&kq->kq_nfiles, 1, __ATOMIC_RELAXED);
+            knote_retain(kn);
+        }
+        pthread_mutex_unlock(&kq->kq_file_mtx);
+        if (kn == NULL)
+            break;
+
+        /* It was disabled or deleted after it was unlinked */
+        knote_lock(kn);
+        if (kn->kn_flags & KNFL_KNOTE_DELETED || kn->kev.flags & EV_DISABLE) {
+            knote_unlock(kn);
+            knote_release(kn);
+            continue;
         }
 
-        return (0);
+        /* Return the offset from the current position to end of file */
+        memcpy(dst, &kn->kev, sizeof(*dst));
+        dst->data = get_eof_offset(kn->kev.ident);
+        if (dst->data != 0
+                && !(kn->kev.flags & (EV_CLEAR | EV_ONESHOT | EV_DISPATCH)))
+            file_link(kq, kn);
+
+        if (dst->flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        if (dst->flags & EV_ONESHOT)
+            knote_delete(filt, kn); //FIXME: Error checking
+        knote_unlock(kn);
+        knote_release(kn);
+
+        if (dst->data != 0) {
+            dst++;
+            nret++;
+        } else {
+            dbg_puts("regular file at EOF, discarding event");
+            stats_spurious(kq);
+        }
     }
 
+    return (nret);
+}
+
+int
+evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
+{
+    struct epoll_event * const ev = (struct epoll_event *) ptr;
+
+    /* epoll disarmed the descriptor when it reported this event */
+    if (src->data.events & EPOLLONESHOT && src->kn_peer == NULL)
+        src->kn_flags |= KNFL_DISARMED;
+
     dbg_printf("epoll: %s", epoll_event_dump(ev));
     memcpy(dst, &src->kev, sizeof(*dst));
 #if defined(HAVE_EPOLLRDHUP)
@@ -120,6 +193,11 @@ evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
            socket backlog. This is not available under Linux.
          */
         dst->data = 1;
+    } else if (src->kev.fflags & NOTE_NODATA) {
+        /* The caller does not need the byte count, so save the ioctl */
+        dst->data = 1;
+        if (ev->events & EPOLLRDHUP)
+            dst->flags |= EV_EOF;
     } else {
         /* On return, data contains the number of bytes of protocol
            data available to read.
@@ -133,6 +211,8 @@ evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
                 dst->flags |= EV_EOF;
         }
     }
+    if (slowpath(src->kn_flags & KNFL_LOWAT))
+        linux_socket_lowat(dst, src, ev);
 
     return (0);
 }
@@ -140,8 +220,6 @@ evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
 int
 evfilt_read_knote_create(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
-
     if (linux_get_descriptor_type(kn) < 0)
         return (-1);
 
@@ -151,41 +229,35 @@ evfilt_read_knote_create(struct filter *filt, struct knote *kn)
 #else
     kn->data.events = EPOLLIN;
 #endif
-    if (kn->kev.flags & EV_ONESHOT || kn->kev.flags & EV_DISPATCH)
-        kn->data.events |= EPOLLONESHOT;
     if (kn->kev.flags & EV_CLEAR)
         kn->data.events |= EPOLLET;
 
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
+    /* Without a byte count to test, EV_EOF comes from EPOLLRDHUP */
+    if (kn->kev.fflags & NOTE_NODATA)
+        kn->data.events |= EPOLLRDHUP;
+
+    /*
+     * A listening socket shared by several kqueues wakes only one of
+     * them per connection when NOTE_EXCLUSIVE is set. The kernel does not
+     * accept EPOLLONESHOT together with EPOLLEXCLUSIVE, so EV_ONESHOT and
+     * EV_DISPATCH rely on copyout deleting the descriptor from the epoll
+     * set instead. A thread that retrieved the event before that happened
+     * sees the knote as deleted or disabled and discards it.
+     */
+    if ((kn->kev.fflags & NOTE_EXCLUSIVE) && (kn->kn_flags & KNFL_PASSIVE_SOCKET))
+        kn->data.events |= EPOLLEXCLUSIVE;
+    else if (kn->kev.flags & EV_ONESHOT || kn->kev.flags & EV_DISPATCH)
+        kn->data.events |= EPOLLONESHOT;
 
-    /* Special case: for regular files, add a surrogate eventfd that is always readable */
+    /* Special case: regular files are always readable */
     if (kn->kn_flags & KNFL_REGULAR_FILE) {
-        int evfd;
-
-        kn->kn_epollfd = filter_epfd(filt);
-        evfd = eventfd(0, 0);
-        if (evfd < 0) {
-            dbg_perror("eventfd(2)");
-            return (-1);
-        }
-        if (eventfd_write(evfd, 1) < 0) {
-            dbg_perror("eventfd_write(3)");
-            (void) close(evfd);
-            return (-1);
-        }
-
-        kn->kdata.kn_eventfd = evfd;
-
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kdata.kn_eventfd, &ev) < 0) {
-            dbg_printf("epoll_ctl(2): %s", strerror(errno));
-            return (-1);
-        }
+        kn->kn_peer = NULL;
+        kn->kdata.kn_ready.tqe_prev = NULL;
+        file_link(filt->kf_kqueue, kn);
         return (0);
     }
 
-    return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
+    return (linux_socket_register(filt, kn));
 }
 
 int
@@ -201,74 +273,43 @@ evfilt_read_knote_modify(struct filter *filt, struct knote *kn,
 int
 evfilt_read_knote_delete(struct filter *filt, struct knote *kn)
 {
-    if (kn->kev.flags & EV_DISABLE)
-        return (0);
-
-    if  (
-            (
-                   kn->kn_flags & KNFL_REGULAR_FILE
-                && kn->kdata.kn_eventfd != -1
-            ) == true
-        ) {
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_DEL, kn->kdata.kn_eventfd, NULL) < 0) {
-            dbg_perror("epoll_ctl(2)");
-            return (-1);
-        }
-        (void) close(kn->kdata.kn_eventfd);
-        kn->kdata.kn_eventfd = -1;
-    } else {
-        return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
-    }
+    if (!(kn->kn_flags & KNFL_REGULAR_FILE))
+        return (linux_socket_unregister(filt, kn));
 
-    // clang will complain about not returning a value otherwise
-    return (-1);
+    file_unlink(filt->kf_kqueue, kn);
+    return (0);
 }
 
 int
 evfilt_read_knote_enable(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
+    if (!(kn->kn_flags & KNFL_REGULAR_FILE))
+        return (linux_socket_enable(filt, kn));
 
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
-
-    if (kn->kn_flags & KNFL_REGULAR_FILE) {
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kdata.kn_eventfd, &ev) < 0) {
-            dbg_perror("epoll_ctl(2)");
-            return (-1);
-        }
-        return (0);
-    } else {
-        return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
-    }
-
-    // clang will complain about not returning a value otherwise
-    return (-1);
+    file_link(filt->kf_kqueue, kn);
+    return (0);
 }
 
+/* See linux_socket_disable() for why EPOLLONESHOT is kept */
 int
 evfilt_read_knote_disable(struct filter *filt, struct knote *kn)
 {
-    if (kn->kn_flags & KNFL_REGULAR_FILE) {
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_DEL, kn->kdata.kn_eventfd, NULL) < 0) {
-            dbg_perror("epoll_ctl(2)");
-            return (-1);
-        }
-        return (0);
-    } else {
-        return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
-    }
+    if (!(kn->kn_flags & KNFL_REGULAR_FILE))
+        return (linux_socket_disable(filt, kn));
+
+    file_unlink(filt->kf_kqueue, kn);
+    return (0);
 }
 
 const struct filter evfilt_read = {
     EVFILT_READ,
     NULL,
-    NULL,
+    linux_socket_destroy,
     evfilt_read_copyout,
     evfilt_read_knote_create,
     evfilt_read_knote_modify,
     evfilt_read_knote_delete,
     evfilt_read_knote_enable,
     evfilt_read_knote_disable,
+    linux_socket_rearm,
 };
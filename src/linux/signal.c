@@ -43,116 +43,182 @@ struct signalfd_siginfo
 };
 #endif
 
-static void
-signalfd_reset(int sigfd)
-{
-    struct signalfd_siginfo sig;
-    ssize_t n;
+/*
+ * All the signal knotes of a kqueue share one signalfd, whose mask is
+ * the set of signals of the enabled knotes.
+ */
+struct evfilt_data {
+    int      sigfd;
+    int      flags;       /* Passed to signalfd(2) */
+    sigset_t mask;
+};
 
-    /* Discard any pending signal */
-    n = read(sigfd, &sig, sizeof(sig));
-    if (n < 0 || n != sizeof(sig)) {
-        if (errno == EWOULDBLOCK)
-            return;
-        //FIXME: eintr?
-        dbg_perror("read(2) from signalfd");
-        abort();
+/* Maximum number of siginfo records read at once */
+#define SIGINFO_MAX 64
+
+static __thread struct signalfd_siginfo siginfo[SIGINFO_MAX];
+
+static int
+signalfd_update(struct evfilt_data *ed)
+{
+    if (signalfd(ed->sigfd, &ed->mask, ed->flags) < 0) {
+        dbg_perror("signalfd(2)");
+        return (-1);
     }
+    return (0);
 }
 
+/* Add the signal to the signalfd mask */
 static int
-signalfd_add(int epfd, int sigfd, void *ptr)
+signal_enable(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
-    int rv;
+    struct evfilt_data *ed = filt->kf_data;
+    const struct timespec zero = { 0, 0 };
+    sigset_t sigmask;
 
-    /* Add the signalfd to the kqueue's epoll descriptor set */
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN;
-    ev.data.ptr = ptr;
-    rv = epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
-    if (rv < 0) {
-        dbg_perror("epoll_ctl(2)");
+    sigemptyset(&sigmask);
+    if (sigaddset(&sigmask, kn->kev.ident) < 0) {
+        dbg_perror("sigaddset(3)");
         return (-1);
     }
 
+    /* Block the signal handler from being invoked */
+    if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
+        dbg_perror("sigprocmask(2)");
+        return (-1);
+    }
+
+    /* Discard any pending signal */
+    (void) sigtimedwait(&sigmask, NULL, &zero);
+
+    sigaddset(&ed->mask, kn->kev.ident);
+    if (signalfd_update(ed) < 0) {
+        sigdelset(&ed->mask, kn->kev.ident);
+        return (-1);
+    }
+    dbg_printf("added signum %d to sigfd %d", (int) kn->kev.ident, ed->sigfd);
+
     return (0);
 }
 
-static int
-signalfd_create(int epfd, void *ptr, int signum)
+int
+evfilt_signal_init(struct filter *filt)
 {
-    static int flags = SFD_NONBLOCK;
-    sigset_t sigmask;
-    int sigfd;
+    struct evfilt_data *ed;
+    struct epoll_event ev;
+
+    ed = calloc(1, sizeof(*ed));
+    if (ed == NULL)
+        return (-1);
 
     /* Create a signalfd */
-    sigemptyset(&sigmask);
-    sigaddset(&sigmask, signum);
-    sigfd = signalfd(-1, &sigmask, flags);
+    sigemptyset(&ed->mask);
+    ed->flags = SFD_NONBLOCK;
+    ed->sigfd = signalfd(-1, &ed->mask, ed->flags);
 
     /* WORKAROUND: Flags are broken on kernels older than Linux 2.6.27 */
-    if (sigfd < 0 && errno == EINVAL && flags != 0) {
-        flags = 0;
-        sigfd = signalfd(-1, &sigmask, flags);
+    if (ed->sigfd < 0 && errno == EINVAL) {
+        ed->flags = 0;
+        ed->sigfd = signalfd(-1, &ed->mask, ed->flags);
+        if (ed->sigfd >= 0 && fcntl(ed->sigfd, F_SETFL, O_NONBLOCK) < 0) {
+            dbg_perror("fcntl(2)");
+            goto errout;
+        }
     }
-    if (sigfd < 0) {
+    if (ed->sigfd < 0) {
         dbg_perror("signalfd(2)");
-        goto errout;
+        free(ed);
+        return (-1);
     }
 
-    /* Block the signal handler from being invoked */
-    if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
-        dbg_perror("sigprocmask(2)");
+    /* Add the signalfd to the kqueue's epoll descriptor set */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = epoll_filter_ptr(filt);
+    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, ed->sigfd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
         goto errout;
     }
+    dbg_printf("added sigfd %d to epfd %d", ed->sigfd, filter_epfd(filt));
 
-    signalfd_reset(sigfd);
-
-    if (signalfd_add(epfd, sigfd, ptr) < 0)
-        goto errout;
-
-    dbg_printf("added sigfd %d to epfd %d (signum=%d)", sigfd, epfd, signum);
-
-    return (sigfd);
+    filt->kf_data = ed;
+    return (0);
 
 errout:
-    (void) close(sigfd);
+    (void) close(ed->sigfd);
+    free(ed);
     return (-1);
 }
 
-int
-evfilt_signal_copyout(struct kevent *dst, struct knote *src, void *x UNUSED)
+void
+evfilt_signal_destroy(struct filter *filt)
 {
-    int sigfd;
+    struct evfilt_data *ed = filt->kf_data;
 
-    sigfd = src->kdata.kn_signalfd;
+    (void) close(ed->sigfd);
+    free(ed);
+    filt->kf_data = NULL;
+}
 
-    signalfd_reset(sigfd);
+int
+evfilt_signal_copyout(struct filter *filt, struct kevent *dst, int nevents)
+{
+    struct evfilt_data *ed = filt->kf_data;
+    struct knote *kn;
+    ssize_t n;
+    int i, j, nrec, nret;
 
-    memcpy(dst, &src->kev, sizeof(*dst));
-    /* NOTE: dst->data should be the number of times the signal occurred,
-       but that information is not available.
-     */
-    dst->data = 1;  
+    if (nevents > SIGINFO_MAX)
+        nevents = SIGINFO_MAX;
+    if (nevents == 0)
+        return (0);
 
-    return (0);
+    n = read(ed->sigfd, &siginfo[0], nevents * sizeof(siginfo[0]));
+    if (n < 0) {
+        if (errno == EWOULDBLOCK)
+            return (0);
+        //FIXME: eintr?
+        dbg_perror("read(2) from signalfd");
+        return (-1);
+    }
+    nrec = n / sizeof(siginfo[0]);
+
+    for (i = nret = 0; i < nrec; i++) {
+        kn = knote_lookup(filt, siginfo[i].ssi_signo);
+        if (kn == NULL || kn->kev.flags & EV_DISABLE)
+            continue;
+
+        /* Queued realtime signals are reported together */
+        for (j = 0; j < nret; j++) {
+            if (dst[j].ident == kn->kev.ident)
+                break;
+        }
+        if (j < nret) {
+            dst[j].data++;
+            continue;
+        }
+
+        memcpy(&dst[nret], &kn->kev, sizeof(*dst));
+        dst[nret].data = 1;
+        nret++;
+
+        if (kn->kev.flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        if (kn->kev.flags & EV_ONESHOT)
+            knote_delete(filt, kn); //FIXME: Error checking
+    }
+
+    return (nret);
 }
 
 int
 evfilt_signal_knote_create(struct filter *filt, struct knote *kn)
 {
-    int fd;
-
-    fd = signalfd_create(filter_epfd(filt), kn, kn->kev.ident);
-    if (fd > 0) {
-        kn->kev.flags |= EV_CLEAR;
-        kn->kdata.kn_signalfd = fd;
-        return (0);
-    } else {
-        kn->kdata.kn_signalfd = -1;
+    if (signal_enable(filt, kn) < 0)
         return (-1);
-    }
+
+    kn->kev.flags |= EV_CLEAR;
+    return (0);
 }
 
 int
@@ -168,33 +234,23 @@ evfilt_signal_knote_modify(struct filter *filt UNUSED,
 int
 evfilt_signal_knote_delete(struct filter *filt, struct knote *kn)
 {
-    const int sigfd = kn->kdata.kn_signalfd;
+    struct evfilt_data *ed = filt->kf_data;
 
     /* Needed so that delete() can be called after disable() */
-    if (kn->kdata.kn_signalfd == -1)
+    if (!sigismember(&ed->mask, kn->kev.ident))
         return (0);
 
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, sigfd, NULL) < 0) {
-        dbg_perror("epoll_ctl(2)");
-        return (-1);
-    }
-
-    if (close(sigfd) < 0) {
-        dbg_perror("close(2)");
-        return (-1);
-    }
-
     /* NOTE: This does not call sigprocmask(3) to unblock the signal. */
-    kn->kdata.kn_signalfd = -1;
+    sigdelset(&ed->mask, kn->kev.ident);
 
-    return (0);
+    return (signalfd_update(ed));
 }
 
 int
 evfilt_signal_knote_enable(struct filter *filt, struct knote *kn)
 {
     dbg_printf("enabling ident %u", (unsigned int) kn->kev.ident);
-    return evfilt_signal_knote_create(filt, kn);
+    return (signal_enable(filt, kn));
 }
 
 int
@@ -207,12 +263,13 @@ evfilt_signal_knote_disable(struct filter *filt, struct knote *kn)
 
 const struct filter evfilt_signal = {
     EVFILT_SIGNAL,
+    evfilt_signal_init,
+    evfilt_signal_destroy,
     NULL,
-    NULL,
-    evfilt_signal_copyout,
     evfilt_signal_knote_create,
     evfilt_signal_knote_modify,
     evfilt_signal_knote_delete,
     evfilt_signal_knote_enable,
     evfilt_signal_knote_disable,         
+    evfilt_signal_copyout,
 };
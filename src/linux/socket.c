@@ -0,0 +1,590 @@
+/*
+ * Copyright (c) 2011 Mark Heily <mark@heily.com>
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * epoll registrations for the EVFILT_READ and EVFILT_WRITE knotes of a
+ * descriptor.
+ *
+ * epoll accepts one registration per descriptor, so when a descriptor
+ * has both a read and a write knote, the two share it. The knotes point
+ * at each other with kn_peer, the read knote holds a reference on the
+ * write knote, and the registration's data.ptr is the read knote with
+ * EPOLL_PEER_TAG set. linux_socket_copyout() turns one event from such a
+ * registration into one kevent for each side.
+ *
+ * A shared registration is level-triggered unless both knotes have
+ * EV_CLEAR. It never has EPOLLONESHOT; EV_ONESHOT and EV_DISPATCH knotes
+ * are removed from the mask when copyout deletes or disables them.
+ *
+ * kq_sock_mtx serializes the changes to shared registrations.
+ *
+ * A NOTE_PRIORITY knote is registered in the nested epoll set of the
+ * kqueue instead, see linux_kevent_wait(). A registration is only shared
+ * by knotes in the same set.
+ *
+ * A NOTE_COALESCE knote is registered with EPOLLONESHOT and never
+ * shares its registration. Once it is copied out, it is armed again when
+ * <data> microseconds have passed, so it is reported at most once per
+ * window however often the descriptor becomes ready. The knotes waiting
+ * for that are kept in a timer heap of the filter, which drives one
+ * timerfd in the epoll set; linux_socket_rearm() handles its events.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/sockios.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "private.h"
+
+/* Knotes armed again for each expiration; the timerfd fires again for the rest */
+#define COALESCE_BATCH  64
+
+struct evfilt_data {
+    pthread_mutex_t   lock;       /* Protects heap and armed */
+    int               timerfd;
+    struct timer_heap heap;       /* Of NOTE_COALESCE knotes, by kn_rearm */
+    uint64_t          armed;      /* Expiration the timerfd is set for, or 0 */
+};
+
+/* Set up the timer of NOTE_COALESCE knotes; call with the filter lock held */
+static int
+socket_coalesce_init(struct filter *filt)
+{
+    struct evfilt_data *ed;
+    struct epoll_event ev;
+
+    if (filt->kf_data != NULL)
+        return (0);
+
+    ed = calloc(1, sizeof(*ed));
+    if (ed == NULL)
+        return (-1);
+    ed->timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (ed->timerfd < 0) {
+        dbg_perror("timerfd_create(2)");
+        free(ed);
+        return (-1);
+    }
+    if (fcntl(ed->timerfd, F_SETFL, O_NONBLOCK) < 0) {
+        dbg_perror("fcntl(2)");
+        goto errout;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = epoll_filter_ptr(filt);
+    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, ed->timerfd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        goto errout;
+    }
+
+    pthread_mutex_init(&ed->lock, NULL);
+    timer_heap_init_at(&ed->heap, offsetof(struct knote, kdata.kn_rearm));
+    filt->kf_data = ed;
+    return (0);
+
+errout:
+    close(ed->timerfd);
+    free(ed);
+    return (-1);
+}
+
+void
+linux_socket_destroy(struct filter *filt)
+{
+    struct evfilt_data *ed = filt->kf_data;
+
+    if (ed == NULL)
+        return;
+    (void) close(ed->timerfd);
+    timer_heap_free(&ed->heap);
+    pthread_mutex_destroy(&ed->lock);
+    free(ed);
+    filt->kf_data = NULL;
+}
+
+/* Arm the timerfd for the earliest knote; call with ed->lock held */
+static void
+socket_coalesce_arm(struct evfilt_data *ed)
+{
+    struct itimerspec ts;
+    uint64_t deadline;
+
+    deadline = timer_heap_deadline(&ed->heap);
+    if (deadline == 0 || (ed->armed != 0 && ed->armed <= deadline))
+        return;
+
+    memset(&ts, 0, sizeof(ts));
+    ts.it_value.tv_sec = deadline / 1000000000;
+    ts.it_value.tv_nsec = deadline % 1000000000;
+    if (timerfd_settime(ed->timerfd, TFD_TIMER_ABSTIME, &ts, NULL) < 0) {
+        dbg_perror("timerfd_settime(2)");
+        return;
+    }
+    ed->armed = deadline;
+}
+
+/*
+ * Schedule a NOTE_COALESCE knote that was just copied out, and disarmed
+ * by epoll, to be armed again at the end of its window. Call with the
+ * knote lock held.
+ */
+void
+linux_socket_coalesce(struct filter *filt, struct knote *kn)
+{
+    struct evfilt_data *ed = filt->kf_data;
+
+    pthread_mutex_lock(&ed->lock);
+    if (kn->kdata.kn_rearm.index == TIMER_HEAP_NONE) {
+        kn->kdata.kn_rearm.when = stats_clock() + (uint64_t) kn->kev.data * 1000;
+        if (timer_heap_insert(&ed->heap, kn) < 0)
+            dbg_puts("unable to schedule the knote to be armed again");
+        socket_coalesce_arm(ed);
+    }
+    pthread_mutex_unlock(&ed->lock);
+}
+
+/*
+ * The kf_copyout_filter of the socket filters, for an expiration of the
+ * timerfd: arm the knotes whose window has ended. It returns no events;
+ * those come from the knotes once epoll reports them again.
+ */
+int
+linux_socket_rearm(struct filter *filt, struct kevent *dst UNUSED,
+        int nevents UNUSED)
+{
+    struct evfilt_data *ed = filt->kf_data;
+    struct knote *kn, *ready[COALESCE_BATCH];
+    uint64_t expired, now;
+    int i, n = 0;
+
+    if (read(ed->timerfd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+        dbg_perror("read(2)");
+
+    pthread_mutex_lock(&ed->lock);
+    ed->armed = 0;
+    now = stats_clock();
+    while (n < COALESCE_BATCH) {
+        kn = timer_heap_peek(&ed->heap);
+        if (kn == NULL || kn->kdata.kn_rearm.when > now)
+            break;
+        timer_heap_remove(&ed->heap, kn);
+        if (knote_tryretain(kn))
+            ready[n++] = kn;
+    }
+    socket_coalesce_arm(ed);
+    pthread_mutex_unlock(&ed->lock);
+
+    /* A knote that was disabled, or enabled again, is left alone */
+    for (i = 0; i < n; i++) {
+        kn = ready[i];
+        knote_lock(kn);
+        if (!(kn->kn_flags & KNFL_KNOTE_DELETED) && !(kn->kev.flags & EV_DISABLE)
+                && kn->kn_flags & KNFL_DISARMED
+                && linux_socket_enable(filt, kn) < 0)
+            dbg_printf("fd=%d could not be armed again", (int) kn->kev.ident);
+        knote_unlock(kn);
+        knote_release(kn);
+    }
+
+    return (0);
+}
+
+/* The interest of a knote that is not sharing its registration */
+static uint32_t
+socket_events(struct knote *kn)
+{
+    if (kn->kev.flags & EV_DISABLE)
+        return (EPOLLONESHOT);
+    return (kn->data.events);
+}
+
+/* The interest of a shared registration, leaving out one knote */
+static uint32_t
+socket_events_shared(struct knote *rkn, struct knote *wkn, struct knote *skip)
+{
+    uint32_t events = 0;
+
+    if (rkn != skip && !(rkn->kev.flags & EV_DISABLE))
+        events |= rkn->data.events & (EPOLLIN | EPOLLRDHUP);
+    if (wkn != skip && !(wkn->kev.flags & EV_DISABLE))
+        events |= EPOLLOUT;
+
+    /* Like a disabled knote, it may still fire once for EPOLLHUP */
+    if (events == 0)
+        return (EPOLLONESHOT);
+    if (rkn->kev.flags & EV_CLEAR && wkn->kev.flags & EV_CLEAR)
+        events |= EPOLLET;
+    return (events);
+}
+
+static int
+socket_ctl(struct filter *filt, struct knote *kn, int op, uint32_t events,
+        void *ptr)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ptr;
+
+    return (epoll_update(op, filt, kn, &ev));
+}
+
+/* Update a shared registration; call with kq_sock_mtx held */
+static int
+socket_update_shared(struct filter *filt, struct knote *kn, struct knote *skip)
+{
+    struct knote *rkn, *wkn;
+
+    if (kn->kev.filter == EVFILT_READ) {
+        rkn = kn;
+        wkn = kn->kn_peer;
+    } else {
+        rkn = kn->kn_peer;
+        wkn = kn;
+    }
+
+    return (socket_ctl(filt, kn, EPOLL_CTL_MOD,
+                socket_events_shared(rkn, wkn, skip),
+                (void *) ((uintptr_t) rkn | EPOLL_PEER_TAG)));
+}
+
+/*
+ * Set up the NOTE_LOWAT of a knote, which wants kev.data bytes queued,
+ * or free in the send buffer. Linux applies SO_RCVLOWAT to poll for TCP
+ * only, and does not allow SO_SNDLOWAT to be set, so in the other cases
+ * the knote is registered edge-triggered, and linux_socket_lowat()
+ * discards its events below the mark.
+ */
+static int
+socket_lowat_init(struct knote *kn)
+{
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    int lowat, type = 0;
+    socklen_t len = sizeof(type);
+
+    if (kn->kev.data <= 1 || kn->kn_flags & KNFL_PASSIVE_SOCKET)
+        return (0);
+    if (kn->kev.data > INT_MAX || kn->kn_flags & KNFL_COALESCE) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    /* Take an IP stream socket for TCP, whose poll honors SO_RCVLOWAT */
+    if (kn->kev.filter == EVFILT_READ
+            && getsockopt(kn->kev.ident, SOL_SOCKET, SO_TYPE, &type, &len) == 0
+            && type == SOCK_STREAM
+            && getsockname(kn->kev.ident, (struct sockaddr *) &sa, &salen) == 0
+            && (sa.ss_family == AF_INET || sa.ss_family == AF_INET6)) {
+        lowat = kn->kev.data;
+        if (setsockopt(kn->kev.ident, SOL_SOCKET, SO_RCVLOWAT, &lowat,
+                    sizeof(lowat)) == 0)
+            return (0);
+        dbg_perror("setsockopt(2) of SO_RCVLOWAT");
+    }
+
+    /* EPOLLONESHOT would leave an event below the mark disarmed */
+    kn->kn_flags |= KNFL_LOWAT;
+    kn->data.events &= ~EPOLLONESHOT;
+    kn->data.events |= EPOLLET;
+    return (0);
+}
+
+/*
+ * Discard the event in dst if it is below the NOTE_LOWAT of the knote.
+ * The registration is edge-triggered, so the next event comes with more
+ * data. A level-triggered knote that is reported is armed again, which
+ * makes epoll check the descriptor at the next wait, as it would have.
+ */
+void
+linux_socket_lowat(struct kevent *dst, struct knote *kn,
+        const struct epoll_event *ev)
+{
+    struct filter *filt = kn->kn_kq->kq_filt[~(kn->kev.filter)];
+    int avail, size;
+    socklen_t len = sizeof(size);
+
+    if (dst->flags & EV_EOF || ev->events & EPOLLERR)
+        return;
+
+    if (kn->kev.filter == EVFILT_READ) {
+        if (!(kn->kev.fflags & NOTE_NODATA))
+            avail = dst->data;
+        else if (ioctl(kn->kev.ident, SIOCINQ, &avail) < 0)
+            return;
+    } else {
+        if (ioctl(kn->kev.ident, SIOCOUTQ, &avail) < 0
+                || getsockopt(kn->kev.ident, SOL_SOCKET, SO_SNDBUF, &size, &len) < 0)
+            return;
+        avail = size - avail;
+    }
+
+    if (avail < kn->kev.data) {
+        dbg_printf("fd=%d: %d bytes are below the low-water mark",
+                (int) kn->kev.ident, avail);
+        memset(dst, 0, sizeof(*dst));
+        return;
+    }
+    if (!(kn->kev.flags & (EV_CLEAR | EV_ONESHOT | EV_DISPATCH)))
+        (void) socket_ctl(filt, kn, EPOLL_CTL_MOD, kn->data.events, kn);
+}
+
+int
+linux_socket_register(struct filter *filt, struct knote *kn)
+{
+    struct kqueue *kq = filt->kf_kqueue;
+    struct knote *peer, *rkn, *wkn;
+    short other;
+    int rv;
+
+    kn->kn_peer = NULL;
+    if (kn->kev.fflags & NOTE_PRIORITY) {
+        if (linux_kqueue_prio_init(kq) < 0)
+            return (-1);
+        kn->kn_flags |= KNFL_PRIORITY;
+    }
+    if (kn->kev.fflags & NOTE_COALESCE && kn->kev.data > 0
+            && !(kn->data.events & EPOLLEXCLUSIVE)) {
+        if (socket_coalesce_init(filt) < 0)
+            return (-1);
+        kn->kn_flags |= KNFL_COALESCE;
+        kn->kdata.kn_rearm.index = TIMER_HEAP_NONE;
+        kn->data.events |= EPOLLONESHOT;
+    }
+    if (kn->kev.fflags & NOTE_LOWAT && socket_lowat_init(kn) < 0)
+        return (-1);
+
+    /* EPOLLEXCLUSIVE registrations cannot be modified, so never share them */
+    other = (kn->kev.filter == EVFILT_READ) ? EVFILT_WRITE : EVFILT_READ;
+    peer = NULL;
+    if (kq->kq_filt[~other] != NULL)
+        peer = knote_lookup(kq->kq_filt[~other], kn->kev.ident);
+    if (peer == NULL || peer->kn_flags & KNFL_REGULAR_FILE
+            || (peer->data.events | kn->data.events) & EPOLLEXCLUSIVE
+            || (peer->kn_flags ^ kn->kn_flags) & KNFL_PRIORITY
+            || (peer->kn_flags | kn->kn_flags) & (KNFL_COALESCE | KNFL_LOWAT))
+        return (socket_ctl(filt, kn, EPOLL_CTL_ADD, kn->data.events, kn));
+
+    pthread_mutex_lock(&kq->kq_sock_mtx);
+    if (peer->kn_flags & KNFL_KNOTE_DELETED || peer->kn_peer != NULL) {
+        pthread_mutex_unlock(&kq->kq_sock_mtx);
+        errno = EEXIST;
+        return (-1);
+    }
+    if (kn->kev.filter == EVFILT_READ) {
+        rkn = kn;
+        wkn = peer;
+    } else {
+        rkn = peer;
+        wkn = kn;
+    }
+    knote_retain(wkn);
+    rkn->kn_peer = wkn;
+    wkn->kn_peer = rkn;
+    peer->kn_flags &= ~KNFL_DISARMED;
+
+    rv = socket_update_shared(filt, kn, NULL);
+    if (rv < 0) {
+        rkn->kn_peer = NULL;
+        wkn->kn_peer = NULL;
+        knote_release(wkn);
+    }
+    pthread_mutex_unlock(&kq->kq_sock_mtx);
+
+    dbg_printf("fd=%d shared by read and write knotes: rv=%d", (int) kn->kev.ident, rv);
+    return (rv);
+}
+
+int
+linux_socket_unregister(struct filter *filt, struct knote *kn)
+{
+    struct kqueue *kq = filt->kf_kqueue;
+    struct knote *peer;
+    int rv;
+
+    if (kn->kn_flags & KNFL_COALESCE) {
+        pthread_mutex_lock(&filt->kf_data->lock);
+        timer_heap_remove(&filt->kf_data->heap, kn);
+        pthread_mutex_unlock(&filt->kf_data->lock);
+    }
+
+    /* Put back the default low-water mark set by socket_lowat_init() */
+    if (kn->kev.fflags & NOTE_LOWAT && kn->kev.filter == EVFILT_READ
+            && kn->kev.data > 1 && !(kn->kn_flags & (KNFL_LOWAT | KNFL_PASSIVE_SOCKET))) {
+        int lowat = 1;
+
+        (void) setsockopt(kn->kev.ident, SOL_SOCKET, SO_RCVLOWAT, &lowat,
+                sizeof(lowat));
+    }
+
+    if (kn->kn_peer == NULL) {
+        if (kn->kev.flags & EV_DISABLE && kn->data.events & EPOLLEXCLUSIVE)
+            return (0);
+        return (epoll_update(EPOLL_CTL_DEL, filt, kn, NULL));
+    }
+
+    /* Give the registration back to the knote that remains */
+    pthread_mutex_lock(&kq->kq_sock_mtx);
+    peer = kn->kn_peer;
+    peer->kn_peer = NULL;
+    kn->kn_peer = NULL;
+    peer->kn_flags &= ~KNFL_DISARMED;
+    rv = socket_ctl(filt, kn, EPOLL_CTL_MOD, socket_events(peer), peer);
+    knote_release((kn->kev.filter == EVFILT_READ) ? peer : kn);
+    pthread_mutex_unlock(&kq->kq_sock_mtx);
+
+    return (rv);
+}
+
+int
+linux_socket_enable(struct filter *filt, struct knote *kn)
+{
+    struct kqueue *kq = filt->kf_kqueue;
+    int rv;
+
+    kn->kn_flags &= ~KNFL_DISARMED;
+    if (kn->kn_peer == NULL) {
+        if (kn->data.events & EPOLLEXCLUSIVE)
+            return (socket_ctl(filt, kn, EPOLL_CTL_ADD, kn->data.events, kn));
+        return (socket_ctl(filt, kn, EPOLL_CTL_MOD, kn->data.events, kn));
+    }
+
+    pthread_mutex_lock(&kq->kq_sock_mtx);
+    rv = socket_update_shared(filt, kn, NULL);
+    pthread_mutex_unlock(&kq->kq_sock_mtx);
+
+    return (rv);
+}
+
+/*
+ * A disabled knote keeps its registration with an empty mask, so that
+ * enabling and disabling it only modify the registration. EPOLLHUP and
+ * EPOLLERR cannot be masked, so the mask keeps EPOLLONESHOT; a disabled
+ * knote then fires at most once, and copyout discards the event.
+ */
+int
+linux_socket_disable(struct filter *filt, struct knote *kn)
+{
+    struct kqueue *kq = filt->kf_kqueue;
+    int rv;
+
+    if (kn->kn_peer == NULL) {
+        if (kn->data.events & EPOLLEXCLUSIVE)
+            return (epoll_update(EPOLL_CTL_DEL, filt, kn, NULL));
+
+        /* An EV_DISPATCH event was just returned and epoll disarmed it */
+        if (kn->kn_flags & KNFL_DISARMED)
+            return (0);
+
+        return (socket_ctl(filt, kn, EPOLL_CTL_MOD, EPOLLONESHOT, kn));
+    }
+
+    /* The knote may not be marked as disabled yet */
+    pthread_mutex_lock(&kq->kq_sock_mtx);
+    rv = socket_update_shared(filt, kn, kn);
+    pthread_mutex_unlock(&kq->kq_sock_mtx);
+
+    return (rv);
+}
+
+/* Copy out the event for one side of a shared registration */
+static int
+socket_copyout_one(struct kqueue *kq, struct kevent *dst, struct knote *kn,
+        struct epoll_event *ev)
+{
+    struct filter *filt = kq->kq_filt[~(kn->kev.filter)];
+
+    knote_lock(kn);
+    if (kn->kn_flags & KNFL_KNOTE_DELETED || kn->kev.flags & EV_DISABLE) {
+        knote_unlock(kn);
+        return (0);
+    }
+    if (linux_filter_copyout(filt, dst, kn, ev) < 0) {
+        dbg_puts("knote_copyout failed");
+        abort();
+    }
+    if (dst->flags & EV_DISPATCH)
+        knote_disable(filt, kn);
+    if (dst->flags & EV_ONESHOT)
+        knote_delete(filt, kn);
+    knote_unlock(kn);
+
+    return (dst->filter != 0);
+}
+
+/*
+ * Convert an event from a shared registration into a kevent for each
+ * side that it applies to, writing at most nevents of them.
+ *
+ * @return the number of kevents written
+ */
+int
+linux_socket_copyout(struct kqueue *kq, struct kevent *dst, int nevents,
+        struct epoll_event *ev)
+{
+    struct knote *rkn, *wkn;
+    struct epoll_event rev, wev;
+    int n = 0;
+
+    rkn = (struct knote *) ((uintptr_t) ev->data.ptr & ~(uintptr_t) EPOLL_PEER_TAG);
+    if (!knote_tryretain(rkn))
+        return (0);
+
+    /* Each side sees only its own readiness, plus hangups and errors */
+    memcpy(&rev, ev, sizeof(rev));
+    rev.events &= ~EPOLLOUT;
+    memcpy(&wev, ev, sizeof(wev));
+    wev.events &= ~(EPOLLIN | EPOLLRDHUP);
+
+    if (rev.events != 0)
+        n += socket_copyout_one(kq, dst + n, rkn, &rev);
+
+    /* The write knote stays referenced while it is the peer */
+    pthread_mutex_lock(&kq->kq_sock_mtx);
+    wkn = rkn->kn_peer;
+    if (wkn != NULL)
+        knote_retain(wkn);
+    pthread_mutex_unlock(&kq->kq_sock_mtx);
+
+    if (wkn != NULL) {
+        if (wev.events != 0) {
+            if (n < nevents) {
+                n += socket_copyout_one(kq, dst + n, wkn, &wev);
+            } else {
+                /*
+                 * There is no room for the second kevent. Modifying
+                 * the registration makes epoll check the descriptor
+                 * again, so an edge-triggered event is not lost.
+                 */
+                pthread_mutex_lock(&kq->kq_sock_mtx);
+                if (rkn->kn_peer == wkn)
+                    (void) socket_update_shared(kq->kq_filt[~EVFILT_WRITE], wkn, NULL);
+                pthread_mutex_unlock(&kq->kq_sock_mtx);
+            }
+        }
+        knote_release(wkn);
+    }
+    knote_release(rkn);
+
+    return (n);
+}
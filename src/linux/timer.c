@@ -42,6 +42,12 @@
 #ifndef SYS_timerfd_gettime
 #define SYS_timerfd_gettime (SYS_timerfd_create + 2)
 #endif
+#ifndef TFD_TIMER_ABSTIME
+#define TFD_TIMER_ABSTIME 1
+#endif
+#ifndef TFD_TIMER_CANCEL_ON_SET
+#define TFD_TIMER_CANCEL_ON_SET (1 << 1)
+#endif
 
 int timerfd_create(int clockid, int flags)
 {
@@ -79,90 +85,244 @@ itimerspec_dump(struct itimerspec *ts)
 }
 #endif
 
-/* Convert milliseconds into seconds+nanoseconds */
-static void
-convert_msec_to_itimerspec(struct itimerspec *dst, int src, int oneshot)
+/*
+ * All the timers of a kqueue share one timerfd, which is armed for the
+ * earliest expiration in a heap of timer knotes. Arming and cancelling a
+ * timer only updates the heap, and calls timerfd_settime(2) if the new
+ * timer expires before the one the timerfd is armed for.
+ *
+ * NOTE_ABSTIME timers expire at a time since the Epoch, so they are kept
+ * in a heap of their own, on CLOCK_REALTIME. Its timerfd is armed with
+ * TFD_TIMER_CANCEL_ON_SET; when the system clock is set, reading it fails
+ * with ECANCELED, and the heap is checked against the new time.
+ */
+struct evfilt_data {
+    int               timerfd;
+    struct timer_heap heap;
+    uint64_t          armed;      /* Expiration the timerfd is set for, or 0 */
+    int               rtfd;       /* The same, for NOTE_ABSTIME timers */
+    struct timer_heap rtheap;
+    uint64_t          rtarmed;
+};
+
+/* Arm a timerfd for the earliest timer of a heap, unless it will expire sooner */
+static int
+timer_arm_fd(int fd, struct timer_heap *th, uint64_t *armed, int flags)
 {
-    time_t sec, nsec;
+    struct itimerspec ts;
+    uint64_t deadline;
 
-    sec = src / 1000;
-    nsec = (src % 1000) * 1000000;
+    deadline = timer_heap_deadline(th);
+    if (deadline == 0 || (*armed != 0 && *armed <= deadline))
+        return (0);
 
-    /* Set the interval */
-    if (oneshot) {
-        dst->it_interval.tv_sec = 0;
-        dst->it_interval.tv_nsec = 0;
-    } else {
-        dst->it_interval.tv_sec = sec;
-        dst->it_interval.tv_nsec = nsec;
+    ts.it_interval.tv_sec = 0;
+    ts.it_interval.tv_nsec = 0;
+    ts.it_value.tv_sec = deadline / 1000000000;
+    ts.it_value.tv_nsec = deadline % 1000000000;
+    dbg_printf("%s", itimerspec_dump(&ts));
+    if (timerfd_settime(fd, flags, &ts, NULL) < 0) {
+        dbg_printf("timerfd_settime(2): %s", strerror(errno));
+        return (-1);
     }
+    *armed = deadline;
 
-    /* Set the initial expiration */
-    dst->it_value.tv_sec = sec;
-    dst->it_value.tv_nsec = nsec;
-    dbg_printf("%s", itimerspec_dump(dst));
+    return (0);
 }
 
-int
-evfilt_timer_copyout(struct kevent *dst, struct knote *src, void *ptr)
+static int
+timer_arm(struct filter *filt)
 {
-    struct epoll_event * const ev = (struct epoll_event *) ptr;
-    uint64_t expired;
-    ssize_t n;
-
-    memcpy(dst, &src->kev, sizeof(*dst));
-    if (ev->events & EPOLLERR)
-        dst->fflags = 1; /* FIXME: Return the actual timer error */
-          
-    /* On return, data contains the number of times the
-       timer has been trigered.
-     */
-    n = read(src->data.pfd, &expired, sizeof(expired));
-    if (n != sizeof(expired)) {
-        dbg_puts("invalid read from timerfd");
-        expired = 1;  /* Fail gracefully */
-    } 
-    dst->data = expired;
+    struct evfilt_data *ed = filt->kf_data;
+
+    if (timer_arm_fd(ed->timerfd, &ed->heap, &ed->armed, TFD_TIMER_ABSTIME) < 0)
+        return (-1);
+    return (timer_arm_fd(ed->rtfd, &ed->rtheap, &ed->rtarmed,
+                TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET));
+}
+
+/* The heap of a timer knote */
+static struct timer_heap *
+timer_heap(struct evfilt_data *ed, const struct knote *kn)
+{
+    return ((kn->kev.fflags & NOTE_ABSTIME) ? &ed->rtheap : &ed->heap);
+}
+
+/* Start the timer, counting from now unless it is absolute */
+static int
+timer_schedule(struct filter *filt, struct knote *kn)
+{
+    struct evfilt_data *ed = filt->kf_data;
+
+    if (kn->kev.fflags & NOTE_ABSTIME)
+        kn->data.timer.when = timer_interval(kn);
+    else
+        kn->data.timer.when = timer_first(kn, timer_now());
+    if (timer_heap_insert(timer_heap(ed, kn), kn) < 0)
+        return (-1);
+    if (timer_arm(filt) < 0) {
+        timer_heap_remove(timer_heap(ed, kn), kn);
+        return (-1);
+    }
 
     return (0);
 }
 
-int
-evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
+/* Create a timerfd, and add it to the epoll set of the filter */
+static int
+timer_fd(struct filter *filt, clockid_t clock)
 {
     struct epoll_event ev;
-    struct itimerspec ts;
     int tfd;
 
-    kn->kev.flags |= EV_CLEAR;
-
-    tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+    tfd = timerfd_create(clock, 0);
     if (tfd < 0) {
         dbg_printf("timerfd_create(2): %s", strerror(errno));
         return (-1);
     }
-    dbg_printf("created timerfd %d", tfd);
-
-    convert_msec_to_itimerspec(&ts, kn->kev.data, kn->kev.flags & EV_ONESHOT);
-    if (timerfd_settime(tfd, 0, &ts, NULL) < 0) {
-        dbg_printf("timerfd_settime(2): %s", strerror(errno));
-        close(tfd);
-        return (-1);
+    if (fcntl(tfd, F_SETFL, O_NONBLOCK) < 0) {
+        dbg_perror("fcntl(2)");
+        goto errout;
     }
+    dbg_printf("created timerfd %d", tfd);
 
     memset(&ev, 0, sizeof(ev));
     ev.events = EPOLLIN;
-    ev.data.ptr = kn;
+    ev.data.ptr = epoll_filter_ptr(filt);
     if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, tfd, &ev) < 0) {
         dbg_printf("epoll_ctl(2): %d", errno);
-        close(tfd);
+        goto errout;
+    }
+
+    return (tfd);
+
+errout:
+    close(tfd);
+    return (-1);
+}
+
+int
+evfilt_timer_init(struct filter *filt)
+{
+    struct evfilt_data *ed;
+
+    ed = calloc(1, sizeof(*ed));
+    if (ed == NULL)
+        return (-1);
+
+    ed->timerfd = timer_fd(filt, CLOCK_MONOTONIC);
+    if (ed->timerfd < 0) {
+        free(ed);
+        return (-1);
+    }
+    ed->rtfd = timer_fd(filt, CLOCK_REALTIME);
+    if (ed->rtfd < 0) {
+        close(ed->timerfd);
+        free(ed);
         return (-1);
     }
 
-    kn->data.pfd = tfd;
+    timer_heap_init(&ed->heap);
+    timer_heap_init(&ed->rtheap);
+    filt->kf_data = ed;
     return (0);
 }
 
+void
+evfilt_timer_destroy(struct filter *filt)
+{
+    struct evfilt_data *ed = filt->kf_data;
+
+    (void) close(ed->timerfd);
+    (void) close(ed->rtfd);
+    timer_heap_free(&ed->heap);
+    timer_heap_free(&ed->rtheap);
+    free(ed);
+    filt->kf_data = NULL;
+}
+
+/* Copy out the timers of a heap that expired by <now> */
+static int
+timer_expire(struct filter *filt, struct timer_heap *th, uint64_t now,
+        struct kevent *dst, int nevents)
+{
+    struct knote *kn;
+    uint64_t expired, interval;
+    int nret;
+
+    for (nret = 0; nret < nevents; nret++, dst++) {
+        kn = timer_heap_peek(th);
+        if (kn == NULL || kn->data.timer.when > now)
+            break;
+
+        timer_heap_remove(th, kn);
+        memcpy(dst, &kn->kev, sizeof(*dst));
+
+        if (kn->kev.flags & EV_ONESHOT) {
+            dst->data = 1;
+            knote_delete(filt, kn); //FIXME: Error checking
+            continue;
+        }
+
+        /* An absolute timer expires once, and is not armed again */
+        if (kn->kev.fflags & NOTE_ABSTIME) {
+            dst->data = 1;
+            continue;
+        }
+
+        /* On return, data contains the number of times the
+           timer has been triggered.
+         */
+        interval = timer_interval(kn);
+        expired = 1 + (now - kn->data.timer.when) / interval;
+        kn->data.timer.when += expired * interval;
+        dst->data = expired;
+
+        if (kn->kev.flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        else if (timer_heap_insert(th, kn) < 0)
+            dbg_puts("unable to rearm the timer");
+    }
+
+    return (nret);
+}
+
+int
+evfilt_timer_copyout(struct filter *filt, struct kevent *dst, int nevents)
+{
+    struct evfilt_data *ed = filt->kf_data;
+    uint64_t expired;
+    int nret;
+
+    /* Reset the timerfds; they may already have been read */
+    if (read(ed->timerfd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+        dbg_perror("read(2)");
+    ed->armed = 0;
+
+    /* ECANCELED if the system clock was set; the heap is checked again */
+    if (read(ed->rtfd, &expired, sizeof(expired)) >= 0 || errno == ECANCELED)
+        ed->rtarmed = 0;
+    else if (errno != EAGAIN)
+        dbg_perror("read(2)");
+
+    nret = timer_expire(filt, &ed->heap, timer_now(), dst, nevents);
+    nret += timer_expire(filt, &ed->rtheap, timer_realtime(), dst + nret,
+            nevents - nret);
+
+    /* Timers that did not fit in the eventlist make it expire at once */
+    if (timer_arm(filt) < 0)
+        return (-1);
+
+    return (nret);
+}
+
+int
+evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
+{
+    kn->kev.flags |= EV_CLEAR;
+    return (timer_schedule(filt, kn));
+}
+
 int
 evfilt_timer_knote_modify(struct filter *filt, struct knote *kn, 
         const struct kevent *kev)
@@ -176,28 +336,16 @@ evfilt_timer_knote_modify(struct filter *filt, struct knote *kn,
 int
 evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
 {
-    int rv = 0;
-
-    if (kn->data.pfd == -1)
-        return (0);
-
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, kn->data.pfd, NULL) < 0) {
-        dbg_printf("epoll_ctl(2): %s", strerror(errno));
-        rv = -1;
-    }
-    if (close(kn->data.pfd) < 0) {
-        dbg_printf("close(2): %s", strerror(errno));
-        rv = -1;
-    }
+    struct evfilt_data *ed = filt->kf_data;
 
-    kn->data.pfd = -1;
-    return (rv);
+    timer_heap_remove(timer_heap(ed, kn), kn);
+    return (0);
 }
 
 int
 evfilt_timer_knote_enable(struct filter *filt, struct knote *kn)
 {
-    return evfilt_timer_knote_create(filt, kn);
+    return (timer_schedule(filt, kn));
 }
 
 int
@@ -208,12 +356,13 @@ evfilt_timer_knote_disable(struct filter *filt, struct knote *kn)
 
 const struct filter evfilt_timer = {
     EVFILT_TIMER,
+    evfilt_timer_init,
+    evfilt_timer_destroy,
     NULL,
-    NULL,
-    evfilt_timer_copyout,
     evfilt_timer_knote_create,
     evfilt_timer_knote_modify,
     evfilt_timer_knote_delete,
     evfilt_timer_knote_enable,
     evfilt_timer_knote_disable,     
+    evfilt_timer_copyout,
 };
@@ -0,0 +1,778 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Batched epoll_ctl(2) submission.
+ *
+ * A changelist with many socket entries normally costs one epoll_ctl(2)
+ * call per entry. When io_uring is available, the updates are queued as
+ * IORING_OP_EPOLL_CTL requests and submitted together with a single
+ * io_uring_enter(2). The requests are hard-linked so the kernel applies
+ * them in changelist order, and a failure does not cancel the rest.
+ *
+ * If kevent() goes on to wait for events, and the kernel implements
+ * IORING_OP_EPOLL_WAIT, the last batch is not submitted by itself but
+ * together with the wait, with a nanosecond timeout. The requests are
+ * completed before the kqueue is unlocked, so that they are applied in
+ * order with the changes of other threads; only the wait is left in
+ * flight, and its events are collected by the next io_uring_enter(2).
+ *
+ * Each thread has its own ring, so a waiting thread never competes with
+ * another for completions. This is opt-in: set KQUEUE_IO_URING in the
+ * environment to enable it.
+ */
+
+#include "../common/private.h"
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if !HAVE_DECL_IORING_OP_EPOLL_WAIT
+/* Added in Linux 6.15; opcode numbers are part of the kernel ABI. */
+# define IORING_OP_EPOLL_WAIT 59
+#endif
+
+/* Maximum number of epoll_ctl(2) requests submitted together */
+#define EPOLL_BATCH_MAX 128
+
+/* The io_uring_sqe.user_data of requests that are not in eb_ops[] */
+#define UD_EPOLL_WAIT   (EPOLL_BATCH_MAX)
+#define UD_TIMEOUT      (EPOLL_BATCH_MAX + 1)
+#define UD_CANCEL       (EPOLL_BATCH_MAX + 2)
+
+struct epoll_batch_op {
+    struct knote        *bo_kn;          /* Retained until completion */
+    struct filter       *bo_filt;
+    const struct kevent *bo_change;      /* Changelist entry being applied */
+    int                  bo_epfd;
+    int                  bo_op;
+    int                  bo_create;      /* Knote was created by bo_change */
+    int                  bo_res;
+    struct epoll_event   bo_ev;
+};
+
+/* A knote created by a request that failed, deleted by epoll_batch_bury() */
+struct epoll_batch_dead {
+    struct filter        *bd_filt;
+    struct knote         *bd_kn;
+};
+
+struct epoll_batch {
+    struct uring          eb_ring;
+    int                   eb_flushing;
+    int                   eb_deferred;   /* The wait is in flight */
+    int                   eb_cancelled;  /* It went in without its timeout */
+    unsigned              eb_pending;    /* Its completions not reaped yet */
+    int                   eb_wait_res;
+    struct __kernel_timespec eb_ts;
+    unsigned              eb_nops;
+    struct epoll_batch_op eb_ops[EPOLL_BATCH_MAX];
+
+    /* Failures that have not been reported yet */
+    struct kevent_error  *eb_errors;
+    size_t                eb_nerrors;
+    size_t                eb_errors_max;
+
+    /* As many as eb_errors has room for */
+    struct epoll_batch_dead *eb_dead;
+    size_t                eb_ndead;
+};
+
+/* -1=unknown, 0=unavailable, 1=enabled */
+static int uring_epoll_ctl = -1;
+static int uring_epoll_wait;
+
+static __thread struct epoll_batch *batch;
+static pthread_key_t batch_key;
+static pthread_once_t batch_key_once = PTHREAD_ONCE_INIT;
+
+int
+uring_setup(struct uring *ur, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ur->ur_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ur->ur_fd < 0) {
+        dbg_perror("io_uring_setup(2)");
+        return (-1);
+    }
+
+    ur->ur_sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->ur_cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->ur_cq_ring_sz > ur->ur_sq_ring_sz)
+            ur->ur_sq_ring_sz = ur->ur_cq_ring_sz;
+        ur->ur_cq_ring_sz = 0;
+    }
+
+    ur->ur_sq_ring = mmap(NULL, ur->ur_sq_ring_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQ_RING);
+    if (ur->ur_sq_ring == MAP_FAILED) {
+        dbg_perror("mmap(2)");
+        goto errout;
+    }
+    if (ur->ur_cq_ring_sz == 0) {
+        ur->ur_cq_ring = ur->ur_sq_ring;
+    } else {
+        ur->ur_cq_ring = mmap(NULL, ur->ur_cq_ring_sz, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_CQ_RING);
+        if (ur->ur_cq_ring == MAP_FAILED) {
+            dbg_perror("mmap(2)");
+            munmap(ur->ur_sq_ring, ur->ur_sq_ring_sz);
+            goto errout;
+        }
+    }
+    ur->ur_sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->ur_sqes = mmap(NULL, ur->ur_sqes_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQES);
+    if (ur->ur_sqes == MAP_FAILED) {
+        dbg_perror("mmap(2)");
+        if (ur->ur_cq_ring_sz != 0)
+            munmap(ur->ur_cq_ring, ur->ur_cq_ring_sz);
+        munmap(ur->ur_sq_ring, ur->ur_sq_ring_sz);
+        goto errout;
+    }
+
+    ur->ur_sq_head = (unsigned *) ((char *) ur->ur_sq_ring + p.sq_off.head);
+    ur->ur_sq_tail = (unsigned *) ((char *) ur->ur_sq_ring + p.sq_off.tail);
+    ur->ur_sq_mask = (unsigned *) ((char *) ur->ur_sq_ring + p.sq_off.ring_mask);
+    ur->ur_sq_array = (unsigned *) ((char *) ur->ur_sq_ring + p.sq_off.array);
+    ur->ur_cq_head = (unsigned *) ((char *) ur->ur_cq_ring + p.cq_off.head);
+    ur->ur_cq_tail = (unsigned *) ((char *) ur->ur_cq_ring + p.cq_off.tail);
+    ur->ur_cq_mask = (unsigned *) ((char *) ur->ur_cq_ring + p.cq_off.ring_mask);
+    ur->ur_cqes = (struct io_uring_cqe *) ((char *) ur->ur_cq_ring + p.cq_off.cqes);
+    ur->ur_tail = *ur->ur_sq_tail;
+
+    return (0);
+
+errout:
+    close(ur->ur_fd);
+    ur->ur_fd = -1;
+    return (-1);
+}
+
+void
+uring_free(struct uring *ur)
+{
+    munmap(ur->ur_sqes, ur->ur_sqes_sz);
+    if (ur->ur_cq_ring_sz != 0)
+        munmap(ur->ur_cq_ring, ur->ur_cq_ring_sz);
+    munmap(ur->ur_sq_ring, ur->ur_sq_ring_sz);
+    close(ur->ur_fd);
+    ur->ur_fd = -1;
+}
+
+struct io_uring_sqe *
+uring_get_sqe(struct uring *ur)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    idx = ur->ur_tail++ & *ur->ur_sq_mask;
+    ur->ur_sq_array[idx] = idx;
+    sqe = &ur->ur_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    return (sqe);
+}
+
+/*
+ * Submit the prepared entries, and wait until <wait_nr> completions
+ * are available. Entries that the kernel did not consume are retracted.
+ *
+ * @return the number of entries submitted
+ */
+unsigned
+uring_submit(struct uring *ur, unsigned n, unsigned wait_nr)
+{
+    unsigned submitted;
+    int rv;
+
+    __atomic_store_n(ur->ur_sq_tail, ur->ur_tail, __ATOMIC_RELEASE);
+
+    submitted = 0;
+    do {
+        rv = syscall(__NR_io_uring_enter, ur->ur_fd, n - submitted,
+                wait_nr, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rv > 0)
+            submitted += rv;
+    } while ((rv > 0 && submitted < n) || (rv < 0 && errno == EINTR));
+    if (rv < 0)
+        dbg_perror("io_uring_enter(2)");
+
+    if (submitted < n) {
+        ur->ur_tail = __atomic_load_n(ur->ur_sq_head, __ATOMIC_ACQUIRE);
+        __atomic_store_n(ur->ur_sq_tail, ur->ur_tail, __ATOMIC_RELEASE);
+    }
+
+    return (submitted);
+}
+
+/* Check which of the opcodes used here the kernel implements */
+static void
+uring_probe(struct uring *ur)
+{
+    struct io_uring_probe *probe;
+    size_t len;
+
+    uring_epoll_ctl = 0;
+    uring_epoll_wait = 0;
+
+    len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    probe = calloc(1, len);
+    if (probe == NULL)
+        return;
+    if (syscall(__NR_io_uring_register, ur->ur_fd, IORING_REGISTER_PROBE,
+                probe, 256) == 0) {
+        if (probe->last_op >= IORING_OP_EPOLL_CTL
+                && (probe->ops[IORING_OP_EPOLL_CTL].flags & IO_URING_OP_SUPPORTED))
+            uring_epoll_ctl = 1;
+        if (probe->last_op >= IORING_OP_EPOLL_WAIT
+                && (probe->ops[IORING_OP_EPOLL_WAIT].flags & IO_URING_OP_SUPPORTED))
+            uring_epoll_wait = 1;
+    }
+    free(probe);
+
+    dbg_printf("IORING_OP_EPOLL_CTL=%d IORING_OP_EPOLL_WAIT=%d",
+            uring_epoll_ctl, uring_epoll_wait);
+}
+
+static void
+epoll_batch_destroy(void *arg)
+{
+    struct epoll_batch *eb = arg;
+
+    uring_free(&eb->eb_ring);
+    free(eb->eb_errors);
+    free(eb->eb_dead);
+    free(eb);
+}
+
+static void
+epoll_batch_key_init(void)
+{
+    if (pthread_key_create(&batch_key, epoll_batch_destroy) != 0)
+        abort();
+}
+
+static struct epoll_batch *
+epoll_batch_new(void)
+{
+    struct epoll_batch *eb;
+
+    eb = calloc(1, sizeof(*eb));
+    if (eb == NULL)
+        return (NULL);
+    if (uring_setup(&eb->eb_ring, EPOLL_BATCH_MAX + 2) < 0) {
+        if (uring_epoll_ctl < 0)
+            uring_epoll_ctl = 0;
+        free(eb);
+        return (NULL);
+    }
+    if (uring_epoll_ctl < 0)
+        uring_probe(&eb->eb_ring);
+    if (uring_epoll_ctl == 0) {
+        uring_free(&eb->eb_ring);
+        free(eb);
+        return (NULL);
+    }
+
+    /* Free the ring when the thread exits */
+    (void) pthread_once(&batch_key_once, epoll_batch_key_init);
+    (void) pthread_setspecific(batch_key, eb);
+
+    return (eb);
+}
+
+/*
+ * Make room in eb_errors and eb_dead for a failure of every queued
+ * request, and of one more.
+ */
+static int
+epoll_batch_reserve(struct epoll_batch *eb)
+{
+    struct kevent_error *p;
+    struct epoll_batch_dead *d;
+    size_t max;
+
+    if (eb->eb_nerrors + eb->eb_nops < eb->eb_errors_max
+            && eb->eb_ndead + eb->eb_nops < eb->eb_errors_max)
+        return (0);
+
+    max = eb->eb_errors_max ? eb->eb_errors_max * 2 : 16;
+    p = realloc(eb->eb_errors, max * sizeof(*p));
+    if (p == NULL)
+        return (-1);
+    eb->eb_errors = p;
+    d = realloc(eb->eb_dead, max * sizeof(*d));
+    if (d == NULL)
+        return (-1);
+    eb->eb_dead = d;
+    eb->eb_errors_max = max;
+
+    return (0);
+}
+
+/* The room was reserved by epoll_batch_add() */
+static void
+epoll_batch_error(struct epoll_batch *eb, const struct kevent *change, int err)
+{
+    /* Only the first failure of a changelist entry is reported */
+    if (eb->eb_nerrors > 0
+            && eb->eb_errors[eb->eb_nerrors - 1].ke_change == change)
+        return;
+
+    eb->eb_errors[eb->eb_nerrors].ke_change = change;
+    eb->eb_errors[eb->eb_nerrors].ke_errno = err;
+    eb->eb_nerrors++;
+}
+
+/*
+ * Queue a submission entry for each request.
+ *
+ * @param flags IOSQE_IO_LINK or IOSQE_IO_HARDLINK
+ * @param last  nonzero to set the flags on the last entry as well
+ */
+static void
+epoll_batch_prep(struct epoll_batch *eb, int flags, int last)
+{
+    struct epoll_batch_op *bo;
+    struct io_uring_sqe *sqe;
+    unsigned i;
+
+    for (i = 0; i < eb->eb_nops; i++) {
+        bo = &eb->eb_ops[i];
+        bo->bo_res = -ECANCELED;
+        sqe = uring_get_sqe(&eb->eb_ring);
+        sqe->opcode = IORING_OP_EPOLL_CTL;
+        sqe->fd = bo->bo_epfd;
+        sqe->off = bo->bo_kn->kev.ident;
+        sqe->addr = (uintptr_t) &bo->bo_ev;
+        sqe->len = bo->bo_op;
+        sqe->user_data = i;
+        if (last || i + 1 < eb->eb_nops)
+            sqe->flags = flags;
+    }
+}
+
+/*
+ * Collect the <*n> outstanding completions.
+ *
+ * @return 0, or -1 if io_uring_enter(2) failed or was interrupted,
+ *         with the number of completions still outstanding in <*n>
+ */
+static int
+epoll_batch_reap(struct epoll_batch *eb, unsigned *n)
+{
+    struct uring *ur = &eb->eb_ring;
+    struct io_uring_cqe *cqe;
+    unsigned head, mask;
+
+    head = *ur->ur_cq_head;
+    mask = *ur->ur_cq_mask;
+    while (*n > 0) {
+        if (head == __atomic_load_n(ur->ur_cq_tail, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(ur->ur_cq_head, head, __ATOMIC_RELEASE);
+            if (syscall(__NR_io_uring_enter, ur->ur_fd, 0, 1,
+                        IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                if (errno != EINTR)
+                    dbg_perror("io_uring_enter(2)");
+                return (-1);
+            }
+            continue;
+        }
+        cqe = &ur->ur_cqes[head & mask];
+        if (cqe->user_data < eb->eb_nops)
+            eb->eb_ops[cqe->user_data].bo_res = cqe->res;
+        else if (cqe->user_data == UD_EPOLL_WAIT)
+            eb->eb_wait_res = cqe->res;
+        head++;
+        (*n)--;
+    }
+    __atomic_store_n(ur->ur_cq_head, head, __ATOMIC_RELEASE);
+
+    return (0);
+}
+
+/*
+ * Stop using io_uring after the ring failed. The requests that were
+ * not reaped still have bo_res == -ECANCELED, so epoll_batch_complete()
+ * applies them with epoll_ctl(2).
+ */
+static void
+epoll_batch_disable(void)
+{
+    dbg_puts("falling back to epoll_ctl(2) and epoll_wait(2)");
+    uring_epoll_ctl = 0;
+    uring_epoll_wait = 0;
+}
+
+/*
+ * Cancel the IORING_OP_EPOLL_WAIT in flight.
+ *
+ * @return the number of completions this adds
+ */
+static unsigned
+epoll_batch_cancel(struct epoll_batch *eb)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(&eb->eb_ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = UD_EPOLL_WAIT;
+    sqe->user_data = UD_CANCEL;
+
+    return (uring_submit(&eb->eb_ring, 1, 0));
+}
+
+/*
+ * Record the failures, and release the requests.
+ * Requests cancelled by an earlier failure in their chain are applied
+ * with epoll_ctl(2). The knotes whose creation failed are kept for
+ * epoll_batch_bury(), because a flush made by epoll_batch_add() runs
+ * with the lock of another knote held.
+ */
+static void
+epoll_batch_complete(struct epoll_batch *eb)
+{
+    struct epoll_batch_op *bo;
+    unsigned i;
+
+    eb->eb_flushing = 1;
+    for (i = 0; i < eb->eb_nops; i++) {
+        bo = &eb->eb_ops[i];
+        if (bo->bo_res == -ECANCELED) {
+            bo->bo_res = 0;
+            if (epoll_ctl(bo->bo_epfd, bo->bo_op, bo->bo_kn->kev.ident,
+                        &bo->bo_ev) < 0)
+                bo->bo_res = -errno;
+        }
+        if (bo->bo_res < 0) {
+            dbg_printf("epoll_ctl(2) op=%d fd=%d: %s", bo->bo_op,
+                    (int) bo->bo_kn->kev.ident, strerror(-bo->bo_res));
+
+            /* Report EFAULT, like a failed kn_create() would */
+            if (bo->bo_create && bo->bo_op == EPOLL_CTL_ADD) {
+                eb->eb_dead[eb->eb_ndead].bd_filt = bo->bo_filt;
+                eb->eb_dead[eb->eb_ndead].bd_kn = bo->bo_kn;
+                eb->eb_ndead++;
+                bo->bo_res = -EFAULT;
+                epoll_batch_error(eb, bo->bo_change, -bo->bo_res);
+                continue;
+            }
+            epoll_batch_error(eb, bo->bo_change, -bo->bo_res);
+        }
+        knote_release(bo->bo_kn);
+    }
+    eb->eb_nops = 0;
+    eb->eb_flushing = 0;
+}
+
+/*
+ * Undo the knote_insert() done by kevent_copyin_one() for the knotes
+ * whose creation failed. Called with the kqueue locked, and no other
+ * lock held.
+ */
+static void
+epoll_batch_bury(struct epoll_batch *eb)
+{
+    struct epoll_batch_dead *bd;
+    size_t i;
+
+    for (i = 0; i < eb->eb_ndead; i++) {
+        bd = &eb->eb_dead[i];
+        filter_lock(bd->bd_filt);
+        knote_lock(bd->bd_kn);
+        if (!(bd->bd_kn->kn_flags & KNFL_KNOTE_DELETED))
+            (void) knote_delete(bd->bd_filt, bd->bd_kn);
+        knote_unlock(bd->bd_kn);
+        filter_unlock(bd->bd_filt);
+        knote_release(bd->bd_kn);
+    }
+    eb->eb_ndead = 0;
+}
+
+/* Submit the queued requests and wait for all of them to complete. */
+static void
+epoll_batch_flush(struct epoll_batch *eb)
+{
+    unsigned pending;
+
+    if (eb->eb_nops == 0)
+        return;
+
+    dbg_printf("submitting %u epoll_ctl requests", eb->eb_nops);
+    epoll_batch_prep(eb, IOSQE_IO_HARDLINK, 0);
+    pending = uring_submit(&eb->eb_ring, eb->eb_nops, eb->eb_nops);
+    while (pending > 0 && epoll_batch_reap(eb, &pending) < 0) {
+        /* The requests complete without blocking, so wait for them */
+        if (errno != EINTR) {
+            epoll_batch_disable();
+            break;
+        }
+    }
+    epoll_batch_complete(eb);
+}
+
+/*
+ * Queue an epoll_ctl(2) request made while applying a changelist.
+ *
+ * @return 1 if the request was queued, or 0 if the caller should
+ * call epoll_ctl(2) itself.
+ */
+int
+epoll_batch_add(int op, struct filter *filt, struct knote *kn,
+        struct epoll_event *ev)
+{
+    struct epoll_batch *eb;
+    struct epoll_batch_op *bo;
+
+    if (kevent_change == NULL || uring_epoll_ctl == 0)
+        return (0);
+    eb = batch;
+    if (eb == NULL) {
+        if (uring_epoll_ctl < 0 && getenv("KQUEUE_IO_URING") == NULL) {
+            uring_epoll_ctl = 0;
+            return (0);
+        }
+        eb = batch = epoll_batch_new();
+        if (eb == NULL)
+            return (0);
+    }
+    if (eb->eb_flushing)
+        return (0);
+    if (eb->eb_nops == EPOLL_BATCH_MAX)
+        epoll_batch_flush(eb);
+    if (epoll_batch_reserve(eb) < 0)
+        return (0);
+
+    bo = &eb->eb_ops[eb->eb_nops++];
+    knote_retain(kn);
+    bo->bo_kn = kn;
+    bo->bo_filt = filt;
+    bo->bo_change = kevent_change;
+    bo->bo_epfd = knote_epfd(filt, kn);
+    bo->bo_op = op;
+    bo->bo_create = (knote_lookup(filt, kn->kev.ident) != kn);
+    if (ev != NULL)
+        memcpy(&bo->bo_ev, ev, sizeof(bo->bo_ev));
+    else
+        memset(&bo->bo_ev, 0, sizeof(bo->bo_ev));
+
+    return (1);
+}
+
+/*
+ * Submit the queued requests together with an IORING_OP_EPOLL_WAIT for
+ * up to <nevents> events, and wait for the requests to complete. The
+ * wait is reaped by epoll_batch_wait(), after the kqueue is unlocked.
+ *
+ * The requests and the wait are soft-linked, so a failure cancels the
+ * wait, and kevent() returns the error without waiting. If the chain is
+ * not submitted whole, the rest of the requests are applied with
+ * epoll_ctl(2), and the wait is done with epoll_wait(2).
+ *
+ * @return 0 if the wait is in flight, or -1 if the requests have been
+ *         completed without it
+ */
+static int
+epoll_batch_submit(struct epoll_batch *eb, struct kqueue *kq,
+        struct epoll_event *events, int nevents, const struct timespec *ts)
+{
+    struct io_uring_sqe *sqe;
+    unsigned n, submitted, pending;
+
+    eb->eb_wait_res = -ECANCELED;
+    eb->eb_cancelled = 0;
+
+    dbg_printf("submitting %u epoll_ctl requests with the wait", eb->eb_nops);
+    epoll_batch_prep(eb, IOSQE_IO_LINK, 1);
+    sqe = uring_get_sqe(&eb->eb_ring);
+    sqe->opcode = IORING_OP_EPOLL_WAIT;
+    sqe->fd = kqueue_epfd(kq);
+    sqe->addr = (uintptr_t) events;
+    sqe->len = nevents;
+    sqe->user_data = UD_EPOLL_WAIT;
+    n = eb->eb_nops + 1;
+    if (ts != NULL) {
+        sqe->flags = IOSQE_IO_LINK;
+        eb->eb_ts.tv_sec = ts->tv_sec;
+        eb->eb_ts.tv_nsec = ts->tv_nsec;
+        sqe = uring_get_sqe(&eb->eb_ring);
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->addr = (uintptr_t) &eb->eb_ts;
+        sqe->len = 1;
+        sqe->user_data = UD_TIMEOUT;
+        n++;
+    }
+
+    /* The requests complete first, because the wait is linked to them */
+    submitted = uring_submit(&eb->eb_ring, n, eb->eb_nops);
+    pending = (submitted < eb->eb_nops) ? submitted : eb->eb_nops;
+    eb->eb_pending = submitted - pending;
+    while (pending > 0 && epoll_batch_reap(eb, &pending) < 0) {
+        if (errno != EINTR) {
+            epoll_batch_disable();
+            break;
+        }
+    }
+    epoll_batch_complete(eb);
+    if (submitted <= eb->eb_nops || !uring_epoll_wait) {
+        dbg_printf("submitted %u of %u entries of the wait chain", submitted, n);
+        eb->eb_pending = 0;
+        return (-1);
+    }
+
+    if (submitted < n) {
+        /* The wait went in without its timeout */
+        eb->eb_pending += epoll_batch_cancel(eb);
+        eb->eb_cancelled = 1;
+    }
+    if (eb->eb_nerrors > 0) {
+        /* The wait was cancelled by the failure */
+        while (eb->eb_pending > 0
+                && epoll_batch_reap(eb, &eb->eb_pending) < 0) {
+            if (errno != EINTR) {
+                epoll_batch_disable();
+                break;
+            }
+        }
+        return (-1);
+    }
+
+    eb->eb_deferred = 1;
+    return (0);
+}
+
+int
+linux_kevent_flush(struct kqueue *kq, struct kevent_error **errs,
+        int nwait, const struct timespec *ts)
+{
+    struct epoll_batch *eb = batch;
+    struct epoll_event *events;
+    int rv;
+
+    if (eb == NULL)
+        return (0);
+
+    /*
+     * Submit the requests with the wait if their failures will fit in
+     * the eventlist.
+     */
+    if (nwait > 0 && uring_epoll_wait && eb->eb_nerrors == 0
+            && eb->eb_nops > 0 && eb->eb_nops <= (unsigned) nwait
+            && (events = linux_kevent_wait_buffer(kq, &nwait)) != NULL
+            && eb->eb_nops <= (unsigned) nwait
+            && epoll_batch_submit(eb, kq, events, nwait, ts) == 0) {
+        epoll_batch_bury(eb);
+        return (0);
+    }
+
+    epoll_batch_flush(eb);
+    epoll_batch_bury(eb);
+    *errs = eb->eb_errors;
+    rv = eb->eb_nerrors;
+    eb->eb_nerrors = 0;
+
+    return (rv);
+}
+
+int
+epoll_batch_deferred(void)
+{
+    return (batch != NULL && batch->eb_deferred);
+}
+
+/*
+ * Collect the events of the wait submitted by epoll_batch_submit().
+ * An interrupted wait is cancelled, and fails with EINTR. If the ring
+ * fails, or the wait went in without its timeout, it is done again
+ * with epoll_wait(2).
+ *
+ * @return the number of events, or -1 on error
+ */
+int
+epoll_batch_wait(struct kqueue *kq, struct epoll_event *events,
+        int nevents, const struct timespec *ts)
+{
+    struct epoll_batch *eb = batch;
+    int interrupted = 0;
+
+    eb->eb_deferred = 0;
+    while (eb->eb_pending > 0 && epoll_batch_reap(eb, &eb->eb_pending) < 0) {
+        if (errno != EINTR) {
+            epoll_batch_disable();
+            eb->eb_pending = 0;
+            eb->eb_cancelled = 1;
+            break;
+        }
+        if (!eb->eb_cancelled) {
+            eb->eb_pending += epoll_batch_cancel(eb);
+            eb->eb_cancelled = interrupted = 1;
+        }
+    }
+    if (interrupted && eb->eb_wait_res == -ECANCELED)
+        eb->eb_wait_res = -EINTR;
+
+    if (eb->eb_wait_res == -ECANCELED) {
+        if (eb->eb_cancelled)
+            return (epoll_wait(kqueue_epfd(kq), events, nevents,
+                        linux_timeout_ms(ts)));
+        /* The wait timed out */
+        return (0);
+    }
+    if (eb->eb_wait_res < 0) {
+        errno = -eb->eb_wait_res;
+        dbg_perror("IORING_OP_EPOLL_WAIT");
+        return (-1);
+    }
+
+    return (eb->eb_wait_res);
+}
+
+#else
+
+int
+epoll_batch_add(int op UNUSED, struct filter *filt UNUSED,
+        struct knote *kn UNUSED, struct epoll_event *ev UNUSED)
+{
+    return (0);
+}
+
+int
+linux_kevent_flush(struct kqueue *kq UNUSED, struct kevent_error **errs UNUSED,
+        int nwait UNUSED, const struct timespec *ts UNUSED)
+{
+    return (0);
+}
+
+int
+epoll_batch_deferred(void)
+{
+    return (0);
+}
+
+int
+epoll_batch_wait(struct kqueue *kq UNUSED, struct epoll_event *events UNUSED,
+        int nevents UNUSED, const struct timespec *ts UNUSED)
+{
+    return (0);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
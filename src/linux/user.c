@@ -29,202 +29,287 @@
 #include "sys/event.h"
 #include "private.h"
 
-/* NOTE: copy+pasted from linux_eventfd_raise() */
-static int
-eventfd_raise(int evfd)
+/*
+ * All the knotes share the filter's eventfd. A triggered knote is pushed
+ * onto a lock-free list, and the eventfd is raised when the list goes
+ * from empty to non-empty; copyout takes the whole list at once.
+ */
+struct evfilt_data {
+    struct knote * volatile pending;
+};
+
+/*
+ * Apply the NOTE_FF* operation in fflags to the knote, and set
+ * NOTE_TRIGGER if trigger is nonzero. This is done atomically,
+ * because kqueue_user_trigger() does it without the knote lock.
+ * Returns the previous fflags.
+ */
+static unsigned int
+user_fflags_update(struct knote *kn, unsigned int fflags, int trigger)
 {
-    uint64_t counter;
-    int rv = 0;
-
-    dbg_puts("raising event level");
-    counter = 1;
-    if (write(evfd, &counter, sizeof(counter)) < 0) {
-        switch (errno) {
-            case EAGAIN:    
-                /* Not considered an error */
+    unsigned int oval, nval;
+    unsigned int ffctrl = fflags & NOTE_FFCTRLMASK;
+
+    /* Excerpted from sys/kern/kern_event.c in FreeBSD HEAD */
+    fflags &= NOTE_FFLAGSMASK;
+    do {
+        oval = kn->kev.fflags;
+        switch (ffctrl) {
+            case NOTE_FFAND:
+                nval = oval & (fflags | ~NOTE_FFLAGSMASK);
                 break;
 
-            case EINTR:
-                rv = -EINTR;
+            case NOTE_FFOR:
+                nval = oval | fflags;
+                break;
+
+            case NOTE_FFCOPY:
+                nval = (oval & ~NOTE_FFLAGSMASK) | fflags;
                 break;
 
             default:
-                dbg_printf("write(2): %s", strerror(errno));
-                rv = -1;
+                nval = oval;
+                break;
         }
-    }
-    return (rv);
+        if (trigger)
+            nval |= NOTE_TRIGGER;
+    } while (atomic_cas(&kn->kev.fflags, oval, nval) != oval);
+
+    return (oval);
 }
 
-/* NOTE: copy+pasted from linux_eventfd_lower() */
-static int
-eventfd_lower(int evfd)
+/* Clear NOTE_TRIGGER, and return the fflags it was cleared from */
+static unsigned int
+user_fflags_clear_trigger(struct knote *kn)
 {
-    uint64_t cur;
-    ssize_t n;
-    int rv = 0;
-
-    /* Reset the counter */
-    dbg_puts("lowering event level");
-    n = read(evfd, &cur, sizeof(cur));
-    if (n < 0) {
-        switch (errno) {
-            case EAGAIN:    
-                /* Not considered an error */
-                break;
+    unsigned int oval;
 
-            case EINTR:
-                rv = -EINTR;
-                break;
+    do {
+        oval = kn->kev.fflags;
+    } while (atomic_cas(&kn->kev.fflags, oval, oval & ~NOTE_TRIGGER) != oval);
 
-            default:
-                dbg_printf("read(2): %s", strerror(errno));
-                rv = -1;
-        }
-    } else if (n != sizeof(cur)) {
-        dbg_puts("short read");
-        rv = -1;
-    }
-
-    return (rv);
+    return (oval);
 }
 
-int
-linux_evfilt_user_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
+/* Push the chain of knotes from first to last onto the pending list */
+static int
+user_push(struct filter *filt, struct knote *first, struct knote *last)
 {
-    memcpy(dst, &src->kev, sizeof(*dst));
-    dst->fflags &= ~NOTE_FFCTRLMASK;     //FIXME: Not sure if needed
-    dst->fflags &= ~NOTE_TRIGGER;
-    if (src->kev.flags & EV_ADD) {
-        /* NOTE: True on FreeBSD but not consistent behavior with
-           other filters. */
-        dst->flags &= ~EV_ADD;
-    }
-    if (src->kev.flags & EV_CLEAR)
-        src->kev.fflags &= ~NOTE_TRIGGER;
-    if (src->kev.flags & (EV_DISPATCH | EV_CLEAR | EV_ONESHOT)) {
-        if (eventfd_lower(src->kdata.kn_eventfd) < 0)
-            return (-1);
-    }
+    struct evfilt_data *ed = filt->kf_data;
+    struct knote *head;
 
-    if (src->kev.flags & EV_DISPATCH)
-        src->kev.fflags &= ~NOTE_TRIGGER;
+    do {
+        head = ed->pending;
+        last->data.user.next = head;
+    } while (atomic_ptr_cas(&ed->pending, head, first) != head);
 
+    if (head == NULL)
+        return (kqops.eventfd_raise(&filt->kf_efd));
     return (0);
 }
 
+/* Queue the knote for copyout, unless it is queued already */
+static int
+user_enqueue(struct filter *filt, struct knote *kn)
+{
+    if (atomic_cas(&kn->data.user.queued, 0, 1) != 0)
+        return (0);
+
+    /* The pending list holds a reference */
+    knote_retain(kn);
+    return (user_push(filt, kn, kn));
+}
+
+/* Apply fflags, and queue the knote if it was not already triggered */
+static int
+user_trigger(struct filter *filt, struct knote *kn, unsigned int fflags)
+{
+    if (user_fflags_update(kn, fflags, 1) & NOTE_TRIGGER)
+        return (0);
+    return (user_enqueue(filt, kn));
+}
+
 int
-linux_evfilt_user_knote_create(struct filter *filt, struct knote *kn)
+linux_evfilt_user_init(struct filter *filt)
 {
+    struct evfilt_data *ed;
     struct epoll_event ev;
-    int evfd;
 
-    /* Create an eventfd */
-    evfd = eventfd(0, 0);
-    if (evfd < 0) {
-        dbg_perror("eventfd");
-        goto errout;
+    ed = calloc(1, sizeof(*ed));
+    if (ed == NULL)
+        return (-1);
+    if (kqops.eventfd_init(&filt->kf_efd) < 0) {
+        free(ed);
+        return (-1);
     }
 
     /* Add the eventfd to the epoll set */
     memset(&ev, 0, sizeof(ev));
     ev.events = EPOLLIN;
-    ev.data.ptr = kn;
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, evfd, &ev) < 0) {
+    ev.data.ptr = epoll_filter_ptr(filt);
+    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD,
+                kqops.eventfd_descriptor(&filt->kf_efd), &ev) < 0) {
         dbg_perror("epoll_ctl(2)");
-        goto errout;
+        kqops.eventfd_close(&filt->kf_efd);
+        free(ed);
+        return (-1);
     }
 
-    kn->kdata.kn_eventfd = evfd;
-
+    filt->kf_data = ed;
     return (0);
+}
 
-errout:
-    (void) close(evfd);
-    kn->kdata.kn_eventfd = -1;
-    return (-1);
+void
+linux_evfilt_user_destroy(struct filter *filt)
+{
+    kqops.eventfd_close(&filt->kf_efd);
+    free(filt->kf_data);
+    filt->kf_data = NULL;
 }
 
 int
-linux_evfilt_user_knote_modify(struct filter *filt UNUSED, struct knote *kn, 
-        const struct kevent *kev)
+linux_evfilt_user_copyout(struct filter *filt, struct kevent *dst, int nevents)
 {
-    unsigned int ffctrl;
+    struct evfilt_data *ed = filt->kf_data;
+    struct knote *kn, *next, *list, *requeue, *requeue_last;
     unsigned int fflags;
+    int nret;
 
-    /* Excerpted from sys/kern/kern_event.c in FreeBSD HEAD */
-    ffctrl = kev->fflags & NOTE_FFCTRLMASK;
-    fflags = kev->fflags & NOTE_FFLAGSMASK;
-    switch (ffctrl) {
-        case NOTE_FFNOP:
-            break;
-
-        case NOTE_FFAND:
-            kn->kev.fflags &= fflags;
-            break;
-
-        case NOTE_FFOR:
-            kn->kev.fflags |= fflags;
-            break;
-
-        case NOTE_FFCOPY:
-            kn->kev.fflags = fflags;
-            break;
-
-        default:
-            /* XXX Return error? */
-            break;
+    /* Lower the eventfd first, so that a knote queued after the list
+       is taken raises it again */
+    if (kqops.eventfd_lower(&filt->kf_efd) < 0)
+        return (-1);
+    do {
+        list = ed->pending;
+    } while (atomic_ptr_cas(&ed->pending, list, NULL) != list);
+
+    /* The list is last-in first-out, so reverse it */
+    for (kn = list, list = NULL; kn != NULL; kn = next) {
+        next = kn->data.user.next;
+        kn->data.user.next = list;
+        list = kn;
     }
 
-    if ((!(kn->kev.flags & EV_DISABLE)) && kev->fflags & NOTE_TRIGGER) {
-        kn->kev.fflags |= NOTE_TRIGGER;
-        if (eventfd_raise(kn->kdata.kn_eventfd) < 0)
-            return (-1);
+    requeue = requeue_last = NULL;
+    for (kn = list, nret = 0; kn != NULL; kn = next) {
+        next = kn->data.user.next;
+
+        /* A disabled knote stays triggered, and is queued again when enabled */
+        if (kn->kn_flags & KNFL_KNOTE_DELETED || kn->kev.flags & EV_DISABLE) {
+            kn->data.user.queued = 0;
+            knote_release(kn);
+            continue;
+        }
+
+        /*
+         * Keep the knotes that do not fit, and the ones that stay
+         * triggered, on the list for the next call.
+         */
+        if (nret == nevents
+                || !(kn->kev.flags & (EV_DISPATCH | EV_CLEAR | EV_ONESHOT))) {
+            kn->data.user.next = requeue;
+            requeue = kn;
+            if (requeue_last == NULL)
+                requeue_last = kn;
+            if (nret == nevents)
+                continue;
+            fflags = kn->kev.fflags;
+        } else {
+            /*
+             * Dequeue the knote before clearing NOTE_TRIGGER. A trigger
+             * that comes in between sees NOTE_TRIGGER still set and does
+             * not queue the knote again, so it is reported with this event.
+             */
+            kn->data.user.queued = 0;
+            fflags = user_fflags_clear_trigger(kn);
+        }
+
+        memcpy(&dst[nret], &kn->kev, sizeof(*dst));
+        dst[nret].fflags = fflags & ~(NOTE_FFCTRLMASK | NOTE_TRIGGER);
+        if (kn->kev.flags & EV_ADD) {
+            /* NOTE: True on FreeBSD but not consistent behavior with
+               other filters. */
+            dst[nret].flags &= ~EV_ADD;
+        }
+        nret++;
+
+        if (kn->kev.flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        if (kn->kev.flags & EV_ONESHOT)
+            knote_delete(filt, kn); //FIXME: Error checking
+        if (!kn->data.user.queued)
+            knote_release(kn);
     }
 
+    if (requeue != NULL && user_push(filt, requeue, requeue_last) < 0)
+        return (-1);
+
+    return (nret);
+}
+
+int
+linux_evfilt_user_knote_create(struct filter *filt UNUSED, struct knote *kn)
+{
+    kn->data.user.next = NULL;
+    kn->data.user.queued = 0;
+    return (0);
+}
+
+int
+linux_evfilt_user_knote_modify(struct filter *filt, struct knote *kn, 
+        const struct kevent *kev)
+{
+    if (kev->fflags & NOTE_TRIGGER)
+        return (user_trigger(filt, kn, kev->fflags));
+
+    (void) user_fflags_update(kn, kev->fflags, 0);
     return (0);
 }
 
+/* Called by kqueue_user_trigger() without the kqueue lock */
 int
-linux_evfilt_user_knote_delete(struct filter *filt, struct knote *kn)
+linux_evfilt_user_knote_trigger(struct filter *filt, struct knote *kn,
+        unsigned int fflags)
 {
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, 
-                kn->kdata.kn_eventfd, NULL) < 0) {
-        dbg_perror("epoll_ctl(2)");
-        return (-1);
-    }
-    if (close(kn->kdata.kn_eventfd) < 0) {
-        dbg_perror("close(2)");
+    if (kn->kn_flags & KNFL_KNOTE_DELETED) {
+        errno = ENOENT;
         return (-1);
     }
-    dbg_printf("removed eventfd %d from the epollfd", kn->kdata.kn_eventfd); 
-    kn->kdata.kn_eventfd = -1;
+    return (user_trigger(filt, kn, fflags));
+}
 
+int
+linux_evfilt_user_knote_delete(struct filter *filt UNUSED, struct knote *kn UNUSED)
+{
+    /* If the knote is queued, copyout drops it */
     return (0);
 }
 
 int
 linux_evfilt_user_knote_enable(struct filter *filt, struct knote *kn)
 {
-    /* FIXME: what happens if NOTE_TRIGGER is in fflags?
-       should the event fire? */
-    return linux_evfilt_user_knote_create(filt, kn);
+    /* An event that was triggered while disabled fires now */
+    if (kn->kev.fflags & NOTE_TRIGGER)
+        return (user_enqueue(filt, kn));
+    return (0);
 }
 
 int
-linux_evfilt_user_knote_disable(struct filter *filt, struct knote *kn)
+linux_evfilt_user_knote_disable(struct filter *filt UNUSED, struct knote *kn UNUSED)
 {
-    return linux_evfilt_user_knote_delete(filt, kn);
+    return (0);
 }
 
 const struct filter evfilt_user = {
     EVFILT_USER,
+    linux_evfilt_user_init,
+    linux_evfilt_user_destroy,
     NULL,
-    NULL,
-    linux_evfilt_user_copyout,
     linux_evfilt_user_knote_create,
     linux_evfilt_user_knote_modify,
     linux_evfilt_user_knote_delete,
     linux_evfilt_user_knote_enable,
     linux_evfilt_user_knote_disable,   
+    linux_evfilt_user_copyout,
+    linux_evfilt_user_knote_trigger,
 };
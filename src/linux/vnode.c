@@ -14,8 +14,16 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/vfs.h>
+
 #include "private.h"
 
+#if HAVE_SYS_FANOTIFY_H
+# include <sys/fanotify.h>
+#endif
+
 #ifndef NDEBUG
 static char *
 inotify_mask_dump(uint32_t mask)
@@ -59,47 +67,169 @@ inotify_event_dump(struct inotify_event *evt)
 #endif /* !NDEBUG */
 
 
-/* TODO: USE this to get events with name field */
-int
-get_one_event(struct inotify_event *dst, int inofd)
-{
-    ssize_t n;
+/*
+ * All the vnode knotes of a kqueue share one inotify descriptor.
+ *
+ * Knotes are found by their watch descriptor through an open addressing
+ * hash table. Descriptors that refer to the same file get the same watch
+ * descriptor, so each slot holds a chain of knotes linked through
+ * kn->data.vnode.next, and the watch mask is the union of their masks.
+ *
+ * Events read from the inotify descriptor are accumulated in the knotes,
+ * which are queued until there is room to copy them out. If any are left
+ * over, the eventfd is raised so that epoll reports the filter again.
+ *
+ * When KQUEUE_VNODE_FANOTIFY is set in the environment, a fanotify
+ * descriptor is used instead. It marks each filesystem that has a watched
+ * file once, with FAN_MARK_FILESYSTEM, and reports events by file handle,
+ * so watching a file neither resolves its path nor adds a kernel watch.
+ * Each distinct file handle gets a vnode_fid with a made up watch
+ * descriptor, so the knotes are chained and queued the same way as with
+ * inotify. The fanotify event masks have the same values as the inotify
+ * ones. This needs CAP_SYS_ADMIN and file handle support in the
+ * filesystem; if fanotify_init(2) fails, inotify is used.
+ */
+struct evfilt_data {
+    int            inofd;
+    int            fanfd;       /* fanotify descriptor, or -1 */
+    int            evfd;
+    int            raised;      /* The eventfd is readable */
+    struct knote **wd_table;
+    size_t         wd_size;     /* Number of slots; a power of two */
+    size_t         wd_count;    /* Number of slots in use */
+    struct knote **pend;
+    size_t         npend;
+    size_t         pend_max;
+    RB_HEAD(vnode_fid_tree, vnode_fid) fids;
+    int            fid_next;    /* Last watch descriptor given to a vnode_fid */
+    fsid_t        *marked;      /* Filesystems marked for fanotify */
+    size_t         nmarked;
+};
 
-    dbg_puts("reading one inotify event");
-    for (;;) {
-        n = read(inofd, dst, sizeof(*dst));
-        if (n < 0) {
-            if (errno == EINTR)
-                continue;
-            dbg_perror("read");
-            return (-1);
-        } else {
-            break;
-        }
+/* A file watched through fanotify, and the knotes that watch it */
+struct vnode_fid {
+    RB_ENTRY(vnode_fid) vf_entry;
+    fsid_t         vf_fsid;
+    int            vf_wd;
+    int            vf_type;     /* Type and size of the file handle */
+    unsigned int   vf_bytes;
+    unsigned char  vf_handle[];
+};
+
+/* Size of the buffer for reading inotify and fanotify events */
+#define INOTIFY_BUFSZ   4096
+
+/*
+ * The largest inotify event, with a name. A read(2) that leaves room for
+ * one in the buffer has taken every queued event.
+ */
+#define INOTIFY_EVENT_MAX   (sizeof(struct inotify_event) + NAME_MAX + 1)
+
+/* Most reads of queued events made by one copyout */
+#define VNODE_DRAIN_MAX     16
+
+/* Initial number of slots in the watch descriptor table */
+#define WD_TABLE_MIN    64
+
+static __thread char inotify_buf[INOTIFY_BUFSZ]
+    __attribute__ ((aligned(8)));
+
+#define wd_hash(ed, wd) (((uint32_t) (wd) * 2654435761u) & ((ed)->wd_size - 1))
+
+static struct knote **
+wd_slot(struct evfilt_data *ed, int wd)
+{
+    struct knote **slot;
+    size_t i;
+
+    if (ed->wd_size == 0)
+        return (NULL);
+    for (i = wd_hash(ed, wd); ; i = (i + 1) & (ed->wd_size - 1)) {
+        slot = &ed->wd_table[i];
+        if (*slot == NULL || (*slot)->data.vnode.wd == wd)
+            return (slot);
     }
-    dbg_printf("read(2) from inotify wd: %ld bytes", (long) n);
+}
+
+static struct knote *
+wd_lookup(struct evfilt_data *ed, int wd)
+{
+    struct knote **slot = wd_slot(ed, wd);
 
-    /* FIXME-TODO: if len > 0, read(len) */
-    if (dst->len != 0) 
-        abort();
+    return ((slot == NULL) ? NULL : *slot);
+}
 
+static int
+wd_grow(struct evfilt_data *ed)
+{
+    struct knote **old = ed->wd_table;
+    size_t i, size = ed->wd_size;
+
+    ed->wd_size = size ? size * 2 : WD_TABLE_MIN;
+    ed->wd_table = calloc(ed->wd_size, sizeof(struct knote *));
+    if (ed->wd_table == NULL) {
+        ed->wd_table = old;
+        ed->wd_size = size;
+        return (-1);
+    }
+    for (i = 0; i < size; i++) {
+        if (old[i] != NULL)
+            *wd_slot(ed, old[i]->data.vnode.wd) = old[i];
+    }
+    free(old);
 
     return (0);
 }
 
+/* Make <kn> the head of the chain for its watch descriptor */
 static int
-add_watch(struct filter *filt, struct knote *kn)
+wd_insert(struct evfilt_data *ed, struct knote *kn)
 {
-    struct epoll_event ev;
-    int ifd;
-    char path[PATH_MAX];
-    uint32_t mask;
+    struct knote **slot;
+
+    slot = wd_slot(ed, kn->data.vnode.wd);
+    if (slot == NULL || *slot == NULL) {
+        if ((ed->wd_count + 1) * 2 > ed->wd_size) {
+            if (wd_grow(ed) < 0)
+                return (-1);
+            slot = wd_slot(ed, kn->data.vnode.wd);
+        }
+        ed->wd_count++;
+        kn->data.vnode.next = NULL;
+    } else {
+        kn->data.vnode.next = *slot;
+    }
+    *slot = kn;
 
-    /* Convert the fd to a pathname */
-    if (linux_fd_to_path(&path[0], sizeof(path), kn->kev.ident) < 0)
-        return (-1);
+    return (0);
+}
+
+/* Empty a slot, shifting back the slots that follow it */
+static void
+wd_remove(struct evfilt_data *ed, struct knote **slot)
+{
+    size_t i, j, k;
+
+    i = slot - ed->wd_table;
+    ed->wd_table[i] = NULL;
+    ed->wd_count--;
+    for (j = (i + 1) & (ed->wd_size - 1); ed->wd_table[j] != NULL;
+            j = (j + 1) & (ed->wd_size - 1)) {
+        k = wd_hash(ed, ed->wd_table[j]->data.vnode.wd);
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            ed->wd_table[i] = ed->wd_table[j];
+            ed->wd_table[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/* Convert the fflags to the inotify mask */
+static uint32_t
+vnode_mask(struct knote *kn)
+{
+    uint32_t mask;
 
-    /* Convert the fflags to the inotify mask */
     mask = IN_CLOSE;
     if (kn->kev.fflags & NOTE_DELETE)
         mask |= IN_ATTRIB | IN_DELETE_SELF;
@@ -112,93 +242,464 @@ add_watch(struct filter *filt, struct knote *kn)
         mask |= IN_ATTRIB;
     if (kn->kev.fflags & NOTE_RENAME)
         mask |= IN_MOVE_SELF;
-    if (kn->kev.flags & EV_ONESHOT)
-        mask |= IN_ONESHOT;
 
-    /* Create an inotify descriptor */
-    ifd = inotify_init();
-    if (ifd < 0) {
-        dbg_perror("inotify_init(2)");
+    return (mask);
+}
+
+static int
+pend_insert(struct evfilt_data *ed, struct knote *kn)
+{
+    struct knote **tmp;
+    size_t max;
+
+    if (ed->npend == ed->pend_max) {
+        max = ed->pend_max ? ed->pend_max * 2 : WD_TABLE_MIN;
+        tmp = realloc(ed->pend, max * sizeof(*tmp));
+        if (tmp == NULL) {
+            dbg_perror("realloc(3)");
+            return (-1);
+        }
+        ed->pend = tmp;
+        ed->pend_max = max;
+    }
+    ed->pend[ed->npend++] = kn;
+
+    return (0);
+}
+
+static void
+pend_remove(struct evfilt_data *ed, struct knote *kn)
+{
+    size_t i;
+
+    if (kn->data.vnode.pending == 0)
+        return;
+    kn->data.vnode.pending = 0;
+    for (i = 0; i < ed->npend; i++) {
+        if (ed->pend[i] == kn) {
+            ed->npend--;
+            memmove(&ed->pend[i], &ed->pend[i + 1],
+                    (ed->npend - i) * sizeof(ed->pend[0]));
+            break;
+        }
+    }
+}
+
+static int
+vnode_fid_cmp(struct vnode_fid *a, struct vnode_fid *b)
+{
+    int rv;
+
+    rv = memcmp(&a->vf_fsid, &b->vf_fsid, sizeof(a->vf_fsid));
+    if (rv == 0 && a->vf_type != b->vf_type)
+        rv = (a->vf_type < b->vf_type) ? -1 : 1;
+    if (rv == 0 && a->vf_bytes != b->vf_bytes)
+        rv = (a->vf_bytes < b->vf_bytes) ? -1 : 1;
+    if (rv == 0)
+        rv = memcmp(a->vf_handle, b->vf_handle, a->vf_bytes);
+    return (rv);
+}
+
+RB_GENERATE(vnode_fid_tree, vnode_fid, vf_entry, vnode_fid_cmp)
+
+#if HAVE_SYS_FANOTIFY_H && defined(FAN_REPORT_FID)
+
+/* Events reported for the files of a marked filesystem */
+#define FANOTIFY_MASK   (FAN_MODIFY | FAN_ATTRIB | FAN_DELETE_SELF | FAN_MOVE_SELF)
+
+/* The largest fanotify event that is reported with a file handle */
+#define FANOTIFY_EVENT_MAX  (sizeof(struct fanotify_event_metadata) \
+        + sizeof(struct fanotify_event_info_fid) + sizeof(struct file_handle) \
+        + MAX_HANDLE_SZ)
+
+/* A vnode_fid with room for the largest file handle */
+union vnode_fid_key {
+    struct vnode_fid vf;
+    char           buf[sizeof(struct vnode_fid) + MAX_HANDLE_SZ];
+};
+
+static int
+fanotify_open(void)
+{
+    int fd;
+
+    if (getenv("KQUEUE_VNODE_FANOTIFY") == NULL)
         return (-1);
+    fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_FID | FAN_NONBLOCK
+            | FAN_CLOEXEC, O_RDONLY);
+    if (fd < 0)
+        dbg_perror("fanotify_init(2)");
+    return (fd);
+}
+
+/* Mark the filesystem of <fd>, unless it already is */
+static int
+fanotify_mark_fs(struct evfilt_data *ed, int fd, const fsid_t *fsid)
+{
+    fsid_t *tmp;
+    size_t i;
+
+    for (i = 0; i < ed->nmarked; i++) {
+        if (memcmp(&ed->marked[i], fsid, sizeof(*fsid)) == 0)
+            return (0);
     }
 
-    /* Add the watch */
-    dbg_printf("inotify_add_watch(2); inofd=%d, %s, path=%s", 
-            ifd, inotify_mask_dump(mask), path);
-    kn->kev.data = inotify_add_watch(ifd, path, mask);
-    if (kn->kev.data < 0) {
-        dbg_perror("inotify_add_watch(2)");
-        goto errout;
+    tmp = realloc(ed->marked, (ed->nmarked + 1) * sizeof(*tmp));
+    if (tmp == NULL)
+        return (-1);
+    ed->marked = tmp;
+    if (fanotify_mark(ed->fanfd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                FANOTIFY_MASK, fd, NULL) < 0) {
+        dbg_perror("fanotify_mark(2)");
+        return (-1);
     }
+    ed->marked[ed->nmarked++] = *fsid;
+    dbg_printf("fanotify fd=%d marked the filesystem of fd=%d", ed->fanfd, fd);
 
-    /* Add the inotify fd to the epoll set */
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN;
-    ev.data.ptr = kn;
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, ifd, &ev) < 0) {
-        dbg_perror("epoll_ctl(2)");
-        goto errout;
+    return (0);
+}
+
+/* Find or create the vnode_fid of the file that <fd> refers to */
+static struct vnode_fid *
+fid_get(struct evfilt_data *ed, int fd)
+{
+    union {
+        struct file_handle fh;
+        char           buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    } h;
+    union vnode_fid_key key;
+    struct file_handle *fh = &h.fh;
+    struct vnode_fid *vf;
+    struct statfs sfs;
+    int mount_id;
+
+    fh->handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(fd, "", fh, &mount_id, AT_EMPTY_PATH) < 0) {
+        dbg_perror("name_to_handle_at(2)");
+        return (NULL);
+    }
+    if (fstatfs(fd, &sfs) < 0) {
+        dbg_perror("fstatfs(2)");
+        return (NULL);
     }
+    memset(&key.vf, 0, sizeof(key.vf));
+    key.vf.vf_fsid = sfs.f_fsid;
+    key.vf.vf_type = fh->handle_type;
+    key.vf.vf_bytes = fh->handle_bytes;
+    memcpy(&key.vf.vf_handle[0], fh->f_handle, fh->handle_bytes);
+
+    vf = RB_FIND(vnode_fid_tree, &ed->fids, &key.vf);
+    if (vf != NULL)
+        return (vf);
+
+    if (fanotify_mark_fs(ed, fd, &sfs.f_fsid) < 0)
+        return (NULL);
+    vf = malloc(sizeof(*vf) + key.vf.vf_bytes);
+    if (vf == NULL)
+        return (NULL);
+    memcpy(vf, &key.vf, sizeof(*vf) + key.vf.vf_bytes);
+    vf->vf_wd = ++ed->fid_next;
+    RB_INSERT(vnode_fid_tree, &ed->fids, vf);
+
+    return (vf);
+}
 
-    kn->kdata.kn_inotifyfd = ifd;
+/* Accumulate the events in the fanotify buffer into their knotes */
+static int
+fanotify_drain(struct evfilt_data *ed)
+{
+    struct fanotify_event_metadata *evt;
+    struct fanotify_event_info_fid *info;
+    struct file_handle *fh;
+    union vnode_fid_key key;
+    struct vnode_fid *vf;
+    struct knote *kn;
+    ssize_t n;
+    int reads;
+
+    /* Take everything that is queued, as inotify_drain() does */
+    for (reads = 0; reads < VNODE_DRAIN_MAX; reads++) {
+        n = read(ed->fanfd, &inotify_buf[0], sizeof(inotify_buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EWOULDBLOCK)
+                return (0);
+            dbg_perror("read(2) from fanotify");
+            return (-1);
+        }
+        dbg_printf("read(2) from fanotify fd: %ld bytes", (long) n);
+
+        for (evt = (struct fanotify_event_metadata *) &inotify_buf[0];
+                FAN_EVENT_OK(evt, n); evt = FAN_EVENT_NEXT(evt, n)) {
+            if (evt->vers != FANOTIFY_METADATA_VERSION) {
+                dbg_puts("fanotify metadata version mismatch");
+                return (-1);
+            }
+            if (evt->fd >= 0)
+                (void) close(evt->fd);
+            if (evt->mask & FAN_Q_OVERFLOW) {
+                dbg_puts("fanotify queue overflow; events were lost");
+                continue;
+            }
+
+            /* The file handle follows the metadata */
+            info = (struct fanotify_event_info_fid *)
+                    ((char *) evt + evt->metadata_len);
+            fh = (struct file_handle *) info->handle;
+            if (evt->event_len < evt->metadata_len + sizeof(*info) + sizeof(*fh)
+                    || info->hdr.info_type != FAN_EVENT_INFO_TYPE_FID
+                    || fh->handle_bytes > MAX_HANDLE_SZ)
+                continue;
+            memset(&key.vf, 0, sizeof(key.vf));
+            memcpy(&key.vf.vf_fsid, &info->fsid, sizeof(key.vf.vf_fsid));
+            key.vf.vf_type = fh->handle_type;
+            key.vf.vf_bytes = fh->handle_bytes;
+            memcpy(&key.vf.vf_handle[0], fh->f_handle, fh->handle_bytes);
+
+            /* Most events are for files that nobody is watching */
+            vf = RB_FIND(vnode_fid_tree, &ed->fids, &key.vf);
+            if (vf == NULL)
+                continue;
+
+            /*
+             * There are no close events, which would be reported for every
+             * file in the filesystem, so copyout checks each time whether
+             * the watched descriptor is still open.
+             */
+            for (kn = wd_lookup(ed, vf->vf_wd); kn != NULL;
+                    kn = kn->data.vnode.next) {
+                if (kn->data.vnode.pending == 0 && pend_insert(ed, kn) < 0)
+                    return (-1);
+                kn->data.vnode.pending |= (evt->mask & FANOTIFY_MASK) | IN_CLOSE;
+            }
+        }
+
+        if (n <= (ssize_t) (sizeof(inotify_buf) - FANOTIFY_EVENT_MAX))
+            break;
+    }
 
     return (0);
+}
 
-errout:
-    kn->kdata.kn_inotifyfd = -1;
-    (void) close(ifd);
+#else
+
+static int
+fanotify_open(void)
+{
     return (-1);
 }
 
+static struct vnode_fid *
+fid_get(struct evfilt_data *ed, int fd)
+{
+    (void) ed;
+    (void) fd;
+    errno = ENOSYS;
+    return (NULL);
+}
+
 static int
-delete_watch(struct filter *filt, struct knote *kn)
+fanotify_drain(struct evfilt_data *ed)
 {
-    int ifd = kn->kdata.kn_inotifyfd;
+    (void) ed;
+    return (0);
+}
 
-    if (ifd < 0)
-        return (0);
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, ifd, NULL) < 0) {
-        dbg_perror("epoll_ctl(2)");
+#endif /* HAVE_SYS_FANOTIFY_H */
+
+/* Watch the file through fanotify */
+static int
+add_fid(struct filter *filt, struct knote *kn)
+{
+    struct evfilt_data *ed = filt->kf_data;
+    struct vnode_fid *vf;
+
+    vf = fid_get(ed, kn->kev.ident);
+    if (vf == NULL)
+        return (-1);
+    kn->data.vnode.fid = vf;
+    kn->data.vnode.wd = vf->vf_wd;
+    kn->data.vnode.pending = 0;
+
+    if (wd_insert(ed, kn) < 0) {
+        if (wd_lookup(ed, vf->vf_wd) == NULL) {
+            RB_REMOVE(vnode_fid_tree, &ed->fids, vf);
+            free(vf);
+        }
+        kn->data.vnode.wd = -1;
         return (-1);
     }
-    (void) close(ifd);
-    kn->kdata.kn_inotifyfd = -1;
 
     return (0);
 }
 
-int
-evfilt_vnode_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
+static int
+add_watch(struct filter *filt, struct knote *kn)
 {
-    struct inotify_event evt;
-    struct stat sb;
+    struct evfilt_data *ed = filt->kf_data;
+    char path[PATH_MAX];
+    uint32_t mask;
 
-    if (get_one_event(&evt, src->kdata.kn_inotifyfd) < 0)
+    if (ed->fanfd >= 0)
+        return (add_fid(filt, kn));
+
+    /* Convert the fd to a pathname */
+    if (linux_fd_to_path(&path[0], sizeof(path), kn->kev.ident) < 0)
+        return (-1);
+
+    /* Add to the mask of any knote already watching the same file */
+    mask = vnode_mask(kn) | IN_MASK_ADD;
+
+    dbg_printf("inotify_add_watch(2); inofd=%d, %s, path=%s", 
+            ed->inofd, inotify_mask_dump(mask), path);
+    kn->data.vnode.wd = inotify_add_watch(ed->inofd, path, mask);
+    if (kn->data.vnode.wd < 0) {
+        dbg_perror("inotify_add_watch(2)");
         return (-1);
+    }
+    kn->data.vnode.pending = 0;
+
+    if (wd_insert(ed, kn) < 0) {
+        if (wd_lookup(ed, kn->data.vnode.wd) == NULL)
+            (void) inotify_rm_watch(ed->inofd, kn->data.vnode.wd);
+        kn->data.vnode.wd = -1;
+        return (-1);
+    }
+
+    return (0);
+}
+
+static int
+delete_watch(struct filter *filt, struct knote *kn)
+{
+    struct evfilt_data *ed = filt->kf_data;
+    struct knote **slot, **prev, *cur;
+    char path[PATH_MAX];
+    uint32_t mask;
+    int wd = kn->data.vnode.wd;
 
-    dbg_printf("inotify event: %s", inotify_event_dump(&evt));
-    if (evt.mask & IN_IGNORED) {
-        /* TODO: possibly return error when fs is unmounted */
-        dst->filter = 0;
+    if (wd < 0)
         return (0);
+    pend_remove(ed, kn);
+
+    slot = wd_slot(ed, wd);
+    kn->data.vnode.wd = -1;
+    if (slot == NULL || *slot == NULL)
+        return (0);
+    if (*slot == kn && kn->data.vnode.next == NULL) {
+        wd_remove(ed, slot);
+        if (ed->fanfd >= 0) {
+            RB_REMOVE(vnode_fid_tree, &ed->fids, kn->data.vnode.fid);
+            free(kn->data.vnode.fid);
+            return (0);
+        }
+        if (inotify_rm_watch(ed->inofd, wd) < 0) {
+            dbg_perror("inotify_rm_watch(2)");
+            return (-1);
+        }
+        return (0);
+    }
+    for (prev = slot; *prev != NULL; prev = &(*prev)->data.vnode.next) {
+        if (*prev == kn) {
+            *prev = kn->data.vnode.next;
+            break;
+        }
     }
 
-    /* Check if the watched file has been closed, and 
-       XXX-this may not exactly match the kevent() behavior if multiple file de
-scriptors reference the same file.
-    */
-    if (evt.mask & IN_CLOSE_WRITE || evt.mask & IN_CLOSE_NOWRITE) {
-        src->kn_flags |= EV_ONESHOT; /* KLUDGE: causes the knote to be deleted */
-        dst->filter = 0; /* KLUDGE: causes the event to be discarded */
+    /* The filesystem mark reports the same events for every file */
+    if (ed->fanfd >= 0)
+        return (0);
+
+    /* Shrink the watch mask to what the remaining knotes need */
+    for (mask = 0, cur = *slot; cur != NULL; cur = cur->data.vnode.next)
+        mask |= vnode_mask(cur);
+    if (linux_fd_to_path(&path[0], sizeof(path), (*slot)->kev.ident) < 0)
         return (0);
+    if (inotify_add_watch(ed->inofd, path, mask) < 0)
+        dbg_perror("inotify_add_watch(2)");
+
+    return (0);
+}
+
+/* Accumulate the events in the inotify buffer into their knotes */
+static int
+inotify_drain(struct evfilt_data *ed)
+{
+    struct inotify_event *evt;
+    struct knote *kn, *head, **slot;
+    ssize_t n;
+    char *p;
+    int reads;
+
+    /*
+     * Take everything that is queued, so that a burst of writes to a file
+     * is OR'ed into one pending mask and reported by one event, and the
+     * descriptor is not left readable.
+     */
+    for (reads = 0; reads < VNODE_DRAIN_MAX; reads++) {
+        n = read(ed->inofd, &inotify_buf[0], sizeof(inotify_buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EWOULDBLOCK)
+                return (0);
+            dbg_perror("read(2) from inotify");
+            return (-1);
+        }
+        dbg_printf("read(2) from inotify fd: %ld bytes", (long) n);
+
+        for (p = &inotify_buf[0]; p < &inotify_buf[0] + n; 
+                p += sizeof(*evt) + evt->len) {
+            evt = (struct inotify_event *) p;
+            dbg_printf("inotify event: %s", inotify_event_dump(evt));
+
+            /* Ignore events for the entries of a watched directory */
+            if (evt->len != 0)
+                continue;
+
+            if (evt->mask & IN_IGNORED) {
+                /* TODO: possibly return error when fs is unmounted */
+                slot = wd_slot(ed, evt->wd);
+                if (slot != NULL && *slot != NULL) {
+                    head = *slot;
+                    wd_remove(ed, slot);
+                    for (kn = head; kn != NULL; kn = kn->data.vnode.next) {
+                        pend_remove(ed, kn);
+                        kn->data.vnode.wd = -1;
+                    }
+                }
+                continue;
+            }
+
+            for (kn = wd_lookup(ed, evt->wd); kn != NULL; 
+                    kn = kn->data.vnode.next) {
+                if (kn->data.vnode.pending == 0 && pend_insert(ed, kn) < 0)
+                    return (-1);
+                kn->data.vnode.pending |= evt->mask;
+            }
+        }
+
+        if (n <= (ssize_t) (sizeof(inotify_buf) - INOTIFY_EVENT_MAX))
+            break;
     }
 
+    return (0);
+}
+
+/* Convert the accumulated inotify events of <src> to a kevent */
+static int
+vnode_event(struct kevent *dst, struct knote *src, uint32_t mask)
+{
+    struct stat sb;
+
     memcpy(dst, &src->kev, sizeof(*dst));
+    dst->fflags = 0;
     dst->data = 0;
 
     /* No error checking because fstat(2) should rarely fail */
     //FIXME: EINTR
-    if ((evt.mask & IN_ATTRIB || evt.mask & IN_MODIFY) 
+    if ((mask & IN_ATTRIB || mask & IN_MODIFY) 
         && fstat(src->kev.ident, &sb) == 0) {
         if (sb.st_nlink == 0 && src->kev.fflags & NOTE_DELETE) 
             dst->fflags |= NOTE_DELETE;
@@ -214,25 +715,151 @@ scriptors reference the same file.
        src->data.vnode.size = sb.st_size;
     }
 
-    if (evt.mask & IN_MODIFY && src->kev.fflags & NOTE_WRITE) 
+    if (mask & IN_MODIFY && src->kev.fflags & NOTE_WRITE) 
         dst->fflags |= NOTE_WRITE;
-    if (evt.mask & IN_ATTRIB && src->kev.fflags & NOTE_ATTRIB) 
+    if (mask & IN_ATTRIB && src->kev.fflags & NOTE_ATTRIB) 
         dst->fflags |= NOTE_ATTRIB;
-    if (evt.mask & IN_MOVE_SELF && src->kev.fflags & NOTE_RENAME) 
+    if (mask & IN_MOVE_SELF && src->kev.fflags & NOTE_RENAME) 
         dst->fflags |= NOTE_RENAME;
-    if (evt.mask & IN_DELETE_SELF && src->kev.fflags & NOTE_DELETE) 
+    if (mask & IN_DELETE_SELF && src->kev.fflags & NOTE_DELETE) 
         dst->fflags |= NOTE_DELETE;
 
-    if (evt.mask & IN_MODIFY && src->kev.fflags & NOTE_WRITE) 
-        dst->fflags |= NOTE_WRITE;
-    if (evt.mask & IN_ATTRIB && src->kev.fflags & NOTE_ATTRIB) 
-        dst->fflags |= NOTE_ATTRIB;
-    if (evt.mask & IN_MOVE_SELF && src->kev.fflags & NOTE_RENAME) 
-        dst->fflags |= NOTE_RENAME;
-    if (evt.mask & IN_DELETE_SELF && src->kev.fflags & NOTE_DELETE) 
-        dst->fflags |= NOTE_DELETE;
+    return (dst->fflags != 0);
+}
+
+int
+evfilt_vnode_init(struct filter *filt)
+{
+    struct evfilt_data *ed;
+    struct epoll_event ev;
+
+    ed = calloc(1, sizeof(*ed));
+    if (ed == NULL)
+        return (-1);
+    ed->evfd = -1;
+    ed->inofd = -1;
+    RB_INIT(&ed->fids);
+
+    /* Create a fanotify descriptor if asked to, or else an inotify one */
+    ed->fanfd = fanotify_open();
+    if (ed->fanfd < 0) {
+        ed->inofd = inotify_init();
+        if (ed->inofd < 0) {
+            dbg_perror("inotify_init(2)");
+            free(ed);
+            return (-1);
+        }
+        if (fcntl(ed->inofd, F_SETFL, O_NONBLOCK) < 0) {
+            dbg_perror("fcntl(2)");
+            goto errout;
+        }
+    }
+
+    ed->evfd = eventfd(0, 0);
+    if (ed->evfd < 0) {
+        dbg_perror("eventfd(2)");
+        goto errout;
+    }
+
+    /* Add both descriptors to the epoll set */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = epoll_filter_ptr(filt);
+    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD,
+                (ed->fanfd >= 0) ? ed->fanfd : ed->inofd, &ev) < 0
+            || epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, ed->evfd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        goto errout;
+    }
 
+    filt->kf_data = ed;
     return (0);
+
+errout:
+    if (ed->evfd >= 0)
+        (void) close(ed->evfd);
+    (void) close((ed->fanfd >= 0) ? ed->fanfd : ed->inofd);
+    free(ed);
+    return (-1);
+}
+
+void
+evfilt_vnode_destroy(struct filter *filt)
+{
+    struct evfilt_data *ed = filt->kf_data;
+    struct vnode_fid *vf;
+
+    (void) close((ed->fanfd >= 0) ? ed->fanfd : ed->inofd);
+    (void) close(ed->evfd);
+    while ((vf = RB_MIN(vnode_fid_tree, &ed->fids)) != NULL) {
+        RB_REMOVE(vnode_fid_tree, &ed->fids, vf);
+        free(vf);
+    }
+    free(ed->marked);
+    free(ed->wd_table);
+    free(ed->pend);
+    free(ed);
+    filt->kf_data = NULL;
+}
+
+int
+evfilt_vnode_copyout(struct filter *filt, struct kevent *dst, int nevents)
+{
+    struct evfilt_data *ed = filt->kf_data;
+    struct knote *kn;
+    eventfd_t cur;
+    uint32_t mask;
+    size_t i;
+    int nret;
+
+    if (ed->raised) {
+        if (eventfd_read(ed->evfd, &cur) < 0) {
+            dbg_perror("eventfd_read(3)");
+            return (-1);
+        }
+        ed->raised = 0;
+    }
+
+    if (((ed->fanfd >= 0) ? fanotify_drain(ed) : inotify_drain(ed)) < 0)
+        return (-1);
+
+    for (i = 0, nret = 0; i < ed->npend && nret < nevents; i++) {
+        kn = ed->pend[i];
+        mask = kn->data.vnode.pending;
+        kn->data.vnode.pending = 0;
+
+        /*
+         * Check if the watched descriptor has been closed.
+         * XXX-this may not exactly match the kevent() behavior if the
+         * descriptor number has been reused.
+         */
+        if (mask & IN_CLOSE && fcntl(kn->kev.ident, F_GETFD) < 0) {
+            knote_delete(filt, kn);
+            continue;
+        }
+
+        if (!vnode_event(&dst[nret], kn, mask))
+            continue;
+        nret++;
+
+        if (kn->kev.flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        if (kn->kev.flags & EV_ONESHOT)
+            knote_delete(filt, kn); //FIXME: Error checking
+    }
+    ed->npend -= i;
+    memmove(&ed->pend[0], &ed->pend[i], ed->npend * sizeof(ed->pend[0]));
+
+    /* Have epoll report the filter again for the knotes that are left */
+    if (ed->npend > 0) {
+        if (eventfd_write(ed->evfd, 1) < 0) {
+            dbg_perror("eventfd_write(3)");
+            return (-1);
+        }
+        ed->raised = 1;
+    }
+
+    return (nret);
 }
 
 int
@@ -246,7 +873,6 @@ evfilt_vnode_knote_create(struct filter *filt, struct knote *kn)
     }
     kn->data.vnode.nlink = sb.st_nlink;
     kn->data.vnode.size = sb.st_size;
-    kn->kev.data = -1;
 
     return (add_watch(filt, kn));
 }
@@ -281,12 +907,13 @@ evfilt_vnode_knote_disable(struct filter *filt, struct knote *kn)
 
 const struct filter evfilt_vnode = {
     EVFILT_VNODE,
+    evfilt_vnode_init,
+    evfilt_vnode_destroy,
     NULL,
-    NULL,
-    evfilt_vnode_copyout,
     evfilt_vnode_knote_create,
     evfilt_vnode_knote_modify,
     evfilt_vnode_knote_delete,
     evfilt_vnode_knote_enable,
     evfilt_vnode_knote_disable,        
+    evfilt_vnode_copyout,
 };
@@ -35,7 +35,11 @@ evfilt_socket_copyout(struct kevent *dst, struct knote *src, void *ptr)
 {
     struct epoll_event * const ev = (struct epoll_event *) ptr;
 
-    epoll_event_dump(ev);
+    /* epoll disarmed the descriptor when it reported this event */
+    if (src->data.events & EPOLLONESHOT && src->kn_peer == NULL)
+        src->kn_flags |= KNFL_DISARMED;
+
+    dbg_printf("epoll: %s", epoll_event_dump(ev));
     memcpy(dst, &src->kev, sizeof(*dst));
 #if defined(HAVE_EPOLLRDHUP)
     if (ev->events & EPOLLRDHUP || ev->events & EPOLLHUP)
@@ -48,11 +52,15 @@ evfilt_socket_copyout(struct kevent *dst, struct knote *src, void *ptr)
         dst->fflags = 1; /* FIXME: Return the actual socket error */
           
     /* On return, data contains the the amount of space remaining in the write buffer */
-    if (ioctl(dst->ident, SIOCOUTQ, &dst->data) < 0) {
+    if (src->kev.fflags & NOTE_NODATA) {
+        dst->data = 1;
+    } else if (ioctl(dst->ident, SIOCOUTQ, &dst->data) < 0) {
             /* race condition with socket close, so ignore this error */
             dbg_puts("ioctl(2) of socket failed");
             dst->data = 0;
     }
+    if (slowpath(src->kn_flags & KNFL_LOWAT))
+        linux_socket_lowat(dst, src, ev);
 
     return (0);
 }
@@ -60,8 +68,6 @@ evfilt_socket_copyout(struct kevent *dst, struct knote *src, void *ptr)
 int
 evfilt_socket_knote_create(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
-
     if (linux_get_descriptor_type(kn) < 0)
         return (-1);
 
@@ -76,11 +82,7 @@ evfilt_socket_knote_create(struct filter *filt, struct knote *kn)
     if (kn->kev.flags & EV_CLEAR)
         kn->data.events |= EPOLLET;
 
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
-
-    return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
+    return (linux_socket_register(filt, kn));
 }
 
 int
@@ -96,38 +98,30 @@ evfilt_socket_knote_modify(struct filter *filt, struct knote *kn,
 int
 evfilt_socket_knote_delete(struct filter *filt, struct knote *kn)
 {
-    if (kn->kev.flags & EV_DISABLE)
-        return (0);
-    else
-        return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
+    return (linux_socket_unregister(filt, kn));
 }
 
 int
 evfilt_socket_knote_enable(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
-
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
-
-    return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
+    return (linux_socket_enable(filt, kn));
 }
 
 int
 evfilt_socket_knote_disable(struct filter *filt, struct knote *kn)
 {
-    return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
+    return (linux_socket_disable(filt, kn));
 }
 
 const struct filter evfilt_write = {
     EVFILT_WRITE,
     NULL,
-    NULL,
+    linux_socket_destroy,
     evfilt_socket_copyout,
     evfilt_socket_knote_create,
     evfilt_socket_knote_modify,
     evfilt_socket_knote_delete,
     evfilt_socket_knote_enable,
     evfilt_socket_knote_disable,         
+    linux_socket_rearm,
 };
@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <limits.h>
 #include <stdlib.h>
 
 #include "sys/event.h"
@@ -21,30 +22,117 @@
 
 const struct filter evfilt_proc = EVFILT_NOTIMPL;
 
+/*
+ * poll(2) runs on a copy of the pollset, so that knotes can be added
+ * and removed while a thread waits. The copy belongs to the thread and
+ * is only grown, never freed.
+ */
+static __thread struct pollfd *poll_fds;
+static __thread void         **poll_udata;
+static __thread size_t         poll_max;
+static __thread int            poll_nfds;
+
+int
+posix_kqueue_init(struct kqueue *kq)
+{
+    posix_pollset_init(&kq->kq_pollset);
+    return (0);
+}
+
+void
+posix_kqueue_free(struct kqueue *kq)
+{
+    posix_pollset_free(&kq->kq_pollset);
+}
+
+/* Poll the descriptor that is shared by all the knotes of a filter */
 int
-posix_kevent_wait(
-        struct kqueue *kq, 
+posix_filter_init(struct kqueue *kq, struct filter *filt)
+{
+    if (filt->kf_pfd <= 0)
+        return (0);
+    return (posix_pollset_add(&kq->kq_pollset, filt->kf_pfd, POLLIN,
+                filt, NULL));
+}
+
+void
+posix_filter_free(struct kqueue *kq, struct filter *filt)
+{
+    struct posix_pollset *ps = &kq->kq_pollset;
+    size_t i;
+
+    for (i = 0; i < ps->ps_len; i++) {
+        if (ps->ps_ent[i].pe_udata == filt) {
+            posix_pollset_remove(ps, i);
+            break;
+        }
+    }
+}
+
+/* Copy the pollset to this thread's buffer; call with the kqueue locked */
+static int
+pollset_snapshot(struct posix_pollset *ps)
+{
+    struct pollfd *fds;
+    void **udata;
+    size_t i, max;
+
+    if (ps->ps_len > poll_max) {
+        for (max = poll_max ? poll_max : 64; max < ps->ps_len; max *= 2)
+            ;
+        fds = realloc(poll_fds, max * sizeof(*fds));
+        if (fds == NULL)
+            return (-1);
+        poll_fds = fds;
+        udata = realloc(poll_udata, max * sizeof(*udata));
+        if (udata == NULL)
+            return (-1);
+        poll_udata = udata;
+        poll_max = max;
+    }
+
+    memcpy(poll_fds, ps->ps_fds, ps->ps_len * sizeof(*poll_fds));
+    for (i = 0; i < ps->ps_len; i++)
+        poll_udata[i] = ps->ps_ent[i].pe_udata;
+
+    return ((int) ps->ps_len);
+}
+
+int
+posix_kevent_wait(struct kqueue *kq, int nevents UNUSED,
         const struct timespec *timeout)
 {
-    int n, nfds;
-    fd_set rfds;
+    int n, timeout_ms;
 
-    nfds = kq->kq_nfds;
-    rfds = kq->kq_fds;
+    kqueue_lock(kq);
+    poll_nfds = pollset_snapshot(&kq->kq_pollset);
+    kqueue_unlock(kq);
+    if (poll_nfds < 0) {
+        dbg_perror("realloc(3)");
+        return (-1);
+    }
+
+    /* Round up, so that a short timeout sleeps instead of polling */
+    if (timeout == NULL) {
+        timeout_ms = -1;
+    } else if (timeout->tv_sec >= INT_MAX / 1000) {
+        timeout_ms = INT_MAX;
+    } else {
+        timeout_ms = timeout->tv_sec * 1000
+            + (timeout->tv_nsec + 999999) / 1000000;
+    }
 
     dbg_puts("waiting for events");
-    n = pselect(nfds, &rfds, NULL , NULL, timeout, NULL);
+    n = poll(poll_fds, poll_nfds, timeout_ms);
     if (n < 0) {
         if (errno == EINTR) {
             dbg_puts("signal caught");
             return (-1);
         }
-        dbg_perror("pselect(2)");
+        dbg_perror("poll(2)");
         return (-1);
     }
 
-    kq->kq_rfds = rfds;
-
     return (n);
 }
 
@@ -52,28 +140,72 @@ int
 posix_kevent_copyout(struct kqueue *kq, int nready,
         struct kevent *eventlist, int nevents)
 {
+    struct posix_pollset *ps = &kq->kq_pollset;
+    struct kevent *start = eventlist;
     struct filter *filt;
-    int i, rv, nret;
-
-    nret = 0;
-    for (i = 0; (i < EVFILT_SYSCOUNT && nready > 0 && nevents > 0); i++) {
-//        dbg_printf("eventlist: n = %d nevents = %d", nready, nevents);
-        filt = &kq->kq_filt[i]; 
-//        dbg_printf("pfd[%d] = %d", i, filt->kf_pfd);
-        if (FD_ISSET(filt->kf_pfd, &kq->kq_rfds)) {
+    struct knote *kn;
+    int i, rv, room;
+
+    for (i = 0; i < poll_nfds && nready > 0; i++) {
+        if (poll_fds[i].revents == 0)
+            continue;
+        nready--;
+
+        room = nevents - (eventlist - start);
+        if (room == 0)
+            break;
+
+        /*
+         * The entry may have been removed or moved since the snapshot.
+         * Its descriptor is level-triggered, so if it is still watched,
+         * the next poll reports it again.
+         */
+        if ((size_t) i >= ps->ps_len || ps->ps_ent[i].pe_udata != poll_udata[i]
+                || ps->ps_fds[i].fd != poll_fds[i].fd) {
+            stats_spurious(kq);
+            continue;
+        }
+
+        /* A descriptor shared by the knotes of a filter */
+        if (ps->ps_ent[i].pe_index == NULL) {
+            filt = poll_udata[i];
             dbg_printf("pending events for filter %d (%s)", filt->kf_id, filter_name(filt->kf_id));
-            rv = filt->kf_copyout(filt, eventlist, nevents);
+            filter_lock(filt);
+            rv = filt->kf_copyout_filter(filt, eventlist, room);
+            filter_unlock(filt);
             if (rv < 0) {
                 dbg_puts("kevent_copyout failed");
-                nret = -1;
-                break;
+                return (-1);
             }
-            nret += rv;
             eventlist += rv;
-            nevents -= rv;
-            nready--;
+            continue;
+        }
+
+        kn = poll_udata[i];
+        filt = kq->kq_filt[~(kn->kev.filter)];
+        rv = filt->kf_copyout(eventlist, kn, &poll_fds[i]);
+        if (slowpath(rv < 0)) {
+            dbg_puts("knote_copyout failed");
+            return (-1);
+        }
+
+        /*
+         * Certain flags cause the associated knote to be deleted
+         * or disabled.
+         */
+        if (eventlist->flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        if (eventlist->flags & EV_ONESHOT)
+            knote_delete(filt, kn); //FIXME: Error checking
+
+        /* If an empty kevent structure is returned, the event is discarded. */
+        if (fastpath(eventlist->filter != 0)) {
+            eventlist++;
+        } else {
+            dbg_puts("spurious wakeup, discarding event");
+            stats_spurious(kq);
         }
     }
 
-    return (nret);
+    return (eventlist - start);
 }
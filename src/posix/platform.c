@@ -16,15 +16,90 @@
 
 #include "../common/private.h"
 
+/* Initial number of slots in a pollset */
+#define POLLSET_MIN 64
+
+void
+posix_pollset_init(struct posix_pollset *ps)
+{
+    ps->ps_fds = NULL;
+    ps->ps_ent = NULL;
+    ps->ps_len = 0;
+    ps->ps_max = 0;
+}
+
+void
+posix_pollset_free(struct posix_pollset *ps)
+{
+    free(ps->ps_fds);
+    free(ps->ps_ent);
+    posix_pollset_init(ps);
+}
+
+/*
+ * Poll fd for events on behalf of udata. If index is not NULL, it
+ * receives the position of the entry, and is kept up to date until the
+ * entry is removed.
+ */
 int
-posix_kqueue_init(struct kqueue *kq UNUSED)
+posix_pollset_add(struct posix_pollset *ps, int fd, short events,
+        void *udata, size_t *index)
 {
+    struct pollfd *fds;
+    struct posix_pollent *ent;
+    size_t max;
+
+    if (ps->ps_len == ps->ps_max) {
+        max = ps->ps_max ? ps->ps_max * 2 : POLLSET_MIN;
+        fds = realloc(ps->ps_fds, max * sizeof(*fds));
+        if (fds == NULL) {
+            dbg_perror("realloc(3)");
+            return (-1);
+        }
+        ps->ps_fds = fds;
+        ent = realloc(ps->ps_ent, max * sizeof(*ent));
+        if (ent == NULL) {
+            dbg_perror("realloc(3)");
+            return (-1);
+        }
+        ps->ps_ent = ent;
+        ps->ps_max = max;
+    }
+
+    fds = &ps->ps_fds[ps->ps_len];
+    fds->fd = fd;
+    fds->events = events;
+    fds->revents = 0;
+    ent = &ps->ps_ent[ps->ps_len];
+    ent->pe_udata = udata;
+    ent->pe_index = index;
+    if (index != NULL)
+        *index = ps->ps_len;
+    ps->ps_len++;
+
+    dbg_printf("fd=%d events=%#x slot=%zu", fd, events, ps->ps_len - 1);
     return (0);
 }
 
+/* Remove the entry at index, moving the last entry into its slot */
 void
-posix_kqueue_free(struct kqueue *kq UNUSED)
+posix_pollset_remove(struct posix_pollset *ps, size_t index)
 {
+    struct posix_pollent *ent;
+
+    if (index >= ps->ps_len)
+        return;
+
+    ent = &ps->ps_ent[index];
+    if (ent->pe_index != NULL)
+        *ent->pe_index = POSIX_POLLIDX_NONE;
+
+    if (--ps->ps_len == index)
+        return;
+    ps->ps_fds[index] = ps->ps_fds[ps->ps_len];
+    ps->ps_ent[index] = ps->ps_ent[ps->ps_len];
+    if (ent->pe_index != NULL)
+        *ent->pe_index = index;
 }
 
 int
@@ -29,6 +29,7 @@
 #define atomic_dec(p)   __sync_sub_and_fetch((p), 1)
 #define atomic_cas(p, oval, nval) __sync_val_compare_and_swap(p, oval, nval)
 #define atomic_ptr_cas(p, oval, nval) __sync_val_compare_and_swap(p, oval, nval)
+#define atomic_barrier() __sync_synchronize()
 
 /*
  * GCC-compatible branch prediction macros
@@ -53,7 +54,6 @@
 #include <pthread.h>
 #include <poll.h>
 #include <sys/resource.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -66,11 +66,53 @@
 #define EVENTFD_PLATFORM_SPECIFIC \
     int ef_wfd
 
+/*
+ * The descriptors polled by the POSIX backend, kept in a compact array
+ * that is passed to poll(2) as is. An entry is removed by moving the
+ * last entry into its slot, so each entry records where its owner keeps
+ * the index, and that index is updated when the entry moves.
+ */
+struct posix_pollent {
+    void        *pe_udata;      /* The knote, or the filter */
+    size_t      *pe_index;      /* The knote's kn_pollidx, or NULL */
+};
+
+struct posix_pollset {
+    struct pollfd        *ps_fds;
+    struct posix_pollent *ps_ent;
+    size_t                ps_len;
+    size_t                ps_max;
+};
+
+#define POSIX_POLLIDX_NONE ((size_t) -1)
+
+/*
+ * A platform that uses posix_kevent_wait() and posix_kevent_copyout()
+ * adds these to its KQUEUE_PLATFORM_SPECIFIC and KNOTE_PLATFORM_SPECIFIC.
+ * A filter that polls a descriptor for each knote passes the knote and
+ * &kn->kn_pollidx to posix_pollset_add(), and kn->kn_pollidx to
+ * posix_pollset_remove().
+ */
+#define POSIX_KQUEUE_PLATFORM_SPECIFIC \
+    struct posix_pollset kq_pollset
+#define POSIX_KNOTE_PLATFORM_SPECIFIC \
+    size_t kn_pollidx
+
+struct filter;
+struct kqueue;
+
 void    posix_kqueue_free(struct kqueue *);
 int     posix_kqueue_init(struct kqueue *);
 
-int     posix_kevent_wait(struct kqueue *, const struct timespec *);
+int     posix_kevent_wait(struct kqueue *, int, const struct timespec *);
 int     posix_kevent_copyout(struct kqueue *, int, struct kevent *, int);
+int     posix_filter_init(struct kqueue *, struct filter *);
+void    posix_filter_free(struct kqueue *, struct filter *);
+
+void    posix_pollset_init(struct posix_pollset *);
+void    posix_pollset_free(struct posix_pollset *);
+int     posix_pollset_add(struct posix_pollset *, int, short, void *, size_t *);
+void    posix_pollset_remove(struct posix_pollset *, size_t);
 
 int     posix_eventfd_init(struct eventfd *);
 void    posix_eventfd_close(struct eventfd *);
@@ -45,6 +45,7 @@ wait_thread(void *arg)
     struct filter *filt = (struct filter *) arg;
     struct knote *kn;
     int status, result;
+    unsigned int idx;
     pid_t pid;
     sigset_t sigmask;
 
@@ -84,6 +85,7 @@ wait_thread(void *arg)
 
         /* Scan the wait queue to see if anyone is interested */
         pthread_mutex_lock(&filt->kf_mtx);
+        idx = epoch_enter(&filt->kf_kqueue->kq_epoch);
         kn = knote_lookup(filt, pid);
         if (kn != NULL) {
             kn->kev.data = result;
@@ -94,6 +96,7 @@ wait_thread(void *arg)
             /* TODO: error handling */
             filter_raise(filt);
         }
+        epoch_exit(&filt->kf_kqueue->kq_epoch, idx);
         pthread_mutex_unlock(&filt->kf_mtx);
     }
 
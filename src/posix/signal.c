@@ -32,35 +32,51 @@
 /* Highest signal number supported. POSIX standard signals are < 32 */
 #define SIGNAL_MAX      32
 
+/*
+ * The handler only counts the signal in its sentry. The first signal
+ * after a copyout also writes a byte to kf_wfd, which makes kf_pfd
+ * readable; later ones see the pending flag and return, so a storm of
+ * signals costs one wakeup. Copyout clears the flag and then takes the
+ * count of every signal at once, which it reports in the data field.
+ */
 struct sentry {
     struct filter  *s_filt;
     struct knote   *s_knote;
     volatile uint32_t s_cnt;
 };
 
+struct evfilt_data {
+    volatile uint32_t pending;    /* Set once kf_wfd has been written to */
+};
+
 static pthread_mutex_t sigtbl_mtx = PTHREAD_MUTEX_INITIALIZER;
 static struct sentry sigtbl[SIGNAL_MAX];
 
-/* XXX-FIXME this will not work with multiple kqueue objects.
-   Need a linked list? Or should signals be delivered to all kqueue objects?
-   */
-static struct eventfd * sig_eventfd;
+/* Wake the kqueue, unless it was woken since its last copyout */
+static void
+signal_raise(struct filter *filt)
+{
+    struct evfilt_data *ed = filt->kf_data;
+
+    if (atomic_cas(&ed->pending, 0, 1) != 0)
+        return;
+    if (write(filt->kf_wfd, ".", 1) < 0) {
+        /* The socket is full, so the kqueue is already readable */
+    }
+}
 
+/* Only async-signal-safe calls may be made here */
 static void
 signal_handler(int sig)
 {
     struct sentry *s = &sigtbl[sig];
+    struct filter *filt;
+    int saved_errno = errno;
 
-    dbg_printf("caught sig=%d", sig);
     atomic_inc(&s->s_cnt);
-#if defined(__sun__)
-    if (port_send(s->s_filt->kf_kqueue->kq_port, 
-                   X_PORT_SOURCE_SIGNAL, &sigtbl[sig]) < 0) {
-        return; //FIXME: errorhandling
-    }
-#else
-    kqops.eventfd_raise(sig_eventfd);
-#endif
+    if ((filt = s->s_filt) != NULL)
+        signal_raise(filt);
+    errno = saved_errno;
 }
 
 static int
@@ -75,16 +91,21 @@ catch_signal(struct filter *filt, struct knote *kn)
 	sa.sa_flags |= SA_RESTART;
 	sigfillset(&sa.sa_mask);
 
-	if (sigaction(kn->kev.ident, &sa, NULL) == -1) {
-		dbg_perror("sigaction");
-		return (-1);
-	}
     /* FIXME: will clobber previous entry, if any */
     pthread_mutex_lock(&sigtbl_mtx);
-    sigtbl[kn->kev.ident].s_filt = filt;
-    sigtbl[kn->kev.ident].s_knote = kn;
+    sigtbl[sig].s_filt = filt;
+    sigtbl[sig].s_knote = kn;
     pthread_mutex_unlock(&sigtbl_mtx);
 
+	if (sigaction(sig, &sa, NULL) == -1) {
+		dbg_perror("sigaction");
+        pthread_mutex_lock(&sigtbl_mtx);
+        sigtbl[sig].s_filt = NULL;
+        sigtbl[sig].s_knote = NULL;
+        pthread_mutex_unlock(&sigtbl_mtx);
+		return (-1);
+	}
+
     dbg_printf("installed handler for signal %d", sig);
     return (0);
 }
@@ -105,6 +126,7 @@ ignore_signal(int sig)
     pthread_mutex_lock(&sigtbl_mtx);
     sigtbl[sig].s_filt = NULL;
     sigtbl[sig].s_knote = NULL;
+    sigtbl[sig].s_cnt = 0;
     pthread_mutex_unlock(&sigtbl_mtx);
 
     dbg_printf("removed handler for signal %d", sig);
@@ -114,22 +136,46 @@ ignore_signal(int sig)
 int
 evfilt_signal_init(struct filter *filt)
 {
-    if (kqops.eventfd_init(&filt->kf_efd) < 0)
+    struct evfilt_data *ed;
+    int fd[2];
+
+    ed = calloc(1, sizeof(*ed));
+    if (ed == NULL)
+        return (-1);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0) {
+        dbg_perror("socketpair(3)");
+        free(ed);
+        return (-1);
+    }
+    if (fcntl(fd[0], F_SETFL, O_NONBLOCK) < 0
+        || fcntl(fd[1], F_SETFL, O_NONBLOCK) < 0) {
+        dbg_perror("fcntl(2)");
+        close(fd[0]);
+        close(fd[1]);
+        free(ed);
         return (-1);
-    sig_eventfd = &filt->kf_efd; // XXX - does not work w/ multiple kqueues
+    }
+
+    filt->kf_wfd = fd[0];
+    filt->kf_pfd = fd[1];
+    filt->kf_data = ed;
     return (0);
 }
 
 void
 evfilt_signal_destroy(struct filter *filt)
 {
-    kqops.eventfd_close(&filt->kf_efd);
+    (void) close(filt->kf_wfd);
+    (void) close(filt->kf_pfd);
+    free(filt->kf_data);
+    filt->kf_data = NULL;
 }
 
 int
 evfilt_signal_knote_create(struct filter *filt, struct knote *kn)
 {
-    if (kn->kev.ident >= SIGNAL_MAX) {
+    if (kn->kev.ident == 0 || kn->kev.ident >= SIGNAL_MAX) {
         dbg_printf("unsupported signal number %u", 
                     (unsigned int) kn->kev.ident);
         return (-1);
@@ -170,57 +216,69 @@ evfilt_signal_knote_disable(struct filter *filt, struct knote *kn)
 }
 
 int
-evfilt_signal_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
+evfilt_signal_copyout(struct filter *filt, struct kevent *dst, int nevents)
 {
+    struct evfilt_data *ed = filt->kf_data;
+    struct knote *fired[SIGNAL_MAX];
     struct sentry *s;
     struct knote *kn;
-    int sig;
-
-    (void) src;
-
-#if defined(__sun__)
-    port_event_t pe;
-
-    port_event_dequeue(&pe, filt->kf_kqueue);
-    s = (struct sentry *) pe.portev_user;
-    sig = s - &sigtbl[0];
-#else
-    kqops.eventfd_lower(sig_eventfd);
-    sig = 1; //XXX-FIXME totally broken, workaround just to compile
-    s = &sigtbl[sig];
-#endif
-
-    kn = s->s_knote;
-    //TODO: READ counter: s->s_knote->kev.data = ?;
-    /* TODO: dst->data should be the number of times the signal occurred */
-    dst->ident = sig;
-    dst->filter = EVFILT_SIGNAL;
-    dst->udata = kn->kev.udata;
-    dst->flags = kn->kev.flags; 
-    dst->fflags = 0;
-    dst->data = 1;  
-
-#if DEADWOOD
-    if (kn->kev.flags & EV_DISPATCH) {
-        ignore_signal(kn->kev.ident);
-        KNOTE_DISABLE(kn);
-    } else if (kn->kev.flags & EV_ONESHOT) {
-        ignore_signal(kn->kev.ident);
-        knote_free(filt, kn);
+    uint32_t cnt;
+    char buf[64];
+    int i, sig, nret;
+
+    /* Clear the flag first, so that a signal caught from now on wakes us */
+    if (read(filt->kf_pfd, buf, sizeof(buf)) < 0 && errno != EAGAIN)
+        dbg_perror("read(2)");
+    ed->pending = 0;
+    atomic_barrier();
+
+    pthread_mutex_lock(&sigtbl_mtx);
+    for (sig = 1, nret = 0; sig < SIGNAL_MAX; sig++) {
+        s = &sigtbl[sig];
+        if (s->s_filt != filt || s->s_cnt == 0)
+            continue;
+
+        /* Signals that do not fit are reported by the next copyout */
+        if (nret == nevents) {
+            signal_raise(filt);
+            break;
+        }
+
+        do {
+            cnt = s->s_cnt;
+        } while (atomic_cas(&s->s_cnt, cnt, 0) != cnt);
+
+        kn = s->s_knote;
+        dst[nret].ident = sig;
+        dst[nret].filter = EVFILT_SIGNAL;
+        dst[nret].udata = kn->kev.udata;
+        dst[nret].flags = kn->kev.flags; 
+        dst[nret].fflags = 0;
+        dst[nret].data = cnt;
+        fired[nret++] = kn;
     }
-#endif
+    pthread_mutex_unlock(&sigtbl_mtx);
 
-    return (1);
+    /* Deleting or disabling a knote takes sigtbl_mtx */
+    for (i = 0; i < nret; i++) {
+        if (fired[i]->kev.flags & EV_DISPATCH)
+            knote_disable(filt, fired[i]); //FIXME: Error checking
+        if (fired[i]->kev.flags & EV_ONESHOT)
+            knote_delete(filt, fired[i]); //FIXME: Error checking
+    }
+
+    return (nret);
 }
 
 const struct filter evfilt_signal = {
     EVFILT_SIGNAL,
     evfilt_signal_init,
     evfilt_signal_destroy,
-    evfilt_signal_copyout,
+    NULL,
     evfilt_signal_knote_create,
     evfilt_signal_knote_modify,
     evfilt_signal_knote_delete,
     evfilt_signal_knote_enable,
     evfilt_signal_knote_disable,     
+    evfilt_signal_copyout,
 };
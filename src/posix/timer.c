@@ -20,9 +20,7 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/queue.h>
 #include <sys/socket.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <string.h>
 #include <time.h>
@@ -31,254 +29,223 @@
 #include "sys/event.h"
 #include "private.h"
 
-/* A request to sleep for a certain time */
-struct sleepreq {
-    int         pfd;            /* fd to poll for ACKs */
-    int         wfd;            /* fd to wake up when sleep is over */
-    uintptr_t   ident;          /* from kevent */
-    intptr_t    interval;       /* sleep time, in milliseconds */
-    pthread_cond_t  cond;
-    pthread_mutex_t mtx;
-    struct sleepstat *stat;
-};
-
-/* Information about a successful sleep operation */
-struct sleepinfo {
-    uintptr_t   ident;          /* from kevent */
-    uintptr_t   counter;        /* number of times the timer expired */
+/*
+ * All the timers of a kqueue are kept in a heap of timer knotes, and one
+ * thread sleeps until the earliest of them expires. It then writes a byte
+ * to kf_wfd, which makes kf_pfd readable, and waits for copyout to return
+ * the expired timers before it looks at the heap again.
+ */
+struct evfilt_data {
+    pthread_t         tid;
+    pthread_mutex_t   mtx;        /* Protects the members below */
+    pthread_cond_t    cond;       /* Signalled when the heap changes */
+    struct timer_heap heap;
+    int               signalled;  /* Nonzero until copyout runs */
+    int               running;
 };
 
 static void *
-sleeper_thread(void *arg)
+timer_thread(void *arg)
 {
-    struct sleepreq *sr = (struct sleepreq *) arg;
-    struct sleepinfo si;
-    struct timeval now;
+    struct filter *filt = arg;
+    struct evfilt_data *ed = filt->kf_data;
     struct timespec req;
-    sigset_t        mask;
-    ssize_t         cnt;
-    bool            cts = true;     /* Clear To Send */
-    char            buf[1];
-	int rv;
-
-#if 0
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-#endif
-
-    /* Initialize the response */
-    si.ident = sr->ident;
-    si.counter = 0;
+    uint64_t deadline;
+    sigset_t mask;
 
     /* Block all signals */
     sigfillset(&mask);
     (void) pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
-    for (;;) {
-
-        pthread_mutex_lock(&sr->mtx);
-
-        /* Convert the timeout into an absolute time */
-        /* Convert milliseconds into seconds+nanoseconds */
-        gettimeofday(&now, NULL);
-        req.tv_sec  = now.tv_sec + sr->interval / 1000;
-        req.tv_nsec = now.tv_usec + ((sr->interval % 1000) * 1000000);
-
-        /* Sleep */
-        dbg_printf("sleeping for %ld ms", (unsigned long) sr->interval);
-		rv = pthread_cond_timedwait(&sr->cond, &sr->mtx, &req);
-        pthread_mutex_unlock(&sr->mtx);
-        if (rv == 0) {
-            /* _timer_delete() has requested that we terminate */
-            dbg_puts("terminating sleeper thread");
-            break;
-        } else if (rv != 0) {
-            dbg_printf("rv=%d %s", rv, strerror(rv));
-			if (rv == EINTR)
-                abort(); //FIXME should not happen
-
-			//ASSUME: rv == ETIMEDOUT
+    pthread_mutex_lock(&ed->mtx);
+    while (ed->running) {
+        deadline = timer_heap_deadline(&ed->heap);
+        if (ed->signalled || deadline == 0) {
+            pthread_cond_wait(&ed->cond, &ed->mtx);
+            continue;
         }
-        si.counter++;
-        dbg_printf(" -------- sleep over (CTS=%d)----------", cts);
-
-        /* Test if the previous wakeup has been acknowledged */
-        if (!cts) {
-            cnt = read(sr->wfd, &buf, 1);
-            if (cnt < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    ;
-                } else {
-                    dbg_perror("read(2)");
-                    break;
-                }
-            } else if (cnt == 0) {
-                dbg_perror("short read(2)");
-                break;
-            } else {
-                cts = true;
-            }
+        if (deadline > timer_now()) {
+            req.tv_sec = deadline / 1000000000;
+            req.tv_nsec = deadline % 1000000000;
+            (void) pthread_cond_timedwait(&ed->cond, &ed->mtx, &req);
+            continue;
         }
 
-        /* Wake up kevent waiters if they are ready */
-        if (cts) {
-            cnt = write(sr->wfd, &si, sizeof(si));
-            if (cnt < 0) {
-                /* FIXME: handle EAGAIN */
-                dbg_perror("write(2)");
-            } else if ((size_t)cnt < sizeof(si)) {
-                dbg_puts("FIXME: handle short write"); 
-            } 
-            cts = false;
-            si.counter = 0;
-        }
+        /* Wake up kevent waiters */
+        dbg_puts("timer expired");
+        if (write(filt->kf_wfd, ".", 1) < 0 && errno != EAGAIN)
+            dbg_perror("write(2)");
+        ed->signalled = 1;
     }
+    pthread_mutex_unlock(&ed->mtx);
 
-    dbg_puts("sleeper thread exiting");
+    dbg_puts("timer thread exiting");
     return (NULL);
 }
 
+/* Start the timer, counting from now unless it is absolute; call with ed->mtx held */
 static int
-_timer_create(struct filter *filt, struct knote *kn)
+timer_schedule(struct evfilt_data *ed, struct knote *kn)
 {
-    pthread_attr_t attr;
-    pthread_t tid;
-    struct sleepreq *req;
-    kn->kev.flags |= EV_CLEAR;
-
-    req = malloc(sizeof(*req));
-    if (req == NULL) {
-        dbg_perror("malloc");
+    kn->data.timer.when = timer_first(kn, timer_now());
+    if (timer_heap_insert(&ed->heap, kn) < 0)
         return (-1);
-    }
-    req->pfd = filt->kf_pfd;
-    req->wfd = filt->kf_wfd;
-    req->ident = kn->kev.ident;
-    req->interval = kn->kev.data;
-    kn->data.sleepreq = req;
-    pthread_cond_init(&req->cond, NULL);
-    pthread_mutex_init(&req->mtx, NULL);
-
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    if (pthread_create(&tid, &attr, sleeper_thread, req) != 0) {
-        dbg_perror("pthread_create");
-        pthread_attr_destroy(&attr);
-        free(req);
-        return (-1);
-    }
-    pthread_attr_destroy(&attr);
 
-    return (0);
-}
+    /* The thread only needs to wake up if this timer is the earliest */
+    if (timer_heap_peek(&ed->heap) == kn)
+        pthread_cond_signal(&ed->cond);
 
-static int
-_timer_delete(struct knote *kn)
-{
-    if (kn->data.sleepreq != NULL) {
-        dbg_puts("deleting timer");
-        pthread_mutex_lock(&kn->data.sleepreq->mtx); //FIXME - error check
-        pthread_cond_signal(&kn->data.sleepreq->cond); //FIXME - error check
-        pthread_mutex_unlock(&kn->data.sleepreq->mtx); //FIXME - error check
-        pthread_cond_destroy(&kn->data.sleepreq->cond); //FIXME - error check
-        free(kn->data.sleepreq);
-        kn->data.sleepreq = NULL;
-    }
     return (0);
 }
 
 int
 evfilt_timer_init(struct filter *filt)
 {
+    struct evfilt_data *ed;
+    pthread_condattr_t attr;
     int fd[2];
 
+    ed = calloc(1, sizeof(*ed));
+    if (ed == NULL)
+        return (-1);
+
     if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0) {
         dbg_perror("socketpair(3)");
+        free(ed);
         return (-1);
     }
     if (fcntl(fd[0], F_SETFL, O_NONBLOCK) < 0
         || fcntl(fd[1], F_SETFL, O_NONBLOCK) < 0) {
         dbg_perror("fcntl(2)");
-        close(fd[0]);
-        close(fd[1]);
-        return (-1);
+        goto errout;
     }
 
+    pthread_mutex_init(&ed->mtx, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ed->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    timer_heap_init(&ed->heap);
+    ed->running = 1;
+
     filt->kf_wfd = fd[0];
     filt->kf_pfd = fd[1];
+    filt->kf_data = ed;
+
+    if (pthread_create(&ed->tid, NULL, timer_thread, filt) != 0) {
+        dbg_perror("pthread_create");
+        pthread_cond_destroy(&ed->cond);
+        pthread_mutex_destroy(&ed->mtx);
+        filt->kf_data = NULL;
+        goto errout;
+    }
 
     return (0);
+
+errout:
+    close(fd[0]);
+    close(fd[1]);
+    free(ed);
+    return (-1);
 }
 
 void
 evfilt_timer_destroy(struct filter *filt)
 {
+    struct evfilt_data *ed = filt->kf_data;
+
+    pthread_mutex_lock(&ed->mtx);
+    ed->running = 0;
+    pthread_cond_signal(&ed->cond);
+    pthread_mutex_unlock(&ed->mtx);
+    if (pthread_join(ed->tid, NULL) != 0)
+        dbg_perror("pthread_join");
+
     (void) close(filt->kf_wfd);
     (void) close(filt->kf_pfd);
+    pthread_cond_destroy(&ed->cond);
+    pthread_mutex_destroy(&ed->mtx);
+    timer_heap_free(&ed->heap);
+    free(ed);
+    filt->kf_data = NULL;
 }
 
 int
-evfilt_timer_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
+evfilt_timer_copyout(struct filter *filt, struct kevent *dst, int nevents)
 {
-    struct filter *filt;
-    struct sleepinfo    si;
-    ssize_t       cnt;
+    struct evfilt_data *ed = filt->kf_data;
     struct knote *kn;
+    uint64_t now, expired, interval;
+    char buf[64];
+    int nret;
+
+    /* Reset the wakeup; it may already have been read */
+    if (read(filt->kf_pfd, buf, sizeof(buf)) < 0 && errno != EAGAIN)
+        dbg_perror("read(2)");
+
+    pthread_mutex_lock(&ed->mtx);
+    now = timer_now();
+    for (nret = 0; nret < nevents; nret++, dst++) {
+        kn = timer_heap_peek(&ed->heap);
+        if (kn == NULL || kn->data.timer.when > now)
+            break;
 
-    filt = knote_get_filter(src);
-
-    /* Read the ident */
-    cnt = read(filt->kf_pfd, &si, sizeof(si));
-    if (cnt < 0) {
-        if (errno == EINTR)
-            return (-EINTR);
-        /* FIXME: handle EAGAIN */
-        dbg_printf("read(2): %s", strerror(errno));
-        return (-1);
-    } else if ((size_t)cnt < sizeof(si)) {
-        dbg_puts("error: short read");
-        return (-1);
-    }
-
-    /* Acknowlege receipt */
-    cnt = write(filt->kf_pfd, ".", 1);
-    if (cnt < 0) {
-        /* FIXME: handle EAGAIN and EINTR */
-        dbg_printf("write(2): %s", strerror(errno));
-        return (-1);
-    } else if (cnt < 1) {
-        dbg_puts("error: short write");
-        return (-1);
-    }
-
-    kn = knote_lookup(filt, si.ident);
+        timer_heap_remove(&ed->heap, kn);
+        memcpy(dst, &kn->kev, sizeof(*dst));
 
-    /* Race condition: timer events remain queued even after
-       the knote is deleted. Ignore these events */
-    if (kn == NULL)
-        return (0);
+        /* knote_delete() and knote_disable() take the lock themselves */
+        if (kn->kev.flags & EV_ONESHOT) {
+            dst->data = 1;
+            pthread_mutex_unlock(&ed->mtx);
+            knote_delete(filt, kn); //FIXME: Error checking
+            pthread_mutex_lock(&ed->mtx);
+            continue;
+        }
 
-    dbg_printf("knote=%p", kn);
-    memcpy(dst, &kn->kev, sizeof(*dst));
+        /* An absolute timer expires once, and is not armed again */
+        if (kn->kev.fflags & NOTE_ABSTIME) {
+            dst->data = 1;
+            continue;
+        }
 
-    dst->data = si.counter;
+        /* On return, data contains the number of times the
+           timer has been triggered.
+         */
+        interval = timer_interval(kn);
+        expired = 1 + (now - kn->data.timer.when) / interval;
+        kn->data.timer.when += expired * interval;
+        dst->data = expired;
+
+        if (kn->kev.flags & EV_DISPATCH) {
+            pthread_mutex_unlock(&ed->mtx);
+            knote_disable(filt, kn); //FIXME: Error checking
+            pthread_mutex_lock(&ed->mtx);
+        } else if (timer_heap_insert(&ed->heap, kn) < 0) {
+            dbg_puts("unable to rearm the timer");
+        }
+    }
 
-#if DEADWOOD
-    if (kn->kev.flags & EV_DISPATCH) {
-        KNOTE_DISABLE(kn);
-        _timer_delete(kn);
-    } else if (kn->kev.flags & EV_ONESHOT) {
-        _timer_delete(kn);
-        knote_free(filt, kn);
-    } 
-#endif
+    /* Timers that did not fit in the eventlist wake the thread up at once */
+    ed->signalled = 0;
+    pthread_cond_signal(&ed->cond);
+    pthread_mutex_unlock(&ed->mtx);
 
-    return (1);
+    return (nret);
 }
 
 int
 evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
 {
-    return _timer_create(filt, kn);
+    struct evfilt_data *ed = filt->kf_data;
+    int rv;
+
+    kn->kev.flags |= EV_CLEAR;
+
+    pthread_mutex_lock(&ed->mtx);
+    rv = timer_schedule(ed, kn);
+    pthread_mutex_unlock(&ed->mtx);
+
+    return (rv);
 }
 
 int
@@ -288,24 +255,33 @@ evfilt_timer_knote_modify(struct filter *filt, struct knote *kn,
     (void) filt;
     (void) kn;
     (void) kev;
-    return (-1); /* STUB */
+    return (0); /* STUB */
 }
 
 int
 evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
 {
-    (void) filt;
-    if (kn->kev.flags & EV_DISABLE)
-        return (0);
+    struct evfilt_data *ed = filt->kf_data;
 
     dbg_printf("deleting timer # %d", (int) kn->kev.ident);
-    return _timer_delete(kn);
+    pthread_mutex_lock(&ed->mtx);
+    timer_heap_remove(&ed->heap, kn);
+    pthread_mutex_unlock(&ed->mtx);
+
+    return (0);
 }
 
 int
 evfilt_timer_knote_enable(struct filter *filt, struct knote *kn)
 {
-    return evfilt_timer_knote_create(filt, kn);
+    struct evfilt_data *ed = filt->kf_data;
+    int rv;
+
+    pthread_mutex_lock(&ed->mtx);
+    rv = timer_schedule(ed, kn);
+    pthread_mutex_unlock(&ed->mtx);
+
+    return (rv);
 }
 
 int
@@ -318,10 +294,11 @@ const struct filter evfilt_timer = {
     EVFILT_TIMER,
     evfilt_timer_init,
     evfilt_timer_destroy,
-    evfilt_timer_copyout,
+    NULL,
     evfilt_timer_knote_create,
     evfilt_timer_knote_modify,
     evfilt_timer_knote_delete,
     evfilt_timer_knote_enable,
     evfilt_timer_knote_disable,     
+    evfilt_timer_copyout,
 };
@@ -16,6 +16,7 @@
 
 #include "../common/private.h"
 
+const struct filter evfilt_aio   = EVFILT_NOTIMPL;
 const struct filter evfilt_vnode = EVFILT_NOTIMPL;
 const struct filter evfilt_proc  = EVFILT_NOTIMPL;
 
@@ -96,11 +97,7 @@ solaris_kqueue_init(struct kqueue *kq)
         return (-1);
     }
     dbg_printf("created event port; fd=%d", kq->kq_id);
-
-    if (filter_register_all(kq) < 0) {
-        close(kq->kq_id);
-        return (-1);
-    }
+    kq->kq_rearm = NULL;
 
     return (0);
 }
@@ -108,23 +105,86 @@ solaris_kqueue_init(struct kqueue *kq)
 void
 solaris_kqueue_free(struct kqueue *kq)
 {
+    if (kq->kq_id < 0)
+        return;
     (void) close(kq->kq_id);
     dbg_printf("closed event port; fd=%d", kq->kq_id);
 }
 
+/*
+ * Event ports dissociate a descriptor when they report it, so a socket
+ * knote has to be associated again after each event. Instead of doing
+ * that as each event is copied out, the knotes are queued and
+ * reassociated together before the next wait. Knotes that are deleted or
+ * disabled in the meantime are skipped. Call with the kqueue lock held.
+ */
+void
+solaris_rearm_add(struct kqueue *kq, struct knote *kn)
+{
+    if (kn->kn_rearm == REARM_NONE) {
+        knote_retain(kn);
+        kn->kn_rearm_next = kq->kq_rearm;
+        kq->kq_rearm = kn;
+    }
+    kn->kn_rearm = REARM_PENDING;
+}
+
+/*
+ * Forget that a knote has to be reassociated. Returns 1 if it was
+ * waiting, which means the descriptor is not associated with the port.
+ */
+int
+solaris_rearm_cancel(struct knote *kn)
+{
+    if (kn->kn_rearm != REARM_PENDING)
+        return (0);
+    kn->kn_rearm = REARM_CANCELLED;
+    return (1);
+}
+
+static void
+solaris_rearm_flush(struct kqueue *kq)
+{
+    struct knote *kn, *next;
+    struct filter *filt;
+    int state;
+
+    kqueue_lock(kq);
+    for (kn = kq->kq_rearm; kn != NULL; kn = next) {
+        next = kn->kn_rearm_next;
+        state = kn->kn_rearm;
+        kn->kn_rearm = REARM_NONE;
+        if (state == REARM_PENDING) {
+            filt = kq->kq_filt[~(kn->kev.filter)];
+            if (filt->kn_create(filt, kn) < 0)
+                dbg_puts("failed to reassociate the descriptor");
+        }
+        knote_release(kn);
+    }
+    kq->kq_rearm = NULL;
+    kqueue_unlock(kq);
+}
+
 int
 solaris_kevent_wait(
         struct kqueue *kq, 
-        int nevents UNUSED,
+        int nevents,
         const struct timespec *ts)
 
 {
     int rv;
     uint_t nget = 1;
 
+    if (nevents > MAX_KEVENT)
+        nevents = MAX_KEVENT;
+
+    if (kq->kq_rearm != NULL)
+        solaris_rearm_flush(kq);
+
+    /* Block until at least one event is ready, then take up to nevents */
     reset_errno();
     dbg_puts("waiting for events");
-    rv = port_getn(kq->kq_id, &evbuf[0], 1, &nget, (struct timespec *) ts);
+    rv = port_getn(kq->kq_id, &evbuf[0], nevents, &nget, (struct timespec *) ts);
 
     dbg_printf("rv=%d errno=%d (%s) nget=%d", rv, errno, strerror(errno), nget);
     if ((rv < 0) && (nget < 1)) {
@@ -145,12 +205,13 @@ solaris_kevent_wait(
 
 int
 solaris_kevent_copyout(struct kqueue *kq, int nready,
-        struct kevent *eventlist, int nevents UNUSED)
+        struct kevent *eventlist, int nevents)
 {
+    struct kevent *start = eventlist;
     port_event_t  *evt;
     struct knote  *kn;
     struct filter *filt;
-    int i, rv, skip_event, skipped_events = 0;
+    int i, rv, skip_event;
 
     for (i = 0; i < nready; i++) {
         evt = &evbuf[i];
@@ -160,15 +221,14 @@ solaris_kevent_copyout(struct kqueue *kq, int nready,
 
         switch (evt->portev_source) {
             case PORT_SOURCE_FD:
-//XXX-FIXME WHAT ABOUT WRITE???
-                filter_lookup(&filt, kq, EVFILT_READ);
+                filt = kq->kq_filt[~(kn->kev.filter)];
                 rv = filt->kf_copyout(eventlist, kn, evt);
 
                 /* For sockets, the event port object must be reassociated
                    after each event is retrieved. */
                 if (rv == 0 && !(kn->kev.flags & EV_DISPATCH 
                             || kn->kev.flags & EV_ONESHOT)) {
-                    rv = filt->kn_create(filt, kn);
+                    solaris_rearm_add(kq, kn);
                 }
                 
                 if (eventlist->data == 0) // if zero data is returned, we raced with a read of data from the socket, skip event to have proper semantics
@@ -176,10 +236,22 @@ solaris_kevent_copyout(struct kqueue *kq, int nready,
                 
                 break;
 
+            /*
+             * The shared timer of the filter, which may return several
+             * events. Room is kept for the port events after this one.
+             */
             case PORT_SOURCE_TIMER:
                 filter_lookup(&filt, kq, EVFILT_TIMER);
-                rv = filt->kf_copyout(eventlist, kn, evt);
-                break;
+                filter_lock(filt);
+                rv = filt->kf_copyout_filter(filt, eventlist,
+                        nevents - (eventlist - start) - (nready - i - 1));
+                filter_unlock(filt);
+                if (rv < 0) {
+                    dbg_puts("kevent_copyout failed");
+                    return (-1);
+                }
+                eventlist += rv;
+                continue;
 
             case PORT_SOURCE_USER:
                 switch (evt->portev_events) {
@@ -218,13 +290,11 @@ solaris_kevent_copyout(struct kqueue *kq, int nready,
             knote_delete(filt, kn); //TODO: Error checking
         }
 
-        if (skip_event)
-            skipped_events++;
-        else
+        if (!skip_event)
             eventlist++;
     }
 
-    return (nready - skipped_events);
+    return (eventlist - start);
 }
 
 const struct kqueue_vtable kqops =
@@ -44,9 +44,30 @@
 #define kqueue_epfd(kq)     ((kq)->kq_id)
 #define filter_epfd(filt)   ((filt)->kf_kqueue->kq_id)
 
+/*
+ * Additional members of struct knote
+ */
+#define KNOTE_PLATFORM_SPECIFIC \
+    struct knote *kn_rearm_next;    /* Next knote waiting to be reassociated */ \
+    int kn_rearm                    /* One of the REARM_* values */
+
+/* States of knote->kn_rearm */
+#define REARM_NONE      0   /* Not on the list */
+#define REARM_PENDING   1   /* Reassociate at the next kevent_wait() */
+#define REARM_CANCELLED 2   /* On the list, but deleted or disabled since */
+
+/*
+ * Additional members of struct kqueue
+ */
+#define KQUEUE_PLATFORM_SPECIFIC \
+    struct knote *kq_rearm          /* Descriptors to reassociate */
+
 void    solaris_kqueue_free(struct kqueue *);
 int     solaris_kqueue_init(struct kqueue *);
 
+void    solaris_rearm_add(struct kqueue *, struct knote *);
+int     solaris_rearm_cancel(struct knote *);
+
 /*
  * Data structures
  */
@@ -79,6 +79,10 @@ evfilt_socket_knote_delete(struct filter *filt, struct knote *kn)
         return (0);
     */
 
+    /* Not associated while it waits to be reassociated */
+    if (solaris_rearm_cancel(kn))
+        return (0);
+
     if (port_dissociate(filter_epfd(filt), PORT_SOURCE_FD, kn->kev.ident) < 0) {
         dbg_perror("port_dissociate(2)");
         return (-1);
@@ -48,99 +48,160 @@ itimerspec_dump(struct itimerspec *ts)
 }
 #endif
 
-/* Convert milliseconds into seconds+nanoseconds */
-static void
-convert_msec_to_itimerspec(struct itimerspec *dst, int src, int oneshot)
+/*
+ * All the timers of a kqueue share one POSIX timer, which notifies the
+ * event port when the earliest timer in a heap of timer knotes expires,
+ * as on Linux. Arming and cancelling a timer only updates the heap, and
+ * calls timer_settime(3C) if the new timer expires before the one the
+ * POSIX timer is armed for.
+ */
+struct evfilt_data {
+    timer_t           timerid;
+    struct timer_heap heap;
+    uint64_t          armed;      /* Expiration the timer is set for, or 0 */
+};
+
+/* Arm the POSIX timer for the earliest timer, unless it will expire sooner */
+static int
+timer_arm(struct filter *filt)
 {
-    time_t sec, nsec;
-
-    sec = src / 1000;
-    nsec = (src % 1000) * 1000000;
-
-    /* Set the interval */
-    if (oneshot) {
-        dst->it_interval.tv_sec = 0;
-        dst->it_interval.tv_nsec = 0;
-    } else {
-        dst->it_interval.tv_sec = sec;
-        dst->it_interval.tv_nsec = nsec;
-    }
+    struct evfilt_data *ed = filt->kf_data;
+    struct itimerspec ts;
+    uint64_t deadline;
 
-    /* Set the initial expiration */
-    dst->it_value.tv_sec = sec;
-    dst->it_value.tv_nsec = nsec;
-    dbg_printf("%s", itimerspec_dump(dst));
-}
+    deadline = timer_heap_deadline(&ed->heap);
+    if (deadline == 0 || (ed->armed != 0 && ed->armed <= deadline))
+        return (0);
+
+    ts.it_interval.tv_sec = 0;
+    ts.it_interval.tv_nsec = 0;
+    ts.it_value.tv_sec = deadline / 1000000000;
+    ts.it_value.tv_nsec = deadline % 1000000000;
+    dbg_printf("%s", itimerspec_dump(&ts));
+    if (timer_settime(ed->timerid, TIMER_ABSTIME, &ts, NULL) < 0) {
+        dbg_perror("timer_settime(2)");
+        return (-1);
+    }
+    ed->armed = deadline;
 
-int
-evfilt_timer_init(struct filter *filt UNUSED)
-{
     return (0);
 }
 
-void
-evfilt_timer_destroy(struct filter *filt UNUSED)
+/* Start the timer, counting from now unless it is absolute */
+static int
+timer_schedule(struct filter *filt, struct knote *kn)
 {
-    return;
-}
+    struct evfilt_data *ed = filt->kf_data;
 
-int
-evfilt_timer_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
-{
-    /* port_event_t *pe = (port_event_t *) ptr; */
-
-    memcpy(dst, &src->kev, sizeof(*dst));
-    //TODO:
-    //if (ev->events & EPOLLERR)
-    //    dst->fflags = 1; /* FIXME: Return the actual timer error */
-
-    dst->data = timer_getoverrun(src->data.timerid) + 1; 
-
-#if FIXME
-    timerid = src->data.timerid;
-    //should be done in kqops.copyout() 
-    if (src->kev.flags & EV_DISPATCH) {
-        timer_delete(src->data.timerid);
-    } else if (src->kev.flags & EV_ONESHOT) {
-        timer_delete(src->data.timerid);
+    kn->data.timer.when = timer_first(kn, timer_now());
+    if (timer_heap_insert(&ed->heap, kn) < 0)
+        return (-1);
+    if (timer_arm(filt) < 0) {
+        timer_heap_remove(&ed->heap, kn);
+        return (-1);
     }
-#endif
 
-    return (1);
+    return (0);
 }
 
 int
-evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
+evfilt_timer_init(struct filter *filt)
 {
+    struct evfilt_data *ed;
     port_notify_t pn;
     struct sigevent se;
-    struct itimerspec ts;
-    timer_t timerid;
 
-    kn->kev.flags |= EV_CLEAR;
+    ed = calloc(1, sizeof(*ed));
+    if (ed == NULL)
+        return (-1);
 
     pn.portnfy_port = filter_epfd(filt);
-    pn.portnfy_user = (void *) kn;
+    pn.portnfy_user = (void *) filt;
 
     se.sigev_notify = SIGEV_PORT;
     se.sigev_value.sival_ptr = &pn;
 
-    if (timer_create (CLOCK_MONOTONIC, &se, &timerid) < 0) {
+    if (timer_create(CLOCK_MONOTONIC, &se, &ed->timerid) < 0) {
         dbg_perror("timer_create(2)"); 
+        free(ed);
         return (-1);
     }
-   
-    convert_msec_to_itimerspec(&ts, kn->kev.data, kn->kev.flags & EV_ONESHOT);
-    if (timer_settime(timerid, 0, &ts, NULL) < 0) {
-        dbg_perror("timer_settime(2)");
-        (void) timer_delete(timerid);
-        return (-1);
+    dbg_printf("created timer with id #%lu", (unsigned long) ed->timerid);
+
+    timer_heap_init(&ed->heap);
+    filt->kf_data = ed;
+    return (0);
+}
+
+void
+evfilt_timer_destroy(struct filter *filt)
+{
+    struct evfilt_data *ed = filt->kf_data;
+
+    (void) timer_delete(ed->timerid);
+    timer_heap_free(&ed->heap);
+    free(ed);
+    filt->kf_data = NULL;
+}
+
+int
+evfilt_timer_copyout(struct filter *filt, struct kevent *dst, int nevents)
+{
+    struct evfilt_data *ed = filt->kf_data;
+    struct knote *kn;
+    uint64_t now, expired, interval;
+    int nret;
+
+    /* The port event was for this arming of the timer */
+    ed->armed = 0;
+
+    now = timer_now();
+    for (nret = 0; nret < nevents; nret++, dst++) {
+        kn = timer_heap_peek(&ed->heap);
+        if (kn == NULL || kn->data.timer.when > now)
+            break;
+
+        timer_heap_remove(&ed->heap, kn);
+        memcpy(dst, &kn->kev, sizeof(*dst));
+
+        if (kn->kev.flags & EV_ONESHOT) {
+            dst->data = 1;
+            knote_delete(filt, kn); //FIXME: Error checking
+            continue;
+        }
+
+        /* An absolute timer expires once, and is not armed again */
+        if (kn->kev.fflags & NOTE_ABSTIME) {
+            dst->data = 1;
+            continue;
+        }
+
+        /* On return, data contains the number of times the
+           timer has been triggered.
+         */
+        interval = timer_interval(kn);
+        expired = 1 + (now - kn->data.timer.when) / interval;
+        kn->data.timer.when += expired * interval;
+        dst->data = expired;
+
+        if (kn->kev.flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        else if (timer_heap_insert(&ed->heap, kn) < 0)
+            dbg_puts("unable to rearm the timer");
     }
 
-    kn->data.timerid = timerid;
-    dbg_printf("created timer with id #%lu", (unsigned long) timerid);
+    /* Timers that did not fit in the eventlist make it expire at once */
+    if (timer_arm(filt) < 0)
+        return (-1);
 
-    return (0);
+    return (nret);
+}
+
+int
+evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
+{
+    kn->kev.flags |= EV_CLEAR;
+    return (timer_schedule(filt, kn));
 }
 
 int
@@ -154,19 +215,18 @@ evfilt_timer_knote_modify(struct filter *filt, struct knote *kn,
 }
 
 int
-evfilt_timer_knote_delete(struct filter *filt UNUSED, struct knote *kn)
+evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
 {
-    if (kn->kev.flags & EV_DISABLE)
-        return (0);
+    struct evfilt_data *ed = filt->kf_data;
 
-    dbg_printf("deleting timer # %d", kn->data.timerid);
-    return timer_delete(kn->data.timerid);
+    timer_heap_remove(&ed->heap, kn);
+    return (0);
 }
 
 int
 evfilt_timer_knote_enable(struct filter *filt, struct knote *kn)
 {
-    return evfilt_timer_knote_create(filt, kn);
+    return (timer_schedule(filt, kn));
 }
 
 int
@@ -179,10 +239,11 @@ const struct filter evfilt_timer = {
     EVFILT_TIMER,
     evfilt_timer_init,
     evfilt_timer_destroy,
-    evfilt_timer_copyout,
+    NULL,
     evfilt_timer_knote_create,
     evfilt_timer_knote_modify,
     evfilt_timer_knote_delete,
     evfilt_timer_knote_enable,
     evfilt_timer_knote_disable,     
+    evfilt_timer_copyout,
 };
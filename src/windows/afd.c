@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Socket readiness through the Ancillary Function Driver.
+ *
+ * Each socket knote keeps one IOCTL_AFD_POLL request outstanding on a
+ * handle to \Device\Afd that is associated with the kqueue's completion
+ * port. The driver completes the request when the socket becomes ready,
+ * so the completion packet arrives on kq_iocp directly, without a wait
+ * thread in between. A poll request completes once; copyout submits it
+ * again unless the knote was deleted or disabled.
+ *
+ * A pending request holds a reference on its knote. When the knote is
+ * deleted or disabled, the request is cancelled, and the cancellation
+ * completes on the port like any other.
+ */
+
+#include "../common/private.h"
+
+#include <winternl.h>
+
+#ifndef SIO_BASE_HANDLE
+# define SIO_BASE_HANDLE    0x48000022
+#endif
+#ifndef STATUS_PENDING
+# define STATUS_PENDING     ((NTSTATUS) 0x00000103L)
+#endif
+#ifndef STATUS_CANCELLED
+# define STATUS_CANCELLED   ((NTSTATUS) 0xC0000120L)
+#endif
+#ifndef STATUS_NOT_FOUND
+# define STATUS_NOT_FOUND   ((NTSTATUS) 0xC0000225L)
+#endif
+
+#define IOCTL_AFD_POLL      0x00012024
+
+typedef struct {
+    HANDLE      Handle;
+    ULONG       Events;
+    NTSTATUS    Status;
+} AFD_POLL_HANDLE_INFO;
+
+typedef struct {
+    LARGE_INTEGER           Timeout;
+    ULONG                   NumberOfHandles;
+    ULONG                   Exclusive;
+    AFD_POLL_HANDLE_INFO    Handles[1];
+} AFD_POLL_INFO;
+
+struct afd_poll {
+    IO_STATUS_BLOCK ap_iosb;    /* Must be first; it is the lpOverlapped */
+    AFD_POLL_INFO   ap_info;
+    HANDLE          ap_socket;  /* The base provider socket */
+    ULONG           ap_events;  /* AFD_POLL_* events to wait for */
+    int             ap_pending; /* Nonzero while the driver owns the request */
+    struct knote   *ap_kn;
+};
+
+typedef NTSTATUS (NTAPI *nt_create_file_t)(PHANDLE, ACCESS_MASK,
+        POBJECT_ATTRIBUTES, PIO_STATUS_BLOCK, PLARGE_INTEGER, ULONG, ULONG,
+        ULONG, ULONG, PVOID, ULONG);
+typedef NTSTATUS (NTAPI *nt_device_io_control_file_t)(HANDLE, HANDLE,
+        PVOID, PVOID, PIO_STATUS_BLOCK, ULONG, PVOID, ULONG, PVOID, ULONG);
+typedef NTSTATUS (NTAPI *nt_cancel_io_file_ex_t)(HANDLE, PIO_STATUS_BLOCK,
+        PIO_STATUS_BLOCK);
+
+static nt_create_file_t             afd_NtCreateFile;
+static nt_device_io_control_file_t  afd_NtDeviceIoControlFile;
+static nt_cancel_io_file_ex_t       afd_NtCancelIoFileEx;
+
+static int
+afd_load_ntdll(void)
+{
+    HMODULE ntdll;
+
+    if (afd_NtCancelIoFileEx != NULL)
+        return (0);
+
+    ntdll = GetModuleHandleW(L"ntdll.dll");
+    if (ntdll == NULL) {
+        dbg_lasterror("GetModuleHandle(ntdll.dll)");
+        return (-1);
+    }
+    afd_NtCreateFile = (nt_create_file_t)
+        GetProcAddress(ntdll, "NtCreateFile");
+    afd_NtDeviceIoControlFile = (nt_device_io_control_file_t)
+        GetProcAddress(ntdll, "NtDeviceIoControlFile");
+    afd_NtCancelIoFileEx = (nt_cancel_io_file_ex_t)
+        GetProcAddress(ntdll, "NtCancelIoFileEx");
+    if (afd_NtCreateFile == NULL || afd_NtDeviceIoControlFile == NULL
+            || afd_NtCancelIoFileEx == NULL) {
+        dbg_puts("ntdll.dll lacks the functions needed for AFD polling");
+        afd_NtCancelIoFileEx = NULL;
+        return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * Open a handle to the AFD driver and associate it with the completion
+ * port. Leaves kq_afd as NULL if that is not possible, in which case the
+ * filters fall back to WSAEventSelect().
+ */
+int
+windows_afd_init(struct kqueue *kq)
+{
+    static WCHAR name[] = L"\\Device\\Afd\\Kqueue";
+    UNICODE_STRING path = { sizeof(name) - sizeof(WCHAR), sizeof(name), name };
+    OBJECT_ATTRIBUTES attr;
+    IO_STATUS_BLOCK iosb;
+    HANDLE afd;
+    NTSTATUS status;
+
+    kq->kq_afd = NULL;
+    if (getenv("KQUEUE_NO_AFD") != NULL || afd_load_ntdll() < 0)
+        return (-1);
+
+    InitializeObjectAttributes(&attr, &path, 0, NULL, NULL);
+    status = afd_NtCreateFile(&afd, SYNCHRONIZE, &attr, &iosb, NULL, 0,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_OPEN, 0, NULL, 0);
+    if (status != 0) {
+        dbg_printf("NtCreateFile(\\Device\\Afd) failed: status=0x%lx", (unsigned long) status);
+        return (-1);
+    }
+    if (CreateIoCompletionPort(afd, kq->kq_iocp, AFD_COMPLETION_KEY, 0) == NULL) {
+        dbg_lasterror("CreateIoCompletionPort");
+        CloseHandle(afd);
+        return (-1);
+    }
+    if (!SetFileCompletionNotificationModes(afd, FILE_SKIP_SET_EVENT_ON_HANDLE)) {
+        dbg_lasterror("SetFileCompletionNotificationModes");
+        CloseHandle(afd);
+        return (-1);
+    }
+
+    kq->kq_afd = afd;
+    return (0);
+}
+
+void
+windows_afd_free(struct kqueue *kq)
+{
+    if (kq->kq_afd != NULL)
+        CloseHandle(kq->kq_afd);
+    kq->kq_afd = NULL;
+}
+
+static int
+afd_submit(struct kqueue *kq, struct afd_poll *ap)
+{
+    NTSTATUS status;
+
+    ap->ap_info.Timeout.QuadPart = INT64_MAX;
+    ap->ap_info.NumberOfHandles = 1;
+    ap->ap_info.Exclusive = FALSE;
+    ap->ap_info.Handles[0].Handle = ap->ap_socket;
+    ap->ap_info.Handles[0].Events = ap->ap_events;
+    ap->ap_info.Handles[0].Status = 0;
+    ap->ap_iosb.Status = STATUS_PENDING;
+
+    status = afd_NtDeviceIoControlFile(kq->kq_afd, NULL, NULL, &ap->ap_iosb,
+            &ap->ap_iosb, IOCTL_AFD_POLL, &ap->ap_info, sizeof(ap->ap_info),
+            &ap->ap_info, sizeof(ap->ap_info));
+    if (status != 0 && status != STATUS_PENDING) {
+        dbg_printf("IOCTL_AFD_POLL failed: status=0x%lx", (unsigned long) status);
+        return (-1);
+    }
+
+    /* The driver posts a completion packet in either case */
+    knote_retain(ap->ap_kn);
+    ap->ap_pending = 1;
+    return (0);
+}
+
+static void
+afd_cancel(struct kqueue *kq, struct afd_poll *ap)
+{
+    IO_STATUS_BLOCK iosb;
+    NTSTATUS status;
+
+    if (!ap->ap_pending)
+        return;
+    status = afd_NtCancelIoFileEx(kq->kq_afd, &ap->ap_iosb, &iosb);
+
+    /* STATUS_NOT_FOUND means the request completed already */
+    if (status != 0 && status != STATUS_NOT_FOUND)
+        dbg_printf("NtCancelIoFileEx failed: status=0x%lx", (unsigned long) status);
+}
+
+/* Start polling a socket for the given AFD_POLL_* events */
+int
+windows_afd_add(struct kqueue *kq, struct knote *kn, ULONG events)
+{
+    struct afd_poll *ap;
+    SOCKET base;
+    DWORD bytes;
+
+    if (WSAIoctl((SOCKET) kn->kev.ident, SIO_BASE_HANDLE, NULL, 0, &base,
+                sizeof(base), &bytes, NULL, NULL) != 0) {
+        dbg_wsalasterror("WSAIoctl(SIO_BASE_HANDLE)");
+        return (-1);
+    }
+
+    ap = calloc(1, sizeof(*ap));
+    if (ap == NULL)
+        return (-1);
+    ap->ap_socket = (HANDLE) base;
+    ap->ap_events = events | AFD_POLL_LOCAL_CLOSE;
+    ap->ap_kn = kn;
+    kn->kn_afd = ap;
+
+    if (!(kn->kev.flags & EV_DISABLE) && afd_submit(kq, ap) < 0) {
+        kn->kn_afd = NULL;
+        free(ap);
+        return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * Stop polling. If the driver still owns the request, it is freed when
+ * the cancellation completes.
+ */
+void
+windows_afd_delete(struct kqueue *kq, struct knote *kn)
+{
+    struct afd_poll *ap = kn->kn_afd;
+
+    if (ap == NULL)
+        return;
+    kn->kn_afd = NULL;
+    if (ap->ap_pending)
+        afd_cancel(kq, ap);
+    else
+        free(ap);
+}
+
+int
+windows_afd_enable(struct kqueue *kq, struct knote *kn)
+{
+    struct afd_poll *ap = kn->kn_afd;
+
+    /* A cancelled request is submitted again when it completes */
+    if (ap == NULL || ap->ap_pending)
+        return (0);
+    return (afd_submit(kq, ap));
+}
+
+void
+windows_afd_disable(struct kqueue *kq, struct knote *kn)
+{
+    if (kn->kn_afd != NULL)
+        afd_cancel(kq, kn->kn_afd);
+}
+
+/*
+ * Handle a completed poll request. Returns the knote with the request's
+ * reference, which the caller releases, or NULL if there is no event.
+ */
+struct knote *
+windows_afd_complete(struct kqueue *kq, OVERLAPPED *overlap, ULONG *events)
+{
+    struct afd_poll *ap = (struct afd_poll *) overlap;
+    struct knote *kn = ap->ap_kn;
+
+    ap->ap_pending = 0;
+
+    /* The knote was deleted while the request was pending */
+    if (kn->kn_afd != ap) {
+        free(ap);
+        knote_release(kn);
+        return (NULL);
+    }
+
+    if (kn->kev.flags & EV_DISABLE) {
+        knote_release(kn);
+        return (NULL);
+    }
+
+    /* Disabled and enabled again before the cancellation completed */
+    if (ap->ap_iosb.Status == STATUS_CANCELLED) {
+        if (afd_submit(kq, ap) < 0)
+            dbg_puts("failed to resubmit the poll request");
+        knote_release(kn);
+        return (NULL);
+    }
+
+    *events = ap->ap_info.Handles[0].Events;
+    if (*events & AFD_POLL_LOCAL_CLOSE) {
+        /* The socket was closed without deleting the knote */
+        knote_release(kn);
+        return (NULL);
+    }
+
+    return (kn);
+}
+
+/* Wait for the next event, unless the knote was deleted or disabled */
+void
+windows_afd_rearm(struct kqueue *kq, struct knote *kn)
+{
+    struct afd_poll *ap = kn->kn_afd;
+
+    if (ap == NULL || ap->ap_pending || kn->kn_flags & KNFL_KNOTE_DELETED
+            || kn->kev.flags & EV_DISABLE)
+        return;
+    if (afd_submit(kq, ap) < 0)
+        dbg_puts("failed to resubmit the poll request");
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * EVFILT_AIO with overlapped I/O.
+ *
+ * The ident of the knote is a struct aiocb, and adding the knote starts
+ * an overlapped ReadFile() or WriteFile(). The first request associates
+ * the file handle with the completion port of the kqueue, so the handle
+ * cannot be used with another port. The completion packet becomes one
+ * kevent and deletes the knote, the same way as on Linux.
+ *
+ * Each request holds a reference on its knote until its packet has been
+ * dequeued. Deleting the knote earlier cancels the request with
+ * CancelIoEx(), and the packet is then dropped.
+ */
+
+#include "../common/private.h"
+
+struct aio_request {
+    OVERLAPPED      ar_ov;      /* Must be first; it is the lpOverlapped */
+    struct knote   *ar_kn;
+    HANDLE          ar_handle;
+    DWORD           ar_error;   /* Set when the I/O failed to start */
+};
+
+/*
+ * Called for a packet with AIO_COMPLETION_KEY. Returns the knote of the
+ * request, or NULL if the knote was deleted while the I/O was pending.
+ */
+struct knote *
+windows_aio_complete(struct kqueue *kq, OVERLAPPED *overlap)
+{
+    struct aio_request *ar = (struct aio_request *) overlap;
+    struct knote *kn = ar->ar_kn;
+
+    (void) kq;
+    if (kn->kn_flags & KNFL_KNOTE_DELETED) {
+        free(ar);
+        knote_release(kn);
+        return (NULL);
+    }
+    return (kn);
+}
+
+int
+evfilt_aio_copyout(struct kevent *dst, struct knote *src, void *ptr)
+{
+    OVERLAPPED_ENTRY *oe = (OVERLAPPED_ENTRY *) ptr;
+    struct aio_request *ar = (struct aio_request *) oe->lpOverlapped;
+    DWORD nbytes, error;
+
+    memcpy(dst, &src->kev, sizeof(*dst));
+    error = ar->ar_error;
+    if (error == 0 && !GetOverlappedResult(ar->ar_handle, &ar->ar_ov, &nbytes, FALSE))
+        error = GetLastError();
+
+    /* Reading at the end of the file transfers nothing, as on Linux */
+    if (error == ERROR_HANDLE_EOF) {
+        error = 0;
+        nbytes = 0;
+    }
+    if (error != 0) {
+        dst->flags |= EV_EOF;
+        dst->fflags = error;
+        dst->data = 0;
+    } else {
+        dst->data = nbytes;
+    }
+
+    src->data.handle = NULL;
+    free(ar);
+
+    return (0);
+}
+
+int
+evfilt_aio_knote_create(struct filter *filt, struct knote *kn)
+{
+    struct aiocb *iocb = (struct aiocb *) kn->kev.ident;
+    struct aio_request *ar;
+    BOOL success;
+
+    if ((iocb->aio_lio_opcode != LIO_READ && iocb->aio_lio_opcode != LIO_WRITE)
+            || iocb->aio_nbytes > MAXDWORD || iocb->aio_offset < 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    ar = calloc(1, sizeof(*ar));
+    if (ar == NULL)
+        return (-1);
+    ar->ar_kn = kn;
+    ar->ar_handle = (HANDLE) iocb->aio_fildes;
+    ar->ar_ov.Offset = (DWORD) iocb->aio_offset;
+    ar->ar_ov.OffsetHigh = (DWORD) (iocb->aio_offset >> 32);
+
+    /* A handle that is already associated fails with ERROR_INVALID_PARAMETER */
+    if (CreateIoCompletionPort(ar->ar_handle, filt->kf_kqueue->kq_iocp,
+                AIO_COMPLETION_KEY, 0) == NULL
+            && GetLastError() != ERROR_INVALID_PARAMETER) {
+        dbg_lasterror("CreateIoCompletionPort()");
+        free(ar);
+        return (-1);
+    }
+
+    /* The completion deletes the knote */
+    kn->kev.flags |= EV_ONESHOT;
+    kn->kev.flags &= ~EV_CLEAR;
+    knote_retain(kn);
+    kn->data.handle = ar;
+
+    if (iocb->aio_lio_opcode == LIO_READ)
+        success = ReadFile(ar->ar_handle, (void *) iocb->aio_buf,
+                (DWORD) iocb->aio_nbytes, NULL, &ar->ar_ov);
+    else
+        success = WriteFile(ar->ar_handle, (const void *) iocb->aio_buf,
+                (DWORD) iocb->aio_nbytes, NULL, &ar->ar_ov);
+
+    /* No packet is queued for I/O that failed to start, so post one */
+    if (!success && GetLastError() != ERROR_IO_PENDING) {
+        ar->ar_error = GetLastError();
+        if (!PostQueuedCompletionStatus(filt->kf_kqueue->kq_iocp, 0,
+                    AIO_COMPLETION_KEY, &ar->ar_ov)) {
+            dbg_lasterror("PostQueuedCompletionStatus()");
+            kn->data.handle = NULL;
+            knote_release(kn);
+            free(ar);
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+int
+evfilt_aio_knote_modify(struct filter *filt, struct knote *kn,
+        const struct kevent *kev)
+{
+    (void) filt;
+    (void) kn;
+    (void) kev;
+
+    /* An aiocb can only be queued once at a time */
+    errno = EBUSY;
+    return (-1);
+}
+
+int
+evfilt_aio_knote_delete(struct filter *filt, struct knote *kn)
+{
+    struct aio_request *ar = (struct aio_request *) kn->data.handle;
+
+    (void) filt;
+    if (ar == NULL)
+        return (0);
+
+    /* The packet still arrives, and windows_aio_complete() frees ar */
+    if (!CancelIoEx(ar->ar_handle, &ar->ar_ov) && GetLastError() != ERROR_NOT_FOUND)
+        dbg_lasterror("CancelIoEx()");
+
+    return (0);
+}
+
+/* A queued request cannot be paused, so these have no effect */
+int
+evfilt_aio_knote_enable(struct filter *filt, struct knote *kn)
+{
+    (void) filt;
+    (void) kn;
+    return (0);
+}
+
+int
+evfilt_aio_knote_disable(struct filter *filt, struct knote *kn)
+{
+    (void) filt;
+    (void) kn;
+    return (0);
+}
+
+const struct filter evfilt_aio = {
+    EVFILT_AIO,
+    NULL,
+    NULL,
+    evfilt_aio_copyout,
+    evfilt_aio_knote_create,
+    evfilt_aio_knote_modify,
+    evfilt_aio_knote_delete,
+    evfilt_aio_knote_enable,
+    evfilt_aio_knote_disable,
+};
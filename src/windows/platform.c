@@ -16,17 +16,12 @@
 
 #include "../common/private.h"
 
-struct event_buf {
-    DWORD       bytes;
-    ULONG_PTR   key;
-    OVERLAPPED *overlap;
-};
-
 /*
- * Per-thread evt event buffer used to ferry data between
- * kevent_wait() and kevent_copyout().
+ * Per-thread completion packets used to ferry data between
+ * kevent_wait() and kevent_copyout(). kevent() never asks for
+ * more than MAX_KEVENT events on this platform.
  */
-static __thread struct event_buf iocp_buf;
+static __thread OVERLAPPED_ENTRY iocp_buf[MAX_KEVENT];
 
 /* FIXME: remove these as filters are implemented */
 const struct filter evfilt_proc = EVFILT_NOTIMPL;
@@ -70,10 +65,8 @@ windows_kqueue_init(struct kqueue *kq)
     }
 #endif
 
-	if(filter_register_all(kq) < 0) {
-		CloseHandle(kq->kq_iocp);
-		return (-1);
-	}
+    /* Without the AFD driver, sockets are polled with WSAEventSelect() */
+    (void) windows_afd_init(kq);
 
     return (0);
 }
@@ -81,89 +74,145 @@ windows_kqueue_init(struct kqueue *kq)
 void
 windows_kqueue_free(struct kqueue *kq)
 {
+    windows_afd_free(kq);
     CloseHandle(kq->kq_iocp);
-    free(kq);
 }
 
 int
-windows_kevent_wait(struct kqueue *kq, int no, const struct timespec *timeout)
+windows_kevent_wait(struct kqueue *kq, int nevents, const struct timespec *timeout)
 {
-	int retval;
     DWORD       timeout_ms;
+    ULONG       nready;
     BOOL        success;
     
     if (timeout == NULL) {
         timeout_ms = INFINITE;
-    } else if ( timeout->tv_sec == 0 && timeout->tv_nsec < 1000000 ) {
-        /* do we need to try high precision timing? */
-        // TODO: This is currently not possible on windows!
-        timeout_ms = 0;
     } else {  /* Convert timeout to milliseconds */
         timeout_ms = 0;
         if (timeout->tv_sec > 0)
             timeout_ms += ((DWORD)timeout->tv_sec) * 1000;
+
+        /*
+         * Round up, so that a short timeout sleeps instead of polling.
+         * EVFILT_TIMER is the way to wait with a finer resolution.
+         */
         if (timeout->tv_nsec > 0)
-            timeout_ms += timeout->tv_nsec / 1000000;
+            timeout_ms += (timeout->tv_nsec + 999999) / 1000000;
     }
+    if (nevents > MAX_KEVENT)
+        nevents = MAX_KEVENT;
 
     dbg_printf("waiting for events (timeout=%u ms)", (unsigned int) timeout_ms);
-#if 0
-    if(timeout_ms <= 0)
-        dbg_printf("Woop, not waiting !?");
-#endif        
-    memset(&iocp_buf, 0, sizeof(iocp_buf));
-    success = GetQueuedCompletionStatus(kq->kq_iocp, 
-            &iocp_buf.bytes, &iocp_buf.key, &iocp_buf.overlap, 
-            timeout_ms);
+
+    /* Dequeue up to nevents packets with a single call */
+    success = GetQueuedCompletionStatusEx(kq->kq_iocp, &iocp_buf[0],
+            (ULONG) nevents, &nready, timeout_ms, FALSE);
     if (success) {
-        return (1);
+        return ((int) nready);
     } else {
         if (GetLastError() == WAIT_TIMEOUT) {
             dbg_puts("no events within the given timeout");
             return (0);
         }
-        dbg_lasterror("GetQueuedCompletionStatus");
+        dbg_lasterror("GetQueuedCompletionStatusEx");
         return (-1);
     }
-
-    return (retval);
 }
 
 int
 windows_kevent_copyout(struct kqueue *kq, int nready,
         struct kevent *eventlist, int nevents)
 {
+    struct kevent *start = eventlist;
     struct filter *filt;
 	struct knote* kn;
-    int rv, nret;
-
-    //FIXME: not true for EVFILT_IOCP
-    kn = (struct knote *) iocp_buf.overlap;
-    filt = &kq->kq_filt[~(kn->kev.filter)];
-    rv = filt->kf_copyout(eventlist, kn, &iocp_buf);
-    if (slowpath(rv < 0)) {
-        dbg_puts("knote_copyout failed");
-        /* XXX-FIXME: hard to handle this without losing events */
-        abort();
-    } else {
-        nret = 1;
-    }
+    ULONG afd_events;
+    void *ptr;
+    int i, rv, nret, aio = 0;
 
-    /*
-     * Certain flags cause the associated knote to be deleted
-     * or disabled.
-     */
-    if (eventlist->flags & EV_DISPATCH) 
-        knote_disable(filt, kn); //TODO: Error checking
-    if (eventlist->flags & EV_ONESHOT)
-        knote_delete(filt, kn); //TODO: Error checking
-
-    /* If an empty kevent structure is returned, the event is discarded. */
-    if (fastpath(eventlist->filter != 0)) {
-        eventlist++;
-    } else {
-        dbg_puts("spurious wakeup, discarding event");
-        nret--;
+    nret = nready;
+    for (i = 0; i < nready; i++) {
+        /* 
+         * One packet for the timers of a kqueue becomes any number of
+         * kevents, leaving room for the rest.
+         */
+        if (iocp_buf[i].lpCompletionKey == TIMER_COMPLETION_KEY) {
+            filt = (struct filter *) iocp_buf[i].lpOverlapped;
+            filter_lock(filt);
+            rv = filt->kf_copyout_filter(filt, eventlist,
+                    nevents - (eventlist - start) - (nready - i - 1));
+            filter_unlock(filt);
+            if (slowpath(rv < 0)) {
+                dbg_puts("kf_copyout_filter failed");
+                abort();
+            }
+            if (rv == 0)
+                stats_spurious(kq);
+            eventlist += rv;
+            nret += rv - 1;
+            continue;
+        }
+
+        /*
+         * A completed AFD poll request holds a reference on its knote,
+         * and the filter is given the events that the driver reported.
+         */
+        if (iocp_buf[i].lpCompletionKey == AFD_COMPLETION_KEY) {
+            kn = windows_afd_complete(kq, iocp_buf[i].lpOverlapped, &afd_events);
+            if (kn == NULL) {
+                stats_spurious(kq);
+                nret--;
+                continue;
+            }
+            ptr = &afd_events;
+        } else if (iocp_buf[i].lpCompletionKey == AIO_COMPLETION_KEY) {
+            /* A request holds a reference on its knote until it completes */
+            kn = windows_aio_complete(kq, iocp_buf[i].lpOverlapped);
+            if (kn == NULL) {
+                stats_spurious(kq);
+                nret--;
+                continue;
+            }
+            aio = 1;
+            ptr = &iocp_buf[i];
+        } else {
+            //FIXME: not true for EVFILT_IOCP
+            kn = (struct knote *) iocp_buf[i].lpOverlapped;
+            ptr = &iocp_buf[i];
+        }
+        filt = kq->kq_filt[~(kn->kev.filter)];
+        rv = filt->kf_copyout(eventlist, kn, ptr);
+        if (slowpath(rv < 0)) {
+            dbg_puts("knote_copyout failed");
+            /* XXX-FIXME: hard to handle this without losing events */
+            abort();
+        }
+
+        /*
+         * Certain flags cause the associated knote to be deleted
+         * or disabled.
+         */
+        if (eventlist->flags & EV_DISPATCH) 
+            knote_disable(filt, kn); //TODO: Error checking
+        if (eventlist->flags & EV_ONESHOT)
+            knote_delete(filt, kn); //TODO: Error checking
+        if (ptr == &afd_events) {
+            windows_afd_rearm(kq, kn);
+            knote_release(kn);
+        }
+        if (aio) {
+            knote_release(kn);
+            aio = 0;
+        }
+
+        /* If an empty kevent structure is returned, the event is discarded. */
+        if (fastpath(eventlist->filter != 0)) {
+            eventlist++;
+        } else {
+            dbg_puts("spurious wakeup, discarding event");
+            stats_spurious(kq);
+            nret--;
+        }
     }
 
 	return nret;
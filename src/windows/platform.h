@@ -17,9 +17,9 @@
 #ifndef  _KQUEUE_WINDOWS_PLATFORM_H
 #define  _KQUEUE_WINDOWS_PLATFORM_H
 
-/* Require Windows XP or later */
-#define WINVER 0x0501
-#define _WIN32_WINNT 0x0501
+/* Require Windows Vista or later, for GetQueuedCompletionStatusEx() */
+#define WINVER 0x0600
+#define _WIN32_WINNT 0x0600
 
 /* Reduces build time by omitting extra system headers */
 #define WIN32_LEAN_AND_MEAN
@@ -50,12 +50,14 @@
 #define atomic_dec   InterlockedDecrement
 #define atomic_cas(p, oval, nval) InterlockedCompareExchange(p, nval, oval)
 #define atomic_ptr_cas(p, oval, nval) InterlockedCompareExchangePointer(p, nval, oval)
+#define atomic_barrier() MemoryBarrier()
 
 /*
  * Additional members of struct kqueue
  */
 #define KQUEUE_PLATFORM_SPECIFIC \
 	HANDLE kq_iocp; \
+	HANDLE kq_afd;  /* Used by afd.c, or NULL */ \
 	HANDLE kq_synthetic_event; \
 	struct filter *kq_filt_ref[EVFILT_SYSCOUNT]; \
     size_t kq_filt_count
@@ -72,7 +74,8 @@
  * Additional members for struct knote
  */
 #define KNOTE_PLATFORM_SPECIFIC \
-	HANDLE kn_event_whandle
+	HANDLE kn_event_whandle; \
+	struct afd_poll *kn_afd
 
 /*
  * Some datatype forward declarations
@@ -92,6 +95,37 @@ int     windows_filter_init(struct kqueue *, struct filter *);
 void    windows_filter_free(struct kqueue *, struct filter *);
 int     windows_get_descriptor_type(struct knote *);
 
+/* Completion key of the packets posted by the AFD driver */
+#define AFD_COMPLETION_KEY  ((ULONG_PTR) 1)
+
+/* Completion key of the packets posted when timers expire */
+#define TIMER_COMPLETION_KEY    ((ULONG_PTR) 2)
+
+/* Completion key of the packets for EVFILT_AIO requests */
+#define AIO_COMPLETION_KEY      ((ULONG_PTR) 3)
+
+struct knote *windows_aio_complete(struct kqueue *, OVERLAPPED *);
+
+/* Events for windows_afd_add() */
+#define AFD_POLL_RECEIVE            0x0001
+#define AFD_POLL_RECEIVE_EXPEDITED  0x0002
+#define AFD_POLL_SEND               0x0004
+#define AFD_POLL_DISCONNECT         0x0008
+#define AFD_POLL_ABORT              0x0010
+#define AFD_POLL_LOCAL_CLOSE        0x0020
+#define AFD_POLL_ACCEPT             0x0080
+#define AFD_POLL_CONNECT_FAIL       0x0100
+
+struct afd_poll;
+int     windows_afd_init(struct kqueue *);
+void    windows_afd_free(struct kqueue *);
+int     windows_afd_add(struct kqueue *, struct knote *, ULONG);
+void    windows_afd_delete(struct kqueue *, struct knote *);
+int     windows_afd_enable(struct kqueue *, struct knote *);
+void    windows_afd_disable(struct kqueue *, struct knote *);
+void    windows_afd_rearm(struct kqueue *, struct knote *);
+struct knote *windows_afd_complete(struct kqueue *, OVERLAPPED *, ULONG *);
+
 /*
  * GCC-compatible branch prediction macros
  */
@@ -139,6 +173,7 @@ typedef CRITICAL_SECTION pthread_rwlock_t;
 #define _cs_unlock(x)  LeaveCriticalSection ((x))
 #define pthread_mutex_lock _cs_lock
 #define pthread_mutex_unlock _cs_unlock
+#define pthread_mutex_trylock(x) (TryEnterCriticalSection((x)) ? 0 : EBUSY)
 #define pthread_mutex_init(x,y) _cs_init((x))
 #define pthread_spin_lock _cs_lock
 #define pthread_spin_unlock _cs_unlock
@@ -91,12 +91,21 @@ evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
 {
     unsigned long bufsize;
 
-    //struct event_buf * const ev = (struct event_buf *) ptr;
-
     /* TODO: handle regular files 
        if (src->flags & KNFL_REGULAR_FILE) { ... } */
 
     memcpy(dst, &src->kev, sizeof(*dst));          
+
+    /* With AFD polling, ptr points to the AFD_POLL_* events */
+    if (src->kn_afd != NULL) {
+        ULONG events = *(ULONG *) ptr;
+
+        if (events & (AFD_POLL_DISCONNECT | AFD_POLL_ABORT))
+            dst->flags |= EV_EOF;
+        if (events & (AFD_POLL_ABORT | AFD_POLL_CONNECT_FAIL))
+            dst->fflags = 1; /* FIXME: Return the actual socket error */
+    }
+
     if (src->kn_flags & KNFL_PASSIVE_SOCKET) {
         /* TODO: should contains the length of the socket backlog */
         dst->data = 1;
@@ -123,6 +132,12 @@ evfilt_read_knote_create(struct filter *filt, struct knote *kn)
     if (windows_get_descriptor_type(kn) < 0)
             return (-1);
 
+    if (filt->kf_kqueue->kq_afd != NULL) {
+        return (windows_afd_add(filt->kf_kqueue, kn, AFD_POLL_RECEIVE
+                    | AFD_POLL_ACCEPT | AFD_POLL_DISCONNECT | AFD_POLL_ABORT
+                    | AFD_POLL_CONNECT_FAIL));
+    }
+
     /* Create an auto-reset event object */
     evt = CreateEvent(NULL, FALSE, FALSE, NULL);
     if (evt == NULL) {
@@ -171,6 +186,11 @@ evfilt_read_knote_modify(struct filter *filt, struct knote *kn,
 int
 evfilt_read_knote_delete(struct filter *filt, struct knote *kn)
 {
+    if (kn->kn_afd != NULL) {
+        windows_afd_delete(filt->kf_kqueue, kn);
+        return (0);
+    }
+
     if (kn->data.handle == NULL || kn->kn_event_whandle == NULL)
         return (0);
 
@@ -190,12 +210,18 @@ evfilt_read_knote_delete(struct filter *filt, struct knote *kn)
 int
 evfilt_read_knote_enable(struct filter *filt, struct knote *kn)
 {
+    if (kn->kn_afd != NULL)
+        return (windows_afd_enable(filt->kf_kqueue, kn));
     return evfilt_read_knote_create(filt, kn);
 }
 
 int
 evfilt_read_knote_disable(struct filter *filt, struct knote *kn)
 {
+    if (kn->kn_afd != NULL) {
+        windows_afd_disable(filt->kf_kqueue, kn);
+        return (0);
+    }
     return evfilt_read_knote_delete(filt, kn);
 }
 
@@ -16,131 +16,196 @@
 
 #include "../common/private.h"
 
-/* Convert milliseconds into negative increments of 100-nanoseconds */
-static void
-convert_msec_to_filetime(LARGE_INTEGER *dst, intptr_t src)
+/* Available since Windows 10, version 1803 */
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+# define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+/*
+ * All the timers of a kqueue share one waitable timer, which is armed
+ * for the earliest expiration in a heap of timer knotes. When it fires,
+ * a thread-pool wait posts a single packet with TIMER_COMPLETION_KEY to
+ * the completion port, and copyout returns every timer that has expired.
+ */
+struct evfilt_data {
+    HANDLE            timer;
+    HANDLE            wait;       /* Registered wait on the timer */
+    struct timer_heap heap;
+    uint64_t          armed;      /* Expiration the timer is set for, or 0 */
+    volatile LONG     posted;     /* Nonzero while a packet is queued */
+};
+
+/* Arm the waitable timer for the earliest timer, unless it will expire sooner */
+static int
+timer_arm(struct filter *filt)
 {
-	dst->QuadPart = -((int64_t) src * 1000 * 10);
+    struct evfilt_data *ed = filt->kf_data;
+    LARGE_INTEGER due;
+    uint64_t deadline, now;
+
+    deadline = timer_heap_deadline(&ed->heap);
+    if (deadline == 0 || (ed->armed != 0 && ed->armed <= deadline))
+        return (0);
+
+    /* A negative due time is relative, in units of 100 nanoseconds */
+    now = stats_clock();
+    if (deadline > now)
+        due.QuadPart = -(LONGLONG) ((deadline - now + 99) / 100);
+    else
+        due.QuadPart = -1;
+
+    if (!SetWaitableTimer(ed->timer, &due, 0, NULL, NULL, FALSE)) {
+        dbg_lasterror("SetWaitableTimer()");
+        return (-1);
+    }
+    ed->armed = deadline;
+
+    return (0);
 }
 
+/* Start the timer, counting from now unless it is absolute */
 static int
-ktimer_delete(struct filter *filt, struct knote *kn)
+timer_schedule(struct filter *filt, struct knote *kn)
 {
+    struct evfilt_data *ed = filt->kf_data;
 
-    if (kn->data.handle == NULL || kn->kn_event_whandle == NULL)
-        return (0);
+    kn->data.timer.when = timer_first(kn, stats_clock());
+    if (timer_heap_insert(&ed->heap, kn) < 0)
+        return (-1);
+    if (timer_arm(filt) < 0) {
+        timer_heap_remove(&ed->heap, kn);
+        return (-1);
+    }
 
-	if(!UnregisterWaitEx(kn->kn_event_whandle, INVALID_HANDLE_VALUE)) {
-		dbg_lasterror("UnregisterWait()");
-		return (-1);
-	}
-
-	if (!CancelWaitableTimer(kn->data.handle)) {
-		dbg_lasterror("CancelWaitableTimer()");
-		return (-1);
-	}
-	if (!CloseHandle(kn->data.handle)) {
-		dbg_lasterror("CloseHandle()");
-		return (-1);
-	}
-
-	if( !(kn->kev.flags & EV_ONESHOT) )
-		knote_release(kn);
-
-	kn->data.handle = NULL;
-	return (0);
+    return (0);
 }
 
-static VOID CALLBACK evfilt_timer_callback(void* param, BOOLEAN fired){
-	struct knote* kn;
-	struct kqueue* kq;
-
-	if(fired){
-		dbg_puts("called, but timer did not fire - this case should never be reached");
-		return;
-	}
-
-	assert(param);
-	kn = (struct knote*)param;
-
-	if(kn->kn_flags & KNFL_KNOTE_DELETED) {
-		dbg_puts("knote marked for deletion, skipping event");
-		return;
-	} else {
-		kq = kn->kn_kq;
-		assert(kq);
-
-		if (!PostQueuedCompletionStatus(kq->kq_iocp, 1, (ULONG_PTR) 0, (LPOVERLAPPED) kn)) {
-			dbg_lasterror("PostQueuedCompletionStatus()");
-			return;
-			/* FIXME: need more extreme action */
-		}
-#if DEADWOOD
-		evt_signal(kq->kq_loop, EVT_WAKEUP, kn);
-#endif
-	}
-	if(kn->kev.flags & EV_ONESHOT) {
-		struct filter* filt;
-		if( filter_lookup(&filt, kq, kn->kev.filter) )
-			dbg_perror("filter_lookup()");
-		knote_release(kn);
-	}
+static VOID CALLBACK
+evfilt_timer_callback(void *param, BOOLEAN timed_out)
+{
+    struct filter *filt = param;
+    struct evfilt_data *ed = filt->kf_data;
+
+    /* Copyout has not run since the last packet; it will see this expiry */
+    if (atomic_cas(&ed->posted, 0, 1) != 0)
+        return;
+
+    if (!PostQueuedCompletionStatus(filt->kf_kqueue->kq_iocp, 0,
+                TIMER_COMPLETION_KEY, (LPOVERLAPPED) filt)) {
+        dbg_lasterror("PostQueuedCompletionStatus()");
+        ed->posted = 0;
+    }
 }
 
 int
 evfilt_timer_init(struct filter *filt)
 {
+    struct evfilt_data *ed;
+
+    ed = calloc(1, sizeof(*ed));
+    if (ed == NULL)
+        return (-1);
+
+    /* Older versions of Windows only have the default resolution */
+    ed->timer = CreateWaitableTimerExW(NULL, NULL,
+            CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (ed->timer == NULL)
+        ed->timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+    if (ed->timer == NULL) {
+        dbg_lasterror("CreateWaitableTimerExW()");
+        free(ed);
+        return (-1);
+    }
+    dbg_printf("created timer handle %p", ed->timer);
+
+    if (!RegisterWaitForSingleObject(&ed->wait, ed->timer,
+                evfilt_timer_callback, filt, INFINITE, WT_EXECUTEINWAITTHREAD)) {
+        dbg_lasterror("RegisterWaitForSingleObject()");
+        CloseHandle(ed->timer);
+        free(ed);
+        return (-1);
+    }
+
+    timer_heap_init(&ed->heap);
+    filt->kf_data = ed;
     return (0);
 }
 
 void
 evfilt_timer_destroy(struct filter *filt)
 {
+    struct evfilt_data *ed = filt->kf_data;
+
+    /* Wait for a callback that is running to return */
+    if (!UnregisterWaitEx(ed->wait, INVALID_HANDLE_VALUE))
+        dbg_lasterror("UnregisterWaitEx()");
+    (void) CancelWaitableTimer(ed->timer);
+    (void) CloseHandle(ed->timer);
+    timer_heap_free(&ed->heap);
+    free(ed);
+    filt->kf_data = NULL;
 }
 
 int
-evfilt_timer_copyout(struct kevent* dst, struct knote* src, void* ptr)
+evfilt_timer_copyout(struct filter *filt, struct kevent *dst, int nevents)
 {
-    memcpy(dst, &src->kev, sizeof(struct kevent));
-	// TODO: Timer error handling
-	
-    /* We have no way to determine the number of times
-       the timer triggered, thus we assume it was only once
-    */
-    dst->data = 1;
-
-	return (0);
+    struct evfilt_data *ed = filt->kf_data;
+    struct knote *kn;
+    uint64_t now, expired, interval;
+    int nret;
+
+    /* Expirations after this point post another packet */
+    ed->posted = 0;
+    atomic_barrier();
+    ed->armed = 0;
+
+    now = stats_clock();
+    for (nret = 0; nret < nevents; nret++, dst++) {
+        kn = timer_heap_peek(&ed->heap);
+        if (kn == NULL || kn->data.timer.when > now)
+            break;
+
+        timer_heap_remove(&ed->heap, kn);
+        memcpy(dst, &kn->kev, sizeof(*dst));
+
+        if (kn->kev.flags & EV_ONESHOT) {
+            dst->data = 1;
+            knote_delete(filt, kn); //FIXME: Error checking
+            continue;
+        }
+
+        /* An absolute timer expires once, and is not armed again */
+        if (kn->kev.fflags & NOTE_ABSTIME) {
+            dst->data = 1;
+            continue;
+        }
+
+        /* On return, data contains the number of times the
+           timer has been triggered.
+         */
+        interval = timer_interval(kn);
+        expired = 1 + (now - kn->data.timer.when) / interval;
+        kn->data.timer.when += expired * interval;
+        dst->data = expired;
+
+        if (kn->kev.flags & EV_DISPATCH)
+            knote_disable(filt, kn); //FIXME: Error checking
+        else if (timer_heap_insert(&ed->heap, kn) < 0)
+            dbg_puts("unable to rearm the timer");
+    }
+
+    /* Timers that did not fit in the eventlist make it expire at once */
+    if (timer_arm(filt) < 0)
+        return (-1);
+
+    return (nret);
 }
 
 int
 evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
 {
-    HANDLE th;
-	LARGE_INTEGER liDueTime;
-
     kn->kev.flags |= EV_CLEAR;
-
-    th = CreateWaitableTimer(NULL, FALSE, NULL);
-    if (th == NULL) {
-        dbg_lasterror("CreateWaitableTimer()");
-        return (-1);
-    }
-    dbg_printf("created timer handle %p", th);
-
-    convert_msec_to_filetime(&liDueTime, kn->kev.data);
-	
-	// XXX-FIXME add completion routine to this call
-    if (!SetWaitableTimer(th, &liDueTime, (LONG)( (kn->kev.flags & EV_ONESHOT) ? 0 : kn->kev.data ), NULL, NULL, FALSE)) {
-        dbg_lasterror("SetWaitableTimer()");
-        CloseHandle(th);
-        return (-1);
-    }
-
-    kn->data.handle = th;
-	RegisterWaitForSingleObject(&kn->kn_event_whandle, th, evfilt_timer_callback, kn, INFINITE, 0);
-	knote_retain(kn);
-
-    return (0);
+    return (timer_schedule(filt, kn));
 }
 
 int
@@ -153,13 +218,16 @@ evfilt_timer_knote_modify(struct filter *filt, struct knote *kn,
 int
 evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
 {
-    return (ktimer_delete(filt,kn));
+    struct evfilt_data *ed = filt->kf_data;
+
+    timer_heap_remove(&ed->heap, kn);
+    return (0);
 }
 
 int
 evfilt_timer_knote_enable(struct filter *filt, struct knote *kn)
 {
-    return evfilt_timer_knote_create(filt, kn);
+    return (timer_schedule(filt, kn));
 }
 
 int
@@ -172,10 +240,11 @@ const struct filter evfilt_timer = {
     EVFILT_TIMER,
     evfilt_timer_init,
     evfilt_timer_destroy,
-    evfilt_timer_copyout,
+    NULL,
     evfilt_timer_knote_create,
     evfilt_timer_knote_modify,
     evfilt_timer_knote_delete,
     evfilt_timer_knote_enable,
     evfilt_timer_knote_disable,     
+    evfilt_timer_copyout,
 };
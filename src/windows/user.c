@@ -16,6 +16,99 @@
 
 #include "../common/private.h"
 
+/*
+ * A triggered knote has one completion packet queued at most, the first
+ * trigger posting it; later triggers only merge their fflags. The bit is
+ * kept in data.user.queued, and the packet holds a reference on the
+ * knote. A knote that stays triggered is posted again by copyout.
+ */
+
+/*
+ * Apply the NOTE_FF* operation in fflags to the knote, and set
+ * NOTE_TRIGGER if trigger is nonzero. This is done atomically,
+ * because kqueue_user_trigger() does it without the knote lock.
+ * Returns the previous fflags.
+ */
+static unsigned int
+user_fflags_update(struct knote *kn, unsigned int fflags, int trigger)
+{
+    unsigned int oval, nval;
+    unsigned int ffctrl = fflags & NOTE_FFCTRLMASK;
+
+    /* Excerpted from sys/kern/kern_event.c in FreeBSD HEAD */
+    fflags &= NOTE_FFLAGSMASK;
+    do {
+        oval = kn->kev.fflags;
+        switch (ffctrl) {
+            case NOTE_FFAND:
+                nval = oval & (fflags | ~NOTE_FFLAGSMASK);
+                break;
+
+            case NOTE_FFOR:
+                nval = oval | fflags;
+                break;
+
+            case NOTE_FFCOPY:
+                nval = (oval & ~NOTE_FFLAGSMASK) | fflags;
+                break;
+
+            default:
+                nval = oval;
+                break;
+        }
+        if (trigger)
+            nval |= NOTE_TRIGGER;
+    } while (atomic_cas(&kn->kev.fflags, oval, nval) != oval);
+
+    return (oval);
+}
+
+/* Clear NOTE_TRIGGER, and return the fflags it was cleared from */
+static unsigned int
+user_fflags_clear_trigger(struct knote *kn)
+{
+    unsigned int oval;
+
+    do {
+        oval = kn->kev.fflags;
+    } while (atomic_cas(&kn->kev.fflags, oval, oval & ~NOTE_TRIGGER) != oval);
+
+    return (oval);
+}
+
+static int
+user_post(struct knote *kn)
+{
+    if (!PostQueuedCompletionStatus(kn->kn_kq->kq_iocp, 1, (ULONG_PTR) 0, (LPOVERLAPPED) kn)) {
+        dbg_lasterror("PostQueuedCompletionStatus()");
+        kn->data.user.queued = 0;
+        knote_release(kn);
+        return (-1);
+    }
+    return (0);
+}
+
+/* Post the packet of the knote, unless one is queued already */
+static int
+user_enqueue(struct knote *kn)
+{
+    if (atomic_cas(&kn->data.user.queued, 0, 1) != 0)
+        return (0);
+
+    /* The packet holds a reference */
+    knote_retain(kn);
+    return (user_post(kn));
+}
+
+/* Apply fflags, and post the knote if it was not already triggered */
+static int
+user_trigger(struct knote *kn, unsigned int fflags)
+{
+    if (user_fflags_update(kn, fflags, 1) & NOTE_TRIGGER)
+        return (0);
+    return (user_enqueue(kn));
+}
+
 int
 evfilt_user_init(struct filter *filt)
 {
@@ -30,20 +123,39 @@ evfilt_user_destroy(struct filter *filt)
 int
 evfilt_user_copyout(struct kevent* dst, struct knote* src, void* ptr)
 {
+    unsigned int fflags;
+
+    /* A disabled knote stays triggered, and is posted again when enabled */
+    if (src->kn_flags & KNFL_KNOTE_DELETED || src->kev.flags & EV_DISABLE) {
+        src->data.user.queued = 0;
+        knote_release(src);
+        memset(dst, 0, sizeof(*dst));
+        return (0);
+    }
+
+    if (src->kev.flags & (EV_DISPATCH | EV_CLEAR | EV_ONESHOT)) {
+        /*
+         * Dequeue the knote before clearing NOTE_TRIGGER. A trigger
+         * that comes in between sees NOTE_TRIGGER still set and does
+         * not post the knote again, so it is reported with this event.
+         * The knote is still referenced by the kqueue.
+         */
+        src->data.user.queued = 0;
+        fflags = user_fflags_clear_trigger(src);
+        knote_release(src);
+    } else {
+        /* It stays triggered; the packet's reference goes to the next one */
+        fflags = src->kev.fflags;
+        (void) user_post(src);
+    }
+
     memcpy(dst, &src->kev, sizeof(struct kevent));
-	
-    dst->fflags &= ~NOTE_FFCTRLMASK;     //FIXME: Not sure if needed
-    dst->fflags &= ~NOTE_TRIGGER;
+    dst->fflags = fflags & ~(NOTE_FFCTRLMASK | NOTE_TRIGGER);
     if (src->kev.flags & EV_ADD) {
         /* NOTE: True on FreeBSD but not consistent behavior with
            other filters. */
         dst->flags &= ~EV_ADD;
     }
-    if (src->kev.flags & EV_CLEAR)
-        src->kev.fflags &= ~NOTE_TRIGGER;
-
-    if (src->kev.flags & EV_DISPATCH)
-        src->kev.fflags &= ~NOTE_TRIGGER;
 
 	return (0);
 }
@@ -51,6 +163,7 @@ evfilt_user_copyout(struct kevent* dst, struct knote* src, void* ptr)
 int
 evfilt_user_knote_create(struct filter *filt, struct knote *kn)
 {
+    kn->data.user.queued = 0;
 	return (0);
 }
 
@@ -58,60 +171,45 @@ int
 evfilt_user_knote_modify(struct filter *filt, struct knote *kn, 
         const struct kevent *kev)
 {
-    unsigned int ffctrl;
-    unsigned int fflags;
+    if (kev->fflags & NOTE_TRIGGER)
+        return (user_trigger(kn, kev->fflags));
 
-    /* Excerpted from sys/kern/kern_event.c in FreeBSD HEAD */
-    ffctrl = kev->fflags & NOTE_FFCTRLMASK;
-    fflags = kev->fflags & NOTE_FFLAGSMASK;
-    switch (ffctrl) {
-        case NOTE_FFNOP:
-            break;
-
-        case NOTE_FFAND:
-            kn->kev.fflags &= fflags;
-            break;
-
-        case NOTE_FFOR:
-            kn->kev.fflags |= fflags;
-            break;
-
-        case NOTE_FFCOPY:
-            kn->kev.fflags = fflags;
-            break;
-
-        default:
-            /* XXX Return error? */
-            break;
-    }
+    (void) user_fflags_update(kn, kev->fflags, 0);
+    return (0);
+}
 
-    if ((!(kn->kev.flags & EV_DISABLE)) && kev->fflags & NOTE_TRIGGER) {
-        kn->kev.fflags |= NOTE_TRIGGER;
-		if (!PostQueuedCompletionStatus(kn->kn_kq->kq_iocp, 1, (ULONG_PTR) 0, (LPOVERLAPPED) kn)) {
-			dbg_lasterror("PostQueuedCompletionStatus()");
-			return (-1);
-		}
+/* Called by kqueue_user_trigger() without the kqueue lock */
+int
+evfilt_user_knote_trigger(struct filter *filt, struct knote *kn,
+        unsigned int fflags)
+{
+    if (kn->kn_flags & KNFL_KNOTE_DELETED) {
+        errno = ENOENT;
+        return (-1);
     }
-
-    return (0);
+    return (user_trigger(kn, fflags));
 }
 
 int
 evfilt_user_knote_delete(struct filter *filt, struct knote *kn)
 {
+    /* If a packet is queued, copyout drops it */
     return (0);
 }
 
 int
 evfilt_user_knote_enable(struct filter *filt, struct knote *kn)
 {
-    return evfilt_user_knote_create(filt, kn);
+    /* An event that was triggered while disabled fires now */
+    if (kn->kev.fflags & NOTE_TRIGGER)
+        return (user_enqueue(kn));
+    return (0);
 }
 
 int
 evfilt_user_knote_disable(struct filter *filt, struct knote *kn)
 {
-    return evfilt_user_knote_delete(filt, kn);
+    return (0);
 }
 
 const struct filter evfilt_user = {
@@ -124,4 +222,6 @@ const struct filter evfilt_user = {
     evfilt_user_knote_delete,
     evfilt_user_knote_enable,
     evfilt_user_knote_disable,     
-};
\ No newline at end of file
+    NULL,
+    evfilt_user_knote_trigger,
+};
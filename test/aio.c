@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <aio.h>
+
+#include "common.h"
+
+/* A file holding "hello world" */
+static int aio_fd = -1;
+
+static void
+aio_setup(struct aiocb *iocb, int fd, int opcode, void *buf, size_t nbytes,
+        off_t offset)
+{
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_fildes = fd;
+    iocb->aio_lio_opcode = opcode;
+    iocb->aio_buf = buf;
+    iocb->aio_nbytes = nbytes;
+    iocb->aio_offset = offset;
+}
+
+/* Wait for the completion of <iocb> */
+static void
+aio_wait(struct test_context *ctx, struct aiocb *iocb, struct kevent *ret)
+{
+    kevent_get(ret, ctx->kqfd);
+    if (ret->filter != EVFILT_AIO || ret->ident != (uintptr_t) iocb)
+        err(1, "unexpected event: %s", kevent_to_str(ret));
+}
+
+static void
+test_kevent_aio_read(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    struct aiocb iocb;
+    char buf[16];
+
+    test_no_kevents(ctx->kqfd);
+
+    memset(buf, 0, sizeof(buf));
+    aio_setup(&iocb, aio_fd, LIO_READ, buf, 5, 6);
+    EV_SET(&kev, (uintptr_t) &iocb, EVFILT_AIO, EV_ADD, 0, 0, &iocb);
+    kevent_update(ctx->kqfd, &kev);
+
+    aio_wait(ctx, &iocb, &ret);
+    if (ret.data != 5 || ret.udata != &iocb || strcmp(buf, "world") != 0)
+        err(1, "read %d bytes: %s", (int) ret.data, buf);
+
+    /* The completion deleted the knote */
+    test_no_kevents(ctx->kqfd);
+    kev.flags = EV_DELETE;
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) == 0)
+        die("knote still exists after completion");
+}
+
+static void
+test_kevent_aio_write(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    struct aiocb iocb;
+    char buf[16];
+
+    test_no_kevents(ctx->kqfd);
+
+    aio_setup(&iocb, aio_fd, LIO_WRITE, "HELLO", 5, 0);
+    EV_SET(&kev, (uintptr_t) &iocb, EVFILT_AIO, EV_ADD, 0, 0, NULL);
+    kevent_update(ctx->kqfd, &kev);
+
+    aio_wait(ctx, &iocb, &ret);
+    if (ret.data != 5)
+        err(1, "wrote %d bytes", (int) ret.data);
+
+    memset(buf, 0, sizeof(buf));
+    if (pread(aio_fd, buf, 11, 0) != 11 || strcmp(buf, "HELLO world") != 0)
+        err(1, "file contains %s", buf);
+}
+
+static void
+test_kevent_aio_error(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    struct aiocb iocb;
+    char buf[16];
+    int fd;
+
+    test_no_kevents(ctx->kqfd);
+
+    /* An error is reported by the completion */
+    if ((fd = open("/dev/null", O_WRONLY)) < 0)
+        die("open");
+    aio_setup(&iocb, fd, LIO_READ, buf, sizeof(buf), 0);
+    EV_SET(&kev, (uintptr_t) &iocb, EVFILT_AIO, EV_ADD, 0, 0, NULL);
+    kevent_update(ctx->kqfd, &kev);
+    aio_wait(ctx, &iocb, &ret);
+    if (!(ret.flags & EV_EOF) || ret.fflags != EBADF)
+        err(1, "unexpected event: %s", kevent_to_str(&ret));
+    close(fd);
+
+    /* Only reads and writes can be queued */
+    aio_setup(&iocb, aio_fd, LIO_NOP, buf, sizeof(buf), 0);
+    EV_SET(&kev, (uintptr_t) &iocb, EVFILT_AIO, EV_ADD, 0, 0, NULL);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) == 0)
+        die("LIO_NOP was accepted");
+    test_no_kevents(ctx->kqfd);
+}
+
+/* Deleting the knote of a request that has not completed cancels it */
+static void
+test_kevent_aio_cancel(struct test_context *ctx)
+{
+    struct kevent kev;
+    struct aiocb iocb;
+    char buf[16];
+    int fds[2];
+
+    test_no_kevents(ctx->kqfd);
+
+    if (pipe(fds) < 0)
+        die("pipe");
+    aio_setup(&iocb, fds[0], LIO_READ, buf, sizeof(buf), 0);
+    EV_SET(&kev, (uintptr_t) &iocb, EVFILT_AIO, EV_ADD, 0, 0, NULL);
+    kevent_update(ctx->kqfd, &kev);
+    test_no_kevents(ctx->kqfd);
+
+    kev.flags = EV_DELETE;
+    kevent_update(ctx->kqfd, &kev);
+    if (write(fds[1], "x", 1) != 1)
+        die("write");
+    usleep(10000);
+    test_no_kevents(ctx->kqfd);
+
+    /* The data was not taken by the cancelled read */
+    if (read(fds[0], buf, sizeof(buf)) != 1)
+        die("read");
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void
+test_evfilt_aio(struct test_context *ctx)
+{
+    char path[] = "/tmp/kqueue-aio.XXXXXX";
+    struct kevent kev;
+    struct aiocb iocb;
+    char buf[1];
+
+    aio_fd = mkstemp(path);
+    if (aio_fd < 0)
+        die("mkstemp");
+    unlink(path);
+    if (write(aio_fd, "hello world", 11) != 11)
+        die("write");
+
+    /* The filter needs io_uring, which may not be allowed */
+    aio_setup(&iocb, aio_fd, LIO_READ, buf, sizeof(buf), 0);
+    EV_SET(&kev, (uintptr_t) &iocb, EVFILT_AIO, EV_ADD, 0, 0, NULL);
+    if (kevent(ctx->kqfd, &kev, 1, &kev, 1, NULL) < 0) {
+        puts("**NOTE** EVFILT_AIO is not available on this system");
+        close(aio_fd);
+        return;
+    }
+
+    test(kevent_aio_read, ctx);
+    test(kevent_aio_write, ctx);
+    test(kevent_aio_error, ctx);
+    test(kevent_aio_cancel, ctx);
+    close(aio_fd);
+}
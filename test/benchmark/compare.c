@@ -0,0 +1,503 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Run the same workloads through kqueue and, on Linux, through raw epoll,
+ * to measure what the compatibility layer costs.
+ *
+ * On Linux the "kqueue" backend is libkqueue, and "kqueue-nodata" is the
+ * same with NOTE_NODATA, which leaves out the ioctl of each copyout. On
+ * FreeBSD and macOS, <sys/event.h> is the native kqueue(2), as in
+ * kqlite/lite.h, so the numbers of the two systems can be set side by side.
+ *
+ *   latency     one event at a time between two threads; p50 and p99 of
+ *               the time from write() until the waiting thread wakes up
+ *   throughput  full batches from sockets that stay readable
+ *   rearm       one-shot events that are armed again after each wakeup,
+ *               which is where each epoll_ctl() of libkqueue shows up
+ *
+ * For each workload and backend, the events per second, the system calls
+ * per event and the context switches per event are printed, as the
+ * tab-separated lines of microbench. System calls are counted with the
+ * raw_syscalls:sys_enter tracepoint, which needs tracefs and permission
+ * to use perf events; without them, that line is left out.
+ *
+ * Usage: compare [-i iterations] [backend ...]
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/event.h>
+#if defined(__linux__)
+# include <sys/epoll.h>
+# include <sys/syscall.h>
+# include <linux/perf_event.h>
+#endif
+
+#define NREADY  1024
+#define NBATCH  256
+
+static int iterations = 100000;
+
+struct backend {
+    const char *name;
+    int       (*open)(void);
+    void      (*add)(int q, int fd, int oneshot);
+    void      (*rearm)(int q, int fd);
+    int       (*wait)(int q, int *fds, int nfds, int block);
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static void
+report(const char *name, const char *backend, double value, const char *unit)
+{
+    printf("%s\t%s\t%.2f\t%s\n", name, backend, value, unit);
+    fflush(stdout);
+}
+
+/* kqueue(2), or libkqueue where there is no native one */
+
+static unsigned int kq_fflags;
+
+static int
+kq_open(void)
+{
+    int kq;
+
+    if ((kq = kqueue()) < 0)
+        err(1, "kqueue");
+    kq_fflags = 0;
+    return (kq);
+}
+
+static void
+kq_change(int kq, int fd, unsigned short flags)
+{
+    struct kevent kev;
+
+    EV_SET(&kev, fd, EVFILT_READ, flags, kq_fflags, 0, NULL);
+    if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+        err(1, "kevent");
+}
+
+static void
+kq_add(int kq, int fd, int oneshot)
+{
+    kq_change(kq, fd, EV_ADD | (oneshot ? EV_DISPATCH : 0));
+}
+
+static void
+kq_rearm(int kq, int fd)
+{
+    kq_change(kq, fd, EV_ENABLE);
+}
+
+static int
+kq_wait(int kq, int *fds, int nfds, int block)
+{
+    static const struct timespec zero = { 0, 0 };
+    struct kevent kev[NBATCH];
+    int i, n;
+
+    if ((n = kevent(kq, NULL, 0, kev, nfds, block ? NULL : &zero)) < 0)
+        err(1, "kevent");
+    for (i = 0; i < n; i++)
+        fds[i] = (int) kev[i].ident;
+    return (n);
+}
+
+#if defined(NOTE_NODATA)
+static int
+kq_nodata_open(void)
+{
+    int kq = kq_open();
+
+    kq_fflags = NOTE_NODATA;
+    return (kq);
+}
+#endif
+
+#if defined(__linux__)
+
+static int
+ep_open(void)
+{
+    int epfd;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        err(1, "epoll_create1");
+    return (epfd);
+}
+
+static void
+ep_change(int epfd, int op, int fd, unsigned int events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, op, fd, &ev) < 0)
+        err(1, "epoll_ctl");
+}
+
+static void
+ep_add(int epfd, int fd, int oneshot)
+{
+    ep_change(epfd, EPOLL_CTL_ADD, fd, EPOLLIN | (oneshot ? EPOLLONESHOT : 0));
+}
+
+static void
+ep_rearm(int epfd, int fd)
+{
+    ep_change(epfd, EPOLL_CTL_MOD, fd, EPOLLIN | EPOLLONESHOT);
+}
+
+static int
+ep_wait(int epfd, int *fds, int nfds, int block)
+{
+    struct epoll_event ev[NBATCH];
+    int i, n;
+
+    if ((n = epoll_wait(epfd, ev, nfds, block ? -1 : 0)) < 0)
+        err(1, "epoll_wait");
+    for (i = 0; i < n; i++)
+        fds[i] = ev[i].data.fd;
+    return (n);
+}
+
+#endif /* defined(__linux__) */
+
+static const struct backend backends[] = {
+    { "kqueue",         kq_open,        kq_add, kq_rearm, kq_wait },
+#if defined(NOTE_NODATA)
+    { "kqueue-nodata",  kq_nodata_open, kq_add, kq_rearm, kq_wait },
+#endif
+#if defined(__linux__)
+    { "epoll",          ep_open,        ep_add, ep_rearm, ep_wait },
+#endif
+    { NULL,             NULL,           NULL,   NULL,     NULL },
+};
+
+/*
+ * System calls made by this process, if the kernel lets us count them.
+ * The counter is inherited by the threads created after it is opened.
+ */
+static int syscall_fd = -1;
+
+static void
+syscall_counter_open(void)
+{
+#if defined(__linux__)
+    static const char *path[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    struct perf_event_attr attr;
+    FILE *f = NULL;
+    long id;
+    int i;
+
+    for (i = 0; i < 2 && f == NULL; i++)
+        f = fopen(path[i], "r");
+    if (f == NULL)
+        return;
+    if (fscanf(f, "%ld", &id) != 1)
+        id = -1;
+    fclose(f);
+    if (id < 0)
+        return;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = id;
+    attr.inherit = 1;
+    syscall_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+/*
+ * An inherited counter cannot be read until the threads that inherited
+ * it exit, so it is read after the workload has joined them.
+ */
+static long
+syscall_count(void)
+{
+    long long n;
+
+    if (syscall_fd < 0 || read(syscall_fd, &n, sizeof(n)) != sizeof(n))
+        return (-1);
+    return ((long) n);
+}
+
+struct sample {
+    double  s_time;
+    long    s_csw;
+    long    s_syscalls;
+};
+
+static void
+sample(struct sample *s)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        err(1, "getrusage");
+    s->s_csw = ru.ru_nvcsw + ru.ru_nivcsw;
+    s->s_syscalls = syscall_count();
+    s->s_time = now();
+}
+
+/* Report the cost of nevents events delivered since start */
+static void
+report_costs(const char *name, const char *backend,
+        const struct sample *start, long nevents)
+{
+    struct sample end;
+    char buf[64];
+
+    sample(&end);
+    snprintf(buf, sizeof(buf), "%s_rate", name);
+    report(buf, backend, nevents / ((end.s_time - start->s_time) / 1e9),
+            "events/s");
+    if (start->s_syscalls >= 0 && end.s_syscalls >= 0) {
+        snprintf(buf, sizeof(buf), "%s_syscalls", name);
+        report(buf, backend,
+                (double) (end.s_syscalls - start->s_syscalls) / nevents,
+                "syscalls/event");
+    }
+    snprintf(buf, sizeof(buf), "%s_csw", name);
+    report(buf, backend, (double) (end.s_csw - start->s_csw) / nevents,
+            "switches/event");
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x < y ? -1 : x > y);
+}
+
+struct latency {
+    const struct backend *lt_backend;
+    int     lt_q;
+    int     lt_data[2];     /* The sender writes its clock here */
+    int     lt_ack[2];      /* and waits for the receiver to answer */
+    int     lt_rounds;
+    double *lt_samples;
+};
+
+static void *
+latency_receiver(void *arg)
+{
+    struct latency *lt = arg;
+    double sent;
+    int i, fd;
+
+    for (i = 0; i < lt->lt_rounds; i++) {
+        if (lt->lt_backend->wait(lt->lt_q, &fd, 1, 1) != 1)
+            errx(1, "no event");
+        if (read(lt->lt_data[0], &sent, sizeof(sent)) != sizeof(sent))
+            err(1, "read");
+        lt->lt_samples[i] = now() - sent;
+        if (write(lt->lt_ack[1], ".", 1) != 1)
+            err(1, "write");
+    }
+    return (NULL);
+}
+
+static void
+bench_latency(const struct backend *be)
+{
+    struct latency lt;
+    struct sample start;
+    pthread_t tid;
+    double sent;
+    char c;
+    int i;
+
+    lt.lt_backend = be;
+    lt.lt_rounds = iterations / 10;
+    if ((lt.lt_samples = calloc(lt.lt_rounds, sizeof(double))) == NULL)
+        err(1, "calloc");
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, lt.lt_data) < 0
+            || socketpair(AF_UNIX, SOCK_STREAM, 0, lt.lt_ack) < 0)
+        err(1, "socketpair");
+    lt.lt_q = be->open();
+    be->add(lt.lt_q, lt.lt_data[0], 0);
+
+    sample(&start);
+    if (pthread_create(&tid, NULL, latency_receiver, &lt) != 0)
+        err(1, "pthread_create");
+    for (i = 0; i < lt.lt_rounds; i++) {
+        sent = now();
+        if (write(lt.lt_data[1], &sent, sizeof(sent)) != sizeof(sent))
+            err(1, "write");
+        if (read(lt.lt_ack[0], &c, 1) != 1)
+            err(1, "read");
+    }
+    if (pthread_join(tid, NULL) != 0)
+        err(1, "pthread_join");
+    report_costs("latency", be->name, &start, lt.lt_rounds);
+
+    qsort(lt.lt_samples, lt.lt_rounds, sizeof(double), cmp_double);
+    report("latency_p50", be->name, lt.lt_samples[lt.lt_rounds / 2], "ns");
+    report("latency_p99", be->name, lt.lt_samples[lt.lt_rounds * 99 / 100],
+            "ns");
+
+    close(lt.lt_q);
+    for (i = 0; i < 2; i++) {
+        close(lt.lt_data[i]);
+        close(lt.lt_ack[i]);
+    }
+    free(lt.lt_samples);
+}
+
+/* Sockets with a byte waiting, registered with a new queue */
+static int
+ready_sockets(const struct backend *be, int fd[][2], int oneshot)
+{
+    int i, q;
+
+    q = be->open();
+    for (i = 0; i < NREADY; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd[i]) < 0)
+            err(1, "socketpair");
+        if (write(fd[i][1], ".", 1) != 1)
+            err(1, "write");
+        be->add(q, fd[i][0], oneshot);
+    }
+    return (q);
+}
+
+static void
+close_sockets(int q, int fd[][2])
+{
+    int i;
+
+    for (i = 0; i < NREADY; i++) {
+        close(fd[i][0]);
+        close(fd[i][1]);
+    }
+    close(q);
+}
+
+static void
+bench_throughput(const struct backend *be)
+{
+    static int fd[NREADY][2];
+    struct sample start;
+    int ready[NBATCH];
+    long total = 0;
+    int i, n, q;
+
+    q = ready_sockets(be, fd, 0);
+    sample(&start);
+    for (i = 0; i < iterations / 100 + 1; i++) {
+        if ((n = be->wait(q, ready, NBATCH, 0)) <= 0)
+            errx(1, "no events");
+        total += n;
+    }
+    report_costs("throughput", be->name, &start, total);
+    close_sockets(q, fd);
+}
+
+static void
+bench_rearm(const struct backend *be)
+{
+    static int fd[NREADY][2];
+    struct sample start;
+    int ready[NBATCH];
+    long total = 0;
+    int i, j, n, q;
+
+    q = ready_sockets(be, fd, 1);
+    sample(&start);
+    for (i = 0; i < iterations / 100 + 1; i++) {
+        if ((n = be->wait(q, ready, NBATCH, 0)) <= 0)
+            errx(1, "no events");
+        for (j = 0; j < n; j++)
+            be->rearm(q, ready[j]);
+        total += n;
+    }
+    report_costs("rearm", be->name, &start, total);
+    close_sockets(q, fd);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct rlimit rl;
+    int c, i, j;
+
+    while ((c = getopt(argc, argv, "i:")) != -1) {
+        switch (c) {
+            case 'i':
+                iterations = atoi(optarg);
+                if (iterations <= 0)
+                    errx(1, "invalid number of iterations");
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-i iterations] [backend ...]\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+
+    /* Both ends of each ready socket, for two queues at a time */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void) setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    syscall_counter_open();
+    if (syscall_fd < 0)
+        fprintf(stderr, "# system calls cannot be counted: %s\n",
+                strerror(errno));
+
+    printf("# benchmark\tbackend\tvalue\tunit\n");
+    for (i = 0; backends[i].name != NULL; i++) {
+        for (j = optind; j < argc; j++) {
+            if (strcmp(argv[j], backends[i].name) == 0)
+                break;
+        }
+        if (optind < argc && j == argc)
+            continue;
+        bench_latency(&backends[i]);
+        bench_throughput(&backends[i]);
+        bench_rearm(&backends[i]);
+    }
+
+    return (0);
+}
@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks for the kevent() hot paths.
+ *
+ * Each benchmark prints one line per measurement with four tab-separated
+ * fields: the benchmark, its parameter, the result and the unit. The
+ * output can be kept and compared between builds to spot regressions.
+ *
+ * Usage: microbench [-i iterations] [benchmark ...]
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/event.h>
+
+static int iterations = 100000;
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static void
+report(const char *name, long param, double value, const char *unit)
+{
+    printf("%s\t%ld\t%.1f\t%s\n", name, param, value, unit);
+    fflush(stdout);
+}
+
+static void
+change(int kq, uintptr_t ident, short filter, unsigned short flags,
+        unsigned int fflags, intptr_t data)
+{
+    struct kevent kev;
+
+    EV_SET(&kev, ident, filter, flags, fflags, data, NULL);
+    if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+        err(1, "kevent");
+}
+
+/*
+ * Raise the descriptor limit and return how many socket pairs fit in it.
+ * Some room is left for the descriptors that each kqueue holds open.
+ */
+static int
+max_socketpairs(int wanted)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        err(1, "getrlimit");
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void) setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if ((rlim_t) wanted * 2 + 256 > rl.rlim_cur)
+        wanted = (rl.rlim_cur - 256) / 2;
+    return (wanted);
+}
+
+/* Cost of adding and deleting a knote with a given number already present */
+static void
+bench_add_delete(void)
+{
+    static const int population[] = { 0, 1000, 10000, 100000 };
+    double start;
+    int i, j, kq;
+
+    for (i = 0; i < (int) (sizeof(population) / sizeof(population[0])); i++) {
+        if ((kq = kqueue()) < 0)
+            err(1, "kqueue");
+        for (j = 0; j < population[i]; j++)
+            change(kq, j + 1, EVFILT_USER, EV_ADD, 0, 0);
+
+        start = now();
+        for (j = 0; j < iterations; j++) {
+            change(kq, 0, EVFILT_USER, EV_ADD, 0, 0);
+            change(kq, 0, EVFILT_USER, EV_DELETE, 0, 0);
+        }
+        report("add_delete", population[i], (now() - start) / iterations,
+                "ns/op");
+        close(kq);
+    }
+}
+
+/* Cost of disabling and re-enabling a socket knote */
+static void
+bench_enable_disable(void)
+{
+    double start;
+    int i, kq, fd[2];
+
+    if ((kq = kqueue()) < 0)
+        err(1, "kqueue");
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+        err(1, "socketpair");
+    change(kq, fd[0], EVFILT_READ, EV_ADD, 0, 0);
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        change(kq, fd[0], EVFILT_READ, EV_DISABLE, 0, 0);
+        change(kq, fd[0], EVFILT_READ, EV_ENABLE, 0, 0);
+    }
+    report("enable_disable", 1, (now() - start) / iterations, "ns/op");
+
+    close(fd[0]);
+    close(fd[1]);
+    close(kq);
+}
+
+/* Cost of arming and cancelling a timer that never expires */
+static void
+bench_timer_arm(void)
+{
+    double start;
+    int i, kq;
+
+    if ((kq = kqueue()) < 0)
+        err(1, "kqueue");
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        change(kq, 1, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 60000);
+        change(kq, 1, EVFILT_TIMER, EV_DELETE, 0, 0);
+    }
+    report("timer_arm_cancel", 1, (now() - start) / iterations, "ns/op");
+
+    close(kq);
+}
+
+struct pingpong {
+    int     pp_kq[2];
+    int     pp_rounds;
+};
+
+static void *
+pong(void *arg)
+{
+    struct pingpong *pp = arg;
+    struct kevent kev;
+    int i;
+
+    for (i = 0; i < pp->pp_rounds; i++) {
+        if (kevent(pp->pp_kq[1], NULL, 0, &kev, 1, NULL) != 1)
+            err(1, "kevent");
+        change(pp->pp_kq[0], 1, EVFILT_USER, 0, NOTE_TRIGGER, 0);
+    }
+
+    return (NULL);
+}
+
+/* Time for an EVFILT_USER trigger to wake a thread, and for it to answer */
+static void
+bench_user_wakeup(void)
+{
+    struct pingpong pp;
+    struct kevent kev;
+    pthread_t tid;
+    double start;
+    int i;
+
+    pp.pp_rounds = iterations / 10;
+    for (i = 0; i < 2; i++) {
+        if ((pp.pp_kq[i] = kqueue()) < 0)
+            err(1, "kqueue");
+        change(pp.pp_kq[i], 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0);
+    }
+    if (pthread_create(&tid, NULL, pong, &pp) != 0)
+        err(1, "pthread_create");
+
+    start = now();
+    for (i = 0; i < pp.pp_rounds; i++) {
+        change(pp.pp_kq[1], 1, EVFILT_USER, 0, NOTE_TRIGGER, 0);
+        if (kevent(pp.pp_kq[0], NULL, 0, &kev, 1, NULL) != 1)
+            err(1, "kevent");
+    }
+    report("user_wakeup_rtt", 2, (now() - start) / pp.pp_rounds, "ns/rtt");
+
+    if (pthread_join(tid, NULL) != 0)
+        err(1, "pthread_join");
+    close(pp.pp_kq[0]);
+    close(pp.pp_kq[1]);
+}
+
+#define NREADY  256
+#define NBATCH  8
+
+static int scale_kq;
+static volatile int scale_running;
+
+static void *
+harvester(void *arg)
+{
+    struct kevent kev[NBATCH];
+    unsigned long *count = arg;
+    int n;
+
+    while (scale_running) {
+        n = kevent(scale_kq, NULL, 0, kev, NBATCH, NULL);
+        if (n < 0)
+            err(1, "kevent");
+        *count += n;
+    }
+
+    return (NULL);
+}
+
+/* Events harvested per second by N threads sharing one kqueue */
+static void
+bench_thread_scaling(void)
+{
+    pthread_t tid[8];
+    unsigned long count[8], total;
+    int fd[NREADY][2];
+    double start;
+    int i, n;
+
+    if ((scale_kq = kqueue()) < 0)
+        err(1, "kqueue");
+    for (i = 0; i < NREADY; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd[i]) < 0)
+            err(1, "socketpair");
+        if (write(fd[i][1], ".", 1) != 1)
+            err(1, "write");
+        change(scale_kq, fd[i][0], EVFILT_READ, EV_ADD, 0, 0);
+    }
+
+    for (n = 1; n <= 8; n *= 2) {
+        scale_running = 1;
+        start = now();
+        for (i = 0; i < n; i++) {
+            count[i] = 0;
+            if (pthread_create(&tid[i], NULL, harvester, &count[i]) != 0)
+                err(1, "pthread_create");
+        }
+        usleep(500000);
+        scale_running = 0;
+        for (i = 0, total = 0; i < n; i++) {
+            if (pthread_join(tid[i], NULL) != 0)
+                err(1, "pthread_join");
+            total += count[i];
+        }
+        report("thread_scaling", n, total / ((now() - start) / 1e9),
+                "events/s");
+    }
+
+    for (i = 0; i < NREADY; i++) {
+        close(fd[i][0]);
+        close(fd[i][1]);
+    }
+    close(scale_kq);
+}
+
+/*
+ * Round trips on one active connection while a growing number of idle
+ * connections are registered, which is the load the old abtest script
+ * put on a web server.
+ */
+static void
+bench_idle_connections(void)
+{
+    static const int nidle[] = { 0, 1000, 10000 };
+    struct kevent kev;
+    int (*idle)[2];
+    int active[2];
+    double start;
+    char c = '.';
+    int i, j, n, kq;
+
+    for (i = 0; i < (int) (sizeof(nidle) / sizeof(nidle[0])); i++) {
+        n = max_socketpairs(nidle[i]);
+        if ((idle = calloc(n + 1, sizeof(*idle))) == NULL)
+            err(1, "calloc");
+        if ((kq = kqueue()) < 0)
+            err(1, "kqueue");
+        for (j = 0; j < n; j++) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, idle[j]) < 0)
+                err(1, "socketpair");
+            change(kq, idle[j][0], EVFILT_READ, EV_ADD, 0, 0);
+        }
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, active) < 0)
+            err(1, "socketpair");
+        change(kq, active[0], EVFILT_READ, EV_ADD, 0, 0);
+
+        start = now();
+        for (j = 0; j < iterations; j++) {
+            if (write(active[1], &c, 1) != 1)
+                err(1, "write");
+            if (kevent(kq, NULL, 0, &kev, 1, NULL) != 1)
+                err(1, "kevent");
+            if (read(active[0], &c, 1) != 1)
+                err(1, "read");
+        }
+        report("idle_connections", n, (now() - start) / iterations,
+                "ns/event");
+
+        close(active[0]);
+        close(active[1]);
+        for (j = 0; j < n; j++) {
+            close(idle[j][0]);
+            close(idle[j][1]);
+        }
+        free(idle);
+        close(kq);
+    }
+}
+
+/*
+ * Cost per event of harvesting full batches of 512 events from a growing
+ * number of readable descriptors, which are level-triggered and so stay
+ * ready. NOTE_NODATA leaves out the ioctl that would dominate the cost.
+ */
+static void
+bench_copyout_batch(void)
+{
+    static const int nready[] = { 512, 4096, 16384 };
+    static const struct timespec zero = { 0, 0 };
+    struct kevent kev[512];
+    int (*fds)[2];
+    double start;
+    long total;
+    char c = '.';
+    int i, j, n, rv, kq;
+
+    for (i = 0; i < (int) (sizeof(nready) / sizeof(nready[0])); i++) {
+        n = max_socketpairs(nready[i]);
+        if ((fds = calloc(n, sizeof(*fds))) == NULL)
+            err(1, "calloc");
+        if ((kq = kqueue()) < 0)
+            err(1, "kqueue");
+        for (j = 0; j < n; j++) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[j]) < 0)
+                err(1, "socketpair");
+            if (write(fds[j][1], &c, 1) != 1)
+                err(1, "write");
+            change(kq, fds[j][0], EVFILT_READ, EV_ADD, NOTE_NODATA, 0);
+        }
+
+        total = 0;
+        start = now();
+        for (j = 0; j < iterations / 100 + 1; j++) {
+            if ((rv = kevent(kq, NULL, 0, kev, 512, &zero)) <= 0)
+                err(1, "kevent");
+            total += rv;
+        }
+        report("copyout_batch", n, (now() - start) / total, "ns/event");
+
+        close(kq);
+        for (j = 0; j < n; j++) {
+            close(fds[j][0]);
+            close(fds[j][1]);
+        }
+        free(fds);
+    }
+}
+
+static const struct {
+    const char *name;
+    void      (*func)(void);
+} benchmarks[] = {
+    { "add_delete",         bench_add_delete },
+    { "enable_disable",     bench_enable_disable },
+    { "timer_arm_cancel",   bench_timer_arm },
+    { "user_wakeup_rtt",    bench_user_wakeup },
+    { "thread_scaling",     bench_thread_scaling },
+    { "idle_connections",   bench_idle_connections },
+    { "copyout_batch",      bench_copyout_batch },
+    { NULL,                 NULL },
+};
+
+int
+main(int argc, char **argv)
+{
+    int c, i, j;
+
+    while ((c = getopt(argc, argv, "i:")) != -1) {
+        switch (c) {
+            case 'i':
+                iterations = atoi(optarg);
+                if (iterations <= 0)
+                    errx(1, "invalid number of iterations");
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-i iterations] [benchmark ...]\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+
+    printf("# benchmark\tparameter\tvalue\tunit\n");
+    for (i = 0; benchmarks[i].name != NULL; i++) {
+        if (optind == argc) {
+            benchmarks[i].func();
+            continue;
+        }
+        for (j = optind; j < argc; j++) {
+            if (strcmp(argv[j], benchmarks[i].name) == 0)
+                benchmarks[i].func();
+        }
+    }
+
+    return (0);
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measure how copyout scales with the number of threads sharing a kqueue.
+ *
+ * A set of sockets is kept readable, so every kevent() call returns a
+ * full batch of events. Each thread harvests events in a loop while one
+ * more thread adds and deletes a knote, to show whether registration
+ * stalls behind copyout.
+ *
+ * Usage: scaling [max threads] [seconds per run]
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/event.h>
+
+#define NSOCKETS    256
+#define NBATCH      8
+
+static int kqfd;
+static int sockfd[NSOCKETS][2];
+static volatile int running;
+
+static void *
+harvester(void *arg)
+{
+    struct kevent kev[NBATCH];
+    unsigned long *count = arg;
+    int n;
+
+    while (running) {
+        n = kevent(kqfd, NULL, 0, kev, NBATCH, NULL);
+        if (n < 0)
+            err(1, "kevent");
+        *count += n;
+    }
+
+    return (NULL);
+}
+
+static void *
+registrar(void *arg)
+{
+    struct kevent kev;
+    unsigned long *count = arg;
+    int fd[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+        err(1, "socketpair");
+    while (running) {
+        EV_SET(&kev, fd[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            err(1, "kevent");
+        EV_SET(&kev, fd[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            err(1, "kevent");
+        *count += 2;
+    }
+    close(fd[0]);
+    close(fd[1]);
+
+    return (NULL);
+}
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+static void
+run(int nthreads, int seconds)
+{
+    pthread_t tid[nthreads + 1];
+    unsigned long count[nthreads + 1];
+    unsigned long total = 0;
+    double start, elapsed;
+    int i;
+
+    running = 1;
+    start = now();
+    for (i = 0; i <= nthreads; i++) {
+        count[i] = 0;
+        if (pthread_create(&tid[i], NULL, (i < nthreads) ? harvester : registrar,
+                    &count[i]) != 0)
+            err(1, "pthread_create");
+    }
+    sleep(seconds);
+    running = 0;
+    for (i = 0; i <= nthreads; i++) {
+        if (pthread_join(tid[i], NULL) != 0)
+            err(1, "pthread_join");
+    }
+    elapsed = now() - start;
+
+    for (i = 0; i < nthreads; i++)
+        total += count[i];
+    printf("%8d %16.0f %16.0f\n", nthreads, total / elapsed,
+            count[nthreads] / elapsed);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct kevent kev;
+    int i, maxthreads, seconds;
+
+    maxthreads = (argc > 1) ? atoi(argv[1]) : 8;
+    seconds = (argc > 2) ? atoi(argv[2]) : 2;
+
+    if ((kqfd = kqueue()) < 0)
+        err(1, "kqueue");
+    for (i = 0; i < NSOCKETS; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockfd[i]) < 0)
+            err(1, "socketpair");
+        if (write(sockfd[i][1], ".", 1) != 1)
+            err(1, "write");
+        EV_SET(&kev, sockfd[i][0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            err(1, "kevent");
+    }
+
+    printf("%8s %16s %16s\n", "threads", "events/sec", "changes/sec");
+    for (i = 1; i <= maxthreads; i *= 2)
+        run(i, seconds);
+
+    return (0);
+}
@@ -43,6 +43,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <sys/event.h>
 #include <arpa/inet.h>
@@ -55,6 +56,18 @@
 # include "../src/windows/platform.h"
 #endif
 
+/* The filters that were built, see --with-filters in configure.ac */
+#ifndef KQUEUE_FILTER_SET
+# define KQUEUE_FILTER_READ     1
+# define KQUEUE_FILTER_WRITE    1
+# define KQUEUE_FILTER_AIO      1
+# define KQUEUE_FILTER_SIGNAL   1
+# define KQUEUE_FILTER_VNODE    1
+# define KQUEUE_FILTER_PROC     1
+# define KQUEUE_FILTER_TIMER    1
+# define KQUEUE_FILTER_USER     1
+#endif
+
 struct test_context;
 
 struct unit_test {
@@ -81,6 +94,7 @@ struct test_context {
 };
 
 void test_evfilt_read(struct test_context *);
+void test_evfilt_aio(struct test_context *);
 void test_evfilt_signal(struct test_context *);
 void test_evfilt_vnode(struct test_context *);
 void test_evfilt_timer(struct test_context *);
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Tests of the C++20 coroutine layer in <sys/event.hpp> */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/event.hpp>
+
+#include "../config.h"
+
+/* The filters that were built, see --with-filters in configure.ac */
+#ifndef KQUEUE_FILTER_SET
+# define KQUEUE_FILTER_TIMER    1
+# define KQUEUE_FILTER_USER     1
+#endif
+
+#define die(str)   do { \
+    fprintf(stderr, "%s(): %s: %s\n", __func__, str, strerror(errno)); \
+    abort(); \
+} while (0)
+
+static libkqueue::task
+read_one(libkqueue::loop &kq, int fd, char *buf)
+{
+    struct kevent kev = co_await kq.readable(fd);
+
+    if (kev.ident != (uintptr_t) fd || kev.filter != EVFILT_READ)
+        die("wrong event");
+    if (read(fd, buf, 1) != 1)
+        die("read(2)");
+}
+
+static void
+test_readable(void)
+{
+    libkqueue::loop kq;
+    char buf = 0;
+    int fd[2];
+
+    if (pipe(fd) < 0)
+        die("pipe(2)");
+
+    read_one(kq, fd[0], &buf);
+    if (kq.pending() != 1 || buf != 0)
+        die("the coroutine did not wait");
+    if (write(fd[1], "x", 1) != 1)
+        die("write(2)");
+    kq.run();
+    if (kq.pending() != 0 || buf != 'x')
+        die("the coroutine was not resumed");
+
+    close(fd[0]);
+    close(fd[1]);
+}
+
+#if KQUEUE_FILTER_TIMER
+static libkqueue::task
+sleep_twice(libkqueue::loop &kq, int *count)
+{
+    using namespace std::chrono;
+
+    for (int i = 0; i < 2; i++) {
+        auto start = steady_clock::now();
+        struct kevent kev = co_await kq.sleep(milliseconds(20));
+
+        if (kev.filter != EVFILT_TIMER)
+            die("wrong event");
+        if (steady_clock::now() - start < milliseconds(20))
+            die("the timer expired early");
+        (*count)++;
+    }
+}
+
+static void
+test_sleep(void)
+{
+    libkqueue::loop kq;
+    int count = 0;
+
+    sleep_twice(kq, &count);
+    kq.run();
+    if (count != 2)
+        die("the coroutine slept the wrong number of times");
+}
+#endif
+
+#if KQUEUE_FILTER_USER
+static libkqueue::task
+wait_user(libkqueue::loop &kq, uintptr_t ident, int *count)
+{
+    for (;;) {
+        struct kevent kev = co_await kq.user(ident);
+
+        if (kev.ident != ident || kev.filter != EVFILT_USER)
+            die("wrong event");
+        if (++*count == 3)
+            co_return;
+    }
+}
+
+static void
+test_user(void)
+{
+    struct timespec ts = { 0, 0 };
+    libkqueue::loop kq;
+    int count = 0;
+
+    wait_user(kq, 1, &count);
+    if (kq.run_once(&ts) != 0)
+        die("an event before the trigger");
+
+    /* EV_DISPATCH keeps the knote, so each await sees one trigger */
+    for (int i = 1; i <= 3; i++) {
+        kq.trigger(1);
+        if (kq.run_once(&ts) != 1 || count != i)
+            die("the trigger did not resume the coroutine");
+    }
+    if (kq.pending() != 0)
+        die("the coroutine is still waiting");
+
+    /* The knote is disabled, so a trigger is not reported */
+    kq.trigger(1);
+    if (kq.run_once(&ts) != 0)
+        die("an event from a disabled knote");
+
+    try {
+        kq.trigger(2);
+        die("trigger() of a missing knote");
+    } catch (const std::system_error &e) {
+        if (e.code().value() != ENOENT)
+            die("wrong error from trigger()");
+    }
+}
+#endif
+
+int
+main(void)
+{
+    test_readable();
+#if KQUEUE_FILTER_TIMER
+    test_sleep();
+#endif
+#if KQUEUE_FILTER_USER
+    test_user();
+#endif
+    puts("+OK All coroutine tests completed.");
+    return (0);
+}
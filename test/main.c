@@ -131,6 +131,577 @@ test_ev_receipt(void *unused)
 #endif
 }
 
+void
+test_kevent_submit(void *unused)
+{
+#if !defined(_WIN32)
+    struct kevent ch[204], kev;
+    int status[204];
+    int i, kq, fd = 1000;
+
+    if ((kq = kqueue()) < 0)
+        die("kqueue()");
+    /* Not a descriptor that the kqueue could open for itself */
+    if (fcntl(fd, F_GETFD) >= 0)
+        die("descriptor 1000 is open");
+
+    for (i = 0; i < 200; i++)
+        EV_SET(&ch[i], 1000 - i, EVFILT_USER, EV_ADD, 0, 0, NULL);
+    EV_SET(&ch[200], fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    EV_SET(&ch[201], 5000, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    /* Changes to one knote are applied in changelist order */
+    EV_SET(&ch[202], 6000, EVFILT_USER, EV_ADD, 0, 0, NULL);
+    EV_SET(&ch[203], 6000, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+
+    /* No eventlist is needed for the failures */
+    if (kevent_submit(kq, ch, 204, status) != 2)
+        die("kevent_submit");
+    for (i = 0; i < 204; i++) {
+        if ((i == 200) ? status[i] == 0 : status[i] != ((i == 201) ? ENOENT : 0)) {
+            printf("status[%d] = %d\n", i, status[i]);
+            die("wrong kevent_submit status");
+        }
+    }
+
+    EV_SET(&kev, 900, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent");
+    kevent_get(&kev, kq);
+    if (kev.ident != 900)
+        die("wrong event");
+    EV_SET(&kev, 6000, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (kevent(kq, &kev, 1, &kev, 1, NULL) != 1 || kev.data != ENOENT)
+        die("knote was not deleted");
+
+    close(kq);
+#endif
+}
+
+/* Test that one call can return more events than the internal batch size */
+void
+test_kevent_large_eventlist(void *unused)
+{
+#if !defined(_WIN32)
+    struct kevent kev, *ret;
+    int sockfd[300][2];
+    int i, kq, n;
+
+    if ((kq = kqueue()) < 0)
+        die("kqueue()");
+    for (i = 0; i < 300; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockfd[i]) < 0)
+            die("socketpair");
+        EV_SET(&kev, sockfd[i][0], EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+        if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+            die("kevent");
+        EV_SET(&kev, sockfd[i][1], EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+        if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+            die("kevent");
+    }
+
+    /* Every descriptor is writable, so all 600 should be returned */
+    if ((ret = calloc(1000, sizeof(*ret))) == NULL)
+        die("calloc");
+    n = kevent(kq, NULL, 0, ret, 1000, NULL);
+    if (n != 600) {
+        printf("expected 600 events, got %d\n", n);
+        die("kevent");
+    }
+    free(ret);
+
+    for (i = 0; i < 300; i++) {
+        close(sockfd[i][0]);
+        close(sockfd[i][1]);
+    }
+    close(kq);
+#endif
+}
+
+void
+test_kqueue_ring(void *unused)
+{
+#if !defined(_WIN32) && defined(EVFILT_USER)
+    struct kqueue_ring *ring;
+    struct kevent kev;
+    struct timespec ts = { 0, 0 };
+    int i, kq;
+
+    if ((kq = kqueue()) < 0)
+        die("kqueue()");
+    if ((ring = kqueue_ring_open(kq, 2)) == NULL)
+        die("kqueue_ring_open()");
+    for (i = 1; i <= 3; i++) {
+        EV_SET(&kev, i, EVFILT_USER, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+        if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+            die("kevent");
+        EV_SET(&kev, i, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+        if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+            die("kevent");
+    }
+
+    /* Two events fit, and the third is left for the next wait */
+    if (kqueue_ring_wait(ring, &ts) != 2)
+        die("kqueue_ring_wait() did not fill the ring");
+    if (kqueue_ring_wait(ring, &ts) != 0)
+        die("kqueue_ring_wait() overfilled the ring");
+    for (i = 0; i < 2; i++) {
+        if (kqueue_ring_pop(ring, &kev) != 1 || kev.filter != EVFILT_USER)
+            die("kqueue_ring_pop()");
+    }
+    if (kqueue_ring_pop(ring, &kev) != 0)
+        die("kqueue_ring_pop() returned an event from an empty ring");
+
+    /* The last event wraps around to the first slot */
+    if (kqueue_ring_wait(ring, &ts) != 1)
+        die("kqueue_ring_wait() lost an event");
+    if (kqueue_ring_pop(ring, &kev) != 1 || kev.filter != EVFILT_USER)
+        die("kqueue_ring_pop()");
+    if (kqueue_ring_pop(ring, &kev) != 0)
+        die("kqueue_ring_pop() returned an event from an empty ring");
+
+    if (kqueue_ring_close(ring) < 0)
+        die("kqueue_ring_close()");
+    close(kq);
+#endif
+}
+
+void
+test_kqueue_stats(void *unused)
+{
+#if defined(EVFILT_USER)
+    struct kqueue_stats ks;
+    struct kevent kev;
+    struct timespec ts = { 0, 0 };
+    uint64_t nbatch;
+    int i, kq;
+
+    if ((kq = kqueue()) < 0)
+        die("kqueue()");
+    EV_SET(&kev, 1, EVFILT_USER, EV_ADD, 0, 0, NULL);
+    if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent");
+    EV_SET(&kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (kevent(kq, &kev, 1, &kev, 1, &ts) != 1)
+        die("kevent");
+
+    if (kqueue_stats(kq, &ks) < 0)
+        die("kqueue_stats()");
+    if (ks.ks_knotes[~EVFILT_USER] != 1 || ks.ks_knotes[~EVFILT_READ] != 0)
+        die("wrong knote count");
+    if (ks.ks_changes != 2 || ks.ks_events != 1 || ks.ks_wakeups != 1)
+        die("wrong counters");
+    for (i = 0, nbatch = 0; i < KQUEUE_STATS_BUCKETS; i++)
+        nbatch += ks.ks_batch[i];
+    if (nbatch != 1 || ks.ks_batch[1] != 1)
+        die("wrong batch histogram");
+
+    if (kqueue_close(kq) < 0)
+        die("kqueue_close()");
+    if (kqueue_stats(kq, &ks) == 0 || errno != EBADF)
+        die("kqueue_stats() of a closed kqueue");
+#endif
+}
+
+void
+test_kqueue_record(void *unused)
+{
+#if defined(EVFILT_USER)
+    struct kqueue_record rec[16];
+    struct kevent kev;
+    struct timespec ts = { 0, 0 };
+    int i, n, kq;
+
+    if ((kq = kqueue()) < 0)
+        die("kqueue()");
+    if (kqueue_record_dump(kq, rec, 16) >= 0 || errno != EINVAL)
+        die("kqueue_record_dump() worked before kqueue_record_start()");
+    if (kqueue_record_start(kq, 5) < 0)
+        die("kqueue_record_start()");
+    if (kqueue_record_start(kq, 8) >= 0 || errno != EBUSY)
+        die("kqueue_record_start() worked twice");
+
+    EV_SET(&kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent");
+    EV_SET(&kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (kevent(kq, &kev, 1, &kev, 1, &ts) != 1)
+        die("kevent");
+
+    /* Two changes, the wait and the event, oldest first */
+    if ((n = kqueue_record_dump(kq, rec, 16)) != 5)
+        die("wrong number of records");
+    if (rec[0].rc_type != KQUEUE_RECORD_CHANGE
+            || rec[1].rc_type != KQUEUE_RECORD_CHANGE
+            || rec[2].rc_type != KQUEUE_RECORD_WAIT_ENTER
+            || rec[3].rc_type != KQUEUE_RECORD_WAIT_EXIT
+            || rec[4].rc_type != KQUEUE_RECORD_EVENT)
+        die("wrong record types");
+    if (rec[4].rc_ident != 1 || rec[4].rc_filter != EVFILT_USER
+            || rec[3].rc_data != 1)
+        die("wrong record contents");
+    for (i = 1; i < n; i++) {
+        if (rec[i].rc_time < rec[i - 1].rc_time)
+            die("records out of order");
+    }
+
+    /* The ring of eight entries keeps the most recent ones */
+    for (i = 0; i < 4; i++) {
+        if (kevent(kq, NULL, 0, &kev, 1, &ts) != 0)
+            die("kevent");
+    }
+    if ((n = kqueue_record_dump(kq, rec, 16)) != 8)
+        die("old records were not overwritten");
+    if (rec[n - 1].rc_type != KQUEUE_RECORD_WAIT_EXIT || rec[n - 1].rc_data != 0)
+        die("the last record is not the last wait");
+
+    if (kqueue_close(kq) < 0)
+        die("kqueue_close()");
+    if (kqueue_record_dump(kq, rec, 16) >= 0 || errno != EBADF)
+        die("kqueue_record_dump() of a closed kqueue");
+#endif
+}
+
+void
+test_kqueue_lockstat(void *unused)
+{
+#if !defined(_WIN32)
+    int fd;
+
+    if ((fd = open("/dev/null", O_WRONLY)) < 0)
+        die("open");
+#ifdef LOCKSTAT
+    if (kqueue_lockstat(fd) < 0)
+        die("kqueue_lockstat()");
+#else
+    if (kqueue_lockstat(fd) == 0 || errno != ENOTSUP)
+        die("kqueue_lockstat() should fail without LOCKSTAT");
+#endif
+    close(fd);
+#endif
+}
+
+void
+test_kqueue_group(void *unused)
+{
+#if !defined(_WIN32) && defined(EVFILT_USER)
+    struct kevent kev[4];
+    struct timespec ts = { 0, 0 };
+    int i, kq, shard;
+
+    if ((kq = kqueue_group(2)) < 0)
+        die("kqueue_group()");
+    if (kqueue_group_shard(kq, 2) >= 0 || errno != EINVAL)
+        die("kqueue_group_shard() accepted a shard that does not exist");
+    if ((shard = kqueue_group_shard(kq, 1)) < 0)
+        die("kqueue_group_shard()");
+    if (kqueue_group_assign(kq, 10, 1) < 0)
+        die("kqueue_group_assign()");
+
+    for (i = 0; i < 4; i++) {
+        EV_SET(&kev[i], 10 + i, EVFILT_USER, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+        if (kevent(kq, &kev[i], 1, NULL, 0, NULL) < 0)
+            die("kevent");
+    }
+
+    /* The assigned ident is reported by its own shard */
+    EV_SET(&kev[0], 10, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (kevent(kq, &kev[0], 1, NULL, 0, NULL) < 0)
+        die("kevent");
+    if (kevent(shard, NULL, 0, kev, 4, &ts) != 1 || kev[0].ident != 10)
+        die("the shard did not return the assigned ident");
+
+    /* The group descriptor returns the events of every shard */
+    for (i = 1; i < 4; i++) {
+        EV_SET(&kev[i], 10 + i, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+        if (kevent(kq, &kev[i], 1, NULL, 0, NULL) < 0)
+            die("kevent");
+    }
+    if (kevent(kq, NULL, 0, kev, 4, NULL) != 3)
+        die("the group did not return every event");
+    if (kevent(kq, NULL, 0, kev, 4, &ts) != 0)
+        die("the group returned an event twice");
+
+    for (i = 0; i < 2; i++)
+        close(kqueue_group_shard(kq, i));
+    close(kq);
+#endif
+}
+
+void
+test_kqueue_nested(void *unused)
+{
+#if !defined(_WIN32) && defined(EVFILT_USER)
+    struct kevent kev[4];
+    struct timespec ts = { 0, 0 };
+    int i, kq, child;
+
+    if ((kq = kqueue()) < 0 || (child = kqueue()) < 0)
+        die("kqueue()");
+
+    EV_SET(&kev[0], kq, EVFILT_READ, EV_ADD, NOTE_NESTED, 0, NULL);
+    if (kevent(kq, &kev[0], 1, NULL, 0, NULL) >= 0 || errno != EINVAL)
+        die("a kqueue was nested in itself");
+    EV_SET(&kev[0], child, EVFILT_READ, EV_ADD, NOTE_NESTED, 0, NULL);
+    if (kevent(kq, &kev[0], 1, NULL, 0, NULL) < 0)
+        die("kevent");
+
+    EV_SET(&kev[0], 1, EVFILT_USER, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    EV_SET(&kev[1], 2, EVFILT_USER, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    if (kevent(child, kev, 2, NULL, 0, NULL) < 0)
+        die("kevent");
+    EV_SET(&kev[0], 3, EVFILT_USER, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    if (kevent(kq, &kev[0], 1, NULL, 0, NULL) < 0)
+        die("kevent");
+
+    EV_SET(&kev[0], 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    EV_SET(&kev[1], 2, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (kevent(child, kev, 2, NULL, 0, NULL) < 0)
+        die("kevent");
+    EV_SET(&kev[0], 3, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (kevent(kq, &kev[0], 1, NULL, 0, NULL) < 0)
+        die("kevent");
+
+    /* The events of the child are returned in place of its own */
+    if (kevent(kq, NULL, 0, kev, 4, NULL) != 3)
+        die("the parent did not return the events of the child");
+    for (i = 0; i < 3; i++) {
+        if (kev[i].filter != EVFILT_USER)
+            die("the child was returned instead of its events");
+    }
+    if (kevent(kq, NULL, 0, kev, 4, &ts) != 0)
+        die("the parent returned an event twice");
+
+    close(child);
+    close(kq);
+#endif
+}
+
+void
+test_kqueue_clone(void *unused)
+{
+#if !defined(_WIN32) && defined(EVFILT_USER)
+    const uint64_t udata = 0x123456789abcdef0ULL;
+    struct kevent64_s ch64, ev64;
+    struct kevent kev[2];
+    struct timespec ts = { 0, 0 };
+    int kq, clone, fd[2], status;
+    pid_t pid;
+
+    if ((kq = kqueue()) < 0)
+        die("kqueue()");
+    if (pipe(fd) < 0)
+        die("pipe");
+    EV_SET(&kev[0], 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, &kev[0]);
+    EV_SET(&kev[1], fd[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+    if (kevent(kq, kev, 2, NULL, 0, NULL) < 0)
+        die("kevent");
+    EV_SET64(&ch64, 2, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, udata, 7, 8);
+    if (kevent64(kq, &ch64, 1, NULL, 0, 0, NULL) != 0)
+        die("kevent64");
+
+    /* The clone has its own knotes, with the same udata */
+    if ((clone = kqueue_clone(kq)) < 0)
+        die("kqueue_clone()");
+    if (kqueue_user_trigger(clone, 2, 0) < 0)
+        die("kqueue_user_trigger");
+    if (kevent64(clone, NULL, 0, &ev64, 1, KEVENT_FLAG_IMMEDIATE, NULL) != 1
+            || ev64.ident != 2 || ev64.udata != udata || ev64.ext[1] != 8)
+        die("the clone lost the udata of a kevent64() knote");
+    if (kevent(kq, NULL, 0, kev, 2, &ts) != 0)
+        die("the trigger of the clone reached the original");
+    close(clone);
+
+    /* The child of fork() clones the kqueue it inherited */
+    if ((pid = fork()) < 0)
+        die("fork");
+    if (pid == 0) {
+        if ((clone = kqueue_clone(kq)) < 0)
+            _exit(1);
+        if (kqueue_user_trigger(clone, 1, 0) < 0)
+            _exit(2);
+        if (kevent(clone, NULL, 0, kev, 2, &ts) != 1 || kev[0].ident != 1
+                || kev[0].udata != &kev[0])
+            _exit(3);
+        if (write(fd[1], ".", 1) != 1
+                || kevent(clone, NULL, 0, kev, 2, &ts) != 1
+                || kev[0].ident != (uintptr_t) fd[0])
+            _exit(4);
+        if (kqueue_close(kq) < 0)
+            _exit(5);
+        _exit(0);
+    }
+    if (waitpid(pid, &status, 0) != pid)
+        die("waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("child status %d\n", status);
+        die("the child could not use its clone");
+    }
+
+    /* Closing the inherited kqueue in the child left these registered */
+    if (kevent(kq, NULL, 0, kev, 2, &ts) != 1
+            || kev[0].ident != (uintptr_t) fd[0])
+        die("the child removed a registration of the parent");
+
+    close(fd[0]);
+    close(fd[1]);
+    close(kq);
+#endif
+}
+
+void
+test_kqueue_close(void *unused)
+{
+#if !defined(_WIN32) && defined(EVFILT_USER)
+    struct kevent kev[4];
+    int i, kq, lowest, fd[2];
+
+    /* The lowest free descriptor, which a leak would move up */
+    if ((lowest = dup(0)) < 0)
+        die("dup");
+    close(lowest);
+
+    for (i = 0; i < 32; i++) {
+        if ((kq = kqueue()) < 0)
+            die("kqueue()");
+        if (pipe(fd) < 0)
+            die("pipe");
+        EV_SET(&kev[0], fd[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+        EV_SET(&kev[1], fd[1], EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+        EV_SET(&kev[2], 1, EVFILT_TIMER, EV_ADD, 0, 1000, NULL);
+        EV_SET(&kev[3], 1, EVFILT_USER, EV_ADD, NOTE_TRIGGER, 0, NULL);
+        if (kevent(kq, kev, 4, NULL, 0, NULL) < 0)
+            die("kevent");
+        if (kevent(kq, NULL, 0, kev, 1, NULL) != 1)
+            die("no event before the kqueue was closed");
+
+        /* With close(2), the teardown happens when the number is reused */
+        if (i % 2 == 0) {
+            if (kqueue_close(kq) < 0)
+                die("kqueue_close()");
+            if (kqueue_close(kq) == 0 || errno != EBADF)
+                die("kqueue_close() of a closed kqueue");
+        } else {
+            close(kq);
+        }
+        close(fd[0]);
+        close(fd[1]);
+    }
+
+    /* The shards go with the group */
+    if ((kq = kqueue_group(2)) < 0)
+        die("kqueue_group()");
+    if (kqueue_close(kq) < 0)
+        die("kqueue_close() of a group");
+
+    if ((i = dup(0)) != lowest)
+        die("kqueue_close() leaked descriptors");
+    close(i);
+#endif
+}
+
+void
+test_kqueue_busy_poll(void *unused)
+{
+#if !defined(_WIN32) && defined(EVFILT_USER)
+    struct kevent kev;
+    struct timespec ts = { 0, 20000000 };
+    int i, kq;
+
+    if ((kq = kqueue()) < 0)
+        die("kqueue()");
+    if (kqueue_busy_poll(kq, 1000) < 0)
+        die("kqueue_busy_poll()");
+    EV_SET(&kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent");
+
+    /* The timeout still expires, spinning or not */
+    for (i = 0; i < 2; i++) {
+        if (kevent(kq, NULL, 0, &kev, 1, &ts) != 0)
+            die("kevent() returned an event that was not triggered");
+    }
+    for (i = 0; i < 10; i++) {
+        if (kqueue_user_trigger(kq, 1, 0) < 0)
+            die("kqueue_user_trigger()");
+        if (kevent(kq, NULL, 0, &kev, 1, &ts) != 1 || kev.ident != 1)
+            die("kevent() missed the event");
+    }
+
+    if (kqueue_busy_poll(kq, 0) < 0)
+        die("kqueue_busy_poll()");
+    close(kq);
+#endif
+}
+
+#if !defined(_WIN32) && defined(EVFILT_USER)
+static pthread_mutex_t dispatch_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int dispatch_busy[64];
+static int dispatch_count;
+
+static void
+dispatch_callback(void *udata, const struct kevent *kev)
+{
+    int *busy = udata;
+
+    pthread_mutex_lock(&dispatch_mtx);
+    if (*busy || busy != &dispatch_busy[kev->ident])
+        die("the event was dispatched twice at once");
+    *busy = 1;
+    pthread_mutex_unlock(&dispatch_mtx);
+
+    usleep(100);
+
+    pthread_mutex_lock(&dispatch_mtx);
+    *busy = 0;
+    dispatch_count++;
+    pthread_mutex_unlock(&dispatch_mtx);
+}
+#endif
+
+void
+test_kqueue_dispatch(void *unused)
+{
+#if !defined(_WIN32) && defined(EVFILT_USER)
+    struct kqueue_dispatch *kd;
+    struct kevent kev[64];
+    int i, kq, count;
+
+    if ((kq = kqueue()) < 0)
+        die("kqueue()");
+    if ((kd = kqueue_dispatch_start(kq, 4, dispatch_callback)) == NULL)
+        die("kqueue_dispatch_start()");
+
+    dispatch_count = 0;
+    for (i = 0; i < 64; i++)
+        EV_SET(&kev[i], i, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, &dispatch_busy[i]);
+    if (kqueue_dispatch_change(kd, kev, 64) < 0)
+        die("kqueue_dispatch_change()");
+
+    /* Trigger every knote twice, even while it is being dispatched */
+    for (i = 0; i < 128; i++) {
+        EV_SET(&kev[0], i % 64, EVFILT_USER, 0, NOTE_TRIGGER, 0,
+                &dispatch_busy[i % 64]);
+        if (kevent(kq, &kev[0], 1, NULL, 0, NULL) < 0)
+            die("kevent");
+    }
+
+    for (i = 0; i < 1000; i++) {
+        pthread_mutex_lock(&dispatch_mtx);
+        count = dispatch_count;
+        pthread_mutex_unlock(&dispatch_mtx);
+        if (count >= 64)
+            break;
+        usleep(1000);
+    }
+    if (kqueue_dispatch_stop(kd) < 0)
+        die("kqueue_dispatch_stop()");
+    if (dispatch_count < 64 || dispatch_count > 128)
+        die("wrong number of callbacks");
+
+    close(kq);
+#endif
+}
+
 void
 run_iteration(struct test_context *ctx)
 {
@@ -163,7 +734,30 @@ test_harness(struct unit_test tests[MAX_TESTS], int iterations)
     if ((kqfd = kqueue()) < 0)
         die("kqueue()");
 
+    /* Skip the tests that use a filter which was not built */
+#if KQUEUE_FILTER_SIGNAL
     test(ev_receipt, ctx);
+#endif
+#if KQUEUE_FILTER_USER
+    test(kqueue_ring, ctx);
+    test(kqueue_stats, ctx);
+    test(kqueue_record, ctx);
+#endif
+    test(kqueue_lockstat, ctx);
+#if KQUEUE_FILTER_USER
+    test(kqueue_group, ctx);
+    test(kqueue_nested, ctx);
+    test(kqueue_clone, ctx);
+#if KQUEUE_FILTER_TIMER
+    test(kqueue_close, ctx);
+#endif
+    test(kqueue_dispatch, ctx);
+    test(kqueue_busy_poll, ctx);
+#endif
+    test(kevent_large_eventlist, ctx);
+#if KQUEUE_FILTER_USER
+    test(kevent_submit, ctx);
+#endif
     /* TODO: this fails now, but would be good later 
     test(kqueue_descriptor_is_pollable);
     */
@@ -205,18 +799,25 @@ main(int argc, char **argv)
 {
     struct unit_test tests[MAX_TESTS] = {
         { "socket", 1, test_evfilt_read },
-#if !defined(_WIN32) && !defined(__ANDROID__)
+#if !defined(_WIN32) && !defined(__ANDROID__) && KQUEUE_FILTER_SIGNAL
         // XXX-FIXME -- BROKEN ON LINUX WHEN RUN IN A SEPARATE THREAD
         { "signal", 1, test_evfilt_signal },
 #endif
-#if FIXME
+#if defined(__linux__)
+#if KQUEUE_FILTER_PROC
         { "proc", 1, test_evfilt_proc },
 #endif
+#if KQUEUE_FILTER_AIO
+        { "aio", 1, test_evfilt_aio },
+#endif
+#endif
+#if KQUEUE_FILTER_TIMER
 		{ "timer", 1, test_evfilt_timer },
-#ifndef _WIN32
+#endif
+#if !defined(_WIN32) && KQUEUE_FILTER_VNODE
 		{ "vnode", 1, test_evfilt_vnode },
 #endif
-#ifdef EVFILT_USER
+#if defined(EVFILT_USER) && KQUEUE_FILTER_USER
         { "user", 1, test_evfilt_user },
 #endif
         { NULL, 0, NULL },
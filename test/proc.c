@@ -18,7 +18,6 @@
 
 static int sigusr1_caught = 0;
 static pid_t pid;
-static int kqfd;
 
 static void
 sig_handler(int signum)
@@ -31,9 +30,9 @@ test_kevent_proc_add(struct test_context *ctx)
 {
     struct kevent kev;
 
-    test_no_kevents(kqfd);
-    kevent_add(kqfd, &kev, pid, EVFILT_PROC, EV_ADD, 0, 0, NULL);
-    test_no_kevents(kqfd);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, pid, EVFILT_PROC, EV_ADD, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
 }
 
 static void
@@ -41,38 +40,134 @@ test_kevent_proc_delete(struct test_context *ctx)
 {
     struct kevent kev;
 
-    test_no_kevents(kqfd);
-    kevent_add(kqfd, &kev, pid, EVFILT_PROC, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, pid, EVFILT_PROC, EV_DELETE, 0, 0, NULL);
     if (kill(pid, SIGKILL) < 0)
         die("kill");
     sleep(1);
-    test_no_kevents(kqfd);
+    test_no_kevents(ctx->kqfd);
+    if (waitpid(pid, NULL, 0) != pid)
+        die("waitpid");
 }
 
 static void
 test_kevent_proc_get(struct test_context *ctx)
 {
     struct kevent kev, buf;
+    int fd[2], status;
+    char c;
 
-    /* Create a child that waits to be killed and then exits */
+    /* Create a child that exits once the pipe is closed */
+    if (pipe(fd) < 0)
+        die("pipe");
     pid = fork();
     if (pid == 0) {
-        pause();
-        printf(" -- child caught signal, exiting\n");
+        close(fd[1]);
+        (void) read(fd[0], &c, 1);
+        printf(" -- child saw EOF, exiting\n");
         exit(2);
     }
+    close(fd[0]);
     printf(" -- child created (pid %d)\n", (int) pid);
 
-    test_no_kevents(kqfd);
-    kevent_add(kqfd, &kev, pid, EVFILT_PROC, EV_ADD, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, NULL);
 
     /* Cause the child to exit, then retrieve the event */
-    printf(" -- killing process %d\n", (int) pid);
-    if (kill(pid, SIGUSR1) < 0)
-        die("kill");
-    kevent_get(&buf, kqfd);
+    printf(" -- stopping process %d\n", (int) pid);
+    close(fd[1]);
+    kevent_get(&buf, ctx->kqfd);
+    kev.flags |= EV_EOF | EV_ONESHOT;
+    if (!WIFEXITED(buf.data) || WEXITSTATUS(buf.data) != 2)
+        die("incorrect exit status");
+    kev.data = buf.data;
     kevent_cmp(&kev, &buf);
+    test_no_kevents(ctx->kqfd);
+
+    /* The child is left for the application to reap */
+    if (waitpid(pid, &status, 0) != pid || status != buf.data)
+        die("waitpid");
+}
+
+/* Follow a child that forks a process, which execs and exits */
+static void
+test_kevent_proc_track(struct test_context *ctx)
+{
+    struct timespec timeout = { 5, 0 };
+    struct kevent kev, ret;
+    pid_t child, grandchild = 0;
+    int kqfd, fd[2], seen = 0, status, rv;
+    char c;
+
+    if ((kqfd = kqueue()) < 0)
+        die("kqueue");
+    if (pipe(fd) < 0)
+        die("pipe");
+    child = fork();
+    if (child == 0) {
+        close(fd[1]);
+        (void) read(fd[0], &c, 1);
+        if (fork() == 0) {
+            execl("/bin/sh", "sh", "-c", "exit 7", (char *) NULL);
+            _exit(1);
+        }
+        (void) wait(NULL);
+        _exit(5);
+    }
+    close(fd[0]);
+
+    /* The first knote of the filter has NOTE_TRACK, which needs the connector */
+    EV_SET(&kev, child, EVFILT_PROC, EV_ADD,
+            NOTE_EXIT | NOTE_FORK | NOTE_EXEC | NOTE_TRACK, 0, NULL);
+    rv = kevent(kqfd, &kev, 1, NULL, 0, NULL);
+    if (rv < 0) {
+        puts("skipped (the proc connector is not available)");
+        close(fd[1]);
+        if (waitpid(child, NULL, 0) != child)
+            die("waitpid");
+        close(kqfd);
+        return;
+    }
     test_no_kevents(kqfd);
+
+    /* The child forks, and both processes exit */
+    close(fd[1]);
+    while ((seen & 0x1f) != 0x1f) {
+        if (kevent(kqfd, NULL, 0, &ret, 1, &timeout) != 1) {
+            printf("seen=%#x\n", seen);
+            die("missing events");
+        }
+        if (ret.ident == (uintptr_t) child) {
+            if (ret.fflags & NOTE_FORK)
+                seen |= 0x01;
+            if (ret.fflags & NOTE_EXIT) {
+                if (!(ret.flags & EV_EOF) || !WIFEXITED(ret.data)
+                        || WEXITSTATUS(ret.data) != 5)
+                    die("incorrect exit status of the child");
+                seen |= 0x02;
+            }
+        } else if (ret.fflags & NOTE_CHILD) {
+            if (ret.data != child)
+                die("NOTE_CHILD without the parent in data");
+            grandchild = ret.ident;
+            seen |= 0x04;
+        } else if (grandchild != 0 && ret.ident == (uintptr_t) grandchild) {
+            if (ret.fflags & NOTE_EXEC)
+                seen |= 0x08;
+            if (ret.fflags & NOTE_EXIT) {
+                if (!WIFEXITED(ret.data) || WEXITSTATUS(ret.data) != 7)
+                    die("incorrect exit status of the grandchild");
+                seen |= 0x10;
+            }
+        } else {
+            die("unexpected event");
+        }
+    }
+    test_no_kevents(kqfd);
+
+    if (waitpid(child, &status, 0) != child || WEXITSTATUS(status) != 5)
+        die("waitpid");
+    close(kqfd);
 }
 
 #ifdef TODO
@@ -215,6 +310,7 @@ test_evfilt_proc(struct test_context *ctx)
     test(kevent_proc_add, ctx);
     test(kevent_proc_delete, ctx);
     test(kevent_proc_get, ctx);
+    test(kevent_proc_track, ctx);
 
     signal(SIGUSR1, SIG_DFL);
 
@@ -289,6 +289,221 @@ test_kevent_socket_listen_backlog(struct test_context *ctx)
     test_no_kevents(ctx->kqfd);
 }
 
+#ifdef NOTE_NODATA
+void
+test_kevent_socket_nodata(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    char buf[3];
+
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_ADD, NOTE_NODATA, 0, &ctx->client_fd);
+    test_no_kevents(ctx->kqfd);
+
+    /* data is a placeholder rather than the number of bytes available */
+    if (send(ctx->server_fd, "...", 3, 0) < 3)
+        die("send(2)");
+    kev.data = 1;
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+
+    if (recv(ctx->client_fd, &buf[0], 3, 0) < 3)
+        die("recv(2)");
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_DELETE, 0, 0, &ctx->client_fd);
+}
+#endif  /* NOTE_NODATA */
+
+#ifdef NOTE_PRIORITY
+#define PRIORITY_BULK   32
+
+static void *
+priority_send_thread(void *arg)
+{
+    int fd = *((int *) arg);
+
+    usleep(50000);
+    if (send(fd, ".", 1, 0) < 1)
+        die("send(2)");
+
+    return (NULL);
+}
+
+/* A NOTE_PRIORITY knote is reported ahead of a backlog of other events */
+void
+test_kevent_socket_priority(struct test_context *ctx)
+{
+    struct timespec timeout = { 5, 0 };
+    struct kevent kev, ret[4];
+    int bulk[PRIORITY_BULK][2];
+    pthread_t tid;
+    char buf[1];
+    int i, n;
+
+    for (i = 0; i < PRIORITY_BULK; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, bulk[i]) < 0)
+            die("socketpair");
+        kevent_add(ctx->kqfd, &kev, bulk[i][0], EVFILT_READ, EV_ADD, NOTE_NODATA, 0, NULL);
+        if (send(bulk[i][1], ".", 1, 0) < 1)
+            die("send(2)");
+    }
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_ADD,
+            NOTE_PRIORITY | NOTE_NODATA, 0, NULL);
+
+    if (send(ctx->server_fd, ".", 1, 0) < 1)
+        die("send(2)");
+    n = kevent(ctx->kqfd, NULL, 0, ret, 4, &timeout);
+    if (n < 1 || ret[0].ident != (uintptr_t) ctx->client_fd)
+        die("priority event was not reported first");
+    if (recv(ctx->client_fd, &buf[0], 1, 0) < 1)
+        die("recv(2)");
+
+    /* It is also first when it becomes ready during a wait */
+    for (i = 0; i < PRIORITY_BULK; i++)
+        kevent_add(ctx->kqfd, &kev, bulk[i][0], EVFILT_READ, EV_DISABLE, 0, 0, NULL);
+    if (pthread_create(&tid, NULL, priority_send_thread, &ctx->server_fd) != 0)
+        die("pthread_create");
+    n = kevent(ctx->kqfd, NULL, 0, ret, 4, &timeout);
+    pthread_join(tid, NULL);
+    if (n != 1 || ret[0].ident != (uintptr_t) ctx->client_fd)
+        die("priority event was not reported after a wait");
+    if (recv(ctx->client_fd, &buf[0], 1, 0) < 1)
+        die("recv(2)");
+
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    for (i = 0; i < PRIORITY_BULK; i++) {
+        kevent_add(ctx->kqfd, &kev, bulk[i][0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        close(bulk[i][0]);
+        close(bulk[i][1]);
+    }
+    test_no_kevents(ctx->kqfd);
+}
+#endif  /* NOTE_PRIORITY */
+
+#ifdef NOTE_COALESCE
+/* A NOTE_COALESCE knote is reported at most once per window */
+void
+test_kevent_socket_coalesce(struct test_context *ctx)
+{
+    struct timespec timeout = { 5, 0 };
+    struct timespec start, end;
+    struct kevent kev, ret;
+    char buf[2];
+    long elapsed;
+
+    /* A window of 100 milliseconds */
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_ADD | EV_CLEAR,
+            NOTE_COALESCE | NOTE_NODATA, 100000, NULL);
+
+    /* The first event is reported at once */
+    if (send(ctx->server_fd, ".", 1, 0) < 1)
+        die("send(2)");
+    kevent_get(&ret, ctx->kqfd);
+    if (ret.ident != (uintptr_t) ctx->client_fd)
+        die("wrong event");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* The next one waits for the end of the window */
+    if (send(ctx->server_fd, ".", 1, 0) < 1)
+        die("send(2)");
+    test_no_kevents(ctx->kqfd);
+    if (kevent(ctx->kqfd, NULL, 0, &ret, 1, &timeout) != 1
+            || ret.ident != (uintptr_t) ctx->client_fd)
+        die("coalesced event was not reported");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if (elapsed < 50) {
+        printf("reported after %ld ms\n", elapsed);
+        die("coalesced event was reported too early");
+    }
+    if (recv(ctx->client_fd, &buf[0], 2, 0) < 2)
+        die("recv(2)");
+
+    /* Deleting it while it waits for its window cancels the timer */
+    if (send(ctx->server_fd, ".", 1, 0) < 1)
+        die("send(2)");
+    kevent_get(&ret, ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    usleep(150000);
+    test_no_kevents(ctx->kqfd);
+    if (recv(ctx->client_fd, &buf[0], 1, 0) < 1)
+        die("recv(2)");
+}
+#endif  /* NOTE_COALESCE */
+
+#ifdef NOTE_EXCLUSIVE
+/*
+ * Test that EV_DISPATCH and EV_ONESHOT still deliver a single event when
+ * a listening socket is registered with NOTE_EXCLUSIVE.
+ */
+void
+test_kevent_socket_exclusive(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    struct sockaddr_in sain;
+    socklen_t sa_len = sizeof(sain);
+    int one = 1;
+    short port;
+    int clnt, srvr;
+
+    port = 15973 + ctx->iteration;
+
+    /* Create a passive socket */
+    memset(&sain, 0, sizeof(sain));
+    sain.sin_family = AF_INET;
+    sain.sin_port = htons(port);
+    if ((srvr = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        err(1, "socket()");
+    if (setsockopt(srvr, SOL_SOCKET, SO_REUSEADDR,
+                (char *) &one, sizeof(one)) != 0)
+        err(1, "setsockopt()");
+    if (bind(srvr, (struct sockaddr *) &sain, sa_len) < 0)
+        err(1, "bind-3", port);
+    if (listen(srvr, 100) < 0)
+        err(1, "listen()");
+
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, srvr, EVFILT_READ, EV_ADD | EV_DISPATCH, NOTE_EXCLUSIVE, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+
+    /* Simulate a client connecting to the server */
+    sain.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if ((clnt = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        err(1, "socket()");
+    if (connect(clnt, (struct sockaddr *) &sain, sa_len) < 0)
+        err(1, "connect()");
+
+    /* The connection is reported once, then the knote is disabled */
+    kev.data = 1;
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+    test_no_kevents(ctx->kqfd);
+
+    /* Re-enabling reports the connection that is still pending */
+    kevent_add(ctx->kqfd, &kev, srvr, EVFILT_READ, EV_ENABLE | EV_DISPATCH, NOTE_EXCLUSIVE, 0, NULL);
+    kev.data = 1;
+    kev.flags = EV_ADD | EV_DISPATCH;
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, srvr, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+
+    /* With EV_ONESHOT, the knote is gone after the first event */
+    kevent_add(ctx->kqfd, &kev, srvr, EVFILT_READ, EV_ADD | EV_ONESHOT, NOTE_EXCLUSIVE, 0, NULL);
+    kev.data = 1;
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+    test_no_kevents(ctx->kqfd);
+
+    kev.flags = EV_DELETE;
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) == 0)
+        die("EV_DELETE of a oneshot knote succeeded");
+
+    close(clnt);
+    close(srvr);
+}
+#endif  /* NOTE_EXCLUSIVE */
+
 #ifdef EV_DISPATCH
 void
 test_kevent_socket_dispatch(struct test_context *ctx)
@@ -323,36 +538,64 @@ test_kevent_socket_dispatch(struct test_context *ctx)
 }
 #endif  /* EV_DISPATCH */
 
-#if BROKEN_ON_LINUX
-void
-test_kevent_socket_lowat(struct test_context *ctx)
+#ifdef NOTE_LOWAT
+static void
+kevent_socket_lowat(int kqfd, int rfd, int wfd)
 {
-    struct kevent kev;
+    struct kevent kev, ret;
+    char buf[2];
 
-    test_begin(test_id);
+    /* A level-triggered knote waiting for two bytes */
+    kevent_add(kqfd, &kev, rfd, EVFILT_READ, EV_ADD, NOTE_LOWAT, 2, NULL);
+    test_no_kevents(kqfd);
 
-    /* Re-add the watch and make sure no events are pending */
-    puts("-- re-adding knote, setting low watermark to 2 bytes");
-    EV_SET(&kev, ctx->client_fd, EVFILT_READ, EV_ADD | EV_ONESHOT, NOTE_LOWAT, 2, &ctx->client_fd);
-    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
-        die("%s", test_id);
-    test_no_kevents();
+    /* One byte is below the mark */
+    if (send(wfd, ".", 1, 0) < 1)
+        die("send(2)");
+    test_no_kevents(kqfd);
 
-    puts("-- checking that one byte does not trigger an event..");
-    kevent_socket_fill(ctx);
-    test_no_kevents();
+    /* The second one triggers it, until the data is read */
+    if (send(wfd, ".", 1, 0) < 1)
+        die("send(2)");
+    kevent_get(&ret, kqfd);
+    if (ret.ident != (uintptr_t) rfd || ret.data != 2)
+        die("wrong event");
+    kevent_get(&ret, kqfd);
+    if (ret.ident != (uintptr_t) rfd)
+        die("level-triggered event was not reported again");
+    if (recv(rfd, &buf[0], 2, 0) < 2)
+        die("recv(2)");
+    test_no_kevents(kqfd);
 
-    puts("-- checking that two bytes triggers an event..");
-    kevent_socket_fill(ctx);
-    if (kevent(ctx->kqfd, NULL, 0, &kev, 1, NULL) != 1)
-        die("%s", test_id);
-    KEV_CMP(kev, ctx->client_fd, EVFILT_READ, 0);
-    test_no_kevents();
+    kevent_add(kqfd, &kev, rfd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+}
 
-    kevent_socket_drain(ctx);
-    kevent_socket_drain(ctx);
+void
+test_kevent_socket_lowat(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    int sv[2];
+
+    /* SO_RCVLOWAT on TCP, and the emulation on a UNIX domain socket */
+    kevent_socket_lowat(ctx->kqfd, ctx->client_fd, ctx->server_fd);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        die("socketpair(2)");
+    kevent_socket_lowat(ctx->kqfd, sv[0], sv[1]);
+
+    /* The send buffer never has that much room */
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_WRITE, EV_ADD, NOTE_LOWAT, 1 << 30, NULL);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_WRITE, EV_ADD | EV_ONESHOT, NOTE_LOWAT, 16, NULL);
+    kevent_get(&ret, ctx->kqfd);
+    if (ret.ident != (uintptr_t) sv[0] || ret.filter != EVFILT_WRITE)
+        die("wrong event");
+    test_no_kevents(ctx->kqfd);
+
+    close(sv[0]);
+    close(sv[1]);
 }
-#endif
+#endif  /* NOTE_LOWAT */
 
 void
 test_kevent_socket_eof(struct test_context *ctx)
@@ -376,6 +619,78 @@ test_kevent_socket_eof(struct test_context *ctx)
     kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_DELETE, 0, 0, &ctx->client_fd);
 }
 
+/* A disabled knote must stay quiet when its peer hangs up */
+void
+test_kevent_socket_disable_eof(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        die("socketpair");
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_READ, EV_DISABLE, 0, 0, NULL);
+    if (close(sv[1]) < 0)
+        die("close(2)");
+    test_no_kevents(ctx->kqfd);
+    test_no_kevents(ctx->kqfd);
+
+    /* The hangup is reported once the knote is enabled */
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_READ, EV_ENABLE, 0, 0, NULL);
+    kev.flags = EV_ADD | EV_EOF;
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    close(sv[0]);
+}
+
+/* EVFILT_READ and EVFILT_WRITE knotes on the same socket */
+void
+test_kevent_socket_read_write(struct test_context *ctx)
+{
+    struct kevent kev, ret[3];
+    struct timespec ts = { 0, 0 };
+    int sv[2], i, nread, nwrite;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        die("socketpair");
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_READ, EV_ADD | EV_DISPATCH, 0, 0, NULL);
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+
+    /* The socket is writable but there is nothing to read */
+    if (kevent(ctx->kqfd, NULL, 0, ret, 3, &ts) != 1 || ret[0].filter != EVFILT_WRITE)
+        die("expected only the write event");
+
+    /* One epoll event becomes two kevents */
+    if (write(sv[1], ".", 1) != 1)
+        die("write");
+    if (kevent(ctx->kqfd, NULL, 0, ret, 3, &ts) != 2)
+        die("expected a read and a write event");
+    for (i = 0, nread = 0, nwrite = 0; i < 2; i++) {
+        nread += (ret[i].filter == EVFILT_READ && ret[i].data == 1);
+        nwrite += (ret[i].filter == EVFILT_WRITE);
+    }
+    if (nread != 1 || nwrite != 1)
+        die("wrong events");
+
+    /* The read knote was dispatched, so only the write side is left */
+    if (kevent(ctx->kqfd, NULL, 0, ret, 3, &ts) != 1 || ret[0].filter != EVFILT_WRITE)
+        die("EV_DISPATCH did not disable the read knote");
+
+    /* Without the write knote, the read knote keeps the registration */
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_READ, EV_ENABLE, 0, 0, NULL);
+    if (kevent(ctx->kqfd, NULL, 0, ret, 3, &ts) != 1 || ret[0].filter != EVFILT_READ)
+        die("expected only the read event");
+
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+    close(sv[0]);
+    close(sv[1]);
+}
+
 /* Test if EVFILT_READ works with regular files */
 void
 test_kevent_regular_file(struct test_context *ctx)
@@ -419,6 +734,109 @@ test_kevent_regular_file(struct test_context *ctx)
     close(fd);
 }
 
+/* EV_CLEAR and EV_DISPATCH report a regular file once */
+void
+test_kevent_regular_file_clear(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    int fd;
+
+    fd = open("/etc/hosts", O_RDONLY);
+    if (fd < 0)
+        abort();
+
+    kevent_add(ctx->kqfd, &kev, fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    kevent_get(&ret, ctx->kqfd);
+    if (ret.ident != (uintptr_t) fd || ret.data <= 0)
+        err(1, "unexpected event: %s", kevent_to_str(&ret));
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+
+#ifdef EV_DISPATCH
+    kevent_add(ctx->kqfd, &kev, fd, EVFILT_READ, EV_ADD | EV_DISPATCH, 0, 0, NULL);
+    kevent_get(&ret, ctx->kqfd);
+    test_no_kevents(ctx->kqfd);
+
+    /* Enabling the knote reports it again */
+    kevent_add(ctx->kqfd, &kev, fd, EVFILT_READ, EV_ENABLE, 0, 0, NULL);
+    kevent_get(&ret, ctx->kqfd);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+#endif
+    test_no_kevents(ctx->kqfd);
+    close(fd);
+}
+
+/* Test a changelist with several entries, one of which fails */
+void
+test_kevent_socket_changelist(struct test_context *ctx)
+{
+    struct kevent kev[3], ret[3];
+    int sv[2], dirfd;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        die("socketpair(2)");
+    dirfd = open("/", O_RDONLY);
+    if (dirfd < 0)
+        die("open(2)");
+
+    /* Directories are not pollable, so the second entry fails */
+    EV_SET(&kev[0], sv[0], EVFILT_READ, EV_ADD | EV_RECEIPT, 0, 0, &sv[0]);
+    EV_SET(&kev[1], dirfd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    EV_SET(&kev[2], sv[1], EVFILT_READ, EV_ADD | EV_RECEIPT, 0, 0, &sv[1]);
+    if (kevent(ctx->kqfd, kev, 3, ret, 3, NULL) != 3)
+        die("kevent");
+    kev[0].data = 0;
+    kevent_cmp(&kev[0], &ret[0]);
+    if (ret[1].data == 0)
+        die("expected an error for the directory");
+    kev[1].data = ret[1].data;
+    kevent_cmp(&kev[1], &ret[1]);
+    kev[2].data = 0;
+    kevent_cmp(&kev[2], &ret[2]);
+
+    /* The failed entry must not leave a knote behind */
+    EV_SET(&kev[1], dirfd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    if (kevent(ctx->kqfd, &kev[1], 1, NULL, 0, NULL) == 0 || errno != ENOENT)
+        die("kevent");
+
+    /* The other entries were applied */
+    if (write(sv[1], ".", 1) < 1)
+        die("write(2)");
+    kevent_get(&ret[0], ctx->kqfd);
+    if (ret[0].ident != (uintptr_t) sv[0])
+        die("wrong descriptor");
+
+    EV_SET(&kev[0], sv[0], EVFILT_READ, EV_DELETE, 0, 0, &sv[0]);
+    EV_SET(&kev[1], sv[1], EVFILT_READ, EV_DELETE, 0, 0, &sv[1]);
+    if (kevent(ctx->kqfd, kev, 2, NULL, 0, NULL) < 0)
+        die("kevent");
+    close(dirfd);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/* Test applying a change and waiting for events in the same call */
+void
+test_kevent_socket_add_and_wait(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    struct timespec timeo = { 1, 0 };
+
+    kevent_socket_fill(ctx);
+    EV_SET(&kev, ctx->client_fd, EVFILT_READ, EV_ADD, 0, 0, &ctx->client_fd);
+    if (kevent(ctx->kqfd, &kev, 1, &ret, 1, &timeo) != 1)
+        die("kevent");
+    kev.flags = EV_ADD;
+    kev.data = 1;
+    kevent_cmp(&kev, &ret);
+
+    kevent_socket_drain(ctx);
+    kev.flags = EV_DELETE;
+    if (kevent(ctx->kqfd, &kev, 1, &ret, 1, &timeo) != 0)
+        die("kevent");
+}
+
 void
 test_evfilt_read(struct test_context *ctx)
 {
@@ -433,10 +851,30 @@ test_evfilt_read(struct test_context *ctx)
     test(kevent_socket_clear, ctx);
 #ifdef EV_DISPATCH
     test(kevent_socket_dispatch, ctx);
+#endif
+    test(kevent_socket_add_and_wait, ctx);
+#ifdef NOTE_NODATA
+    test(kevent_socket_nodata, ctx);
 #endif
     test(kevent_socket_listen_backlog, ctx);
+#ifdef NOTE_EXCLUSIVE
+    test(kevent_socket_exclusive, ctx);
+#endif
+#ifdef NOTE_PRIORITY
+    test(kevent_socket_priority, ctx);
+#endif
+#ifdef NOTE_COALESCE
+    test(kevent_socket_coalesce, ctx);
+#endif
+#ifdef NOTE_LOWAT
+    test(kevent_socket_lowat, ctx);
+#endif
+    test(kevent_socket_disable_eof, ctx);
+    test(kevent_socket_read_write, ctx);
     test(kevent_socket_eof, ctx);
     test(kevent_regular_file, ctx);
+    test(kevent_regular_file_clear, ctx);
+    test(kevent_socket_changelist, ctx);
     close(ctx->client_fd);
     close(ctx->server_fd);
 }
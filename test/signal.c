@@ -87,6 +87,7 @@ test_kevent_signal_del(struct test_context *ctx)
     kevent_add(ctx->kqfd, &kev, SIGUSR1, EVFILT_SIGNAL, EV_DELETE, 0, 0, NULL);
 
     signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
     if (kill(getpid(), SIGUSR1) < 0)
         die("kill");
 
@@ -134,6 +135,48 @@ test_kevent_signal_modify(struct test_context *ctx)
     test_kevent_signal_del(ctx);
 }
 
+void
+test_kevent_signal_multiple(struct test_context *ctx)
+{
+    struct kevent kev[2], ret[2];
+
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev[0], SIGUSR1, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    kevent_add(ctx->kqfd, &kev[1], SIGUSR2, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+
+    /* Both signals are reported by a single call */
+    if (kill(getpid(), SIGUSR1) < 0)
+        die("kill");
+    if (kill(getpid(), SIGUSR2) < 0)
+        die("kill");
+    if (kevent(ctx->kqfd, NULL, 0, ret, 2, NULL) != 2)
+        die("kevent");
+    if (ret[0].ident != SIGUSR1) {
+        struct kevent tmp = ret[0];
+        ret[0] = ret[1];
+        ret[1] = tmp;
+    }
+    kev[0].flags |= EV_CLEAR;
+    kev[0].data = 1;
+    kevent_cmp(&kev[0], &ret[0]);
+    kev[1].flags |= EV_CLEAR;
+    kev[1].data = 1;
+    kevent_cmp(&kev[1], &ret[1]);
+
+    /* Deleting one signal leaves the other one watched */
+    kevent_add(ctx->kqfd, &kev[0], SIGUSR1, EVFILT_SIGNAL, EV_DELETE, 0, 0, NULL);
+    if (kill(getpid(), SIGUSR1) < 0)
+        die("kill");
+    test_no_kevents(ctx->kqfd);
+    if (kill(getpid(), SIGUSR2) < 0)
+        die("kill");
+    kevent_get(&ret[1], ctx->kqfd);
+    kevent_cmp(&kev[1], &ret[1]);
+
+    kevent_add(ctx->kqfd, &kev[1], SIGUSR2, EVFILT_SIGNAL, EV_DELETE, 0, 0, NULL);
+}
+
 #ifdef EV_DISPATCH
 void
 test_kevent_signal_dispatch(struct test_context *ctx)
@@ -180,6 +223,7 @@ void
 test_evfilt_signal(struct test_context *ctx)
 {
     signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
 
     test(kevent_signal_add, ctx);
     test(kevent_signal_del, ctx);
@@ -188,6 +232,7 @@ test_evfilt_signal(struct test_context *ctx)
     test(kevent_signal_enable, ctx);
     test(kevent_signal_oneshot, ctx);
     test(kevent_signal_modify, ctx);
+    test(kevent_signal_multiple, ctx);
 #ifdef EV_DISPATCH
     test(kevent_signal_dispatch, ctx);
 #endif
@@ -117,6 +117,116 @@ test_kevent_timer_disable_and_enable(struct test_context *ctx)
     kevent_cmp(&kev, &ret);
 }
 
+/* Test many timers that expire at about the same time */
+static void
+test_kevent_timer_many(struct test_context *ctx)
+{
+    struct kevent kev[16], ret[16];
+    struct timespec timeo = { 1, 0 };
+    int i, n, nret;
+
+    test_no_kevents(ctx->kqfd);
+
+    for (i = 0; i < 16; i++)
+        EV_SET(&kev[i], 100 + i, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 50 + i, NULL);
+    if (kevent(ctx->kqfd, kev, 16, NULL, 0, NULL) < 0)
+        die("kevent");
+
+    /* Cancel one of them */
+    EV_SET(&kev[0], 107, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+    if (kevent(ctx->kqfd, kev, 1, NULL, 0, NULL) < 0)
+        die("kevent");
+
+    /* Retrieve the others, a few at a time */
+    for (nret = 0; nret < 15; nret += n) {
+        n = kevent(ctx->kqfd, NULL, 0, ret, 4, &timeo);
+        if (n < 1)
+            die("kevent");
+        for (i = 0; i < n; i++) {
+            if (ret[i].ident < 100 || ret[i].ident >= 116 || ret[i].ident == 107
+                    || ret[i].data != 1)
+                die("unexpected timer event");
+        }
+    }
+
+    test_no_kevents(ctx->kqfd);
+}
+
+/*
+ * Wait up to a second for a timer event. The timerfd may still be armed
+ * for a timer that was deleted, which makes kevent() return early with
+ * no events.
+ */
+static int
+timer_wait(struct test_context *ctx, struct kevent *ret)
+{
+    struct timespec timeo = { 0, 100000000 };
+    int i, n;
+
+    for (i = 0, n = 0; i < 10 && n == 0; i++)
+        n = kevent(ctx->kqfd, NULL, 0, ret, 1, &timeo);
+    return (n);
+}
+
+/* Test the unit flags, and the count of expirations missed by a periodic timer */
+static void
+test_kevent_timer_units(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+
+    test_no_kevents(ctx->kqfd);
+
+    EV_SET(&kev, 5, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_USECONDS, 2000, NULL);
+    kevent_update(ctx->kqfd, &kev);
+    if (timer_wait(ctx, &ret) != 1 || ret.ident != 5 || ret.data != 1)
+        die("microsecond timer did not expire");
+
+    EV_SET(&kev, 6, EVFILT_TIMER, EV_ADD, NOTE_NSECONDS, 1000000, NULL);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent");
+    usleep(50000);
+    if (timer_wait(ctx, &ret) != 1 || ret.ident != 6 || ret.data < 40)
+        die("periodic timer lost expirations");
+    kev.flags = EV_DELETE;
+    kevent_update(ctx->kqfd, &kev);
+}
+
+/* Test a timer that expires at a time since the Epoch */
+static void
+test_kevent_timer_absolute(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    struct timespec now;
+    int64_t deadline;
+
+    test_no_kevents(ctx->kqfd);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    deadline = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000 + 100000;
+    EV_SET(&kev, 7, EVFILT_TIMER, EV_ADD, NOTE_ABSTIME | NOTE_USECONDS, deadline, NULL);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent");
+    test_no_kevents(ctx->kqfd);
+    if (timer_wait(ctx, &ret) != 1 || ret.ident != 7 || ret.data != 1)
+        die("absolute timer did not expire");
+    clock_gettime(CLOCK_REALTIME, &now);
+    if ((int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000 < deadline)
+        die("absolute timer expired early");
+
+    /* It only expires once */
+    usleep(200000);
+    test_no_kevents(ctx->kqfd);
+    kev.flags = EV_DELETE;
+    kevent_update(ctx->kqfd, &kev);
+
+    /* A time in the past expires at once */
+    EV_SET(&kev, 7, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_ABSTIME | NOTE_SECONDS,
+            now.tv_sec - 10, NULL);
+    kevent_update(ctx->kqfd, &kev);
+    if (timer_wait(ctx, &ret) != 1 || ret.ident != 7)
+        die("expired absolute timer did not fire");
+}
+
 #ifdef EV_DISPATCH
 void
 test_kevent_timer_dispatch(struct test_context *ctx)
@@ -164,6 +274,9 @@ test_evfilt_timer(struct test_context *ctx)
     test(kevent_timer_oneshot, ctx);
     test(kevent_timer_periodic, ctx);
     test(kevent_timer_disable_and_enable, ctx);
+    test(kevent_timer_many, ctx);
+    test(kevent_timer_units, ctx);
+    test(kevent_timer_absolute, ctx);
 #ifdef EV_DISPATCH
     test(kevent_timer_dispatch, ctx);
 #endif
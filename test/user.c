@@ -133,6 +133,253 @@ test_kevent_user_multi_trigger_merged(struct test_context *ctx)
     test_no_kevents(ctx->kqfd);
 }
 
+/* Test more user events than there are descriptors available */
+static void
+test_kevent_user_many(struct test_context *ctx)
+{
+    struct kevent kev, ret[64];
+    char seen[2000];
+    int i, n, nret;
+
+    test_no_kevents(ctx->kqfd);
+
+    for (i = 0; i < 2000; i++)
+        kevent_add(ctx->kqfd, &kev, 1000 + i, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    for (i = 0; i < 2000; i++)
+        kevent_add(ctx->kqfd, &kev, 1000 + i, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+
+    /* Each event is returned once */
+    memset(seen, 0, sizeof(seen));
+    for (nret = 0; nret < 2000; nret += n) {
+        n = kevent(ctx->kqfd, NULL, 0, ret, 64, NULL);
+        if (n < 1)
+            die("kevent");
+        for (i = 0; i < n; i++) {
+            if (ret[i].ident < 1000 || ret[i].ident >= 3000
+                    || seen[ret[i].ident - 1000]++)
+                die("unexpected user event");
+        }
+    }
+    test_no_kevents(ctx->kqfd);
+
+    for (i = 0; i < 2000; i++)
+        kevent_add(ctx->kqfd, &kev, 1000 + i, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+}
+
+#if !defined(_WIN32)
+static void
+test_kevent_user_fast_trigger(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev, 3, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+
+    /* Triggers made while the event is pending are merged into it */
+    if (kqueue_user_trigger(ctx->kqfd, 3, NOTE_FFOR | 0x1) < 0)
+        die("kqueue_user_trigger");
+    if (kqueue_user_trigger(ctx->kqfd, 3, NOTE_FFOR | 0x2) < 0)
+        die("kqueue_user_trigger");
+    if (kqueue_user_trigger(ctx->kqfd, 3, NOTE_FFOR | 0x4) < 0)
+        die("kqueue_user_trigger");
+
+    kev.flags = EV_CLEAR;
+    kev.fflags = 0x7;
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+    test_no_kevents(ctx->kqfd);
+
+    /* The knote stays armed for the next trigger */
+    if (kqueue_user_trigger(ctx->kqfd, 3, NOTE_FFNOP) < 0)
+        die("kqueue_user_trigger");
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+    test_no_kevents(ctx->kqfd);
+
+    if (kqueue_user_trigger(ctx->kqfd, 99, NOTE_FFNOP) == 0 || errno != ENOENT)
+        die("kqueue_user_trigger of a missing knote should fail");
+
+    kevent_add(ctx->kqfd, &kev, 3, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+}
+
+struct trigger_args {
+    int          kqfd;
+    volatile int stop;
+};
+
+static void *
+trigger_thread(void *arg)
+{
+    struct trigger_args *ta = (struct trigger_args *) arg;
+    unsigned int i;
+
+    for (i = 0; !ta->stop; i++)
+        (void) kqueue_user_trigger(ta->kqfd, 4000 + i % 64, NOTE_FFNOP);
+
+    return (NULL);
+}
+
+/* Knotes are deleted and reused while another thread looks them up */
+static void
+test_kevent_user_trigger_while_deleting(struct test_context *ctx)
+{
+    struct trigger_args ta;
+    struct kevent kev;
+    pthread_t tid;
+    int i, j;
+
+    test_no_kevents(ctx->kqfd);
+
+    ta.kqfd = ctx->kqfd;
+    ta.stop = 0;
+    if (pthread_create(&tid, NULL, trigger_thread, &ta) != 0)
+        die("pthread_create");
+
+    for (i = 0; i < 200; i++) {
+        for (j = 0; j < 64; j++)
+            kevent_add(ctx->kqfd, &kev, 4000 + j, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        for (j = 0; j < 64; j++)
+            kevent_add(ctx->kqfd, &kev, 4000 + j, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    }
+
+    ta.stop = 1;
+    pthread_join(tid, NULL);
+    test_no_kevents(ctx->kqfd);
+}
+
+static void
+test_kevent64_user(struct test_context *ctx)
+{
+    const uint64_t udata = 0x123456789abcdef0ULL;
+    struct kevent64_s ch, ev;
+    struct kevent ret;
+
+    test_no_kevents(ctx->kqfd);
+
+    EV_SET64(&ch, 5, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, udata, 7, 8);
+    if (kevent64(ctx->kqfd, &ch, 1, NULL, 0, 0, NULL) != 0)
+        die("kevent64");
+
+    /* All of udata and ext[] come back with the event */
+    if (kqueue_user_trigger(ctx->kqfd, 5, 0) < 0)
+        die("kqueue_user_trigger");
+    if (kevent64(ctx->kqfd, NULL, 0, &ev, 1, KEVENT_FLAG_IMMEDIATE, NULL) != 1)
+        die("kevent64");
+    if (ev.ident != 5 || ev.filter != EVFILT_USER || ev.flags != EV_CLEAR
+            || ev.udata != udata || ev.ext[0] != 7 || ev.ext[1] != 8)
+        die("wrong kevent64 event");
+
+    /* kevent() returns as much of udata as fits */
+    if (kqueue_user_trigger(ctx->kqfd, 5, 0) < 0)
+        die("kqueue_user_trigger");
+    kevent_get(&ret, ctx->kqfd);
+    if (ret.udata != (void *) (uintptr_t) udata || ret.flags != EV_CLEAR) {
+        puts(kevent_to_str(&ret));
+        die("wrong kevent event");
+    }
+
+    /* A change that fails is returned with its own udata and ext[] */
+    EV_SET64(&ch, 6, EVFILT_USER, EV_DELETE | EV_RECEIPT, 0, 0, 42, 1, 2);
+    if (kevent64(ctx->kqfd, &ch, 1, &ev, 1, 0, NULL) != 1)
+        die("kevent64");
+    if (ev.ident != 6 || ev.data != ENOENT || ev.udata != 42
+            || ev.ext[0] != 1 || ev.ext[1] != 2)
+        die("wrong kevent64 error");
+
+    EV_SET64(&ch, 5, EVFILT_USER, EV_DELETE, 0, 0, 0, 0, 0);
+    if (kevent64(ctx->kqfd, &ch, 1, NULL, 0, 0, NULL) != 0)
+        die("kevent64");
+    test_no_kevents(ctx->kqfd);
+}
+
+static void *
+post_thread(void *arg)
+{
+    int kqfd = *((int *) arg);
+    struct kevent kev;
+
+    usleep(50000);
+    EV_SET(&kev, 7, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (kevent_post(kqfd, &kev, 1) < 0)
+        die("kevent_post");
+
+    return (NULL);
+}
+
+static void
+test_kevent_post(struct test_context *ctx)
+{
+    struct timespec timeout = { 5, 0 };
+    struct kevent kev, ret;
+    pthread_t tid;
+
+    test_no_kevents(ctx->kqfd);
+
+    /* Posted changes are applied by the next kevent() */
+    EV_SET(&kev, 7, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (kevent_post(ctx->kqfd, &kev, 1) < 0)
+        die("kevent_post");
+    EV_SET(&kev, 7, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (kevent_post(ctx->kqfd, &kev, 1) < 0)
+        die("kevent_post");
+    kevent_get(&ret, ctx->kqfd);
+    if (ret.ident != 7 || ret.filter != EVFILT_USER)
+        die("wrong event for a posted change");
+
+    /* A thread that waits for events is woken up to apply them */
+    if (pthread_create(&tid, NULL, post_thread, &ctx->kqfd) != 0)
+        die("pthread_create");
+    if (kevent(ctx->kqfd, NULL, 0, &ret, 1, &timeout) != 1)
+        die("kevent did not return the posted trigger");
+    pthread_join(tid, NULL);
+    if (ret.ident != 7 || ret.filter != EVFILT_USER)
+        die("wrong event for a posted change");
+
+    kevent_add(ctx->kqfd, &kev, 7, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+}
+
+static void *
+wait_thread(void *arg)
+{
+    struct kevent ret;
+
+    if (kevent(*(int *) arg, NULL, 0, &ret, 1, NULL) != 1 || ret.ident != 9)
+        die("kevent");
+
+    return (NULL);
+}
+
+/* A thread that waits without a timeout does not hold back the knotes deleted meanwhile */
+static void
+test_kevent_user_churn(struct test_context *ctx)
+{
+    struct timespec start, end;
+    struct kevent kev;
+    pthread_t tid;
+    int i;
+
+    kevent_add(ctx->kqfd, &kev, 9, EVFILT_USER, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    if (pthread_create(&tid, NULL, wait_thread, &ctx->kqfd) != 0)
+        die("pthread_create");
+    usleep(10000);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < 100000; i++) {
+        kevent_add(ctx->kqfd, &kev, 10, EVFILT_USER, EV_ADD, 0, 0, NULL);
+        kevent_add(ctx->kqfd, &kev, 10, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (end.tv_sec - start.tv_sec > 10)
+        die("deleting knotes slowed down while a thread waited");
+
+    kevent_add(ctx->kqfd, &kev, 9, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    pthread_join(tid, NULL);
+    test_no_kevents(ctx->kqfd);
+}
+#endif
+
 #ifdef EV_DISPATCH
 void
 test_kevent_user_dispatch(struct test_context *ctx)
@@ -184,6 +431,14 @@ test_evfilt_user(struct test_context *ctx)
     test(kevent_user_disable_and_enable, ctx);
     test(kevent_user_oneshot, ctx);
     test(kevent_user_multi_trigger_merged, ctx);
+    test(kevent_user_many, ctx);
+#if !defined(_WIN32)
+    test(kevent_user_fast_trigger, ctx);
+    test(kevent_user_trigger_while_deleting, ctx);
+    test(kevent64_user, ctx);
+    test(kevent_post, ctx);
+    test(kevent_user_churn, ctx);
+#endif
 #ifdef EV_DISPATCH
     test(kevent_user_dispatch, ctx);
 #endif
@@ -113,6 +113,36 @@ test_kevent_vnode_note_write(struct test_context *ctx)
     kevent_cmp(&kev, &ret);
 }
 
+/* A burst of writes that are queued before the wait is one event */
+void
+test_kevent_vnode_burst(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    int i, fd;
+
+    if ((fd = open(ctx->testfile, O_WRONLY | O_APPEND)) < 0)
+        die("open");
+    kevent_add(ctx->kqfd, &kev, ctx->vnode_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+            NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB, 0, NULL);
+
+    /* Alternate the events, which keeps inotify from merging them */
+    for (i = 0; i < 1000; i++) {
+        if (write(fd, "x", 1) != 1)
+            die("write");
+        if (fchmod(fd, (i & 1) ? 0600 : 0644) < 0)
+            die("fchmod");
+    }
+
+    kevent_get(&ret, ctx->kqfd);
+    if (ret.ident != (uintptr_t) ctx->vnode_fd
+            || ret.fflags != (NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB))
+        die("incorrect event");
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev, ctx->vnode_fd, EVFILT_VNODE, EV_DELETE, 0, 0, NULL);
+    close(fd);
+}
+
 void
 test_kevent_vnode_note_attrib(struct test_context *ctx)
 {
@@ -157,6 +187,57 @@ test_kevent_vnode_note_rename(struct test_context *ctx)
     test_no_kevents(ctx->kqfd);
 }
 
+#ifdef __linux__
+/*
+ * Watch the test file through fanotify, which falls back to inotify if
+ * the process is not allowed to mark the filesystem.
+ */
+void
+test_kevent_vnode_fanotify(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    char path[sizeof(ctx->testfile) + sizeof(".other")];
+    int kqfd, fd;
+
+    setenv("KQUEUE_VNODE_FANOTIFY", "1", 1);
+    if ((kqfd = kqueue()) < 0)
+        die("kqueue");
+    unsetenv("KQUEUE_VNODE_FANOTIFY");
+
+    /* Another file in the same filesystem */
+    snprintf(path, sizeof(path), "%s.other", ctx->testfile);
+    testfile_create(path);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        die("open");
+
+    kevent_add(kqfd, &kev, ctx->vnode_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+    kevent_add(kqfd, &ret, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_ATTRIB, 0, NULL);
+    test_no_kevents(kqfd);
+
+    testfile_write(ctx->testfile);
+    kev.flags &= ~EV_ENABLE;
+    kev.fflags |= NOTE_EXTEND;
+    kevent_get(&ret, kqfd);
+    kevent_cmp(&kev, &ret);
+    test_no_kevents(kqfd);
+
+    /* A knote that is deleted no longer reports the file */
+    kev.flags = EV_DELETE;
+    kevent_update(kqfd, &kev);
+    testfile_touch(path);
+    kevent_get(&ret, kqfd);
+    if (ret.ident != (uintptr_t) fd || ret.fflags != NOTE_ATTRIB)
+        err(1, "%s - incorrect event (ident=%u; fflags=%u)",
+                test_id, (unsigned int) ret.ident, ret.fflags);
+    testfile_write(ctx->testfile);
+    test_no_kevents(kqfd);
+
+    close(fd);
+    unlink(path);
+    close(kqfd);
+}
+#endif
+
 void
 test_kevent_vnode_del(struct test_context *ctx)
 {
@@ -196,6 +277,59 @@ test_kevent_vnode_disable_and_enable(struct test_context *ctx)
                 test_id, (unsigned int)kev.ident, kev.filter, kev.flags);
 }
 
+void
+test_kevent_vnode_multiple(struct test_context *ctx)
+{
+    struct kevent kev[3], ret[3];
+    char path[sizeof(ctx->testfile) + 4];
+    int fd[3], i, n, nret, seen;
+
+    test_no_kevents(ctx->kqfd);
+
+    /* Two descriptors for the test file, and one for another file */
+    snprintf(path, sizeof(path), "%s.2", ctx->testfile);
+    testfile_create(path);
+    if ((fd[0] = open(ctx->testfile, O_RDONLY)) < 0
+            || (fd[1] = open(ctx->testfile, O_RDONLY)) < 0
+            || (fd[2] = open(path, O_RDONLY)) < 0)
+        die("open");
+    for (i = 0; i < 3; i++)
+        kevent_add(ctx->kqfd, &kev[i], fd[i], EVFILT_VNODE, EV_ADD, NOTE_ATTRIB, 0, NULL);
+
+    testfile_touch(ctx->testfile);
+    testfile_touch(path);
+    for (n = seen = 0; n < 3; n += nret) {
+        /* One at a time, so that some are left over */
+        nret = kevent(ctx->kqfd, NULL, 0, &ret[0], 1, NULL);
+        if (nret < 1)
+            die("kevent");
+        for (i = 0; i < nret; i++) {
+            if (ret[i].fflags != NOTE_ATTRIB)
+                die("incorrect fflags");
+            if (ret[i].ident == (uintptr_t) fd[0])
+                seen |= 1;
+            else if (ret[i].ident == (uintptr_t) fd[1])
+                seen |= 2;
+            else if (ret[i].ident == (uintptr_t) fd[2])
+                seen |= 4;
+        }
+    }
+    if (seen != 7)
+        die("missing event");
+
+    /* The remaining watch on the test file still works */
+    kevent_add(ctx->kqfd, &kev[1], fd[1], EVFILT_VNODE, EV_DELETE, 0, 0, NULL);
+    kevent_add(ctx->kqfd, &kev[2], fd[2], EVFILT_VNODE, EV_DELETE, 0, 0, NULL);
+    testfile_touch(ctx->testfile);
+    kevent_get(&ret[0], ctx->kqfd);
+    kevent_cmp(&kev[0], &ret[0]);
+    kevent_add(ctx->kqfd, &kev[0], fd[0], EVFILT_VNODE, EV_DELETE, 0, 0, NULL);
+
+    for (i = 0; i < 3; i++)
+        close(fd[i]);
+    unlink(path);
+}
+
 #ifdef EV_DISPATCH
 void
 test_kevent_vnode_dispatch(struct test_context *ctx)
@@ -262,9 +396,14 @@ test_evfilt_vnode(struct test_context *ctx)
 #ifdef EV_DISPATCH
     test(kevent_vnode_dispatch, ctx);
 #endif
+    test(kevent_vnode_multiple, ctx);
     test(kevent_vnode_note_write, ctx);
+    test(kevent_vnode_burst, ctx);
     test(kevent_vnode_note_attrib, ctx);
     test(kevent_vnode_note_rename, ctx);
+#ifdef __linux__
+    test(kevent_vnode_fanotify, ctx);
+#endif
     test(kevent_vnode_note_delete, ctx);
     /* TODO: test r590 corner case where a descriptor is closed and
              the associated knote is automatically freed. */